@@ -29,32 +29,8 @@ AccountManager::Result AccountManager::AddUser(User&& new_user) {
                               new_user.account)};
   }
 
-  const std::list<std::string>& parent_allowed_partition =
-      find_account->allowed_partition;
-  if (!new_user.allowed_partition_qos_map.empty()) {
-    // Check if user's allowed partition is a subset of parent's allowed
-    // partition
-    for (auto&& [partition, qos] : new_user.allowed_partition_qos_map) {
-      if (std::find(parent_allowed_partition.begin(),
-                    parent_allowed_partition.end(),
-                    partition) != parent_allowed_partition.end()) {
-        qos.first = find_account->default_qos;
-        qos.second = find_account->allowed_qos_list;
-      } else {
-        return Result{false,
-                      fmt::format("Partition {} is not allowed in account {}",
-                                  partition, find_account->name)};
-      }
-    }
-  } else {
-    // Inherit
-    for (const auto& partition : parent_allowed_partition) {
-      new_user.allowed_partition_qos_map[partition] =
-          std::pair<std::string, std::list<std::string>>{
-              find_account->default_qos,
-              std::list<std::string>{find_account->allowed_qos_list}};
-    }
-  }
+  Result result = CheckNewUserNoLock_(*find_account, &new_user);
+  if (!result.ok) return result;
 
   mongocxx::client_session::with_transaction_cb callback =
       [&](mongocxx::client_session* session) {
@@ -80,8 +56,9 @@ AccountManager::Result AccountManager::AddUser(User&& new_user) {
     return Result{false, "Fail to update data in database"};
   }
 
-  m_account_map_[new_user.account]->users.emplace_back(name);
+  m_account_map_[new_user.account]->users.emplace(name);
   m_user_map_[name] = std::make_unique<User>(std::move(new_user));
+  UpdatePermissionIndexNoLock_({name});
 
   return Result{true};
 }
@@ -99,63 +76,21 @@ AccountManager::Result AccountManager::AddAccount(Account&& new_account) {
   }
 
   util::read_lock_guard read_qos_lock_guard(m_rw_qos_mutex_);
-  for (const auto& qos : new_account.allowed_qos_list) {
-    const Qos* find_qos = GetExistedQosInfoNoLock_(qos);
-    if (!find_qos) {
-      return Result{false, fmt::format("Qos {} not existed", qos)};
-    }
-  }
-
+  const Account* find_parent = nullptr;
   if (!new_account.parent_account.empty()) {
     // Check whether the account's parent account exists
-    const Account* find_parent =
-        GetExistedAccountInfoNoLock_(new_account.parent_account);
+    find_parent = GetExistedAccountInfoNoLock_(new_account.parent_account);
     if (!find_parent) {
       return Result{
           false,
           fmt::format("The parent account {} doesn't exist in the database",
                       new_account.parent_account)};
     }
-
-    if (new_account.allowed_partition.empty()) {
-      // Inherit
-      new_account.allowed_partition =
-          std::list<std::string>{find_parent->allowed_partition};
-    } else {
-      // check allowed partition authority
-      for (const auto& par : new_account.allowed_partition) {
-        if (std::find(find_parent->allowed_partition.begin(),
-                      find_parent->allowed_partition.end(), par) ==
-            find_parent->allowed_partition.end()) {  // not find
-          return Result{
-              false,
-              fmt::format(
-                  "Parent account {} does not have access to partition {}",
-                  new_account.parent_account, par)};
-        }
-      }
-    }
-
-    if (new_account.allowed_qos_list.empty()) {
-      // Inherit
-      new_account.allowed_qos_list =
-          std::list<std::string>{find_parent->allowed_qos_list};
-    } else {
-      // check allowed qos list authority
-      for (const auto& qos : new_account.allowed_qos_list) {
-        if (std::find(find_parent->allowed_qos_list.begin(),
-                      find_parent->allowed_qos_list.end(),
-                      qos) ==
-            find_parent->allowed_qos_list.end()) {  // not find
-          return Result{
-              false,
-              fmt::format("Parent account {} does not have access to qos {}",
-                          new_account.parent_account, qos)};
-        }
-      }
-    }
   }
 
+  Result result = CheckNewAccountNoLock_(find_parent, &new_account);
+  if (!result.ok) return result;
+
   mongocxx::client_session::with_transaction_cb callback =
       [&](mongocxx::client_session* session) {
         if (!new_account.parent_account.empty()) {
@@ -182,8 +117,7 @@ AccountManager::Result AccountManager::AddAccount(Account&& new_account) {
     return Result{false, "Fail to update data in database"};
   }
   if (!new_account.parent_account.empty()) {
-    m_account_map_[new_account.parent_account]->child_accounts.emplace_back(
-        name);
+    m_account_map_[new_account.parent_account]->child_accounts.emplace(name);
   }
   m_account_map_[name] = std::make_unique<Account>(std::move(new_account));
 
@@ -221,6 +155,119 @@ AccountManager::Result AccountManager::AddQos(const Qos& new_qos) {
   }
 
   m_qos_map_[new_qos.name] = std::make_unique<Qos>(new_qos);
+  g_qos_limiter->SetQosLimits(new_qos.name, QosLimitsOf_(new_qos));
+
+  return Result{true};
+}
+
+AccountManager::Result AccountManager::AddAccountsAndUsers(
+    std::list<Account>&& new_accounts, std::list<User>&& new_users) {
+  util::write_lock_guard user_guard(m_rw_user_mutex_);
+  util::write_lock_guard account_guard(m_rw_account_mutex_);
+  util::read_lock_guard qos_guard(m_rw_qos_mutex_);
+
+  // New accounts and copies of the existing accounts whose user or child
+  // lists grow. The maps are only modified after the transaction commits.
+  absl::node_hash_map<std::string, Account> staged_accounts;
+  absl::flat_hash_set<std::string> created_accounts;
+  auto get_staged_account = [&](const std::string& name) -> Account* {
+    auto iter = staged_accounts.find(name);
+    if (iter != staged_accounts.end()) return &iter->second;
+
+    const Account* account = GetExistedAccountInfoNoLock_(name);
+    if (!account) return nullptr;
+    return &staged_accounts.emplace(name, *account).first->second;
+  };
+
+  for (auto& new_account : new_accounts) {
+    const std::string& name = new_account.name;
+    const Account* find_account = GetAccountInfoNoLock_(name);
+    if ((find_account && !find_account->deleted) ||
+        created_accounts.contains(name)) {
+      return Result{
+          false,
+          fmt::format("The account {} already exists in the database", name)};
+    }
+
+    Account* parent = nullptr;
+    if (!new_account.parent_account.empty()) {
+      parent = get_staged_account(new_account.parent_account);
+      if (!parent) {
+        return Result{
+            false,
+            fmt::format("The parent account {} doesn't exist in the database",
+                        new_account.parent_account)};
+      }
+    }
+
+    Result result = CheckNewAccountNoLock_(parent, &new_account);
+    if (!result.ok) return result;
+
+    if (parent) parent->child_accounts.emplace(name);
+    created_accounts.emplace(name);
+    staged_accounts.emplace(name, new_account);
+  }
+
+  absl::flat_hash_set<std::string> created_users;
+  for (auto& new_user : new_users) {
+    const std::string& name = new_user.name;
+    const User* find_user = GetUserInfoNoLock_(name);
+    if ((find_user && !find_user->deleted) || created_users.contains(name)) {
+      return Result{
+          false,
+          fmt::format("The user {} already exists in the database", name)};
+    }
+
+    if (new_user.account.empty()) {
+      return Result{false,
+                    fmt::format("Please specify the account of user {}", name)};
+    }
+
+    Account* account = get_staged_account(new_user.account);
+    if (!account) {
+      return Result{false,
+                    fmt::format("The account {} doesn't exist in the database",
+                                new_user.account)};
+    }
+
+    Result result = CheckNewUserNoLock_(*account, &new_user);
+    if (!result.ok) return result;
+
+    account->users.emplace(name);
+    created_users.emplace(name);
+  }
+
+  std::vector<const Account*> accounts_to_create, accounts_to_update;
+  for (const auto& [name, account] : staged_accounts) {
+    if (created_accounts.contains(name))
+      accounts_to_create.emplace_back(&account);
+    else
+      accounts_to_update.emplace_back(&account);
+  }
+  std::vector<const User*> users_to_create;
+  for (const auto& new_user : new_users)
+    users_to_create.emplace_back(&new_user);
+
+  mongocxx::client_session::with_transaction_cb callback =
+      [&](mongocxx::client_session* session) {
+        g_db_client->BulkUpsertAccounts(accounts_to_create, accounts_to_update);
+        g_db_client->BulkUpsertUsers(users_to_create, {});
+      };
+
+  if (!g_db_client->CommitTransaction(callback)) {
+    return Result{false, "Fail to update data in database"};
+  }
+
+  for (auto& [name, account] : staged_accounts)
+    m_account_map_[name] = std::make_unique<Account>(std::move(account));
+
+  std::vector<std::string> user_names;
+  user_names.reserve(new_users.size());
+  for (auto& new_user : new_users) {
+    user_names.emplace_back(new_user.name);
+    m_user_map_[new_user.name] = std::make_unique<User>(std::move(new_user));
+  }
+  UpdatePermissionIndexNoLock_(user_names);
 
   return Result{true};
 }
@@ -250,8 +297,9 @@ AccountManager::Result AccountManager::DeleteUser(const std::string& name) {
   if (!g_db_client->CommitTransaction(callback)) {
     return Result{false, "Fail to update data in database"};
   }
-  m_account_map_[user->account]->users.remove(name);
+  m_account_map_[user->account]->users.erase(name);
   m_user_map_[name]->deleted = true;
+  UpdatePermissionIndexNoLock_({name});
 
   return Result{true};
 }
@@ -287,7 +335,7 @@ AccountManager::Result AccountManager::DeleteAccount(const std::string& name) {
   }
 
   if (!account->parent_account.empty()) {
-    m_account_map_[account->parent_account]->child_accounts.remove(name);
+    m_account_map_[account->parent_account]->child_accounts.erase(name);
   }
   m_account_map_[name]->deleted = true;
 
@@ -307,6 +355,7 @@ AccountManager::Result AccountManager::DeleteQos(const std::string& name) {
     return Result{false, fmt::format("Delete qos {} failed", name)};
   }
   m_qos_map_[name]->deleted = true;
+  g_qos_limiter->RemoveQos(name);
 
   return Result{true};
 }
@@ -397,25 +446,41 @@ AccountManager::Result AccountManager::ModifyUser(
 
   util::read_lock_guard account_guard(m_rw_account_mutex_);
 
-  const Account* account = GetExistedAccountInfoNoLock_(user.account);
+  Result result = ModifyUserNoLock_(operatorType, partition, lhs, rhs, &user);
+  if (!result.ok) return result;
+
+  // Update to database
+  if (!g_db_client->UpdateUser(user)) {
+    return Result{false, "Fail to update data in database"};
+  }
+  *m_user_map_[name] = user;
+  UpdatePermissionIndexNoLock_({name});
+
+  return Result{true};
+}
+
+AccountManager::Result AccountManager::ModifyUserNoLock_(
+    const crane::grpc::ModifyEntityRequest_OperatorType& operatorType,
+    const std::string& partition, const std::string& lhs,
+    const std::string& rhs, User* user) {
+  const std::string& name = user->name;
+  const Account* account = GetExistedAccountInfoNoLock_(user->account);
   switch (operatorType) {
     case crane::grpc::ModifyEntityRequest_OperatorType_Add:
       if (lhs == "allowed_partition") {
         // TODO: check if new partition existed
 
         // check if account has access to new partition
-        if (std::find(account->allowed_partition.begin(),
-                      account->allowed_partition.end(),
-                      rhs) == account->allowed_partition.end()) {
+        if (!account->allowed_partition.contains(rhs)) {
           return Result{
               false,
               fmt::format(
                   "User {}'s account {} not allow to use the partition {}",
-                  name, user.account, rhs)};
+                  name, user->account, rhs)};
         }
 
         // check if add item already the user's allowed partition
-        for (const auto& par : user.allowed_partition_qos_map) {
+        for (const auto& par : user->allowed_partition_qos_map) {
           if (rhs == par.first) {
             return Result{false, fmt::format("The partition {} is already in "
                                              "user {}'s allowed partition",
@@ -424,10 +489,11 @@ AccountManager::Result AccountManager::ModifyUser(
         }
 
         // Update the map
-        user.allowed_partition_qos_map[rhs] =
+        user->allowed_partition_qos_map[rhs] =
             std::pair<std::string, std::list<std::string>>{
                 account->default_qos,
-                std::list<std::string>{account->allowed_qos_list}};
+                std::list<std::string>(account->allowed_qos_list.begin(),
+                                       account->allowed_qos_list.end())};
 
       } else if (lhs == "allowed_qos_list") {
         // check if qos existed
@@ -437,9 +503,7 @@ AccountManager::Result AccountManager::ModifyUser(
         }
 
         // check if account has access to new qos
-        if (std::find(account->allowed_qos_list.begin(),
-                      account->allowed_qos_list.end(),
-                      rhs) == account->allowed_qos_list.end()) {
+        if (!account->allowed_qos_list.contains(rhs)) {
           return Result{
               false,
               fmt::format("Sorry, your account not allow to use the qos {}",
@@ -450,7 +514,7 @@ AccountManager::Result AccountManager::ModifyUser(
         if (partition.empty()) {
           // add to all partition
           bool is_changed = false;
-          for (auto& [par, qos] : user.allowed_partition_qos_map) {
+          for (auto& [par, qos] : user->allowed_partition_qos_map) {
             std::list<std::string>& list = qos.second;
             if (std::find(list.begin(), list.end(), rhs) == list.end()) {
               list.emplace_back(rhs);
@@ -465,8 +529,8 @@ AccountManager::Result AccountManager::ModifyUser(
           }
         } else {
           // add to exacted partition
-          auto iter = user.allowed_partition_qos_map.find(partition);
-          if (iter == user.allowed_partition_qos_map.end()) {
+          auto iter = user->allowed_partition_qos_map.find(partition);
+          if (iter == user->allowed_partition_qos_map.end()) {
             return Result{
                 false, fmt::format(
                            "Partition {} is not in user {}'s allowed partition",
@@ -497,11 +561,11 @@ AccountManager::Result AccountManager::ModifyUser(
           new_level = User::Admin;
         }
 
-        if (new_level == user.admin_level) {
+        if (new_level == user->admin_level) {
           return Result{false,
                         fmt::format("User {} is already a {} role", name, rhs)};
         }
-        user.admin_level = new_level;
+        user->admin_level = new_level;
       }
       //      else if (lhs == "account") {
       //        Account* new_account = GetAccountInfo(rhs);
@@ -515,7 +579,7 @@ AccountManager::Result AccountManager::ModifyUser(
       else if (lhs == "default_qos") {
         if (partition.empty()) {
           bool is_changed = false;
-          for (auto& [par, qos] : user.allowed_partition_qos_map) {
+          for (auto& [par, qos] : user->allowed_partition_qos_map) {
             if (std::find(qos.second.begin(), qos.second.end(), rhs) !=
                     qos.second.end() &&
                 rhs != qos.first) {
@@ -530,7 +594,7 @@ AccountManager::Result AccountManager::ModifyUser(
                                              rhs)};
           }
         } else {
-          auto iter = user.allowed_partition_qos_map.find(partition);
+          auto iter = user->allowed_partition_qos_map.find(partition);
 
           if (std::find(iter->second.second.begin(), iter->second.second.end(),
                         rhs) == iter->second.second.end()) {
@@ -551,20 +615,20 @@ AccountManager::Result AccountManager::ModifyUser(
 
     case crane::grpc::ModifyEntityRequest_OperatorType_Delete:
       if (lhs == "allowed_partition") {
-        auto iter = user.allowed_partition_qos_map.find(rhs);
-        if (iter == user.allowed_partition_qos_map.end()) {
+        auto iter = user->allowed_partition_qos_map.find(rhs);
+        if (iter == user->allowed_partition_qos_map.end()) {
           return Result{
               false,
               fmt::format(
                   "Partition {} is not in user {}'s allowed partition list",
                   rhs, name)};
         }
-        user.allowed_partition_qos_map.erase(iter);
+        user->allowed_partition_qos_map.erase(iter);
 
       } else if (lhs == "allowed_qos_list") {
         if (partition.empty()) {
           bool is_changed = false;
-          for (auto& [par, qos] : user.allowed_partition_qos_map) {
+          for (auto& [par, qos] : user->allowed_partition_qos_map) {
             if (std::find(qos.second.begin(), qos.second.end(), rhs) !=
                     qos.second.end() &&
                 qos.first != rhs) {
@@ -580,9 +644,9 @@ AccountManager::Result AccountManager::ModifyUser(
                             rhs)};
           }
         } else {
-          auto iter = user.allowed_partition_qos_map.find(partition);
+          auto iter = user->allowed_partition_qos_map.find(partition);
 
-          if (iter == user.allowed_partition_qos_map.end()) {
+          if (iter == user->allowed_partition_qos_map.end()) {
             return Result{
                 false, fmt::format("Partition {} not in allowed partition list",
                                    partition)};
@@ -614,11 +678,58 @@ AccountManager::Result AccountManager::ModifyUser(
       break;
   }
 
-  // Update to database
-  if (!g_db_client->UpdateUser(user)) {
+  return Result{true};
+}
+
+AccountManager::Result AccountManager::ModifyUsers(
+    const google::protobuf::RepeatedPtrField<crane::grpc::ModifyEntityRequest>&
+        requests) {
+  util::write_lock_guard user_guard(m_rw_user_mutex_);
+  util::read_lock_guard account_guard(m_rw_account_mutex_);
+
+  // Modifications of the same user are applied to the same copy in order.
+  absl::flat_hash_map<std::string, User> staged_users;
+  for (const auto& request : requests) {
+    if (request.entity_type() != crane::grpc::User) {
+      return Result{false, "Only users can be modified in bulk"};
+    }
+
+    auto iter = staged_users.find(request.name());
+    if (iter == staged_users.end()) {
+      const User* p = GetExistedUserInfoNoLock_(request.name());
+      if (!p) {
+        return Result{false, fmt::format("Unknown user {}", request.name())};
+      }
+      iter = staged_users.emplace(request.name(), *p).first;
+    }
+
+    Result result =
+        ModifyUserNoLock_(request.type(), request.partition(), request.lhs(),
+                          request.rhs(), &iter->second);
+    if (!result.ok) return result;
+  }
+
+  std::vector<const User*> users_to_update;
+  users_to_update.reserve(staged_users.size());
+  for (const auto& [name, user] : staged_users)
+    users_to_update.emplace_back(&user);
+
+  mongocxx::client_session::with_transaction_cb callback =
+      [&](mongocxx::client_session* session) {
+        g_db_client->BulkUpsertUsers({}, users_to_update);
+      };
+
+  if (!g_db_client->CommitTransaction(callback)) {
     return Result{false, "Fail to update data in database"};
   }
-  *m_user_map_[name] = user;
+
+  std::vector<std::string> user_names;
+  user_names.reserve(staged_users.size());
+  for (auto& [name, user] : staged_users) {
+    user_names.emplace_back(name);
+    *m_user_map_[name] = std::move(user);
+  }
+  UpdatePermissionIndexNoLock_(user_names);
 
   return Result{true};
 }
@@ -627,6 +738,9 @@ AccountManager::Result AccountManager::ModifyAccount(
     const crane::grpc::ModifyEntityRequest_OperatorType& operatorType,
     const std::string& name, const std::string& lhs, const std::string& rhs) {
   std::string opt;
+  // Deleting a partition or a qos also updates the users of the account.
+  // The locks are taken in the order of user, account and qos everywhere.
+  util::write_lock_guard user_guard(m_rw_user_mutex_);
   util::write_lock_guard account_guard(m_rw_account_mutex_);
 
   const Account* account = GetExistedAccountInfoNoLock_(name);
@@ -644,9 +758,7 @@ AccountManager::Result AccountManager::ModifyAccount(
         if (!account->parent_account.empty()) {
           const Account* parent =
               GetExistedAccountInfoNoLock_(account->parent_account);
-          if (std::find(parent->allowed_partition.begin(),
-                        parent->allowed_partition.end(),
-                        rhs) == parent->allowed_partition.end()) {
+          if (!parent->allowed_partition.contains(rhs)) {
             return Result{
                 false,
                 fmt::format(
@@ -655,9 +767,7 @@ AccountManager::Result AccountManager::ModifyAccount(
           }
         }
 
-        if (std::find(account->allowed_partition.begin(),
-                      account->allowed_partition.end(),
-                      rhs) != account->allowed_partition.end()) {
+        if (account->allowed_partition.contains(rhs)) {
           return Result{
               false,
               fmt::format("Partition {} is already in allowed partition list",
@@ -668,7 +778,7 @@ AccountManager::Result AccountManager::ModifyAccount(
                                           opt, name, lhs, rhs)) {
           return Result{false, "Can't update the  database"};
         }
-        m_account_map_[name]->allowed_partition.emplace_back(rhs);
+        m_account_map_[name]->allowed_partition.emplace(rhs);
 
         return Result{true};
 
@@ -684,9 +794,7 @@ AccountManager::Result AccountManager::ModifyAccount(
           const Account* parent =
               GetExistedAccountInfoNoLock_(account->parent_account);
 
-          if (std::find(parent->allowed_qos_list.begin(),
-                        parent->allowed_qos_list.end(),
-                        rhs) == parent->allowed_qos_list.end()) {
+          if (!parent->allowed_qos_list.contains(rhs)) {
             return Result{
                 false,
                 fmt::format("Parent account {} does not have access to qos {}",
@@ -694,9 +802,7 @@ AccountManager::Result AccountManager::ModifyAccount(
           }
         }
 
-        if (std::find(account->allowed_qos_list.begin(),
-                      account->allowed_qos_list.end(),
-                      rhs) != account->allowed_qos_list.end()) {
+        if (account->allowed_qos_list.contains(rhs)) {
           return Result{
               false, fmt::format("Qos {} is already in allowed qos list", rhs)};
         }
@@ -705,7 +811,7 @@ AccountManager::Result AccountManager::ModifyAccount(
                                           opt, name, lhs, rhs)) {
           return Result{false, "Can't update the  database"};
         }
-        m_account_map_[name]->allowed_qos_list.emplace_back(rhs);
+        m_account_map_[name]->allowed_qos_list.emplace(rhs);
 
         return Result{true};
 
@@ -746,9 +852,7 @@ AccountManager::Result AccountManager::ModifyAccount(
                         fmt::format("Qos {} is already the default qos", rhs)};
         }
 
-        if (std::find(account->allowed_qos_list.begin(),
-                      account->allowed_qos_list.end(),
-                      rhs) == account->allowed_qos_list.end()) {
+        if (!account->allowed_qos_list.contains(rhs)) {
           return Result{false,
                         fmt::format("Qos {} not in allowed qos list", rhs)};
         }
@@ -768,8 +872,6 @@ AccountManager::Result AccountManager::ModifyAccount(
 
     case crane::grpc::ModifyEntityRequest_OperatorType_Delete:
       if (lhs == "allowed_partition") {
-        util::write_lock_guard user_guard(m_rw_user_mutex_);
-
         mongocxx::client_session::with_transaction_cb callback =
             [&](mongocxx::client_session* session) {
               DeleteAccountAllowedPartitionFromDB_(account->name, rhs);
@@ -780,11 +882,13 @@ AccountManager::Result AccountManager::ModifyAccount(
         }
         DeleteAccountAllowedPartitionFromMap_(account->name, rhs);
 
-      } else if (lhs == "allowed_qos_list") {
-        auto iter = std::find(account->allowed_qos_list.begin(),
-                              account->allowed_qos_list.end(), rhs);
+        std::vector<std::string> affected_users;
+        CollectUsersOfAccountNoLock_(account->name, &affected_users);
+        UpdatePermissionIndexNoLock_(affected_users);
 
-        if (iter == account->allowed_qos_list.end()) {
+      } else if (lhs == "allowed_qos_list") {
+        // The qos is also removed from the users of this account.
+        if (!account->allowed_qos_list.contains(rhs)) {
           return Result{
               false,
               fmt::format("Qos {} is not in account {}'s allowed qos list", rhs,
@@ -807,6 +911,10 @@ AccountManager::Result AccountManager::ModifyAccount(
         }
         DeleteAccountAllowedQosFromMap_(account->name, rhs);
 
+        std::vector<std::string> affected_users;
+        CollectUsersOfAccountNoLock_(account->name, &affected_users);
+        UpdatePermissionIndexNoLock_(affected_users);
+
         return Result{true};
       } else {
         return Result{false, fmt::format("Field {} can't be deleted", lhs)};
@@ -837,38 +945,71 @@ AccountManager::Result AccountManager::ModifyQos(const std::string& name,
       return Result{false, "Fail to update the database"};
     }
   } else {
-    qos.priority = std::stoi(rhs);
+    uint32_t* field;
+    if (lhs == "max_jobs_per_user")
+      field = &qos.max_jobs_per_user;
+    else if (lhs == "max_running_jobs_per_user")
+      field = &qos.max_running_jobs_per_user;
+    else if (lhs == "max_cpus_per_user")
+      field = &qos.max_cpus_per_user;
+    else
+      field = &qos.priority;
+
+    *field = std::stoi(rhs);
     if (!g_db_client->UpdateEntityOne(MongodbClient::EntityType::QOS, "$set",
                                       name, lhs, std::stoi(rhs))) {
       return Result{false, "Fail to update the database"};
     }
   }
   *m_qos_map_[name] = qos;
+  g_qos_limiter->SetQosLimits(name, QosLimitsOf_(qos));
 
   return Result{true};
 }
 
 bool AccountManager::CheckUserPermissionToPartition(
     const std::string& name, const std::string& partition) {
-  UserMutexSharedPtr user_share_ptr = GetExistedUserInfo(name);
-  if (!user_share_ptr) {
+  std::shared_ptr<const UserPermission> permission =
+      m_permission_index_.load()->Find(name);
+  if (!permission) {
     return false;
   }
 
-  if (user_share_ptr->allowed_partition_qos_map.find(partition) !=
-      user_share_ptr->allowed_partition_qos_map.end()) {
-    return true;
+  return permission->partitions.contains(partition);
+}
+
+std::shared_ptr<const AccountManager::UserPermission>
+AccountManager::GetUserPermission(const std::string& name) {
+  return m_permission_index_.load()->Find(name);
+}
+
+std::shared_ptr<const AccountManager::UserPermission>
+AccountManager::PermissionIndex::Find(const std::string& name) const {
+  const std::shared_ptr<const Shard>& shard = shards[ShardOf(name)];
+  if (!shard) {
+    return nullptr;
   }
-  return false;
+
+  auto iter = shard->find(name);
+  if (iter == shard->end()) {
+    return nullptr;
+  }
+
+  return iter->second;
 }
 
 void AccountManager::InitDataMap_() {
   std::list<User> user_list;
   g_db_client->SelectAllUser(&user_list);
+  std::vector<std::string> user_names;
   for (auto& user : user_list) {
     m_user_map_[user.name] = std::make_unique<User>(user);
+    user_names.emplace_back(user.name);
   }
 
+  m_permission_index_.store(std::make_shared<const PermissionIndex>());
+  UpdatePermissionIndexNoLock_(user_names);
+
   std::list<Account> account_list;
   g_db_client->SelectAllAccount(&account_list);
   for (auto& account : account_list) {
@@ -879,6 +1020,73 @@ void AccountManager::InitDataMap_() {
   g_db_client->SelectAllQos(&qos_list);
   for (auto& qos : qos_list) {
     m_qos_map_[qos.name] = std::make_unique<Qos>(qos);
+    if (!qos.deleted) g_qos_limiter->SetQosLimits(qos.name, QosLimitsOf_(qos));
+  }
+}
+
+QosLimiter::Limits AccountManager::QosLimitsOf_(const Qos& qos) {
+  return QosLimiter::Limits{
+      .max_jobs_per_user = qos.max_jobs_per_user,
+      .max_running_jobs_per_user = qos.max_running_jobs_per_user,
+      .max_cpus_per_user = qos.max_cpus_per_user,
+  };
+}
+
+void AccountManager::UpdatePermissionIndexNoLock_(
+    const std::vector<std::string>& names) {
+  util::lock_guard guard(m_permission_index_mtx_);
+
+  // Only the shards of the affected users are copied. The others are shared
+  // with the previous index.
+  auto index =
+      std::make_shared<PermissionIndex>(*m_permission_index_.load());
+  index->version++;
+
+  std::array<std::shared_ptr<PermissionIndex::Shard>,
+             PermissionIndex::kShardNum>
+      copied_shards;
+
+  for (const auto& name : names) {
+    size_t shard_idx = PermissionIndex::ShardOf(name);
+    std::shared_ptr<PermissionIndex::Shard>& shard = copied_shards[shard_idx];
+    if (!shard) {
+      const auto& old_shard = index->shards[shard_idx];
+      shard = old_shard ? std::make_shared<PermissionIndex::Shard>(*old_shard)
+                        : std::make_shared<PermissionIndex::Shard>();
+      index->shards[shard_idx] = shard;
+    }
+
+    const User* user = GetExistedUserInfoNoLock_(name);
+    if (!user) {
+      shard->erase(name);
+      continue;
+    }
+
+    auto permission = std::make_shared<UserPermission>();
+    permission->account = user->account;
+    for (const auto& [partition, qos] : user->allowed_partition_qos_map) {
+      auto& part_permission = permission->partitions[partition];
+      part_permission.default_qos = qos.first;
+      part_permission.allowed_qos.insert(qos.second.begin(), qos.second.end());
+    }
+    (*shard)[name] = std::move(permission);
+  }
+
+  CRANE_TRACE("Permission index updated to version {} for {} user(s).",
+              index->version, names.size());
+  m_permission_index_.store(std::move(index));
+}
+
+void AccountManager::CollectUsersOfAccountNoLock_(
+    const std::string& name, std::vector<std::string>* users) {
+  const Account* account = GetExistedAccountInfoNoLock_(name);
+  if (!account) {
+    return;
+  }
+
+  users->insert(users->end(), account->users.begin(), account->users.end());
+  for (const auto& child : account->child_accounts) {
+    CollectUsersOfAccountNoLock_(child, users);
   }
 }
 
@@ -888,6 +1096,83 @@ void AccountManager::InitDataMap_() {
  * @note copy user info from m_user_map_
  * @return bool
  */
+AccountManager::Result AccountManager::CheckNewUserNoLock_(
+    const Account& account, User* new_user) {
+  const absl::flat_hash_set<std::string>& parent_allowed_partition =
+      account.allowed_partition;
+  if (!new_user->allowed_partition_qos_map.empty()) {
+    // Check if user's allowed partition is a subset of parent's allowed
+    // partition
+    for (auto&& [partition, qos] : new_user->allowed_partition_qos_map) {
+      if (parent_allowed_partition.contains(partition)) {
+        qos.first = account.default_qos;
+        qos.second.assign(account.allowed_qos_list.begin(),
+                          account.allowed_qos_list.end());
+      } else {
+        return Result{false,
+                      fmt::format("Partition {} is not allowed in account {}",
+                                  partition, account.name)};
+      }
+    }
+  } else {
+    // Inherit
+    for (const auto& partition : parent_allowed_partition) {
+      new_user->allowed_partition_qos_map[partition] =
+          std::pair<std::string, std::list<std::string>>{
+              account.default_qos,
+              std::list<std::string>(account.allowed_qos_list.begin(),
+                                     account.allowed_qos_list.end())};
+    }
+  }
+
+  return Result{true};
+}
+
+AccountManager::Result AccountManager::CheckNewAccountNoLock_(
+    const Account* parent, Account* new_account) {
+  for (const auto& qos : new_account->allowed_qos_list) {
+    const Qos* find_qos = GetExistedQosInfoNoLock_(qos);
+    if (!find_qos) {
+      return Result{false, fmt::format("Qos {} not existed", qos)};
+    }
+  }
+
+  if (parent) {
+    if (new_account->allowed_partition.empty()) {
+      // Inherit
+      new_account->allowed_partition = parent->allowed_partition;
+    } else {
+      // check allowed partition authority
+      for (const auto& par : new_account->allowed_partition) {
+        if (!parent->allowed_partition.contains(par)) {  // not find
+          return Result{
+              false,
+              fmt::format(
+                  "Parent account {} does not have access to partition {}",
+                  parent->name, par)};
+        }
+      }
+    }
+
+    if (new_account->allowed_qos_list.empty()) {
+      // Inherit
+      new_account->allowed_qos_list = parent->allowed_qos_list;
+    } else {
+      // check allowed qos list authority
+      for (const auto& qos : new_account->allowed_qos_list) {
+        if (!parent->allowed_qos_list.contains(qos)) {  // not find
+          return Result{
+              false,
+              fmt::format("Parent account {} does not have access to qos {}",
+                          parent->name, qos)};
+        }
+      }
+    }
+  }
+
+  return Result{true};
+}
+
 const User* AccountManager::GetUserInfoNoLock_(const std::string& name) {
   auto find_res = m_user_map_.find(name);
   if (find_res == m_user_map_.end()) {
@@ -982,9 +1267,7 @@ bool AccountManager::DeleteAccountAllowedQosFromDB_(const std::string& name,
     return false;
   }
 
-  auto iter = std::find(account->allowed_qos_list.begin(),
-                        account->allowed_qos_list.end(), qos);
-  if (iter == account->allowed_qos_list.end()) {
+  if (!account->allowed_qos_list.contains(qos)) {
     return false;
   }
 
@@ -1010,9 +1293,7 @@ bool AccountManager::DeleteAccountAllowedQosFromMap_(const std::string& name,
     return false;
   }
 
-  if (std::find(account->allowed_qos_list.begin(),
-                account->allowed_qos_list.end(),
-                qos) == account->allowed_qos_list.end()) {
+  if (!account->allowed_qos_list.contains(qos)) {
     return false;
   }
 
@@ -1022,7 +1303,7 @@ bool AccountManager::DeleteAccountAllowedQosFromMap_(const std::string& name,
   for (const auto& user : account->users) {
     DeleteUserAllowedQosOfAllPartitionFromMap_(user, qos, true);
   }
-  m_account_map_[name]->allowed_qos_list.remove(qos);
+  m_account_map_[name]->allowed_qos_list.erase(qos);
   return true;
 }
 
@@ -1099,9 +1380,7 @@ bool AccountManager::DeleteAccountAllowedPartitionFromDB_(
     return false;
   }
 
-  auto iter = std::find(account->allowed_partition.begin(),
-                        account->allowed_partition.end(), partition);
-  if (iter == account->allowed_partition.end()) {
+  if (!account->allowed_partition.contains(partition)) {
     return false;
   }
 
@@ -1128,9 +1407,7 @@ bool AccountManager::DeleteAccountAllowedPartitionFromMap_(
     return false;
   }
 
-  if (std::find(account->allowed_partition.begin(),
-                account->allowed_partition.end(),
-                partition) == account->allowed_partition.end()) {
+  if (!account->allowed_partition.contains(partition)) {
     return false;
   }
 
@@ -1140,7 +1417,7 @@ bool AccountManager::DeleteAccountAllowedPartitionFromMap_(
   for (const auto& user : account->users) {
     m_user_map_[user]->allowed_partition_qos_map.erase(partition);
   }
-  m_account_map_[account->name]->allowed_partition.remove(partition);
+  m_account_map_[account->name]->allowed_partition.erase(partition);
 
   return true;
 }
@@ -1,10 +1,20 @@
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <absl/container/node_hash_map.h>
+
+#include <array>
+#include <atomic>
+#include <list>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "CtldPublicDefs.h"
 #include "DbClient.h"
+#include "QosLimiter.h"
 #include "crane/Lock.h"
 #include "crane/Pointer.h"
 
@@ -28,6 +38,22 @@ class AccountManager {
     std::string reason;
   };
 
+  /**
+   * What a user is allowed to use, flattened from the user's
+   * allowed_partition_qos_map, which is already narrowed down by the parent
+   * accounts. A published UserPermission is never modified.
+   */
+  struct UserPermission {
+    struct PartitionPermission {
+      std::string default_qos;
+      absl::flat_hash_set<std::string> allowed_qos;
+    };
+
+    std::string account;
+    absl::flat_hash_map<std::string /*partition name*/, PartitionPermission>
+        partitions;
+  };
+
   AccountManager();
 
   ~AccountManager() = default;
@@ -38,6 +64,15 @@ class AccountManager {
 
   Result AddQos(const Qos& new_qos);
 
+  /**
+   * Add the accounts in order and then the users in one transaction, so
+   * onboarding a large batch costs a single round of database writes. An
+   * account or a user may refer to an account added earlier in the same
+   * batch. Nothing is added if any of them is invalid.
+   */
+  Result AddAccountsAndUsers(std::list<Account>&& new_accounts,
+                             std::list<User>&& new_users);
+
   Result DeleteUser(const std::string& name);
 
   Result DeleteAccount(const std::string& name);
@@ -64,12 +99,90 @@ class AccountManager {
   Result ModifyQos(const std::string& name, const std::string& lhs,
                    const std::string& rhs);
 
+  /**
+   * Apply the modifications of users in order in one transaction. Nothing is
+   * modified if any of them fails.
+   */
+  Result ModifyUsers(const google::protobuf::RepeatedPtrField<
+                     crane::grpc::ModifyEntityRequest>& requests);
+
+  /**
+   * Lock-free. Called on the submission path.
+   */
   bool CheckUserPermissionToPartition(const std::string& name,
                                       const std::string& partition);
 
+  /**
+   * Lock-free.
+   * @return nullptr if the user doesn't exist.
+   */
+  std::shared_ptr<const UserPermission> GetUserPermission(
+      const std::string& name);
+
  private:
+  /**
+   * An immutable snapshot of the permissions of all existing users. The
+   * users are spread over shards by the hash of their names. Each
+   * modification publishes a new index which copies only the shards of the
+   * affected users and shares the other shards with the previous one.
+   */
+  struct PermissionIndex {
+    static constexpr size_t kShardNum = 64;
+
+    using Shard = absl::flat_hash_map<std::string /*user name*/,
+                                      std::shared_ptr<const UserPermission>>;
+
+    static size_t ShardOf(const std::string& name) {
+      return absl::Hash<std::string>{}(name) % kShardNum;
+    }
+
+    // nullptr if the user doesn't exist.
+    std::shared_ptr<const UserPermission> Find(const std::string& name) const;
+
+    uint64_t version{0};
+
+    // A null shard has no user.
+    std::array<std::shared_ptr<const Shard>, kShardNum> shards;
+  };
+
   void InitDataMap_();
 
+  static QosLimiter::Limits QosLimitsOf_(const Qos& qos);
+
+  /**
+   * Rebuild the permissions of the given users from m_user_map_ and publish a
+   * new permission index. Must be called after m_user_map_ is modified and
+   * before the lock of m_user_map_ is released.
+   */
+  void UpdatePermissionIndexNoLock_(const std::vector<std::string>& names);
+
+  /**
+   * Append the users of the account and all its descendant accounts.
+   */
+  void CollectUsersOfAccountNoLock_(const std::string& name,
+                                    std::vector<std::string>* users);
+
+  /**
+   * Check a new user against its account and fill in the qos of its
+   * allowed partitions.
+   */
+  Result CheckNewUserNoLock_(const Account& account, User* new_user);
+
+  /**
+   * Check a new account against its parent, which is nullptr for a root
+   * account, and inherit the unspecified fields from the parent.
+   */
+  Result CheckNewAccountNoLock_(const Account* parent, Account* new_account);
+
+  /**
+   * Apply one modification to the copy of a user without writing the
+   * database.
+   */
+  Result ModifyUserNoLock_(
+      const crane::grpc::ModifyEntityRequest_OperatorType& operatorType,
+      const std::string& partition, const std::string& lhs,
+      const std::string& rhs, User* user);
+
   const User* GetUserInfoNoLock_(const std::string& name);
   const User* GetExistedUserInfoNoLock_(const std::string& name);
 
@@ -101,6 +214,8 @@ class AccountManager {
   bool DeleteUserAllowedPartitionFromDB_(const std::string& name,
                                          const std::string& partition);
 
+  // A method taking more than one of the locks below takes them in the order
+  // of m_rw_user_mutex_, m_rw_account_mutex_ and m_rw_qos_mutex_.
   std::unordered_map<std::string /*account name*/, std::unique_ptr<Account>>
       m_account_map_;
   util::rw_mutex m_rw_account_mutex_;
@@ -109,6 +224,11 @@ class AccountManager {
   util::rw_mutex m_rw_user_mutex_;
   std::unordered_map<std::string /*Qos name*/, std::unique_ptr<Qos>> m_qos_map_;
   util::rw_mutex m_rw_qos_mutex_;
+
+  // Loaded without any lock. Stored with m_permission_index_mtx_ held, which
+  // is always the last lock acquired.
+  std::atomic<std::shared_ptr<const PermissionIndex>> m_permission_index_;
+  util::mutex m_permission_index_mtx_;
 };
 
 }  // namespace Ctld
@@ -1,6 +1,7 @@
 #include <absl/strings/ascii.h>
 #include <event2/thread.h>
 #include <sys/file.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <yaml-cpp/yaml.h>
 
@@ -18,6 +19,8 @@
 #include "CtldGrpcServer.h"
 #include "DbClient.h"
 #include "EmbeddedDbClient.h"
+#include "FairShareManager.h"
+#include "QosLimiter.h"
 #include "TaskScheduler.h"
 #include "crane/PublicHeader.h"
 #include "crane/String.h"
@@ -139,6 +142,78 @@ void ParseConfig(int argc, char** argv) {
       else
         g_config.DbName = "crane_db";
 
+      if (config["PriorityDecayHalfLife"] &&
+          !config["PriorityDecayHalfLife"].IsNull()) {
+        uint32_t half_life_days =
+            config["PriorityDecayHalfLife"].as<uint32_t>();
+        if (half_life_days == 0) {
+          CRANE_ERROR("PriorityDecayHalfLife must be positive.");
+          std::exit(1);
+        }
+        g_config.PriorityDecayHalfLife = absl::Hours(half_life_days * 24);
+      } else
+        g_config.PriorityDecayHalfLife = absl::Hours(7 * 24);
+
+      if (config["CranedHeartbeatIntervalSec"]) {
+        uint32_t heartbeat_interval_sec =
+            config["CranedHeartbeatIntervalSec"].as<uint32_t>();
+        if (heartbeat_interval_sec == 0) {
+          CRANE_ERROR("CranedHeartbeatIntervalSec must be positive.");
+          std::exit(1);
+        }
+        g_config.CranedHeartbeatInterval =
+            absl::Seconds(heartbeat_interval_sec);
+      } else
+        g_config.CranedHeartbeatInterval = absl::Seconds(10);
+
+      if (config["CranedHeartbeatMissThreshold"])
+        g_config.CranedHeartbeatMissThreshold =
+            config["CranedHeartbeatMissThreshold"].as<uint32_t>();
+      else
+        g_config.CranedHeartbeatMissThreshold = 3;
+
+      if (config["CranedChannelKeepaliveTimeSec"]) {
+        uint32_t keepalive_time_sec =
+            config["CranedChannelKeepaliveTimeSec"].as<uint32_t>();
+        // Craned closes a connection pinged more often than this.
+        if (keepalive_time_sec < kCranedMinPingIntervalSec) {
+          CRANE_ERROR("CranedChannelKeepaliveTimeSec must be at least {}.",
+                      kCranedMinPingIntervalSec);
+          std::exit(1);
+        }
+        g_config.CranedChannel.KeepaliveTime =
+            absl::Seconds(keepalive_time_sec);
+      }
+
+      if (config["CranedChannelKeepaliveTimeoutSec"])
+        g_config.CranedChannel.KeepaliveTimeout = absl::Seconds(
+            config["CranedChannelKeepaliveTimeoutSec"].as<uint32_t>());
+
+      if (config["CranedChannelCompression"]) {
+        g_config.CranedChannel.Compression = absl::AsciiStrToLower(
+            config["CranedChannelCompression"].as<std::string>());
+        const std::string& compression = g_config.CranedChannel.Compression;
+        if (compression != "none" && compression != "deflate" &&
+            compression != "gzip") {
+          CRANE_ERROR("Illegal CranedChannelCompression: {}", compression);
+          std::exit(1);
+        }
+      }
+
+      if (config["CranedChannelMemoryQuotaMB"])
+        g_config.CranedChannel.MemoryQuotaBytes =
+            config["CranedChannelMemoryQuotaMB"].as<uint64_t>() * 1024 * 1024;
+
+      if (config["RpcWorkerNum"])
+        g_config.RpcWorkerNum = config["RpcWorkerNum"].as<uint32_t>();
+      else
+        g_config.RpcWorkerNum = 16;
+
+      if (config["RpcMaxQueuedNum"])
+        g_config.RpcMaxQueuedNum = config["RpcMaxQueuedNum"].as<uint32_t>();
+      else
+        g_config.RpcMaxQueuedNum = 4096;
+
       if (config["CraneCtldForeground"]) {
         g_config.CraneCtldForeground = config["CraneCtldForeground"].as<bool>();
       }
@@ -295,6 +370,24 @@ void ParseConfig(int argc, char** argv) {
   }
 }
 
+// Log the memory and CPU consumed by cranectld divided by the number of
+// connected Craneds. Used to measure the overhead of each Craned connection.
+void LogResourceUsagePerCraned() {
+  uint32_t craned_num = g_craned_keeper->AvailableCranedCount();
+  if (craned_num == 0) return;
+
+  rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return;
+
+  double cpu_ms = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+                  (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+  CRANE_INFO(
+      "{} craned connected. Max RSS: {} KiB ({:.1f} KiB per craned). CPU "
+      "time: {:.0f} ms ({:.2f} ms per craned).",
+      craned_num, usage.ru_maxrss, double(usage.ru_maxrss) / craned_num,
+      cpu_ms, cpu_ms / craned_num);
+}
+
 void InitializeCtldGlobalVariables() {
   using namespace Ctld;
 
@@ -355,8 +448,21 @@ void InitializeCtldGlobalVariables() {
     std::exit(1);
   }
 
+  // The qos limits are loaded into g_qos_limiter by AccountManager.
+  g_qos_limiter = std::make_unique<QosLimiter>();
   g_account_manager = std::make_unique<AccountManager>();
 
+  g_fair_share_manager =
+      std::make_unique<FairShareManager>(g_config.PriorityDecayHalfLife);
+  std::vector<UsageRecord> usage_records;
+  g_db_client->SelectAllUsageRecords(&usage_records);
+  g_fair_share_manager->Load(usage_records);
+  g_fair_share_manager->StartCheckpointThread(
+      absl::Minutes(5), [](std::vector<UsageRecord>&& records) {
+        if (!g_db_client->UpsertUsageRecords(records))
+          CRANE_ERROR("Failed to checkpoint the usage to database.");
+      });
+
   g_meta_container = std::make_unique<CranedMetaContainerSimpleImpl>();
   g_meta_container->InitFromConfig(g_config);
 
@@ -442,6 +548,7 @@ void InitializeCtldGlobalVariables() {
       break;
     }
   }
+  LogResourceUsagePerCraned();
 
   g_task_scheduler =
       std::make_unique<TaskScheduler>(std::make_unique<MinLoadFirst>());
@@ -451,13 +558,21 @@ void InitializeCtldGlobalVariables() {
     std::exit(1);
   }
 
+  g_thread_pool = std::make_unique<BS::thread_pool>(g_config.RpcWorkerNum);
+
   g_ctld_server = std::make_unique<Ctld::CtldServer>(g_config.ListenConf);
 }
 
 void DestroyCtldGlobalVariables() {
   using namespace Ctld;
+  // All the RPCs have been finished after g_ctld_server->Wait() returns.
+  g_thread_pool.reset();
+
   g_craned_keeper.reset();
   g_embedded_db_client.reset();
+
+  // The last checkpoint is written to the database on destruction.
+  g_fair_share_manager.reset();
 }
 
 void CreateFolders() {
@@ -2,7 +2,10 @@
 
 #include <google/protobuf/util/time_util.h>
 
+#include <algorithm>
+#include <iterator>
 #include <optional>
+#include <random>
 #include <utility>
 
 namespace Ctld {
@@ -142,29 +145,39 @@ CraneErr CranedStub::TerminateOrphanedTask(task_id_t task_id) {
     return CraneErr::kGenericFailure;
 }
 
-CraneErr CranedStub::CreateCgroupForTask(uint32_t task_id, uid_t uid) {
-  using crane::grpc::CreateCgroupForTaskReply;
-  using crane::grpc::CreateCgroupForTaskRequest;
+CraneErr CranedStub::CreateCgroupForTasks(
+    std::vector<std::pair<task_id_t, uid_t>> const &task_uid_pairs,
+    std::vector<task_id_t> *failed_task_ids) {
+  using crane::grpc::CreateCgroupForTasksReply;
+  using crane::grpc::CreateCgroupForTasksRequest;
 
   ClientContext context;
   Status status;
-  CreateCgroupForTaskRequest request;
-  CreateCgroupForTaskReply reply;
+  CreateCgroupForTasksRequest request;
+  CreateCgroupForTasksReply reply;
+
+  request.mutable_task_ids()->Reserve(task_uid_pairs.size());
+  request.mutable_uids()->Reserve(task_uid_pairs.size());
+  for (auto const &[task_id, uid] : task_uid_pairs) {
+    request.add_task_ids(task_id);
+    request.add_uids(uid);
+  }
 
-  request.set_task_id(task_id);
-  request.set_uid(uid);
-  status = m_stub_->CreateCgroupForTask(&context, request, &reply);
+  status = m_stub_->CreateCgroupForTasks(&context, request, &reply);
   if (!status.ok()) {
     CRANE_ERROR(
-        "CreateCgroupForTask RPC for Node {} returned with status not ok: {}",
+        "CreateCgroupForTasks RPC for Node {} returned with status not ok: {}",
         m_addr_and_id_.node_id, status.error_message());
     return CraneErr::kRpcFailure;
   }
 
-  if (reply.ok())
-    return CraneErr::kOk;
-  else
-    return CraneErr::kGenericFailure;
+  if (reply.failed_task_ids().empty()) return CraneErr::kOk;
+
+  if (failed_task_ids != nullptr)
+    failed_task_ids->insert(failed_task_ids->end(),
+                            reply.failed_task_ids().begin(),
+                            reply.failed_task_ids().end());
+  return CraneErr::kGenericFailure;
 }
 
 CraneErr CranedStub::ReleaseCgroupForTask(uint32_t task_id, uid_t uid) {
@@ -220,25 +233,35 @@ CraneErr CranedStub::CheckTaskStatus(task_id_t task_id,
     return CraneErr::kNonExistent;
 }
 
-CranedKeeper::CranedKeeper() : m_cq_closed_(false), m_tag_pool_(32, 0) {
-  m_cq_thread_ = std::thread(&CranedKeeper::StateMonitorThreadFunc_, this);
+CranedKeeper::CranedKeeper() {
+  InitChannelOptions_();
+
+  uint32_t cq_num = DefaultCqNum_();
+  for (uint32_t i = 0; i < cq_num; i++)
+    m_cq_shards_.emplace_back(std::make_unique<CqShard>());
+  for (uint32_t i = 0; i < cq_num; i++)
+    m_cq_shards_[i]->thread =
+        std::thread(&CranedKeeper::StateMonitorThreadFunc_, this, i);
+
   m_period_connect_thread_ =
       std::thread(&CranedKeeper::PeriodConnectCranedThreadFunc_, this);
 }
 
 CranedKeeper::~CranedKeeper() {
-  m_cq_mtx_.Lock();
-
-  m_cq_.Shutdown();
-  m_cq_closed_ = true;
-
-  m_cq_mtx_.Unlock();
-
-  m_cq_thread_.join();
+  // Stop connecting Craneds before shutting down the completion queues.
+  m_period_connect_stop_.Notify();
   m_period_connect_thread_.join();
 
-  // Dependency order: rpc_cq -> channel_state_cq -> tag pool.
-  // Tag pool's destructor will free all trailing tags in cq.
+  for (auto &shard : m_cq_shards_) {
+    util::write_lock_guard lock(shard->mtx);
+    shard->cq.Shutdown();
+    shard->closed = true;
+  }
+
+  // The monitor threads drain the queues before exiting. The tags of
+  // initializing Craneds are freed with them there, while the tags of
+  // established Craneds are freed with m_craned_vec_.
+  for (auto &shard : m_cq_shards_) shard->thread.join();
 }
 
 void CranedKeeper::InitAndRegisterCraneds(
@@ -250,14 +273,90 @@ void CranedKeeper::InitAndRegisterCraneds(
   CRANE_TRACE("Trying register all craneds...");
 }
 
-void CranedKeeper::StateMonitorThreadFunc_() {
+uint32_t CranedKeeper::DefaultCqNum_() {
+  // The monitor threads are idle most of the time. A few of them are enough
+  // to absorb a mass reconnection even in a large cluster.
+  return std::clamp(std::thread::hardware_concurrency() / 4, 1U, 8U);
+}
+
+void CranedKeeper::InitChannelOptions_() {
+  const Config::CranedChannelConf &conf = g_config.CranedChannel;
+
+  m_channel_args_.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS,
+                         absl::ToInt64Milliseconds(conf.KeepaliveTime));
+  m_channel_args_.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS,
+                         absl::ToInt64Milliseconds(conf.KeepaliveTimeout));
+  m_channel_args_.SetInt(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1 /*true*/);
+  m_channel_args_.SetInt(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+
+  // The messages to Craneds are small. BDP probing only adds a ping and a
+  // timer to each connection.
+  m_channel_args_.SetInt(GRPC_ARG_HTTP2_BDP_PROBE, 0 /*false*/);
+
+  if (conf.Compression == "gzip")
+    m_channel_args_.SetCompressionAlgorithm(GRPC_COMPRESS_GZIP);
+  else if (conf.Compression == "deflate")
+    m_channel_args_.SetCompressionAlgorithm(GRPC_COMPRESS_DEFLATE);
+  else
+    m_channel_args_.SetCompressionAlgorithm(GRPC_COMPRESS_NONE);
+
+  if (conf.MemoryQuotaBytes != 0) {
+    grpc::ResourceQuota quota("craned_channels");
+    quota.Resize(conf.MemoryQuotaBytes);
+    m_channel_args_.SetResourceQuota(quota);
+  }
+
+  if (g_config.ListenConf.UseTls) {
+    grpc::SslCredentialsOptions ssl_opts;
+    ssl_opts.pem_root_certs = g_config.ListenConf.CertContent;
+    ssl_opts.pem_cert_chain = g_config.ListenConf.CertContent;
+    ssl_opts.pem_private_key = g_config.ListenConf.KeyContent;
+
+    m_channel_creds_ = grpc::SslCredentials(ssl_opts);
+  } else {
+    m_channel_creds_ = grpc::InsecureChannelCredentials();
+  }
+}
+
+bool CranedKeeper::WatchCranedState_(
+    CranedStub *craned, CqTag *tag,
+    std::chrono::system_clock::time_point deadline) {
+  CqShard *shard = m_cq_shards_[craned->m_cq_index_].get();
+
+  util::read_lock_guard lock(shard->mtx);
+  // When cq is closed, do not register any more callbacks on it.
+  if (shard->closed) return false;
+
+  craned->m_channel_->NotifyOnStateChange(craned->m_prev_channel_state_,
+                                          deadline, &shard->cq, tag);
+  return true;
+}
+
+void CranedKeeper::StateMonitorThreadFunc_(uint32_t cq_index) {
   using namespace std::chrono_literals;
 
+  grpc::CompletionQueue &cq = m_cq_shards_[cq_index]->cq;
+
+  std::mt19937 rng{std::random_device{}()};
+  std::uniform_int_distribution<int64_t> jitter_dist(
+      0, kWatchDeadlineJitter.count());
+  auto next_deadline = [&] {
+    return std::chrono::system_clock::now() + 3s +
+           std::chrono::milliseconds(jitter_dist(rng));
+  };
+
+  // Free an initializing Craned whose watch can't be registered because the
+  // queue has been shut down.
+  auto free_unwatched_tag = [](CqTag *tag) {
+    if (tag->type == CqTag::kInitializingCraned)
+      delete reinterpret_cast<InitializingCranedTagData *>(tag->data);
+  };
+
   bool ok;
   CqTag *tag;
 
   while (true) {
-    if (m_cq_.Next((void **)&tag, &ok)) {
+    if (cq.Next((void **)&tag, &ok)) {
       CranedStub *craned;
       switch (tag->type) {
         case CqTag::kInitializingCraned:
@@ -285,16 +384,10 @@ void CranedKeeper::StateMonitorThreadFunc_() {
             break;
         }
         if (next_tag) {
-          util::lock_guard lock(m_cq_mtx_);
-          if (!m_cq_closed_) {
-            // CRANE_TRACE("Registering next tag: {}", next_tag->type);
-
-            craned->m_prev_channel_state_ = new_state;
-            // When cq is closed, do not register any more callbacks on it.
-            craned->m_channel_->NotifyOnStateChange(
-                craned->m_prev_channel_state_,
-                std::chrono::system_clock::now() + 3s, &m_cq_, next_tag);
-          }
+          // CRANE_TRACE("Registering next tag: {}", next_tag->type);
+          craned->m_prev_channel_state_ = new_state;
+          if (!WatchCranedState_(craned, next_tag, next_deadline()))
+            free_unwatched_tag(next_tag);
         } else {
           // END state of both state machine. Free the Craned client.
           if (tag->type == CqTag::kInitializingCraned) {
@@ -321,28 +414,21 @@ void CranedKeeper::StateMonitorThreadFunc_() {
             CRANE_ERROR("Unknown tag type: {}", tag->type);
           }
         }
-
-        util::lock_guard lock(m_tag_pool_mtx_);
-        m_tag_pool_.free(tag);
       } else {
         /* ok = false implies that NotifyOnStateChange() timed out.
          * See GRPC code: src/core/ext/filters/client_channel/
          *  channel_connectivity.cc:grpc_channel_watch_connectivity_state()
          *
-         * Register the same tag again. Do not free it because we have no newly
-         * allocated tag. */
-        util::lock_guard lock(m_cq_mtx_);
-        if (!m_cq_closed_) {
-          // CRANE_TRACE("Registering next tag: {}", tag->type);
-
-          // When cq is closed, do not register any more callbacks on it.
-          craned->m_channel_->NotifyOnStateChange(
-              craned->m_prev_channel_state_,
-              std::chrono::system_clock::now() + 3s, &m_cq_, tag);
-        }
+         * Register the same tag again. */
+        if (tag->type == CqTag::kEstablishedCraned)
+          CheckCranedHeartbeat_(craned);
+
+        // CRANE_TRACE("Registering next tag: {}", tag->type);
+        if (!WatchCranedState_(craned, tag, next_deadline()))
+          free_unwatched_tag(tag);
       }
     } else {
-      // m_cq_.Shutdown() has been called. Exit the thread.
+      // cq.Shutdown() has been called. Exit the thread.
       break;
     }
   }
@@ -393,6 +479,11 @@ CranedKeeper::CqTag *CranedKeeper::InitCranedStateMachine_(
         raw_craned->m_failure_retry_times_ = 0;
         raw_craned->m_invalid_ = false;
       }
+      raw_craned->m_channel_ready_ = true;
+      raw_craned->m_heartbeat_lost_ = false;
+      raw_craned->m_last_heartbeat_us_.store(absl::ToUnixMicros(absl::Now()),
+                                             std::memory_order_relaxed);
+
       if (m_craned_is_up_cb_)
         m_craned_is_up_cb_(raw_craned->m_addr_and_id_.node_id);
 
@@ -463,11 +554,9 @@ CranedKeeper::CqTag *CranedKeeper::InitCranedStateMachine_(
   // CRANE_TRACE("Exit InitCranedStateMachine_");
   if (next_tag_type.has_value()) {
     if (next_tag_type.value() == CqTag::kInitializingCraned) {
-      util::lock_guard lock(m_tag_pool_mtx_);
-      return m_tag_pool_.construct(CqTag{next_tag_type.value(), tag_data});
+      return &tag_data->tag;
     } else if (next_tag_type.value() == CqTag::kEstablishedCraned) {
-      util::lock_guard lock(m_tag_pool_mtx_);
-      return m_tag_pool_.construct(CqTag{next_tag_type.value(), raw_craned});
+      return &raw_craned->m_cq_tag_;
     }
   }
   return nullptr;
@@ -513,8 +602,7 @@ CranedKeeper::CqTag *CranedKeeper::EstablishedCranedStateMachine_(
         util::write_lock_guard lock(m_alive_craned_rw_mtx_);
         m_alive_craned_bitset_[craned->m_slot_offset_] = false;
       }
-      if (m_craned_is_temp_down_cb_)
-        m_craned_is_temp_down_cb_(craned->m_addr_and_id_.node_id);
+      UpdateCranedLiveness_(craned, false, craned->m_heartbeat_lost_);
 
       next_tag_type = CqTag::kEstablishedCraned;
       break;
@@ -537,8 +625,7 @@ CranedKeeper::CqTag *CranedKeeper::EstablishedCranedStateMachine_(
           m_alive_craned_bitset_[craned->m_slot_offset_] = true;
         }
 
-        if (m_craned_rec_from_temp_failure_cb_)
-          m_craned_rec_from_temp_failure_cb_(craned->m_addr_and_id_.node_id);
+        UpdateCranedLiveness_(craned, true, craned->m_heartbeat_lost_);
 
         next_tag_type = CqTag::kEstablishedCraned;
       }
@@ -556,8 +643,7 @@ CranedKeeper::CqTag *CranedKeeper::EstablishedCranedStateMachine_(
           util::write_lock_guard lock(m_alive_craned_rw_mtx_);
           m_alive_craned_bitset_[craned->m_slot_offset_] = false;
         }
-        if (m_craned_is_temp_down_cb_)
-          m_craned_is_temp_down_cb_(craned->m_addr_and_id_.node_id);
+        UpdateCranedLiveness_(craned, false, craned->m_heartbeat_lost_);
 
         next_tag_type = CqTag::kEstablishedCraned;
       } else if (craned->m_prev_channel_state_ == GRPC_CHANNEL_CONNECTING) {
@@ -610,15 +696,61 @@ CranedKeeper::CqTag *CranedKeeper::EstablishedCranedStateMachine_(
   }
 
   if (next_tag_type.has_value()) {
-    util::lock_guard lock(m_tag_pool_mtx_);
     CRANE_TRACE("Exit EstablishedCranedStateMachine_");
-    return m_tag_pool_.construct(CqTag{next_tag_type.value(), craned});
+    return &craned->m_cq_tag_;
   }
 
   CRANE_TRACE("Exit EstablishedCranedStateMachine_");
   return nullptr;
 }
 
+void CranedKeeper::UpdateCranedLiveness_(CranedStub *craned,
+                                         bool channel_ready,
+                                         bool heartbeat_lost) {
+  bool was_up = craned->m_channel_ready_ && !craned->m_heartbeat_lost_;
+  bool is_up = channel_ready && !heartbeat_lost;
+  craned->m_channel_ready_ = channel_ready;
+  craned->m_heartbeat_lost_ = heartbeat_lost;
+
+  if (was_up && !is_up) {
+    if (m_craned_is_temp_down_cb_)
+      m_craned_is_temp_down_cb_(craned->m_addr_and_id_.node_id);
+  } else if (!was_up && is_up) {
+    if (m_craned_rec_from_temp_failure_cb_)
+      m_craned_rec_from_temp_failure_cb_(craned->m_addr_and_id_.node_id);
+  }
+}
+
+void CranedKeeper::CheckCranedHeartbeat_(CranedStub *craned) {
+  if (g_config.CranedHeartbeatMissThreshold == 0) return;
+
+  absl::Time last_heartbeat = absl::FromUnixMicros(
+      craned->m_last_heartbeat_us_.load(std::memory_order_relaxed));
+  bool lost = absl::Now() - last_heartbeat >
+              g_config.CranedHeartbeatInterval *
+                  int64_t{g_config.CranedHeartbeatMissThreshold};
+  if (lost == craned->m_heartbeat_lost_) return;
+
+  if (lost)
+    CRANE_INFO("Craned {} missed {} heartbeats in a row. Consider it down.",
+               craned->m_addr_and_id_.node_id,
+               g_config.CranedHeartbeatMissThreshold);
+  else
+    CRANE_INFO("Heartbeats of Craned {} resumed.",
+               craned->m_addr_and_id_.node_id);
+
+  UpdateCranedLiveness_(craned, craned->m_channel_ready_, lost);
+}
+
+void CranedKeeper::CranedHeartbeat(const CranedId &craned_id) {
+  util::lock_guard lock(m_craned_mtx_);
+  auto iter = m_craned_id_slot_offset_map_.find(craned_id);
+  if (iter == m_craned_id_slot_offset_map_.end()) return;
+
+  m_craned_vec_[iter->second]->m_last_heartbeat_us_.store(
+      absl::ToUnixMicros(absl::Now()), std::memory_order_relaxed);
+}
+
 uint32_t CranedKeeper::AvailableCranedCount() {
   util::read_lock_guard r_lock(m_alive_craned_rw_mtx_);
   return m_alive_craned_bitset_.count();
@@ -674,31 +806,11 @@ void CranedKeeper::ConnectCranedNode_(CranedAddrAndId addr_info) {
    * connection-backoff algorithm. We might need to adjust these values.
    * https://grpc.github.io/grpc/cpp/md_doc_connection-backoff.html
    */
-  grpc::ChannelArguments channel_args;
-  //  channel_args.SetInt(GRPC_ARG_INITIAL_RECONNECT_BACKOFF_MS, 100 /*ms*/);
-  //  channel_args.SetInt(GRPC_ARG_MIN_RECONNECT_BACKOFF_MS, 1 /*s*/ * 1000
-  //  /*ms*/); channel_args.SetInt(GRPC_ARG_MAX_RECONNECT_BACKOFF_MS, 2 /*s*/ *
-  //  1000 /*ms*/);
-  //  channel_args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, 5 /*s*/ * 1000 /*ms*/);
-  //  channel_args.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, 10 /*s*/ * 1000
-  //  /*ms*/); channel_args.SetInt(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1
-  //  /*true*/);
-
   std::string addr_port =
       fmt::format("{}:{}", addr_info.node_addr, kCranedDefaultPort);
 
-  if (g_config.ListenConf.UseTls) {
-    grpc::SslCredentialsOptions ssl_opts;
-    ssl_opts.pem_root_certs = g_config.ListenConf.CertContent;
-    ssl_opts.pem_cert_chain = g_config.ListenConf.CertContent;
-    ssl_opts.pem_private_key = g_config.ListenConf.KeyContent;
-
-    cq_tag_data->craned->m_channel_ = grpc::CreateCustomChannel(
-        addr_port, grpc::SslCredentials(ssl_opts), channel_args);
-  } else {
-    cq_tag_data->craned->m_channel_ = grpc::CreateCustomChannel(
-        addr_port, grpc::InsecureChannelCredentials(), channel_args);
-  }
+  cq_tag_data->craned->m_channel_ =
+      grpc::CreateCustomChannel(addr_port, m_channel_creds_, m_channel_args_);
 
   cq_tag_data->craned->m_prev_channel_state_ =
       cq_tag_data->craned->m_channel_->GetState(true);
@@ -710,15 +822,13 @@ void CranedKeeper::ConnectCranedNode_(CranedAddrAndId addr_info) {
 
   cq_tag_data->craned->m_maximum_retry_times_ = 2;
 
-  CqTag *tag;
-  {
-    util::lock_guard lock(m_tag_pool_mtx_);
-    tag = m_tag_pool_.construct(CqTag{CqTag::kInitializingCraned, cq_tag_data});
-  }
+  cq_tag_data->craned->m_cq_index_ =
+      m_next_cq_index_.fetch_add(1, std::memory_order_relaxed) %
+      m_cq_shards_.size();
 
-  cq_tag_data->craned->m_channel_->NotifyOnStateChange(
-      cq_tag_data->craned->m_prev_channel_state_,
-      std::chrono::system_clock::now() + 2s, &m_cq_, tag);
+  if (!WatchCranedState_(cq_tag_data->craned.get(), &cq_tag_data->tag,
+                         std::chrono::system_clock::now() + 2s))
+    delete cq_tag_data;
 }
 
 void CranedKeeper::PutBackNodeIntoUnavailList_(CranedStub *stub) {
@@ -730,20 +840,27 @@ void CranedKeeper::PutBackNodeIntoUnavailList_(CranedStub *stub) {
 }
 
 void CranedKeeper::PeriodConnectCranedThreadFunc_() {
-  while (true) {
-    if (m_cq_closed_) break;
+  std::mt19937 rng{std::random_device{}()};
+  std::uniform_int_distribution<int64_t> jitter_dist(
+      -kConnectWaveJitter.count(), kConnectWaveJitter.count());
 
+  do {
+    std::list<CranedAddrAndId> wave;
     {
       util::lock_guard guard(m_unavail_craned_list_mtx_);
-      while (!m_unavail_craned_list_.empty()) {
-        auto &addr_id = m_unavail_craned_list_.front();
-        ConnectCranedNode_(std::move(addr_id));
-        m_unavail_craned_list_.pop_front();
-      }
+      auto end = m_unavail_craned_list_.begin();
+      std::advance(end, std::min<size_t>(kMaxConnectNumPerWave,
+                                         m_unavail_craned_list_.size()));
+      wave.splice(wave.end(), m_unavail_craned_list_,
+                  m_unavail_craned_list_.begin(), end);
     }
 
-    std::this_thread::sleep_for(std::chrono::milliseconds(300));
-  }
+    // The Craneds failing to connect are put back into the tail of
+    // m_unavail_craned_list_, so the waiting Craneds are connected in turn.
+    for (auto &addr_id : wave) ConnectCranedNode_(std::move(addr_id));
+  } while (!m_period_connect_stop_.WaitForNotificationWithTimeout(
+      absl::FromChrono(kConnectWaveInterval +
+                       std::chrono::milliseconds(jitter_dist(rng)))));
 }
 
-}  // namespace Ctld
\ No newline at end of file
+}  // namespace Ctld
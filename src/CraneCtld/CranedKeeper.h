@@ -1,13 +1,15 @@
 #pragma once
 
 #include <absl/synchronization/blocking_counter.h>
+#include <absl/synchronization/notification.h>
 #include <grpc++/alarm.h>
 #include <grpc++/completion_queue.h>
 #include <grpc++/grpc++.h>
 
+#include <atomic>
 #include <boost/dynamic_bitset.hpp>
-#include <boost/pool/object_pool.hpp>
 #include <boost/uuid/uuid.hpp>
+#include <chrono>
 #include <functional>
 #include <future>
 #include <memory>
@@ -28,6 +30,18 @@ struct CranedAddrAndId {
   CranedId node_id;
 };
 
+/**
+ * The tag of a connectivity watch registered on a completion queue of
+ * CranedKeeper. A Craned has at most one outstanding watch at any time, so
+ * the tag is embedded in the object it refers to instead of being allocated
+ * from a shared pool for each watch.
+ */
+struct CranedCqTag {
+  enum Type { kInitializingCraned, kEstablishedCraned };
+  Type type;
+  void *data;
+};
+
 /**
  * A class that encapsulate the detail of the underlying gRPC stub.
  */
@@ -39,7 +53,14 @@ class CranedStub {
 
   CraneErr ExecuteTask(const TaskInCtld *task);
 
-  CraneErr CreateCgroupForTask(uint32_t task_id, uid_t uid);
+  /**
+   * Create the cgroups of several tasks on this node with a single RPC.
+   * @param failed_task_ids If not nullptr, the tasks whose cgroups cannot be
+   *  created are appended to it.
+   */
+  CraneErr CreateCgroupForTasks(
+      std::vector<std::pair<task_id_t, uid_t>> const &task_uid_pairs,
+      std::vector<task_id_t> *failed_task_ids = nullptr);
 
   CraneErr ReleaseCgroupForTask(uint32_t task_id, uid_t uid);
 
@@ -56,6 +77,10 @@ class CranedStub {
 
   uint32_t m_slot_offset_;
 
+  // The index of the completion queue shard watching this Craned.
+  uint32_t m_cq_index_;
+  CranedCqTag m_cq_tag_{CranedCqTag::kEstablishedCraned, this};
+
   grpc_connectivity_state m_prev_channel_state_;
   std::shared_ptr<grpc::Channel> m_channel_;
 
@@ -64,6 +89,15 @@ class CranedStub {
   // Set if underlying gRPC is down.
   bool m_invalid_;
 
+  // The time of the last heartbeat in unix microseconds. Written by the
+  // heartbeat RPC and read by the monitor thread of its completion queue.
+  std::atomic_int64_t m_last_heartbeat_us_{0};
+
+  // Only accessed by the monitor thread of its completion queue. The Craned is
+  // reported up if its channel is ready and its heartbeats are not lost.
+  bool m_channel_ready_{false};
+  bool m_heartbeat_lost_{false};
+
   uint32_t m_maximum_retry_times_;
   uint32_t m_failure_retry_times_;
 
@@ -110,27 +144,86 @@ class CranedKeeper {
 
   void SetCranedIsTempUpCb(std::function<void(CranedId)> cb);
 
+  /**
+   * Record a heartbeat from the Craned. Lost heartbeats are detected when
+   * the connectivity watch of the Craned times out.
+   */
+  void CranedHeartbeat(const CranedId &craned_id);
+
  private:
+  using CqTag = CranedCqTag;
+
   struct InitializingCranedTagData {
     std::unique_ptr<CranedStub> craned;
+    CqTag tag{CqTag::kInitializingCraned, this};
   };
 
-  struct CqTag {
-    enum Type { kInitializingCraned, kEstablishedCraned };
-    Type type;
-    void *data;
+  /**
+   * The connectivity watches of Craneds are spread over several completion
+   * queues, each of which is polled by its own thread, so that a mass
+   * reconnection is not serialized on a single thread and a single lock.
+   */
+  struct CqShard {
+    grpc::CompletionQueue cq;
+
+    // Prevent registering new watches on cq after it is shut down.
+    util::rw_mutex mtx;
+    bool closed GUARDED_BY(mtx){false};
+
+    std::thread thread;
   };
 
+  // The Craneds waiting for reconnection are connected in waves. Each wave
+  // connects at most kMaxConnectNumPerWave Craneds, and the interval between
+  // waves is jittered, so that thousands of Craneds coming back at the same
+  // time after a network failure don't flood ctld with handshakes at once.
+  static constexpr uint32_t kMaxConnectNumPerWave = 256;
+  static constexpr std::chrono::milliseconds kConnectWaveInterval{300};
+  static constexpr std::chrono::milliseconds kConnectWaveJitter{100};
+
+  // The jitter added to the deadline of connectivity watches so that the
+  // timeouts of thousands of watches don't line up.
+  static constexpr std::chrono::milliseconds kWatchDeadlineJitter{1000};
+
+  static uint32_t DefaultCqNum_();
+
+  /**
+   * Build the arguments and credentials shared by the channels to all
+   * Craneds from g_config.
+   */
+  void InitChannelOptions_();
+
   static void PutBackNodeIntoUnavailList_(CranedStub *stub);
 
   void ConnectCranedNode_(CranedAddrAndId addr_info);
 
+  /**
+   * Watch the connectivity state change of the channel of craned on its
+   * completion queue.
+   * @return false if the completion queue has been shut down.
+   */
+  bool WatchCranedState_(CranedStub *craned, CqTag *tag,
+                         std::chrono::system_clock::time_point deadline);
+
+  /**
+   * Update the liveness of an established Craned and call the temporarily
+   * down or up callback if its reported state changes.
+   */
+  void UpdateCranedLiveness_(CranedStub *craned, bool channel_ready,
+                             bool heartbeat_lost);
+
+  /**
+   * Mark the Craned as down if it has missed too many heartbeats while its
+   * channel is ready, or as up again once its heartbeats resume.
+   */
+  void CheckCranedHeartbeat_(CranedStub *craned);
+
   CqTag *InitCranedStateMachine_(InitializingCranedTagData *tag_data,
                                  grpc_connectivity_state new_state);
   CqTag *EstablishedCranedStateMachine_(CranedStub *craned,
                                         grpc_connectivity_state new_state);
 
-  void StateMonitorThreadFunc_();
+  void StateMonitorThreadFunc_(uint32_t cq_index);
 
   void PeriodConnectCranedThreadFunc_();
 
@@ -142,13 +235,6 @@ class CranedKeeper {
   // called.
   std::function<void(CranedId)> m_craned_is_down_cb_;
 
-  util::mutex m_tag_pool_mtx_;
-
-  // Must be declared previous to any grpc::CompletionQueue, so it can be
-  // constructed before any CompletionQueue and be destructed after any
-  // CompletionQueue.
-  boost::object_pool<CqTag> m_tag_pool_;
-
   // Protect m_node_vec_, m_node_id_slot_offset_map_ and m_empty_slot_bitset_.
   util::mutex m_craned_mtx_;
 
@@ -175,13 +261,18 @@ class CranedKeeper {
   // grpc channel state is GRPC_CHANNEL_READY).
   boost::dynamic_bitset<> m_alive_craned_bitset_;
 
-  grpc::CompletionQueue m_cq_;
-  util::mutex m_cq_mtx_;
-  bool m_cq_closed_;
+  // Created once and shared by all channels. Channels created with the same
+  // arguments to the same address also share the underlying subchannel in
+  // the global subchannel pool, so reconnecting a Craned whose old channel
+  // is still alive doesn't open a new connection.
+  grpc::ChannelArguments m_channel_args_;
+  std::shared_ptr<grpc::ChannelCredentials> m_channel_creds_;
 
-  std::thread m_cq_thread_;
+  std::vector<std::unique_ptr<CqShard>> m_cq_shards_;
+  std::atomic_uint32_t m_next_cq_index_{0};
 
   std::thread m_period_connect_thread_;
+  absl::Notification m_period_connect_stop_;
 };
 
 }  // namespace Ctld
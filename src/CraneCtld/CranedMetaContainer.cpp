@@ -1,14 +1,17 @@
 #include "CranedMetaContainer.h"
 
+#include <absl/container/flat_hash_set.h>
+
 #include "crane/String.h"
 
 namespace Ctld {
 
 void CranedMetaContainerSimpleImpl::CranedUp(const CranedId& craned_id) {
-  LockGuard guard(mtx_);
+  PartitionShard* shard = GetPartitionShard_(craned_id.partition_id);
+  CRANE_ASSERT(shard != nullptr);
+  LockGuard guard(shard->mtx);
 
-  CRANE_ASSERT(partition_metas_map_.count(craned_id.partition_id) > 0);
-  auto& part_meta = partition_metas_map_.at(craned_id.partition_id);
+  auto& part_meta = *shard->metas;
 
   CRANE_ASSERT(part_meta.craned_meta_map.count(craned_id.craned_index) > 0);
   auto& node_meta = part_meta.craned_meta_map.at(craned_id.craned_index);
@@ -17,20 +20,21 @@ void CranedMetaContainerSimpleImpl::CranedUp(const CranedId& craned_id) {
   part_meta.partition_global_meta.m_resource_total_ += node_meta.res_total;
   part_meta.partition_global_meta.m_resource_avail_ += node_meta.res_total;
   part_meta.partition_global_meta.alive_craned_cnt++;
+
+  UpdateSummaryNoLock_(shard, craned_id.craned_index);
 }
 
 void CranedMetaContainerSimpleImpl::CranedDown(CranedId craned_id) {
-  LockGuard guard(mtx_);
-
-  auto part_metas_iter = partition_metas_map_.find(craned_id.partition_id);
-  if (part_metas_iter == partition_metas_map_.end()) {
+  PartitionShard* shard = GetPartitionShard_(craned_id.partition_id);
+  if (shard == nullptr) {
     CRANE_ERROR(
         "Deleting non-existent craned {} in CranedDown: Partition not found",
         craned_id);
     return;
   }
+  LockGuard guard(shard->mtx);
 
-  CranedMetaMap& craned_meta_map = part_metas_iter->second.craned_meta_map;
+  CranedMetaMap& craned_meta_map = shard->metas->craned_meta_map;
   auto craned_meta_iter = craned_meta_map.find(craned_id.craned_index);
   if (craned_meta_iter == craned_meta_map.end()) {
     CRANE_ERROR(
@@ -40,32 +44,34 @@ void CranedMetaContainerSimpleImpl::CranedDown(CranedId craned_id) {
     return;
   }
 
-  PartitionGlobalMeta& part_meta =
-      part_metas_iter->second.partition_global_meta;
+  PartitionGlobalMeta& part_meta = shard->metas->partition_global_meta;
   CranedMeta& craned_meta = craned_meta_iter->second;
+  if (!craned_meta.alive) {
+    CRANE_DEBUG("Craned {} is already down. Ignoring CranedDown.", craned_id);
+    return;
+  }
   craned_meta.alive = false;
 
   part_meta.m_resource_avail_ -= craned_meta.res_avail;
   part_meta.m_resource_total_ -= craned_meta.res_total;
   part_meta.m_resource_in_use_ -= craned_meta.res_in_use;
-  part_meta.alive_craned_cnt++;
+  part_meta.alive_craned_cnt--;
+
+  UpdateSummaryNoLock_(shard, craned_id.craned_index);
 }
 
 CranedMetaContainerInterface::PartitionMetasPtr
-CranedMetaContainerSimpleImpl::GetPartitionMetasPtr(uint32_t partition_id) {
-  mtx_.lock();
+CranedMetaContainerSimpleImpl::GetPartitionMetasPtr(uint32_t partition_id)
+    NO_THREAD_SAFETY_ANALYSIS {
+  PartitionShard* shard = GetPartitionShard_(partition_id);
+  if (shard == nullptr) return PartitionMetasPtr{nullptr};
 
-  auto iter = partition_metas_map_.find(partition_id);
-  if (iter == partition_metas_map_.end()) {
-    mtx_.unlock();
-    return PartitionMetasPtr{nullptr};
-  }
-  return PartitionMetasPtr(&iter->second, &mtx_);
+  shard->mtx.lock();
+  return PartitionMetasPtr(shard->metas, &shard->mtx);
 }
 
 bool CranedMetaContainerSimpleImpl::GetPartitionId(
     const std::string& partition_name, uint32_t* partition_id) {
-  LockGuard guard(mtx_);
   auto iter = partition_name_id_map_.find(partition_name);
   if (iter == partition_name_id_map_.end()) {
     return false;
@@ -77,76 +83,100 @@ bool CranedMetaContainerSimpleImpl::GetPartitionId(
 
 bool CranedMetaContainerSimpleImpl::PartitionExists(
     const std::string& partition_name) {
-  LockGuard guard(mtx_);
-
   return partition_name_id_map_.count(partition_name) > 0;
 }
 
 CranedMetaContainerInterface::CranedMetaPtr
-CranedMetaContainerSimpleImpl::GetNodeMetaPtr(CranedId node_id) {
-  mtx_.lock();
-
-  auto part_metas_iter = partition_metas_map_.find(node_id.partition_id);
-  if (part_metas_iter == partition_metas_map_.end()) {
+CranedMetaContainerSimpleImpl::GetNodeMetaPtr(CranedId node_id)
+    NO_THREAD_SAFETY_ANALYSIS {
+  PartitionShard* shard = GetPartitionShard_(node_id.partition_id);
+  if (shard == nullptr) {
     // No such partition.
-    mtx_.unlock();
     return CranedMetaPtr{nullptr};
   }
 
+  shard->mtx.lock();
+
   auto node_meta_iter =
-      part_metas_iter->second.craned_meta_map.find(node_id.craned_index);
-  if (node_meta_iter == part_metas_iter->second.craned_meta_map.end()) {
+      shard->metas->craned_meta_map.find(node_id.craned_index);
+  if (node_meta_iter == shard->metas->craned_meta_map.end()) {
     // No such node in this partition.
-    mtx_.unlock();
+    shard->mtx.unlock();
     return CranedMetaPtr{nullptr};
   }
 
-  return CranedMetaPtr{&node_meta_iter->second, &mtx_};
+  return CranedMetaPtr{&node_meta_iter->second, &shard->mtx};
 }
 
 CranedMetaContainerInterface::AllPartitionsMetaMapPtr
 CranedMetaContainerSimpleImpl::GetAllPartitionsMetaMapPtr() {
-  mtx_.lock();
-  return AllPartitionsMetaMapPtr{&partition_metas_map_, &mtx_};
+  all_partitions_mtx_.lock();
+  return AllPartitionsMetaMapPtr{&partition_metas_map_, &all_partitions_mtx_};
 }
 
 void CranedMetaContainerSimpleImpl::MallocResourceFromNode(
     CranedId node_id, uint32_t task_id, const Resources& resources) {
-  LockGuard guard(mtx_);
-
-  auto part_metas_iter = partition_metas_map_.find(node_id.partition_id);
-  if (part_metas_iter == partition_metas_map_.end()) {
+  PartitionShard* shard = GetPartitionShard_(node_id.partition_id);
+  if (shard == nullptr) {
     // No such partition.
     return;
   }
+  LockGuard guard(shard->mtx);
 
-  auto node_meta_iter =
-      part_metas_iter->second.craned_meta_map.find(node_id.craned_index);
-  if (node_meta_iter == part_metas_iter->second.craned_meta_map.end()) {
+  if (shard->metas->craned_meta_map.count(node_id.craned_index) == 0) {
     // No such node in this partition.
     return;
   }
 
-  node_meta_iter->second.running_task_resource_map.emplace(task_id, resources);
-  part_metas_iter->second.partition_global_meta.m_resource_avail_ -= resources;
-  part_metas_iter->second.partition_global_meta.m_resource_in_use_ += resources;
-  node_meta_iter->second.res_avail -= resources;
-  node_meta_iter->second.res_in_use += resources;
+  MallocResourceFromNodeNoLock_(shard, node_id.craned_index, task_id,
+                                resources);
+}
+
+bool CranedMetaContainerSimpleImpl::TryMallocResourceFromNode(
+    CranedId node_id, uint32_t task_id, const Resources& resources) {
+  PartitionShard* shard = GetPartitionShard_(node_id.partition_id);
+  if (shard == nullptr) return false;
+  LockGuard guard(shard->mtx);
+
+  auto node_meta_iter =
+      shard->metas->craned_meta_map.find(node_id.craned_index);
+  if (node_meta_iter == shard->metas->craned_meta_map.end()) return false;
+
+  const CranedMeta& craned_meta = node_meta_iter->second;
+  if (!craned_meta.alive || !(resources <= craned_meta.res_avail))
+    return false;
+
+  MallocResourceFromNodeNoLock_(shard, node_id.craned_index, task_id,
+                                resources);
+  return true;
+}
+
+void CranedMetaContainerSimpleImpl::MallocResourceFromNodeNoLock_(
+    PartitionShard* shard, uint32_t craned_index, uint32_t task_id,
+    const Resources& resources) {
+  CranedMeta& craned_meta = shard->metas->craned_meta_map.at(craned_index);
+
+  craned_meta.running_task_resource_map.emplace(task_id, resources);
+  shard->metas->partition_global_meta.m_resource_avail_ -= resources;
+  shard->metas->partition_global_meta.m_resource_in_use_ += resources;
+  craned_meta.res_avail -= resources;
+  craned_meta.res_in_use += resources;
+
+  UpdateSummaryNoLock_(shard, craned_index);
 }
 
 void CranedMetaContainerSimpleImpl::FreeResourceFromNode(CranedId craned_id,
                                                          uint32_t task_id) {
-  LockGuard guard(mtx_);
-
-  auto part_metas_iter = partition_metas_map_.find(craned_id.partition_id);
-  if (part_metas_iter == partition_metas_map_.end()) {
+  PartitionShard* shard = GetPartitionShard_(craned_id.partition_id);
+  if (shard == nullptr) {
     // No such partition.
     return;
   }
+  LockGuard guard(shard->mtx);
 
   auto node_meta_iter =
-      part_metas_iter->second.craned_meta_map.find(craned_id.craned_index);
-  if (node_meta_iter == part_metas_iter->second.craned_meta_map.end()) {
+      shard->metas->craned_meta_map.find(craned_id.craned_index);
+  if (node_meta_iter == shard->metas->craned_meta_map.end()) {
     // No such node in this partition.
     return;
   }
@@ -159,19 +189,38 @@ void CranedMetaContainerSimpleImpl::FreeResourceFromNode(CranedId craned_id,
   }
 
   const Resources& resources = resource_iter->second;
-  part_metas_iter->second.partition_global_meta.m_resource_avail_ += resources;
-  part_metas_iter->second.partition_global_meta.m_resource_in_use_ -= resources;
+  shard->metas->partition_global_meta.m_resource_avail_ += resources;
+  shard->metas->partition_global_meta.m_resource_in_use_ -= resources;
   node_meta_iter->second.res_avail += resources;
   node_meta_iter->second.res_in_use -= resources;
 
   node_meta_iter->second.running_task_resource_map.erase(resource_iter);
+
+  UpdateSummaryNoLock_(shard, craned_id.craned_index);
 }
 
-void CranedMetaContainerSimpleImpl::InitFromConfig(const Config& config) {
-  LockGuard guard(mtx_);
+void CranedMetaContainerSimpleImpl::UpdateCranedLoad(CranedId craned_id,
+                                                     const CranedLoad& load) {
+  PartitionShard* shard = GetPartitionShard_(craned_id.partition_id);
+  if (shard == nullptr) return;
+  LockGuard guard(shard->mtx);
+
+  auto node_meta_iter =
+      shard->metas->craned_meta_map.find(craned_id.craned_index);
+  if (node_meta_iter == shard->metas->craned_meta_map.end()) return;
 
+  // The load is only used by node selection and is not in the summary.
+  node_meta_iter->second.load = load;
+}
+
+void CranedMetaContainerSimpleImpl::InitFromConfig(const Config& config)
+    NO_THREAD_SAFETY_ANALYSIS {
+  // Called before the container is shared, so no lock is needed here.
   uint32_t part_seq = 0;
 
+  change_log_first_version_ = absl::ToUnixMicros(absl::Now());
+  cluster_state_version_.store(change_log_first_version_ - 1);
+
   for (auto&& [part_name, partition] : config.Partitions) {
     CRANE_TRACE("Parsing partition {}", part_name);
 
@@ -236,12 +285,184 @@ void CranedMetaContainerSimpleImpl::InitFromConfig(const Config& config) {
         craned_index);
     part_seq++;
   }
+
+  for (uint32_t part_id = 0; part_id < part_seq; part_id++) {
+    PartitionMetas& part_metas = partition_metas_map_.at(part_id);
+    const PartitionGlobalMeta& part_meta = part_metas.partition_global_meta;
+
+    auto shard = std::make_unique<PartitionShard>();
+    shard->metas = &part_metas;
+    shard->craned_infos = decltype(shard->craned_infos)(part_meta.node_cnt);
+
+    auto part_info = std::make_shared<crane::grpc::PartitionInfo>();
+    FillPartitionInfo_(part_meta, part_info.get());
+    shard->partition_info.store(std::move(part_info));
+
+    for (uint32_t craned_index = 0; craned_index < part_meta.node_cnt;
+         craned_index++) {
+      const CranedMeta& craned_meta =
+          part_metas.craned_meta_map.at(craned_index);
+      crane::grpc::CranedState state = CranedStateOf_(craned_meta);
+
+      shard->craned_states.emplace_back(state);
+      shard->hostnames_of_state[state].emplace(
+          craned_meta.static_meta.hostname);
+
+      auto craned_info = std::make_shared<crane::grpc::CranedInfo>();
+      FillCranedInfo_(craned_meta, craned_info.get());
+      shard->craned_infos[craned_index].store(std::move(craned_info));
+    }
+
+    shard->state_changed.fill(true);
+    RebuildPartitionCranedInfoNoLock_(shard.get());
+
+    all_partitions_mtx_.partition_mtxs.emplace_back(&shard->mtx);
+    partition_shards_.emplace_back(std::move(shard));
+  }
+}
+
+crane::grpc::CranedState CranedMetaContainerSimpleImpl::CranedStateOf_(
+    const CranedMeta& craned_meta) {
+  if (!craned_meta.alive) return crane::grpc::CranedState::CRANE_DOWN;
+
+  auto& alloc_res_in_use = craned_meta.res_in_use.allocatable_resource;
+  auto& alloc_res_avail = craned_meta.res_avail.allocatable_resource;
+  if (alloc_res_in_use.cpu_count == 0 && alloc_res_in_use.memory_bytes == 0)
+    return crane::grpc::CranedState::CRANE_IDLE;
+  if (alloc_res_avail.cpu_count == 0 && alloc_res_avail.memory_bytes == 0)
+    return crane::grpc::CranedState::CRANE_ALLOC;
+  return crane::grpc::CranedState::CRANE_MIX;
+}
+
+void CranedMetaContainerSimpleImpl::FillCranedInfo_(
+    const CranedMeta& craned_meta, crane::grpc::CranedInfo* craned_info) {
+  auto& alloc_res_total = craned_meta.res_total.allocatable_resource;
+  auto& alloc_res_in_use = craned_meta.res_in_use.allocatable_resource;
+  auto& alloc_res_avail = craned_meta.res_avail.allocatable_resource;
+
+  craned_info->set_hostname(craned_meta.static_meta.hostname);
+  craned_info->set_cpus(alloc_res_total.cpu_count);
+  craned_info->set_alloc_cpus(alloc_res_in_use.cpu_count);
+  craned_info->set_free_cpus(alloc_res_avail.cpu_count);
+  craned_info->set_real_mem(alloc_res_total.memory_bytes);
+  craned_info->set_alloc_mem(alloc_res_in_use.memory_bytes);
+  craned_info->set_free_mem(alloc_res_avail.memory_bytes);
+  craned_info->set_partition_name(craned_meta.static_meta.partition_name);
+  craned_info->set_running_task_num(
+      craned_meta.running_task_resource_map.size());
+  if (craned_meta.alive)
+    craned_info->set_state(crane::grpc::CranedState::CRANE_IDLE);
+  else
+    craned_info->set_state(crane::grpc::CranedState::CRANE_DOWN);
+}
+
+void CranedMetaContainerSimpleImpl::FillPartitionInfo_(
+    const PartitionGlobalMeta& part_meta,
+    crane::grpc::PartitionInfo* part_info) {
+  auto& alloc_res_total =
+      part_meta.m_resource_total_inc_dead_.allocatable_resource;
+  auto& alloc_res_avail = part_meta.m_resource_avail_.allocatable_resource;
+  auto& alloc_res_in_use = part_meta.m_resource_in_use_.allocatable_resource;
+  part_info->set_name(part_meta.name);
+  part_info->set_total_nodes(part_meta.node_cnt);
+  part_info->set_alive_nodes(part_meta.alive_craned_cnt);
+  part_info->set_total_cpus(alloc_res_total.cpu_count);
+  part_info->set_avail_cpus(alloc_res_avail.cpu_count);
+  part_info->set_alloc_cpus(alloc_res_in_use.cpu_count);
+  part_info->set_total_mem(alloc_res_total.memory_bytes);
+  part_info->set_avail_mem(alloc_res_avail.memory_bytes);
+  part_info->set_alloc_mem(alloc_res_in_use.memory_bytes);
+
+  if (part_meta.alive_craned_cnt > 0)
+    part_info->set_state(crane::grpc::PartitionState::PARTITION_UP);
+  else
+    part_info->set_state(crane::grpc::PartitionState::PARTITION_DOWN);
+
+  part_info->set_hostlist(part_meta.nodelist_str);
+}
+
+void CranedMetaContainerSimpleImpl::UpdateSummaryNoLock_(
+    PartitionShard* shard, uint32_t craned_index) {
+  const PartitionMetas& part_metas = *shard->metas;
+  const CranedMeta& craned_meta = part_metas.craned_meta_map.at(craned_index);
+
+  auto part_info = std::make_shared<crane::grpc::PartitionInfo>();
+  FillPartitionInfo_(part_metas.partition_global_meta, part_info.get());
+  bool part_state_changed =
+      part_info->state() != shard->partition_info.load()->state();
+  shard->partition_info.store(std::move(part_info));
+
+  auto craned_info = std::make_shared<crane::grpc::CranedInfo>();
+  FillCranedInfo_(craned_meta, craned_info.get());
+  shard->craned_infos[craned_index].store(std::move(craned_info));
+
+  crane::grpc::CranedState old_state = shard->craned_states[craned_index];
+  crane::grpc::CranedState new_state = CranedStateOf_(craned_meta);
+  if (old_state != new_state) {
+    const std::string& hostname = craned_meta.static_meta.hostname;
+    shard->craned_states[craned_index] = new_state;
+    shard->hostnames_of_state[old_state].erase(hostname);
+    shard->hostnames_of_state[new_state].emplace(hostname);
+    shard->state_changed[old_state] = true;
+    shard->state_changed[new_state] = true;
+  }
+
+  if (old_state != new_state || part_state_changed)
+    shard->partition_craned_info_stale.store(true);
+
+  LogCranedChange_({craned_meta.static_meta.partition_id, craned_index});
+}
+
+void CranedMetaContainerSimpleImpl::RebuildPartitionCranedInfoNoLock_(
+    PartitionShard* shard) {
+  const PartitionGlobalMeta& part_meta = shard->metas->partition_global_meta;
+
+  std::shared_ptr<crane::grpc::PartitionCranedInfo> part_craned_info;
+  if (auto published = shard->partition_craned_info.load()) {
+    part_craned_info =
+        std::make_shared<crane::grpc::PartitionCranedInfo>(*published);
+  } else {
+    part_craned_info = std::make_shared<crane::grpc::PartitionCranedInfo>();
+    part_craned_info->set_name(part_meta.name);
+    if (part_meta.name == g_config.DefaultPartition)
+      part_craned_info->set_name(part_meta.name + '*');
+    for (size_t state = 0; state < kCranedStateNum; state++)
+      part_craned_info->add_common_craned_state_list()->set_state(
+          static_cast<crane::grpc::CranedState>(state));
+  }
+
+  part_craned_info->set_state(shard->partition_info.load()->state());
+
+  for (size_t state = 0; state < kCranedStateNum; state++) {
+    if (!shard->state_changed[state]) continue;
+    shard->state_changed[state] = false;
+
+    const auto& hostnames = shard->hostnames_of_state[state];
+    auto* craned_list =
+        part_craned_info->mutable_common_craned_state_list(state);
+    craned_list->set_craned_num(hostnames.size());
+    craned_list->set_craned_list_regex(util::HostNameListToStr(
+        std::list<std::string>(hostnames.begin(), hostnames.end())));
+  }
+
+  shard->partition_craned_info.store(std::move(part_craned_info));
+  shard->partition_craned_info_stale.store(false);
+}
+
+void CranedMetaContainerSimpleImpl::LogCranedChange_(
+    const CranedId& craned_id) {
+  util::lock_guard guard(change_log_mtx_);
+  change_log_.emplace_back(craned_id);
+  if (change_log_.size() > kChangeLogCapacity) {
+    change_log_.pop_front();
+    change_log_first_version_++;
+  }
+  uint64_t version = change_log_first_version_ + change_log_.size() - 1;
+  cluster_state_version_.store(version);
 }
 
 bool CranedMetaContainerSimpleImpl::CheckCranedAllowed(
     const std::string& hostname) {
-  LockGuard guard(mtx_);
-
   if (node_hostname_part_id_map_.count(hostname) > 0) return true;
 
   return false;
@@ -249,8 +470,6 @@ bool CranedMetaContainerSimpleImpl::CheckCranedAllowed(
 
 bool CranedMetaContainerSimpleImpl::GetCraneId(const std::string& hostname,
                                                CranedId* craned_id) {
-  LockGuard guard(mtx_);
-
   auto it1 = node_hostname_part_id_map_.find(hostname);
   if (it1 == node_hostname_part_id_map_.end()) return false;
   uint32_t part_id = it1->second;
@@ -267,42 +486,18 @@ bool CranedMetaContainerSimpleImpl::GetCraneId(const std::string& hostname,
 
 crane::grpc::QueryCranedInfoReply
 CranedMetaContainerSimpleImpl::QueryAllCranedInfo() {
-  LockGuard guard(mtx_);
-
   crane::grpc::QueryCranedInfoReply reply;
   auto* list = reply.mutable_craned_info_list();
 
-  for (auto&& [part_name, part_meta] : partition_metas_map_) {
-    for (auto&& [craned_index, craned_meta] : part_meta.craned_meta_map) {
-      auto* craned_info = list->Add();
-      auto& alloc_res_total = craned_meta.res_total.allocatable_resource;
-      auto& alloc_res_in_use = craned_meta.res_in_use.allocatable_resource;
-      auto& alloc_res_avail = craned_meta.res_avail.allocatable_resource;
-
-      craned_info->set_hostname(craned_meta.static_meta.hostname);
-      craned_info->set_cpus(alloc_res_total.cpu_count);
-      craned_info->set_alloc_cpus(alloc_res_in_use.cpu_count);
-      craned_info->set_free_cpus(alloc_res_avail.cpu_count);
-      craned_info->set_real_mem(alloc_res_total.memory_bytes);
-      craned_info->set_alloc_mem(alloc_res_in_use.memory_bytes);
-      craned_info->set_free_mem(alloc_res_avail.memory_bytes);
-      craned_info->set_partition_name(craned_meta.static_meta.partition_name);
-      craned_info->set_running_task_num(
-          craned_meta.running_task_resource_map.size());
-      if (craned_meta.alive)
-        craned_info->set_state(crane::grpc::CranedState::CRANE_IDLE);
-      else
-        craned_info->set_state(crane::grpc::CranedState::CRANE_DOWN);
-    }
-  }
+  for (auto&& shard : partition_shards_)
+    for (auto&& craned_info : shard->craned_infos)
+      *list->Add() = *craned_info.load();
 
   return reply;
 }
 
 crane::grpc::QueryCranedInfoReply
 CranedMetaContainerSimpleImpl::QueryCranedInfo(const std::string& node_name) {
-  LockGuard guard(mtx_);
-
   crane::grpc::QueryCranedInfoReply reply;
   auto* list = reply.mutable_craned_info_list();
 
@@ -319,63 +514,18 @@ CranedMetaContainerSimpleImpl::QueryCranedInfo(const std::string& node_name) {
   }
   uint32_t node_index = it2->second;
 
-  auto& node_meta = partition_metas_map_[part_id].craned_meta_map[node_index];
-  auto* node_info = list->Add();
-  auto& alloc_res_total = node_meta.res_total.allocatable_resource;
-  auto& alloc_res_in_use = node_meta.res_in_use.allocatable_resource;
-  auto& alloc_res_avail = node_meta.res_avail.allocatable_resource;
-
-  node_info->set_hostname(node_meta.static_meta.hostname);
-  node_info->set_cpus(alloc_res_total.cpu_count);
-  node_info->set_alloc_cpus(alloc_res_in_use.cpu_count);
-  node_info->set_free_cpus(alloc_res_avail.cpu_count);
-  node_info->set_real_mem(alloc_res_total.memory_bytes);
-  node_info->set_alloc_mem(alloc_res_in_use.memory_bytes);
-  node_info->set_free_mem(alloc_res_avail.memory_bytes);
-  node_info->set_partition_name(node_meta.static_meta.partition_name);
-  node_info->set_running_task_num(node_meta.running_task_resource_map.size());
-  if (node_meta.alive)
-    node_info->set_state(crane::grpc::CranedState::CRANE_IDLE);
-  else
-    node_info->set_state(crane::grpc::CranedState::CRANE_DOWN);
+  *list->Add() = *partition_shards_[part_id]->craned_infos[node_index].load();
 
   return reply;
 }
 
 crane::grpc::QueryPartitionInfoReply
 CranedMetaContainerSimpleImpl::QueryAllPartitionInfo() {
-  LockGuard guard(mtx_);
-
   crane::grpc::QueryPartitionInfoReply reply;
   auto* list = reply.mutable_partition_info();
 
-  for (auto&& [part_name, part_meta] : partition_metas_map_) {
-    auto* part_info = list->Add();
-    auto& alloc_res_total =
-        part_meta.partition_global_meta.m_resource_total_inc_dead_
-            .allocatable_resource;
-    auto& alloc_res_avail =
-        part_meta.partition_global_meta.m_resource_avail_.allocatable_resource;
-    auto& alloc_res_in_use =
-        part_meta.partition_global_meta.m_resource_in_use_.allocatable_resource;
-    part_info->set_name(part_meta.partition_global_meta.name);
-    part_info->set_total_nodes(part_meta.partition_global_meta.node_cnt);
-    part_info->set_alive_nodes(
-        part_meta.partition_global_meta.alive_craned_cnt);
-    part_info->set_total_cpus(alloc_res_total.cpu_count);
-    part_info->set_avail_cpus(alloc_res_avail.cpu_count);
-    part_info->set_alloc_cpus(alloc_res_in_use.cpu_count);
-    part_info->set_total_mem(alloc_res_total.memory_bytes);
-    part_info->set_avail_mem(alloc_res_avail.memory_bytes);
-    part_info->set_alloc_mem(alloc_res_in_use.memory_bytes);
-
-    if (part_meta.partition_global_meta.alive_craned_cnt > 0)
-      part_info->set_state(crane::grpc::PartitionState::PARTITION_UP);
-    else
-      part_info->set_state(crane::grpc::PartitionState::PARTITION_DOWN);
-
-    part_info->set_hostlist(part_meta.partition_global_meta.nodelist_str);
-  }
+  for (auto&& shard : partition_shards_)
+    *list->Add() = *shard->partition_info.load();
 
   return reply;
 }
@@ -383,111 +533,90 @@ CranedMetaContainerSimpleImpl::QueryAllPartitionInfo() {
 crane::grpc::QueryPartitionInfoReply
 CranedMetaContainerSimpleImpl::QueryPartitionInfo(
     const std::string& partition_name) {
-  LockGuard guard(mtx_);
-
   crane::grpc::QueryPartitionInfoReply reply;
   auto* list = reply.mutable_partition_info();
 
   auto it = partition_name_id_map_.find(partition_name);
   if (it == partition_name_id_map_.end()) return reply;
 
-  auto& part_meta = partition_metas_map_.at(it->second);
-
-  auto* part_info = list->Add();
-  auto& alloc_res_total = part_meta.partition_global_meta
-                              .m_resource_total_inc_dead_.allocatable_resource;
-  auto& alloc_res_avail =
-      part_meta.partition_global_meta.m_resource_avail_.allocatable_resource;
-  auto& alloc_res_in_use =
-      part_meta.partition_global_meta.m_resource_in_use_.allocatable_resource;
-  part_info->set_name(part_meta.partition_global_meta.name);
-  part_info->set_total_nodes(part_meta.partition_global_meta.node_cnt);
-  part_info->set_alive_nodes(part_meta.partition_global_meta.alive_craned_cnt);
-  part_info->set_total_cpus(alloc_res_total.cpu_count);
-  part_info->set_avail_cpus(alloc_res_avail.cpu_count);
-  part_info->set_alloc_cpus(alloc_res_in_use.cpu_count);
-  part_info->set_total_mem(alloc_res_total.memory_bytes);
-  part_info->set_avail_mem(alloc_res_avail.memory_bytes);
-  part_info->set_alloc_mem(alloc_res_in_use.memory_bytes);
-
-  if (part_meta.partition_global_meta.alive_craned_cnt > 0)
-    part_info->set_state(crane::grpc::PartitionState::PARTITION_UP);
-  else
-    part_info->set_state(crane::grpc::PartitionState::PARTITION_DOWN);
-
-  part_info->set_hostlist(part_meta.partition_global_meta.nodelist_str);
+  *list->Add() = *partition_shards_[it->second]->partition_info.load();
 
   return reply;
 }
 
 crane::grpc::QueryClusterInfoReply
 CranedMetaContainerSimpleImpl::QueryClusterInfo() {
-  LockGuard guard(mtx_);
   crane::grpc::QueryClusterInfoReply reply;
   auto* partition_craned_list = reply.mutable_partition_craned();
 
-  for (auto&& [part_id, part_meta] : partition_metas_map_) {
-    auto* part_craned_info = partition_craned_list->Add();
-    part_craned_info->set_name(part_meta.partition_global_meta.name);
-    if (part_craned_info->name() == g_config.DefaultPartition) {
-      part_craned_info->set_name(part_craned_info->name() + '*');
-    }
-    if (part_meta.partition_global_meta.alive_craned_cnt > 0)
-      part_craned_info->set_state(crane::grpc::PartitionState::PARTITION_UP);
-    else
-      part_craned_info->set_state(crane::grpc::PartitionState::PARTITION_DOWN);
-
-    auto* common_craned_state_list =
-        part_craned_info->mutable_common_craned_state_list();
-
-    auto* idle_craned_list = common_craned_state_list->Add();
-    idle_craned_list->set_state(crane::grpc::CranedState::CRANE_IDLE);
-    auto* mix_craned_list = common_craned_state_list->Add();
-    mix_craned_list->set_state(crane::grpc::CranedState::CRANE_MIX);
-    auto* alloc_craned_list = common_craned_state_list->Add();
-    alloc_craned_list->set_state(crane::grpc::CranedState::CRANE_ALLOC);
-    auto* down_craned_list = common_craned_state_list->Add();
-    down_craned_list->set_state(crane::grpc::CranedState::CRANE_DOWN);
-
-    std::list<std::string> idle_craned_name_list, mix_craned_name_list,
-        alloc_craned_name_list, down_craned_name_list;
-
-    for (auto&& [craned_index, craned_meta] : part_meta.craned_meta_map) {
-      auto& alloc_res_total = craned_meta.res_total.allocatable_resource;
-      auto& alloc_res_in_use = craned_meta.res_in_use.allocatable_resource;
-      auto& alloc_res_avail = craned_meta.res_avail.allocatable_resource;
-
-      if (craned_meta.alive) {
-        if (alloc_res_in_use.cpu_count == 0 &&
-            alloc_res_in_use.memory_bytes == 0) {
-          idle_craned_list->set_craned_num(idle_craned_list->craned_num() + 1);
-          idle_craned_name_list.emplace_back(craned_meta.static_meta.hostname);
-        } else if (alloc_res_avail.cpu_count == 0 &&
-                   alloc_res_avail.memory_bytes == 0) {
-          alloc_craned_list->set_craned_num(alloc_craned_list->craned_num() +
-                                            1);
-          alloc_craned_name_list.emplace_back(craned_meta.static_meta.hostname);
-        } else {
-          mix_craned_list->set_craned_num(mix_craned_list->craned_num() + 1);
-          mix_craned_name_list.emplace_back(craned_meta.static_meta.hostname);
-        }
-      } else {
-        down_craned_list->set_craned_num(down_craned_list->craned_num() + 1);
-        down_craned_name_list.emplace_back(craned_meta.static_meta.hostname);
-      }
+  for (auto&& shard : partition_shards_) {
+    if (shard->partition_craned_info_stale.load()) {
+      LockGuard guard(shard->mtx);
+      if (shard->partition_craned_info_stale.load())
+        RebuildPartitionCranedInfoNoLock_(shard.get());
     }
-
-    idle_craned_list->set_craned_list_regex(
-        util::HostNameListToStr(idle_craned_name_list));
-    mix_craned_list->set_craned_list_regex(
-        util::HostNameListToStr(mix_craned_name_list));
-    alloc_craned_list->set_craned_list_regex(
-        util::HostNameListToStr(alloc_craned_name_list));
-    down_craned_list->set_craned_list_regex(
-        util::HostNameListToStr(down_craned_name_list));
+    *partition_craned_list->Add() = *shard->partition_craned_info.load();
   }
 
   return reply;
 }
 
+void CranedMetaContainerSimpleImpl::QueryClusterStateSince(
+    uint64_t since_version, crane::grpc::WatchClusterStateReply* reply) {
+  std::vector<CranedId> changed_craneds;
+  uint64_t version;
+  bool snapshot;
+  {
+    util::lock_guard guard(change_log_mtx_);
+    version = change_log_first_version_ + change_log_.size() - 1;
+    snapshot = since_version == 0 ||
+               since_version + 1 < change_log_first_version_ ||
+               since_version > version;
+    if (!snapshot)
+      changed_craneds.assign(
+          change_log_.begin() + (since_version + 1 - change_log_first_version_),
+          change_log_.end());
+  }
+
+  reply->set_version(version);
+  reply->set_snapshot(snapshot);
+  if (snapshot) {
+    // The summaries loaded after the version is read are at least as new as
+    // the version.
+    FillClusterStateSnapshot_(reply);
+    return;
+  }
+
+  // A craned changed many times since since_version is sent only once with
+  // its latest state.
+  absl::flat_hash_set<CranedId, CranedId::Hash> sent_craneds;
+  absl::btree_set<uint32_t /*partition id*/> changed_partitions;
+  for (const CranedId& craned_id : changed_craneds) {
+    if (!sent_craneds.emplace(craned_id).second) continue;
+
+    changed_partitions.emplace(craned_id.partition_id);
+    *reply->add_craned_info_list() =
+        *partition_shards_[craned_id.partition_id]
+             ->craned_infos[craned_id.craned_index]
+             .load();
+  }
+
+  for (uint32_t part_id : changed_partitions)
+    *reply->add_partition_info_list() =
+        *partition_shards_[part_id]->partition_info.load();
+}
+
+void CranedMetaContainerSimpleImpl::FillClusterStateSnapshot_(
+    crane::grpc::WatchClusterStateReply* reply) {
+  for (auto&& shard : partition_shards_) {
+    for (auto&& craned_info : shard->craned_infos)
+      *reply->add_craned_info_list() = *craned_info.load();
+    *reply->add_partition_info_list() = *shard->partition_info.load();
+  }
+}
+
+uint64_t CranedMetaContainerSimpleImpl::ClusterStateVersion() {
+  return cluster_state_version_.load();
+}
+
 }  // namespace Ctld
\ No newline at end of file
@@ -1,8 +1,13 @@
 #pragma once
 
+#include <absl/container/btree_set.h>
 #include <absl/container/flat_hash_map.h>
 
+#include <array>
+#include <atomic>
+#include <deque>
 #include <unordered_map>
+#include <vector>
 
 #include "CtldPublicDefs.h"
 #include "crane/Lock.h"
@@ -12,17 +17,50 @@ namespace Ctld {
 
 /**
  * All public methods in this class is thread-safe.
+ *
+ * Each partition is guarded by its own lock. Lock order:
+ * 1. Partition locks are acquired in ascending order of partition id. Only
+ *    GetAllPartitionsMetaMapPtr() holds more than one of them.
+ * 2. No partition lock may be held when calling another public method of this
+ *    class since the locks are not recursive.
+ * 3. The lock of the change log is acquired after partition locks.
+ * The locks of TaskScheduler are acquired before any partition lock.
  */
 class CranedMetaContainerInterface {
  public:
-  using Mutex = util::recursive_mutex;
-  using LockGuard = util::recursive_lock_guard;
+  /**
+   * util::mutex with the lock()/unlock() required by util::ScopeExclusivePtr.
+   */
+  class LOCKABLE Mutex : public util::mutex {
+   public:
+    void lock() EXCLUSIVE_LOCK_FUNCTION() { Lock(); }
+    void unlock() UNLOCK_FUNCTION() { Unlock(); }
+  };
+  using LockGuard = util::lock_guard;
+
+  /**
+   * The locks of all partitions, acquired in the lock order above.
+   */
+  class AllPartitionsMutex {
+   public:
+    void lock() NO_THREAD_SAFETY_ANALYSIS {
+      for (Mutex* mtx : partition_mtxs) mtx->lock();
+    }
+    void unlock() NO_THREAD_SAFETY_ANALYSIS {
+      for (auto it = partition_mtxs.rbegin(); it != partition_mtxs.rend();
+           ++it)
+        (*it)->unlock();
+    }
+
+    // Indexed by partition id.
+    std::vector<Mutex*> partition_mtxs;
+  };
 
   using AllPartitionsMetaMap =
       absl::flat_hash_map<uint32_t /*partition id*/, PartitionMetas>;
 
   using AllPartitionsMetaMapPtr =
-      util::ScopeExclusivePtr<AllPartitionsMetaMap, Mutex>;
+      util::ScopeExclusivePtr<AllPartitionsMetaMap, AllPartitionsMutex>;
   using PartitionMetasPtr = util::ScopeExclusivePtr<PartitionMetas, Mutex>;
   using CranedMetaPtr = util::ScopeExclusivePtr<CranedMeta, Mutex>;
 
@@ -53,6 +91,22 @@ class CranedMetaContainerInterface {
 
   virtual crane::grpc::QueryClusterInfoReply QueryClusterInfo() = 0;
 
+  /**
+   * Fill reply with the craneds changed after since_version and the
+   * partitions they belong to. If since_version is 0 or the changes after it
+   * are no longer kept in the change log, all craneds and partitions are
+   * filled and reply->snapshot() is set instead.
+   */
+  virtual void QueryClusterStateSince(
+      uint64_t since_version, crane::grpc::WatchClusterStateReply* reply) = 0;
+
+  /**
+   * Lock-free.
+   * @return The version of the latest logged change. A watcher holding an
+   *  older version has changes to query.
+   */
+  virtual uint64_t ClusterStateVersion() = 0;
+
   virtual bool GetCraneId(const std::string& hostname, CranedId* node_id) = 0;
 
   /**
@@ -64,8 +118,20 @@ class CranedMetaContainerInterface {
 
   virtual void MallocResourceFromNode(CranedId node_id, uint32_t task_id,
                                       const Resources& resources) = 0;
+  /**
+   * Same as MallocResourceFromNode, but checks under the partition lock that
+   * the craned is alive and has the resources available first.
+   * @return false and malloc nothing if the check fails.
+   */
+  virtual bool TryMallocResourceFromNode(CranedId node_id, uint32_t task_id,
+                                         const Resources& resources) = 0;
   virtual void FreeResourceFromNode(CranedId node_id, uint32_t task_id) = 0;
 
+  /**
+   * Record the load reported by the heartbeat of a craned.
+   */
+  virtual void UpdateCranedLoad(CranedId craned_id, const CranedLoad& load) = 0;
+
   /**
    * Provide a thread-safe way to access NodeMeta.
    * @return a ScopeExclusivePointerType class. During the initialization of
@@ -103,6 +169,12 @@ class CranedMetaContainerSimpleImpl final
 
   crane::grpc::QueryClusterInfoReply QueryClusterInfo() override;
 
+  void QueryClusterStateSince(
+      uint64_t since_version,
+      crane::grpc::WatchClusterStateReply* reply) override;
+
+  uint64_t ClusterStateVersion() override;
+
   bool GetCraneId(const std::string& hostname, CranedId* craned_id) override;
 
   void CranedUp(const CranedId& craned_id) override;
@@ -125,11 +197,116 @@ class CranedMetaContainerSimpleImpl final
   void MallocResourceFromNode(CranedId node_id, uint32_t task_id,
                               const Resources& resources) override;
 
+  bool TryMallocResourceFromNode(CranedId node_id, uint32_t task_id,
+                                 const Resources& resources) override;
+
   void FreeResourceFromNode(CranedId craned_id, uint32_t task_id) override;
 
+  void UpdateCranedLoad(CranedId craned_id, const CranedLoad& load) override;
+
  private:
+  static constexpr size_t kCranedStateNum = 4;
+
+  // A watcher lagging more changes than this gets a snapshot instead.
+  static constexpr size_t kChangeLogCapacity = 16384;
+
+  /**
+   * Everything kept for a partition. The PartitionMetas itself is stored in
+   * partition_metas_map_ so that it can be handed out by
+   * GetAllPartitionsMetaMapPtr().
+   *
+   * The parts of the replies of QueryClusterInfo, QueryAllPartitionInfo and
+   * QueryAllCranedInfo are published separately. A published part is never
+   * modified. Writers publish a new one instead, so readers only do an atomic
+   * load. A change of a craned only rebuilds its CranedInfo and the
+   * PartitionInfo, both of constant size. The hostlists of the craned states
+   * are recompressed by the first QueryClusterInfo after they change.
+   */
+  struct PartitionShard {
+    Mutex mtx;
+
+    PartitionMetas* metas PT_GUARDED_BY(mtx);
+
+    // The incrementally maintained state from which partition_craned_info is
+    // built. Indexed by craned index.
+    std::vector<crane::grpc::CranedState> craned_states GUARDED_BY(mtx);
+    // Indexed by crane::grpc::CranedState.
+    std::array<absl::btree_set<std::string>, kCranedStateNum>
+        hostnames_of_state GUARDED_BY(mtx);
+    // The states whose hostlists are changed after partition_craned_info is
+    // built.
+    std::array<bool, kCranedStateNum> state_changed GUARDED_BY(mtx) = {};
+
+    // The fields below are loaded without mtx and only stored with mtx held.
+    std::atomic<std::shared_ptr<const crane::grpc::PartitionInfo>>
+        partition_info;
+    std::atomic<std::shared_ptr<const crane::grpc::PartitionCranedInfo>>
+        partition_craned_info;
+    // Set when partition_craned_info is to be rebuilt.
+    std::atomic_bool partition_craned_info_stale{false};
+    // Indexed by craned index. Sized in InitFromConfig().
+    std::vector<std::atomic<std::shared_ptr<const crane::grpc::CranedInfo>>>
+        craned_infos;
+  };
+
+  static crane::grpc::CranedState CranedStateOf_(const CranedMeta& craned_meta);
+
+  static void FillCranedInfo_(const CranedMeta& craned_meta,
+                              crane::grpc::CranedInfo* craned_info);
+
+  static void FillPartitionInfo_(const PartitionGlobalMeta& part_meta,
+                                 crane::grpc::PartitionInfo* part_info);
+
+  /**
+   * @return nullptr if the partition doesn't exist.
+   */
+  PartitionShard* GetPartitionShard_(uint32_t partition_id) {
+    if (partition_id >= partition_shards_.size()) return nullptr;
+    return partition_shards_[partition_id].get();
+  }
+
+  void MallocResourceFromNodeNoLock_(PartitionShard* shard,
+                                     uint32_t craned_index, uint32_t task_id,
+                                     const Resources& resources)
+      EXCLUSIVE_LOCKS_REQUIRED(shard->mtx);
+
+  /**
+   * Called after the meta of a craned is changed. Only the parts of the
+   * summary affected by this craned are rebuilt.
+   */
+  void UpdateSummaryNoLock_(PartitionShard* shard, uint32_t craned_index)
+      EXCLUSIVE_LOCKS_REQUIRED(shard->mtx);
+
+  /**
+   * Recompress the hostlists of the changed states and publish a new
+   * partition_craned_info.
+   */
+  static void RebuildPartitionCranedInfoNoLock_(PartitionShard* shard)
+      EXCLUSIVE_LOCKS_REQUIRED(shard->mtx);
+
+  /**
+   * Append a change of the craned to the change log. Called with the lock of
+   * its partition held and after its new summary is published, so a reader
+   * seeing the new version also sees the new summary.
+   */
+  void LogCranedChange_(const CranedId& craned_id)
+      LOCKS_EXCLUDED(change_log_mtx_);
+
+  void FillClusterStateSnapshot_(crane::grpc::WatchClusterStateReply* reply);
+
+  /* ---------------------------------------------------------------------
+   * The partitions and craneds are all known after InitFromConfig(), so the
+   * maps and vectors below are only written in it, before the container is
+   * shared, and are read without locks afterwards. The PartitionMetas in
+   * partition_metas_map_ are guarded by the lock of their PartitionShard.
+   * --------------------------------------------------------------------- */
   AllPartitionsMetaMap partition_metas_map_;
 
+  // Indexed by partition id.
+  std::vector<std::unique_ptr<PartitionShard>> partition_shards_;
+
+  AllPartitionsMutex all_partitions_mtx_;
+
   absl::flat_hash_map<std::string /*partition name*/, uint32_t /*partition id*/>
       partition_name_id_map_;
 
@@ -140,7 +317,18 @@ class CranedMetaContainerSimpleImpl final
                       uint32_t /*node index in a partition*/>
       part_id_host_index_map_;
 
-  Mutex mtx_;
+  util::mutex change_log_mtx_;
+
+  // change_log_[i] is the craned changed at version
+  // change_log_first_version_ + i. Versions start from the startup time in
+  // microseconds, so the versions a watcher got from a previous run of
+  // CraneCtld are older than the log and a snapshot is sent for them.
+  std::deque<CranedId> change_log_ GUARDED_BY(change_log_mtx_);
+  uint64_t change_log_first_version_ GUARDED_BY(change_log_mtx_) = 1;
+
+  // change_log_first_version_ + change_log_.size() - 1, updated under
+  // change_log_mtx_.
+  std::atomic_uint64_t cluster_state_version_{0};
 };
 
 }  // namespace Ctld
@@ -1,6 +1,7 @@
 #include "CtldGrpcServer.h"
 
 #include <absl/strings/str_split.h>
+#include <google/protobuf/util/field_mask_util.h>
 #include <google/protobuf/util/time_util.h>
 #include <pwd.h>
 
@@ -16,87 +17,118 @@
 
 namespace Ctld {
 
-grpc::Status CraneCtldServiceImpl::AllocateInteractiveTask(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::AllocateInteractiveTask(
+    grpc::CallbackServerContext *context,
     const crane::grpc::InteractiveTaskAllocRequest *request,
     crane::grpc::InteractiveTaskAllocReply *response) {
-  CraneErr err;
-  auto task = std::make_unique<TaskInCtld>();
-
-  task->partition_name = request->partition_name();
-  task->resources.allocatable_resource =
-      request->required_resources().allocatable_resource();
-  task->time_limit = absl::Seconds(request->time_limit_sec());
-  task->type = crane::grpc::Interactive;
-  task->meta = InteractiveMetaInTask{};
-
-  // Todo: Eliminate useless allocation here when err!=kOk.
-  uint32_t task_id;
-  err = g_task_scheduler->SubmitTask(std::move(task), &task_id);
-
-  if (err == CraneErr::kOk) {
-    response->set_ok(true);
-    response->set_task_id(task_id);
-  } else {
-    response->set_ok(false);
-    response->set_reason(err == CraneErr::kNonExistent
-                             ? "Partition doesn't exist!"
-                             : "Resource not enough!");
-  }
+  return RunBlocking_(context, [request, response]() -> grpc::Status {
+    CraneErr err;
+    auto task = std::make_unique<TaskInCtld>();
+
+    task->partition_name = request->partition_name();
+    task->resources.allocatable_resource =
+        request->required_resources().allocatable_resource();
+    task->time_limit = absl::Seconds(request->time_limit_sec());
+    task->type = crane::grpc::Interactive;
+    task->meta = InteractiveMetaInTask{};
+
+    // Todo: Eliminate useless allocation here when err!=kOk.
+    uint32_t task_id;
+    err = g_task_scheduler->SubmitTask(std::move(task), &task_id);
+
+    if (err == CraneErr::kOk) {
+      response->set_ok(true);
+      response->set_task_id(task_id);
+    } else if (err == CraneErr::kNonExistent) {
+      response->set_ok(false);
+      response->set_reason("Partition doesn't exist!");
+    } else if (err == CraneErr::kExceedQosLimit) {
+      response->set_ok(false);
+      response->set_reason("Exceeding the limit of the QoS!");
+    } else {
+      response->set_ok(false);
+      response->set_reason("Resource not enough!");
+    }
 
-  return grpc::Status::OK;
+    return grpc::Status::OK;
+  });
 }
 
-grpc::Status CraneCtldServiceImpl::SubmitBatchTask(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::SubmitBatchTask(
+    grpc::CallbackServerContext *context,
     const crane::grpc::SubmitBatchTaskRequest *request,
     crane::grpc::SubmitBatchTaskReply *response) {
-  CraneErr err;
+  return RunBlocking_(context, [request, response]() -> grpc::Status {
+    CraneErr err;
+
+    auto task = std::make_unique<TaskInCtld>();
+    task->SetFieldsByTaskToCtld(request->task());
+
+    if (task->uid) {
+      auto permission =
+          g_account_manager->GetUserPermission(getpwuid(task->uid)->pw_name);
+      if (!permission ||
+          !permission->partitions.contains(task->partition_name)) {
+        response->set_ok(false);
+        response->set_reason(fmt::format(
+            "The user:{} don't have access to submit task in partition:{}",
+            task->uid, task->partition_name));
+        return grpc::Status::OK;
+      }
 
-  auto task = std::make_unique<TaskInCtld>();
-  task->SetFieldsByTaskToCtld(request->task());
+      // The usage of this task will be charged to this account.
+      task->SetAccount(permission->account);
+
+      const auto &part_permission =
+          permission->partitions.at(task->partition_name);
+      if (task->qos.empty()) {
+        task->SetQos(part_permission.default_qos);
+      } else if (!part_permission.allowed_qos.contains(task->qos)) {
+        response->set_ok(false);
+        response->set_reason(fmt::format(
+            "The user:{} don't have access to qos:{} in partition:{}",
+            task->uid, task->qos, task->partition_name));
+        return grpc::Status::OK;
+      }
+    }
 
-  if (task->uid) {
-    if (!g_account_manager->CheckUserPermissionToPartition(
-            getpwuid(task->uid)->pw_name, task->partition_name)) {
+    uint32_t task_id;
+    err = g_task_scheduler->SubmitTask(std::move(task), &task_id);
+    if (err == CraneErr::kOk) {
+      response->set_ok(true);
+      response->set_task_id(task_id);
+      CRANE_DEBUG("Received an batch task request. Task id allocated: {}",
+                  task_id);
+    } else if (err == CraneErr::kNonExistent) {
+      response->set_ok(false);
+      response->set_reason("Partition doesn't exist!");
+      CRANE_DEBUG(
+          "Received an batch task request "
+          "but the allocation failed. Reason: Resource "
+          "not enough!");
+    } else if (err == CraneErr::kInvalidNodeNum) {
+      response->set_ok(false);
+      response->set_reason(
+          "--node is either invalid or greater than "
+          "the number of alive nodes in its partition.");
+      CRANE_DEBUG(
+          "Received an batch task request "
+          "but the allocation failed. Reason: --node is either invalid or "
+          "greater than the number of alive nodes in its partition.");
+    } else {
       response->set_ok(false);
-      response->set_reason(fmt::format(
-          "The user:{} don't have access to submit task in partition:{}",
-          task->uid, task->partition_name));
-      return grpc::Status::OK;
+      response->set_reason(std::string(CraneErrStr(err)));
+      CRANE_DEBUG(
+          "Received an batch task request but it was rejected. Reason: {}",
+          CraneErrStr(err));
     }
-  }
 
-  uint32_t task_id;
-  err = g_task_scheduler->SubmitTask(std::move(task), &task_id);
-  if (err == CraneErr::kOk) {
-    response->set_ok(true);
-    response->set_task_id(task_id);
-    CRANE_DEBUG("Received an batch task request. Task id allocated: {}",
-                task_id);
-  } else if (err == CraneErr::kNonExistent) {
-    response->set_ok(false);
-    response->set_reason("Partition doesn't exist!");
-    CRANE_DEBUG(
-        "Received an batch task request "
-        "but the allocation failed. Reason: Resource "
-        "not enough!");
-  } else if (err == CraneErr::kInvalidNodeNum) {
-    response->set_ok(false);
-    response->set_reason(
-        "--node is either invalid or greater than "
-        "the number of alive nodes in its partition.");
-    CRANE_DEBUG(
-        "Received an batch task request "
-        "but the allocation failed. Reason: --node is either invalid or "
-        "greater than the number of alive nodes in its partition.");
-  }
-
-  return grpc::Status::OK;
+    return grpc::Status::OK;
+  });
 }
 
-grpc::Status CraneCtldServiceImpl::QueryInteractiveTaskAllocDetail(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::QueryInteractiveTaskAllocDetail(
+    grpc::CallbackServerContext *context,
     const crane::grpc::QueryInteractiveTaskAllocDetailRequest *request,
     crane::grpc::QueryInteractiveTaskAllocDetailReply *response) {
   auto *detail = g_ctld_server->QueryAllocDetailOfIaTask(request->task_id());
@@ -111,58 +143,88 @@ grpc::Status CraneCtldServiceImpl::QueryInteractiveTaskAllocDetail(
     response->set_ok(false);
   }
 
-  return grpc::Status::OK;
+  auto *reactor = context->DefaultReactor();
+  reactor->Finish(grpc::Status::OK);
+  return reactor;
 }
 
-grpc::Status CraneCtldServiceImpl::TaskStatusChange(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::TaskStatusChange(
+    grpc::CallbackServerContext *context,
     const crane::grpc::TaskStatusChangeRequest *request,
     crane::grpc::TaskStatusChangeReply *response) {
-  crane::grpc::TaskStatus status{};
-  if (request->new_status() == crane::grpc::Finished)
-    status = crane::grpc::Finished;
-  else if (request->new_status() == crane::grpc::Failed)
-    status = crane::grpc::Failed;
-  else if (request->new_status() == crane::grpc::Cancelled)
-    status = crane::grpc::Cancelled;
-  else
-    CRANE_ERROR(
-        "Task #{}: When TaskStatusChange RPC is called, the task should either "
-        "be Finished, Failed or Cancelled. new_status = {}",
-        request->task_id(), request->new_status());
-
-  std::optional<std::string> reason;
-  if (!request->reason().empty()) reason = request->reason();
-
-  g_task_scheduler->TaskStatusChange(request->task_id(),
-                                     request->craned_index(), status, reason);
+  return RunBlocking_(
+      context,
+      [request, response]() -> grpc::Status {
+        crane::grpc::TaskStatus status{};
+        if (request->new_status() == crane::grpc::Finished)
+          status = crane::grpc::Finished;
+        else if (request->new_status() == crane::grpc::Failed)
+          status = crane::grpc::Failed;
+        else if (request->new_status() == crane::grpc::Cancelled)
+          status = crane::grpc::Cancelled;
+        else
+          CRANE_ERROR(
+              "Task #{}: When TaskStatusChange RPC is called, the task should "
+              "either be Finished, Failed or Cancelled. new_status = {}",
+              request->task_id(), request->new_status());
+
+        std::optional<std::string> reason;
+        if (!request->reason().empty()) reason = request->reason();
+
+        g_task_scheduler->TaskStatusChange(
+            request->task_id(), request->craned_index(), status, reason,
+            request->resource_usage());
+        response->set_ok(true);
+        return grpc::Status::OK;
+      },
+      /*sheddable=*/false);
+}
+
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::CranedHeartbeat(
+    grpc::CallbackServerContext *context,
+    const crane::grpc::CranedHeartbeatRequest *request,
+    crane::grpc::CranedHeartbeatReply *response) {
+  CranedId craned_id{request->partition_id(), request->craned_index()};
+
+  CranedLoad load{.load_average = request->load_average(),
+                  .free_memory_bytes = request->free_memory_bytes(),
+                  .running_task_num = request->running_task_num()};
+
+  g_craned_keeper->CranedHeartbeat(craned_id);
+  g_meta_container->UpdateCranedLoad(craned_id, load);
+
   response->set_ok(true);
-  return grpc::Status::OK;
+  auto *reactor = context->DefaultReactor();
+  reactor->Finish(grpc::Status::OK);
+  return reactor;
 }
 
-grpc::Status CraneCtldServiceImpl::CancelTask(
-    grpc::ServerContext *context, const crane::grpc::CancelTaskRequest *request,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::CancelTask(
+    grpc::CallbackServerContext *context,
+    const crane::grpc::CancelTaskRequest *request,
     crane::grpc::CancelTaskReply *response) {
-  uint32_t task_id = request->task_id();
-  uint32_t operator_uid = request->operator_uid();
-
-  CraneErr err =
-      g_task_scheduler->CancelPendingOrRunningTask(operator_uid, task_id);
-  // Todo: make the reason be set here!
-  if (err == CraneErr::kOk)
-    response->set_ok(true);
-  else {
-    response->set_ok(false);
-    if (err == CraneErr::kNonExistent)
-      response->set_reason("Task id doesn't exist!");
-    else
-      response->set_reason(CraneErrStr(err).data());
-  }
-  return grpc::Status::OK;
+  return RunBlocking_(context, [request, response]() -> grpc::Status {
+    uint32_t task_id = request->task_id();
+    uint32_t operator_uid = request->operator_uid();
+
+    CraneErr err =
+        g_task_scheduler->CancelPendingOrRunningTask(operator_uid, task_id);
+    // Todo: make the reason be set here!
+    if (err == CraneErr::kOk)
+      response->set_ok(true);
+    else {
+      response->set_ok(false);
+      if (err == CraneErr::kNonExistent)
+        response->set_reason("Task id doesn't exist!");
+      else
+        response->set_reason(CraneErrStr(err).data());
+    }
+    return grpc::Status::OK;
+  });
 }
 
-grpc::Status CraneCtldServiceImpl::QueryCranedInfo(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::QueryCranedInfo(
+    grpc::CallbackServerContext *context,
     const crane::grpc::QueryCranedInfoRequest *request,
     crane::grpc::QueryCranedInfoReply *response) {
   if (request->craned_name().empty()) {
@@ -171,11 +233,13 @@ grpc::Status CraneCtldServiceImpl::QueryCranedInfo(
     *response = g_meta_container->QueryCranedInfo(request->craned_name());
   }
 
-  return grpc::Status::OK;
+  auto *reactor = context->DefaultReactor();
+  reactor->Finish(grpc::Status::OK);
+  return reactor;
 }
 
-grpc::Status CraneCtldServiceImpl::QueryPartitionInfo(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::QueryPartitionInfo(
+    grpc::CallbackServerContext *context,
     const crane::grpc::QueryPartitionInfoRequest *request,
     crane::grpc::QueryPartitionInfoReply *response) {
   if (request->partition_name().empty()) {
@@ -184,40 +248,58 @@ grpc::Status CraneCtldServiceImpl::QueryPartitionInfo(
     *response = g_meta_container->QueryPartitionInfo(request->partition_name());
   }
 
-  return grpc::Status::OK;
+  auto *reactor = context->DefaultReactor();
+  reactor->Finish(grpc::Status::OK);
+  return reactor;
 }
 
-grpc::Status CraneCtldServiceImpl::QueryJobsInPartition(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::QueryJobsInPartition(
+    grpc::CallbackServerContext *context,
     const crane::grpc::QueryJobsInPartitionRequest *request,
     crane::grpc::QueryJobsInPartitionReply *response) {
-  std::optional<std::string> partition_opt;
-  if (!request->find_all()) partition_opt = request->partition();
-
-  g_task_scheduler->QueryTasksInPartition(partition_opt, response);
+  return RunBlocking_(context, [request, response]() -> grpc::Status {
+    std::optional<std::string> partition_opt;
+    if (!request->find_all()) partition_opt = request->partition();
+
+    google::protobuf::FieldMask const *task_meta_mask = nullptr;
+    if (request->has_task_meta_mask()) {
+      if (!google::protobuf::util::FieldMaskUtil::IsValidFieldMask<
+              crane::grpc::TaskToCtld>(request->task_meta_mask()))
+        return {grpc::StatusCode::INVALID_ARGUMENT, "Invalid task_meta_mask"};
+      task_meta_mask = &request->task_meta_mask();
+    }
 
-  return grpc::Status::OK;
+    g_task_scheduler->QueryTasksInPartition(partition_opt, task_meta_mask,
+                                            response);
+    return grpc::Status::OK;
+  });
 }
 
-grpc::Status CraneCtldServiceImpl::QueryJobsInfo(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::QueryJobsInfo(
+    grpc::CallbackServerContext *context,
     const crane::grpc::QueryJobsInfoRequest *request,
     crane::grpc::QueryJobsInfoReply *response) {
-  std::list<TaskInCtld> task_list;
-  g_db_client->FetchJobRecordsWithStates(
-      &task_list,
-      {crane::grpc::Pending, crane::grpc::Running, crane::grpc::Finished});
+  return RunBlocking_(context, [request, response]() -> grpc::Status {
+    google::protobuf::FieldMask const *submit_info_mask = nullptr;
+    if (request->has_submit_info_mask()) {
+      if (!google::protobuf::util::FieldMaskUtil::IsValidFieldMask<
+              crane::grpc::TaskToCtld>(request->submit_info_mask()))
+        return {grpc::StatusCode::INVALID_ARGUMENT,
+                "Invalid submit_info_mask"};
+      submit_info_mask = &request->submit_info_mask();
+    }
+
+    std::list<TaskInCtld> task_list;
+    g_db_client->FetchJobRecordsWithStates(
+        &task_list,
+        {crane::grpc::Pending, crane::grpc::Running, crane::grpc::Finished});
 
-  if (request->find_all()) {
     auto *task_info_list = response->mutable_task_info_list();
 
-    for (auto &&task : task_list) {
-      if (task.Status() == crane::grpc::Finished &&
-          absl::ToInt64Seconds(absl::Now() - task.EndTime()) > 300)
-        continue;
+    auto append_fn = [&](TaskInCtld const &task) {
       auto *task_it = task_info_list->Add();
 
-      task_it->mutable_submit_info()->CopyFrom(task.TaskToCtld());
+      task.CopyTaskToCtldTo(submit_info_mask, task_it->mutable_submit_info());
       task_it->set_task_id(task.TaskId());
       task_it->set_gid(task.Gid());
       task_it->set_account(task.Account());
@@ -230,245 +312,338 @@ grpc::Status CraneCtldServiceImpl::QueryJobsInfo(
       task_it->mutable_end_time()->CopyFrom(
           google::protobuf::util::TimeUtil::SecondsToTimestamp(
               task.EndTimeInUnixSecond()));
-    }
-  } else {
-    auto *task_info_list = response->mutable_task_info_list();
-
-    for (auto &&task : task_list) {
-      if (task.TaskId() == request->job_id()) {
-        auto *task_it = task_info_list->Add();
-        task_it->mutable_submit_info()->CopyFrom(task.TaskToCtld());
-        task_it->set_task_id(task.TaskId());
-        task_it->set_gid(task.Gid());
-        task_it->set_account(task.Account());
-        task_it->set_status(task.Status());
-        task_it->set_craned_list(task.allocated_craneds_regex);
-
-        task_it->mutable_start_time()->CopyFrom(
-            google::protobuf::util::TimeUtil::SecondsToTimestamp(
-                ToUnixSeconds(task.StartTime())));
-        task_it->mutable_end_time()->CopyFrom(
-            google::protobuf::util::TimeUtil::SecondsToTimestamp(
-                ToUnixSeconds(task.EndTime())));
+    };
+
+    if (request->find_all()) {
+      for (auto &&task : task_list) {
+        if (task.Status() == crane::grpc::Finished &&
+            absl::ToInt64Seconds(absl::Now() - task.EndTime()) > 300)
+          continue;
+        append_fn(task);
+      }
+    } else {
+      for (auto &&task : task_list) {
+        if (task.TaskId() == request->job_id()) append_fn(task);
       }
     }
-  }
-  return grpc::Status::OK;
+    return grpc::Status::OK;
+  });
 }
 
-grpc::Status CraneCtldServiceImpl::AddAccount(
-    grpc::ServerContext *context, const crane::grpc::AddAccountRequest *request,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::AddAccount(
+    grpc::CallbackServerContext *context,
+    const crane::grpc::AddAccountRequest *request,
     crane::grpc::AddAccountReply *response) {
-  Account account;
-  const crane::grpc::AccountInfo *account_info = &request->account();
-
-  account.name = account_info->name();
-  account.parent_account = account_info->parent_account();
-  account.description = account_info->description();
-  account.default_qos = account_info->default_qos();
-  for (const auto &p : account_info->allowed_partitions()) {
-    account.allowed_partition.emplace_back(p);
-  }
-  for (const auto &qos : account_info->allowed_qos_list()) {
-    account.allowed_qos_list.emplace_back(qos);
-  }
+  return RunBlocking_(context, [request, response]() -> grpc::Status {
+    Account account;
+    const crane::grpc::AccountInfo *account_info = &request->account();
+
+    account.name = account_info->name();
+    account.parent_account = account_info->parent_account();
+    account.description = account_info->description();
+    account.default_qos = account_info->default_qos();
+    for (const auto &p : account_info->allowed_partitions()) {
+      account.allowed_partition.emplace(p);
+    }
+    for (const auto &qos : account_info->allowed_qos_list()) {
+      account.allowed_qos_list.emplace(qos);
+    }
 
-  AccountManager::Result result =
-      g_account_manager->AddAccount(std::move(account));
-  if (result.ok) {
-    response->set_ok(true);
-  } else {
-    response->set_ok(false);
-    response->set_reason(result.reason);
-  }
+    AccountManager::Result result =
+        g_account_manager->AddAccount(std::move(account));
+    if (result.ok) {
+      response->set_ok(true);
+    } else {
+      response->set_ok(false);
+      response->set_reason(result.reason);
+    }
 
-  return grpc::Status::OK;
+    return grpc::Status::OK;
+  });
 }
 
-grpc::Status CraneCtldServiceImpl::AddUser(
-    grpc::ServerContext *context, const crane::grpc::AddUserRequest *request,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::AddUser(
+    grpc::CallbackServerContext *context,
+    const crane::grpc::AddUserRequest *request,
     crane::grpc::AddUserReply *response) {
-  User user;
-  const crane::grpc::UserInfo *user_info = &request->user();
+  return RunBlocking_(context, [request, response]() -> grpc::Status {
+    User user;
+    const crane::grpc::UserInfo *user_info = &request->user();
+
+    user.name = user_info->name();
+    user.uid = user_info->uid();
+    user.account = user_info->account();
+    user.admin_level = User::AdminLevel(user_info->admin_level());
+
+    AccountManager::Result result = g_account_manager->AddUser(std::move(user));
+    if (result.ok) {
+      response->set_ok(true);
+    } else {
+      response->set_ok(false);
+      response->set_reason(result.reason);
+    }
 
-  user.name = user_info->name();
-  user.uid = user_info->uid();
-  user.account = user_info->account();
-  user.admin_level = User::AdminLevel(user_info->admin_level());
+    return grpc::Status::OK;
+  });
+}
 
-  AccountManager::Result result = g_account_manager->AddUser(std::move(user));
-  if (result.ok) {
-    response->set_ok(true);
-  } else {
-    response->set_ok(false);
-    response->set_reason(result.reason);
-  }
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::AddQos(
+    grpc::CallbackServerContext *context,
+    const crane::grpc::AddQosRequest *request,
+    crane::grpc::AddQosReply *response) {
+  return RunBlocking_(context, [request, response]() -> grpc::Status {
+    Qos qos;
+    const crane::grpc::QosInfo *qos_info = &request->qos();
+
+    qos.name = qos_info->name();
+    qos.description = qos_info->description();
+    qos.priority = qos_info->priority();
+    qos.max_jobs_per_user = qos_info->max_jobs_per_user();
+    qos.max_running_jobs_per_user = qos_info->max_running_jobs_per_user();
+    qos.max_cpus_per_user = qos_info->max_cpus_per_user();
+
+    AccountManager::Result result = g_account_manager->AddQos(qos);
+    if (result.ok) {
+      response->set_ok(true);
+    } else {
+      response->set_ok(false);
+      response->set_reason(result.reason);
+    }
 
-  return grpc::Status::OK;
+    return grpc::Status::OK;
+  });
 }
 
-grpc::Status CraneCtldServiceImpl::AddQos(
-    grpc::ServerContext *context, const crane::grpc::AddQosRequest *request,
-    crane::grpc::AddQosReply *response) {
-  Qos qos;
-  const crane::grpc::QosInfo *qos_info = &request->qos();
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::AddAccountsAndUsers(
+    grpc::CallbackServerContext *context,
+    const crane::grpc::AddAccountsAndUsersRequest *request,
+    crane::grpc::AddAccountsAndUsersReply *response) {
+  return RunBlocking_(context, [request, response]() -> grpc::Status {
+    std::list<Account> accounts;
+    for (const auto &account_info : request->accounts()) {
+      Account &account = accounts.emplace_back();
+      account.name = account_info.name();
+      account.parent_account = account_info.parent_account();
+      account.description = account_info.description();
+      account.default_qos = account_info.default_qos();
+      for (const auto &p : account_info.allowed_partitions()) {
+        account.allowed_partition.emplace(p);
+      }
+      for (const auto &qos : account_info.allowed_qos_list()) {
+        account.allowed_qos_list.emplace(qos);
+      }
+    }
 
-  qos.name = qos_info->name();
-  qos.description = qos_info->description();
-  qos.priority = qos_info->priority();
-  qos.max_jobs_per_user = qos_info->max_jobs_per_user();
+    std::list<User> users;
+    for (const auto &user_info : request->users()) {
+      User &user = users.emplace_back();
+      user.name = user_info.name();
+      user.uid = user_info.uid();
+      user.account = user_info.account();
+      user.admin_level = User::AdminLevel(user_info.admin_level());
+    }
 
-  AccountManager::Result result = g_account_manager->AddQos(qos);
-  if (result.ok) {
-    response->set_ok(true);
-  } else {
-    response->set_ok(false);
-    response->set_reason(result.reason);
-  }
+    AccountManager::Result result = g_account_manager->AddAccountsAndUsers(
+        std::move(accounts), std::move(users));
+    if (result.ok) {
+      response->set_ok(true);
+    } else {
+      response->set_ok(false);
+      response->set_reason(result.reason);
+    }
 
-  return grpc::Status::OK;
+    return grpc::Status::OK;
+  });
 }
 
-grpc::Status CraneCtldServiceImpl::ModifyEntity(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::ModifyEntity(
+    grpc::CallbackServerContext *context,
     const crane::grpc::ModifyEntityRequest *request,
     crane::grpc::ModifyEntityReply *response) {
-  AccountManager::Result res;
-
-  switch (request->entity_type()) {
-    case crane::grpc::Account:
-      res = g_account_manager->ModifyAccount(request->type(), request->name(),
-                                             request->lhs(), request->rhs());
-
-      break;
-    case crane::grpc::User:
-      res = g_account_manager->ModifyUser(request->type(), request->name(),
-                                          request->partition(), request->lhs(),
-                                          request->rhs());
-      break;
-    case crane::grpc::Qos:
-      res = g_account_manager->ModifyQos(request->name(), request->lhs(),
-                                         request->rhs());
-      break;
-    default:
-      break;
-  }
-  if (res.ok) {
-    response->set_ok(true);
-  } else {
-    response->set_ok(false);
-    response->set_reason(res.reason);
-  }
-  return grpc::Status::OK;
+  return RunBlocking_(context, [request, response]() -> grpc::Status {
+    AccountManager::Result res;
+
+    switch (request->entity_type()) {
+      case crane::grpc::Account:
+        res = g_account_manager->ModifyAccount(
+            request->type(), request->name(), request->lhs(), request->rhs());
+
+        break;
+      case crane::grpc::User:
+        res = g_account_manager->ModifyUser(
+            request->type(), request->name(), request->partition(),
+            request->lhs(), request->rhs());
+        break;
+      case crane::grpc::Qos:
+        res = g_account_manager->ModifyQos(request->name(), request->lhs(),
+                                           request->rhs());
+        break;
+      default:
+        break;
+    }
+    if (res.ok) {
+      response->set_ok(true);
+    } else {
+      response->set_ok(false);
+      response->set_reason(res.reason);
+    }
+    return grpc::Status::OK;
+  });
+}
+
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::ModifyUsers(
+    grpc::CallbackServerContext *context,
+    const crane::grpc::ModifyUsersRequest *request,
+    crane::grpc::ModifyUsersReply *response) {
+  return RunBlocking_(context, [request, response]() -> grpc::Status {
+    AccountManager::Result res =
+        g_account_manager->ModifyUsers(request->modifications());
+    if (res.ok) {
+      response->set_ok(true);
+    } else {
+      response->set_ok(false);
+      response->set_reason(res.reason);
+    }
+    return grpc::Status::OK;
+  });
 }
 
-grpc::Status CraneCtldServiceImpl::QueryEntityInfo(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::QueryEntityInfo(
+    grpc::CallbackServerContext *context,
     const crane::grpc::QueryEntityInfoRequest *request,
     crane::grpc::QueryEntityInfoReply *response) {
-  switch (request->entity_type()) {
-    case crane::grpc::Account:
-      if (request->name().empty()) {
-        AccountManager::AccountMapMutexSharedPtr account_map_shared_ptr =
-            g_account_manager->GetAllAccountInfo();
-
-        auto *list = response->mutable_account_list();
-
-        if (account_map_shared_ptr) {
-          for (const auto &[name, account] : *account_map_shared_ptr) {
-            if (account->deleted) {
-              continue;
-            }
+  return RunBlocking_(context, [request, response]() -> grpc::Status {
+    switch (request->entity_type()) {
+      case crane::grpc::Account:
+        if (request->name().empty()) {
+          AccountManager::AccountMapMutexSharedPtr account_map_shared_ptr =
+              g_account_manager->GetAllAccountInfo();
+
+          auto *list = response->mutable_account_list();
+
+          if (account_map_shared_ptr) {
+            for (const auto &[name, account] : *account_map_shared_ptr) {
+              if (account->deleted) {
+                continue;
+              }
 
-            auto *account_info = list->Add();
-            account_info->set_name(account->name);
-            account_info->set_description(account->description);
+              auto *account_info = list->Add();
+              account_info->set_name(account->name);
+              account_info->set_description(account->description);
+
+              auto *user_list = account_info->mutable_users();
+              for (auto &&user : account->users) {
+                user_list->Add()->assign(user);
+              }
+
+              auto *child_list = account_info->mutable_child_accounts();
+              for (auto &&child : account->child_accounts) {
+                child_list->Add()->assign(child);
+              }
+              account_info->set_parent_account(account->parent_account);
+
+              auto *partition_list = account_info->mutable_allowed_partitions();
+              for (auto &&partition : account->allowed_partition) {
+                partition_list->Add()->assign(partition);
+              }
+              account_info->set_default_qos(account->default_qos);
+
+              auto *allowed_qos_list = account_info->mutable_allowed_qos_list();
+              for (const auto &qos : account->allowed_qos_list) {
+                allowed_qos_list->Add()->assign(qos);
+              }
+            }
+          }
+          response->set_ok(true);
+        } else {
+          // Query an account
+          AccountManager::AccountMutexSharedPtr account_shared_ptr =
+              g_account_manager->GetExistedAccountInfo(request->name());
+          if (account_shared_ptr) {
+            auto *account_info = response->mutable_account_list()->Add();
+            account_info->set_name(account_shared_ptr->name);
+            account_info->set_description(account_shared_ptr->description);
 
             auto *user_list = account_info->mutable_users();
-            for (auto &&user : account->users) {
+            for (auto &&user : account_shared_ptr->users) {
               user_list->Add()->assign(user);
             }
 
             auto *child_list = account_info->mutable_child_accounts();
-            for (auto &&child : account->child_accounts) {
+            for (auto &&child : account_shared_ptr->child_accounts) {
               child_list->Add()->assign(child);
             }
-            account_info->set_parent_account(account->parent_account);
+            account_info->set_parent_account(
+                account_shared_ptr->parent_account);
 
             auto *partition_list = account_info->mutable_allowed_partitions();
-            for (auto &&partition : account->allowed_partition) {
+            for (auto &&partition : account_shared_ptr->allowed_partition) {
               partition_list->Add()->assign(partition);
             }
-            account_info->set_default_qos(account->default_qos);
+            account_info->set_default_qos(account_shared_ptr->default_qos);
 
             auto *allowed_qos_list = account_info->mutable_allowed_qos_list();
-            for (const auto &qos : account->allowed_qos_list) {
+            for (const auto &qos : account_shared_ptr->allowed_qos_list) {
               allowed_qos_list->Add()->assign(qos);
             }
+            response->set_ok(true);
+          } else {
+            response->set_ok(false);
           }
         }
-        response->set_ok(true);
-      } else {
-        // Query an account
-        AccountManager::AccountMutexSharedPtr account_shared_ptr =
-            g_account_manager->GetExistedAccountInfo(request->name());
-        if (account_shared_ptr) {
-          auto *account_info = response->mutable_account_list()->Add();
-          account_info->set_name(account_shared_ptr->name);
-          account_info->set_description(account_shared_ptr->description);
-
-          auto *user_list = account_info->mutable_users();
-          for (auto &&user : account_shared_ptr->users) {
-            user_list->Add()->assign(user);
-          }
-
-          auto *child_list = account_info->mutable_child_accounts();
-          for (auto &&child : account_shared_ptr->child_accounts) {
-            child_list->Add()->assign(child);
-          }
-          account_info->set_parent_account(account_shared_ptr->parent_account);
-
-          auto *partition_list = account_info->mutable_allowed_partitions();
-          for (auto &&partition : account_shared_ptr->allowed_partition) {
-            partition_list->Add()->assign(partition);
-          }
-          account_info->set_default_qos(account_shared_ptr->default_qos);
+        break;
+      case crane::grpc::User:
+        if (request->name().empty()) {
+          AccountManager::UserMapMutexSharedPtr user_map_shared_ptr =
+              g_account_manager->GetAllUserInfo();
+
+          if (user_map_shared_ptr) {
+            auto *list = response->mutable_user_list();
+            for (const auto &[user_name, user] : *user_map_shared_ptr) {
+              if (user->deleted) {
+                continue;
+              }
 
-          auto *allowed_qos_list = account_info->mutable_allowed_qos_list();
-          for (const auto &qos : account_shared_ptr->allowed_qos_list) {
-            allowed_qos_list->Add()->assign(qos);
+              auto *user_info = list->Add();
+              user_info->set_name(user->name);
+              user_info->set_uid(user->uid);
+              user_info->set_account(user->account);
+              user_info->set_admin_level(
+                  (crane::grpc::UserInfo_AdminLevel)user->admin_level);
+
+              auto *partition_qos_list =
+                  user_info->mutable_allowed_partition_qos_list();
+              for (const auto &[par_name, pair] :
+                   user->allowed_partition_qos_map) {
+                auto *partition_qos = partition_qos_list->Add();
+                partition_qos->set_partition_name(par_name);
+                partition_qos->set_default_qos(pair.first);
+
+                auto *qos_list = partition_qos->mutable_qos_list();
+                for (const auto &qos : pair.second) {
+                  qos_list->Add()->assign(qos);
+                }
+              }
+            }
           }
           response->set_ok(true);
         } else {
-          response->set_ok(false);
-        }
-      }
-      break;
-    case crane::grpc::User:
-      if (request->name().empty()) {
-        AccountManager::UserMapMutexSharedPtr user_map_shared_ptr =
-            g_account_manager->GetAllUserInfo();
-
-        if (user_map_shared_ptr) {
-          auto *list = response->mutable_user_list();
-          for (const auto &[user_name, user] : *user_map_shared_ptr) {
-            if (user->deleted) {
-              continue;
-            }
-
-            auto *user_info = list->Add();
-            user_info->set_name(user->name);
-            user_info->set_uid(user->uid);
-            user_info->set_account(user->account);
+          AccountManager::UserMutexSharedPtr user_shared_ptr =
+              g_account_manager->GetExistedUserInfo(request->name());
+          if (user_shared_ptr) {
+            auto *user_info = response->mutable_user_list()->Add();
+            user_info->set_name(user_shared_ptr->name);
+            user_info->set_uid(user_shared_ptr->uid);
+            user_info->set_account(user_shared_ptr->account);
             user_info->set_admin_level(
-                (crane::grpc::UserInfo_AdminLevel)user->admin_level);
+                (crane::grpc::UserInfo_AdminLevel)user_shared_ptr->admin_level);
 
             auto *partition_qos_list =
                 user_info->mutable_allowed_partition_qos_list();
-            for (const auto &[par_name, pair] :
-                 user->allowed_partition_qos_map) {
+            for (const auto &[name, pair] :
+                 user_shared_ptr->allowed_partition_qos_map) {
               auto *partition_qos = partition_qos_list->Add();
-              partition_qos->set_partition_name(par_name);
+              partition_qos->set_partition_name(name);
               partition_qos->set_default_qos(pair.first);
 
               auto *qos_list = partition_qos->mutable_qos_list();
@@ -476,114 +651,181 @@ grpc::Status CraneCtldServiceImpl::QueryEntityInfo(
                 qos_list->Add()->assign(qos);
               }
             }
+            response->set_ok(true);
+          } else {
+            response->set_ok(false);
           }
         }
-        response->set_ok(true);
-      } else {
-        AccountManager::UserMutexSharedPtr user_shared_ptr =
-            g_account_manager->GetExistedUserInfo(request->name());
-        if (user_shared_ptr) {
-          auto *user_info = response->mutable_user_list()->Add();
-          user_info->set_name(user_shared_ptr->name);
-          user_info->set_uid(user_shared_ptr->uid);
-          user_info->set_account(user_shared_ptr->account);
-          user_info->set_admin_level(
-              (crane::grpc::UserInfo_AdminLevel)user_shared_ptr->admin_level);
-
-          auto *partition_qos_list =
-              user_info->mutable_allowed_partition_qos_list();
-          for (const auto &[name, pair] :
-               user_shared_ptr->allowed_partition_qos_map) {
-            auto *partition_qos = partition_qos_list->Add();
-            partition_qos->set_partition_name(name);
-            partition_qos->set_default_qos(pair.first);
-
-            auto *qos_list = partition_qos->mutable_qos_list();
-            for (const auto &qos : pair.second) {
-              qos_list->Add()->assign(qos);
+        break;
+      case crane::grpc::Qos:
+        if (request->name().empty()) {
+          AccountManager::QosMapMutexSharedPtr qos_map_shared_ptr =
+              g_account_manager->GetAllQosInfo();
+
+          if (qos_map_shared_ptr) {
+            auto *list = response->mutable_qos_list();
+            for (const auto &[name, qos] : *qos_map_shared_ptr) {
+              if (qos->deleted) {
+                continue;
+              }
+
+              auto *qos_info = list->Add();
+              qos_info->set_name(qos->name);
+              qos_info->set_description(qos->description);
+              qos_info->set_priority(qos->priority);
+              qos_info->set_max_jobs_per_user(qos->max_jobs_per_user);
+              qos_info->set_max_running_jobs_per_user(
+                  qos->max_running_jobs_per_user);
+              qos_info->set_max_cpus_per_user(qos->max_cpus_per_user);
             }
           }
           response->set_ok(true);
         } else {
-          response->set_ok(false);
-        }
-      }
-      break;
-    case crane::grpc::Qos:
-      if (request->name().empty()) {
-        AccountManager::QosMapMutexSharedPtr qos_map_shared_ptr =
-            g_account_manager->GetAllQosInfo();
-
-        if (qos_map_shared_ptr) {
-          auto *list = response->mutable_qos_list();
-          for (const auto &[name, qos] : *qos_map_shared_ptr) {
-            if (qos->deleted) {
-              continue;
-            }
-
-            auto *qos_info = list->Add();
-            qos_info->set_name(qos->name);
-            qos_info->set_description(qos->description);
-            qos_info->set_priority(qos->priority);
-            qos_info->set_max_jobs_per_user(qos->max_jobs_per_user);
+          AccountManager::QosMutexSharedPtr qos_shared_ptr =
+              g_account_manager->GetExistedQosInfo(request->name());
+          if (qos_shared_ptr) {
+            auto *qos_info = response->mutable_qos_list()->Add();
+            qos_info->set_name(qos_shared_ptr->name);
+            qos_info->set_description(qos_shared_ptr->description);
+            qos_info->set_priority(qos_shared_ptr->priority);
+            qos_info->set_max_jobs_per_user(qos_shared_ptr->max_jobs_per_user);
+            qos_info->set_max_running_jobs_per_user(
+                qos_shared_ptr->max_running_jobs_per_user);
+            qos_info->set_max_cpus_per_user(qos_shared_ptr->max_cpus_per_user);
+            response->set_ok(true);
+          } else {
+            response->set_ok(false);
           }
         }
-        response->set_ok(true);
-      } else {
-        AccountManager::QosMutexSharedPtr qos_shared_ptr =
-            g_account_manager->GetExistedQosInfo(request->name());
-        if (qos_shared_ptr) {
-          auto *qos_info = response->mutable_qos_list()->Add();
-          qos_info->set_name(qos_shared_ptr->name);
-          qos_info->set_description(qos_shared_ptr->description);
-          qos_info->set_priority(qos_shared_ptr->priority);
-          qos_info->set_max_jobs_per_user(qos_shared_ptr->max_jobs_per_user);
-          response->set_ok(true);
-        } else {
-          response->set_ok(false);
-        }
-      }
-    default:
-      break;
-  }
-  return grpc::Status::OK;
+      default:
+        break;
+    }
+    return grpc::Status::OK;
+  });
 }
 
-grpc::Status CraneCtldServiceImpl::DeleteEntity(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::DeleteEntity(
+    grpc::CallbackServerContext *context,
     const crane::grpc::DeleteEntityRequest *request,
     crane::grpc::DeleteEntityReply *response) {
-  AccountManager::Result res;
-
-  switch (request->entity_type()) {
-    case crane::grpc::User:
-      res = g_account_manager->DeleteUser(request->name());
-      break;
-    case crane::grpc::Account:
-      res = g_account_manager->DeleteAccount(request->name());
-      break;
-    case crane::grpc::Qos:
-      res = g_account_manager->DeleteQos(request->name());
-      break;
-    default:
-      break;
-  }
+  return RunBlocking_(context, [request, response]() -> grpc::Status {
+    AccountManager::Result res;
+
+    switch (request->entity_type()) {
+      case crane::grpc::User:
+        res = g_account_manager->DeleteUser(request->name());
+        break;
+      case crane::grpc::Account:
+        res = g_account_manager->DeleteAccount(request->name());
+        break;
+      case crane::grpc::Qos:
+        res = g_account_manager->DeleteQos(request->name());
+        break;
+      default:
+        break;
+    }
 
-  if (res.ok) {
-    response->set_ok(true);
-  } else {
-    response->set_ok(false);
-    response->set_reason(res.reason);
-  }
-  return grpc::Status::OK;
+    if (res.ok) {
+      response->set_ok(true);
+    } else {
+      response->set_ok(false);
+      response->set_reason(res.reason);
+    }
+    return grpc::Status::OK;
+  });
 }
 
-grpc::Status CraneCtldServiceImpl::QueryClusterInfo(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::QueryClusterInfo(
+    grpc::CallbackServerContext *context,
     const crane::grpc::QueryClusterInfoRequest *request,
     crane::grpc::QueryClusterInfoReply *response) {
   *response = g_meta_container->QueryClusterInfo();
-  return grpc::Status::OK;
+  auto *reactor = context->DefaultReactor();
+  reactor->Finish(grpc::Status::OK);
+  return reactor;
+}
+
+grpc::ServerWriteReactor<crane::grpc::WatchClusterStateReply> *
+CraneCtldServiceImpl::WatchClusterState(
+    grpc::CallbackServerContext *context,
+    const crane::grpc::WatchClusterStateRequest *request) {
+  return new WatchClusterStateReactor(context, request, m_ctld_server_);
+}
+
+grpc::ServerUnaryReactor *CraneCtldServiceImpl::RunBlocking_(
+    grpc::CallbackServerContext *context, std::function<grpc::Status()> fn,
+    bool sheddable) {
+  auto *reactor = context->DefaultReactor();
+
+  if (m_blocking_rpc_num_.fetch_add(1) >= g_config.RpcMaxQueuedNum &&
+      sheddable) {
+    m_blocking_rpc_num_.fetch_sub(1);
+    reactor->Finish({grpc::StatusCode::RESOURCE_EXHAUSTED,
+                     "Too many requests are being processed by CraneCtld"});
+    return reactor;
+  }
+
+  g_thread_pool->push_task([this, reactor, fn = std::move(fn)] {
+    grpc::Status status;
+    try {
+      status = fn();
+    } catch (const std::exception &e) {
+      CRANE_ERROR("Exception in a blocking RPC handler: {}", e.what());
+      status = grpc::Status(grpc::StatusCode::UNKNOWN, e.what());
+    } catch (...) {
+      CRANE_ERROR("Unknown exception in a blocking RPC handler.");
+      status = grpc::Status(grpc::StatusCode::UNKNOWN, "Unknown exception");
+    }
+
+    m_blocking_rpc_num_.fetch_sub(1);
+    reactor->Finish(status);
+  });
+
+  return reactor;
+}
+
+WatchClusterStateReactor::WatchClusterStateReactor(
+    grpc::CallbackServerContext *context,
+    const crane::grpc::WatchClusterStateRequest *request, CtldServer *server)
+    : m_context_(context),
+      m_ctld_server_(server),
+      m_version_(request->since_version()) {
+  Poll_();
+}
+
+void WatchClusterStateReactor::OnWriteDone(bool ok) {
+  if (!ok) {
+    Finish(grpc::Status::OK);
+    return;
+  }
+
+  Poll_();
+}
+
+void WatchClusterStateReactor::Poll_() {
+  if (m_context_->IsCancelled() ||
+      m_ctld_server_->m_is_shutting_down_.load()) {
+    Finish(grpc::Status::OK);
+    return;
+  }
+
+  // The first reply is sent even if there is no change so that the watcher
+  // knows the stream is established.
+  if (m_first_reply_ ||
+      g_meta_container->ClusterStateVersion() != m_version_) {
+    m_reply_.Clear();
+    g_meta_container->QueryClusterStateSince(m_version_, &m_reply_);
+    if (m_first_reply_ || m_reply_.version() != m_version_) {
+      m_first_reply_ = false;
+      m_version_ = m_reply_.version();
+      StartWrite(&m_reply_);
+      return;
+    }
+  }
+
+  m_alarm_ = std::make_unique<grpc::Alarm>();
+  m_alarm_->Set(absl::ToChronoTime(absl::Now() + kWatchPollInterval),
+                [this](bool) { Poll_(); });
 }
 
 CtldServer::CtldServer(const Config::CraneCtldListenConf &listen_conf) {
@@ -625,11 +867,12 @@ CtldServer::CtldServer(const Config::CraneCtldListenConf &listen_conf) {
              listen_conf.UseTls);
 
   // Avoid the potential deadlock error in underlying absl::mutex
-  std::thread sigint_waiting_thread([p_server = m_server_.get()] {
+  std::thread sigint_waiting_thread([this, p_server = m_server_.get()] {
     std::unique_lock<std::mutex> lk(s_sigint_mtx);
     s_sigint_cv.wait(lk);
 
     CRANE_TRACE("SIGINT captured. Calling Shutdown() on grpc server...");
+    m_is_shutting_down_.store(true);
     p_server->Shutdown();
   });
   sigint_waiting_thread.detach();
@@ -2,13 +2,16 @@
 
 #include <absl/container/node_hash_map.h>
 #include <grpc++/grpc++.h>
+#include <grpcpp/alarm.h>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_generators.hpp>
 #include <boost/uuid/uuid_io.hpp>
+#include <atomic>
 #include <condition_variable>
+#include <functional>
 #include <mutex>
 #include <thread>
 #include <vector>
@@ -32,86 +35,166 @@ using grpc::Server;
 
 class CtldServer;
 
-class CraneCtldServiceImpl final : public crane::grpc::CraneCtld::Service {
+/**
+ * Streams the changes of the cluster state to a watcher. The change log of
+ * the meta container is polled by a grpc::Alarm instead of being waited on,
+ * so an idle watcher holds no thread.
+ */
+class WatchClusterStateReactor
+    : public grpc::ServerWriteReactor<crane::grpc::WatchClusterStateReply> {
+ public:
+  WatchClusterStateReactor(grpc::CallbackServerContext *context,
+                           const crane::grpc::WatchClusterStateRequest *request,
+                           CtldServer *server);
+
+  void OnWriteDone(bool ok) override;
+
+  void OnDone() override { delete this; }
+
+ private:
+  static constexpr absl::Duration kWatchPollInterval = absl::Milliseconds(100);
+
+  // Send the changes since m_version_ or poll again later.
+  void Poll_();
+
+  grpc::CallbackServerContext *m_context_;
+  CtldServer *m_ctld_server_;
+
+  uint64_t m_version_;
+  bool m_first_reply_{true};
+
+  crane::grpc::WatchClusterStateReply m_reply_;
+
+  // A new alarm is created for each wait, since the callback of an alarm
+  // must not be replaced while it runs.
+  std::unique_ptr<grpc::Alarm> m_alarm_;
+};
+
+class CraneCtldServiceImpl final
+    : public crane::grpc::CraneCtld::CallbackService {
  public:
   explicit CraneCtldServiceImpl(CtldServer *server) : m_ctld_server_(server) {}
 
-  grpc::Status AllocateInteractiveTask(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *AllocateInteractiveTask(
+      grpc::CallbackServerContext *context,
       const crane::grpc::InteractiveTaskAllocRequest *request,
       crane::grpc::InteractiveTaskAllocReply *response) override;
 
-  grpc::Status QueryInteractiveTaskAllocDetail(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *QueryInteractiveTaskAllocDetail(
+      grpc::CallbackServerContext *context,
       const crane::grpc::QueryInteractiveTaskAllocDetailRequest *request,
       crane::grpc::QueryInteractiveTaskAllocDetailReply *response) override;
 
-  grpc::Status SubmitBatchTask(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *SubmitBatchTask(
+      grpc::CallbackServerContext *context,
       const crane::grpc::SubmitBatchTaskRequest *request,
       crane::grpc::SubmitBatchTaskReply *response) override;
 
-  grpc::Status TaskStatusChange(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *TaskStatusChange(
+      grpc::CallbackServerContext *context,
       const crane::grpc::TaskStatusChangeRequest *request,
       crane::grpc::TaskStatusChangeReply *response) override;
 
-  grpc::Status CancelTask(grpc::ServerContext *context,
-                          const crane::grpc::CancelTaskRequest *request,
-                          crane::grpc::CancelTaskReply *response) override;
+  grpc::ServerUnaryReactor *CranedHeartbeat(
+      grpc::CallbackServerContext *context,
+      const crane::grpc::CranedHeartbeatRequest *request,
+      crane::grpc::CranedHeartbeatReply *response) override;
+
+  grpc::ServerUnaryReactor *CancelTask(
+      grpc::CallbackServerContext *context,
+      const crane::grpc::CancelTaskRequest *request,
+      crane::grpc::CancelTaskReply *response) override;
 
-  grpc::Status QueryJobsInPartition(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *QueryJobsInPartition(
+      grpc::CallbackServerContext *context,
       const crane::grpc::QueryJobsInPartitionRequest *request,
       crane::grpc::QueryJobsInPartitionReply *response) override;
 
-  grpc::Status QueryJobsInfo(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *QueryJobsInfo(
+      grpc::CallbackServerContext *context,
       const crane::grpc::QueryJobsInfoRequest *request,
       crane::grpc::QueryJobsInfoReply *response) override;
 
-  grpc::Status QueryCranedInfo(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *QueryCranedInfo(
+      grpc::CallbackServerContext *context,
       const crane::grpc::QueryCranedInfoRequest *request,
       crane::grpc::QueryCranedInfoReply *response) override;
 
-  grpc::Status QueryPartitionInfo(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *QueryPartitionInfo(
+      grpc::CallbackServerContext *context,
       const crane::grpc::QueryPartitionInfoRequest *request,
       crane::grpc::QueryPartitionInfoReply *response) override;
 
-  grpc::Status AddAccount(grpc::ServerContext *context,
-                          const crane::grpc::AddAccountRequest *request,
-                          crane::grpc::AddAccountReply *response) override;
-
-  grpc::Status AddUser(grpc::ServerContext *context,
-                       const crane::grpc::AddUserRequest *request,
-                       crane::grpc::AddUserReply *response) override;
-
-  grpc::Status AddQos(grpc::ServerContext *context,
-                      const crane::grpc::AddQosRequest *request,
-                      crane::grpc::AddQosReply *response) override;
-
-  grpc::Status ModifyEntity(grpc::ServerContext *context,
-                            const crane::grpc::ModifyEntityRequest *request,
-                            crane::grpc::ModifyEntityReply *response) override;
-
-  grpc::Status QueryEntityInfo(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *AddAccount(
+      grpc::CallbackServerContext *context,
+      const crane::grpc::AddAccountRequest *request,
+      crane::grpc::AddAccountReply *response) override;
+
+  grpc::ServerUnaryReactor *AddUser(
+      grpc::CallbackServerContext *context,
+      const crane::grpc::AddUserRequest *request,
+      crane::grpc::AddUserReply *response) override;
+
+  grpc::ServerUnaryReactor *AddQos(grpc::CallbackServerContext *context,
+                                   const crane::grpc::AddQosRequest *request,
+                                   crane::grpc::AddQosReply *response) override;
+
+  grpc::ServerUnaryReactor *AddAccountsAndUsers(
+      grpc::CallbackServerContext *context,
+      const crane::grpc::AddAccountsAndUsersRequest *request,
+      crane::grpc::AddAccountsAndUsersReply *response) override;
+
+  grpc::ServerUnaryReactor *ModifyEntity(
+      grpc::CallbackServerContext *context,
+      const crane::grpc::ModifyEntityRequest *request,
+      crane::grpc::ModifyEntityReply *response) override;
+
+  grpc::ServerUnaryReactor *ModifyUsers(
+      grpc::CallbackServerContext *context,
+      const crane::grpc::ModifyUsersRequest *request,
+      crane::grpc::ModifyUsersReply *response) override;
+
+  grpc::ServerUnaryReactor *QueryEntityInfo(
+      grpc::CallbackServerContext *context,
       const crane::grpc::QueryEntityInfoRequest *request,
       crane::grpc::QueryEntityInfoReply *response) override;
 
-  grpc::Status DeleteEntity(grpc::ServerContext *context,
-                            const crane::grpc::DeleteEntityRequest *request,
-                            crane::grpc::DeleteEntityReply *response) override;
+  grpc::ServerUnaryReactor *DeleteEntity(
+      grpc::CallbackServerContext *context,
+      const crane::grpc::DeleteEntityRequest *request,
+      crane::grpc::DeleteEntityReply *response) override;
 
-  grpc::Status QueryClusterInfo(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *QueryClusterInfo(
+      grpc::CallbackServerContext *context,
       const crane::grpc::QueryClusterInfoRequest *request,
       crane::grpc::QueryClusterInfoReply *response) override;
 
+  grpc::ServerWriteReactor<crane::grpc::WatchClusterStateReply> *
+  WatchClusterState(
+      grpc::CallbackServerContext *context,
+      const crane::grpc::WatchClusterStateRequest *request) override;
+
  private:
+  /**
+   * The handlers of the RPCs run in the threads of gRPC, which must not
+   * block. The handlers accessing the databases are passed here and run in
+   * g_thread_pool instead, so the number of threads blocked on the databases
+   * and contending for the locks of TaskScheduler is bounded by the size of
+   * the pool, whatever the number of clients.
+   * @param fn Fills the response and returns the status of the RPC.
+   *  An exception thrown by fn finishes the RPC with UNKNOWN.
+   * @param sheddable If true, the RPC is rejected with RESOURCE_EXHAUSTED
+   *  without running fn if g_config.RpcMaxQueuedNum handlers are already
+   *  waiting or running. The RPCs from Craned pass false since Craned doesn't
+   *  resend them on this error.
+   */
+  grpc::ServerUnaryReactor *RunBlocking_(grpc::CallbackServerContext *context,
+                                         std::function<grpc::Status()> fn,
+                                         bool sheddable = true);
+
   CtldServer *m_ctld_server_;
+
+  std::atomic_uint32_t m_blocking_rpc_num_{0};
 };
 
 /***
@@ -143,6 +226,10 @@ class CtldServer {
   std::unique_ptr<CraneCtldServiceImpl> m_service_impl_;
   std::unique_ptr<Server> m_server_;
 
+  // Server::Shutdown() waits for all ongoing RPCs. Long-lived streaming RPCs
+  // check this flag and return when it is set.
+  std::atomic_bool m_is_shutting_down_{false};
+
   Mutex m_mtx_;
   // Use absl::hash_node_map because QueryAllocDetailOfIaTask returns a
   // pointer. Pointer stability is needed here. The return type is a const
@@ -155,6 +242,7 @@ class CtldServer {
   static void signal_handler_func(int) { s_sigint_cv.notify_one(); };
 
   friend class CraneCtldServiceImpl;
+  friend class WatchClusterStateReactor;
 };
 
 }  // namespace Ctld
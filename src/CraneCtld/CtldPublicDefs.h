@@ -4,7 +4,9 @@
 #include <absl/container/flat_hash_map.h>
 #include <absl/container/flat_hash_set.h>
 #include <absl/time/time.h>  // NOLINT(modernize-deprecated-headers)
+#include <google/protobuf/util/field_mask_util.h>
 
+#include <BS_thread_pool.hpp>
 #include <boost/container_hash/hash.hpp>
 #include <boost/uuid/uuid.hpp>
 #include <chrono>
@@ -53,6 +55,21 @@ struct Config {
 
   CraneCtldListenConf ListenConf;
 
+  // Options shared by the channels from cranectld to all Craneds.
+  struct CranedChannelConf {
+    absl::Duration KeepaliveTime{absl::Seconds(60)};
+    absl::Duration KeepaliveTimeout{absl::Seconds(20)};
+
+    // One of "none", "deflate" and "gzip".
+    std::string Compression{"none"};
+
+    // The memory all the channels may use for their buffers in total. 0 means
+    // unlimited.
+    uint64_t MemoryQuotaBytes{0};
+  };
+
+  CranedChannelConf CranedChannel;
+
   std::string CraneCtldDebugLevel;
   std::string CraneCtldLogFile;
 
@@ -71,12 +88,27 @@ struct Config {
   std::string DbPort;
   std::string DbRSName;
   std::string DbName;
+
+  absl::Duration PriorityDecayHalfLife;
+
+  // A craned whose channel is ready is still considered down after missing
+  // CranedHeartbeatMissThreshold heartbeats in a row. 0 disables the check.
+  absl::Duration CranedHeartbeatInterval;
+  uint32_t CranedHeartbeatMissThreshold;
+
+  // The RPCs accessing the databases are run by RpcWorkerNum threads. Those
+  // arriving while RpcMaxQueuedNum of them are waiting or running are
+  // rejected, except the ones from Craned.
+  uint32_t RpcWorkerNum;
+  uint32_t RpcMaxQueuedNum;
 };
 
 }  // namespace Ctld
 
 inline Ctld::Config g_config;
 
+inline std::unique_ptr<BS::thread_pool> g_thread_pool;
+
 namespace Ctld {
 struct InteractiveTaskAllocationDetail {
   uint32_t craned_index;
@@ -102,6 +134,15 @@ struct CranedStaticMeta {
   Resources res;
 };
 
+/**
+ * The load reported by the last heartbeat of a Craned.
+ */
+struct CranedLoad {
+  double load_average{0};
+  uint64_t free_memory_bytes{0};
+  uint32_t running_task_num{0};
+};
+
 /**
  * Represent the runtime status on a Craned node.
  * A Node is uniquely identified by (partition id, node index).
@@ -117,6 +158,8 @@ struct CranedMeta {
   Resources res_avail;
   Resources res_in_use;
 
+  CranedLoad load;
+
   // Store the information of the slices of allocated resource.
   // One task id owns one shard of allocated resource.
   absl::flat_hash_map<uint32_t /*task id*/, Resources>
@@ -176,6 +219,8 @@ struct TaskInCtld {
 
   bool requeue_if_failed{false};
 
+  std::string qos;
+
   std::string cmd_line;
   std::string env;
   std::string cwd;
@@ -227,6 +272,24 @@ struct TaskInCtld {
   // Helper function
  public:
   crane::grpc::TaskToCtld const& TaskToCtld() { return task_to_ctld; }
+
+  // Copy the fields of TaskToCtld selected by `mask` into `out`.
+  // If `mask` is nullptr, all the fields are copied.
+  void CopyTaskToCtldTo(google::protobuf::FieldMask const* mask,
+                        crane::grpc::TaskToCtld* out) const {
+    if (mask == nullptr)
+      out->CopyFrom(task_to_ctld);
+    else
+      google::protobuf::util::FieldMaskUtil::MergeMessageTo(
+          task_to_ctld, *mask, {}, out);
+  }
+
+  // Set when the qos is resolved at the submission time.
+  void SetQos(std::string const& val) {
+    qos = val;
+    task_to_ctld.set_qos(val);
+  }
+
   crane::grpc::PersistedPartOfTaskInCtld const& PersistedPart() {
     return persisted_part;
   }
@@ -318,6 +381,16 @@ struct TaskInCtld {
   absl::Time const& EndTime() const { return end_time; }
   uint64_t EndTimeInUnixSecond() const { return ToUnixSeconds(end_time); }
 
+  // The usage is reported by executing_node_id with TaskStatusChange. The
+  // processes of a task only run there, so the cgroups on its other nodes
+  // don't add to it.
+  void SetResourceUsage(crane::grpc::TaskResourceUsage const& val) {
+    *persisted_part.mutable_resource_usage() = val;
+  }
+  crane::grpc::TaskResourceUsage const& ResourceUsage() const {
+    return persisted_part.resource_usage();
+  }
+
   void SetFieldsByTaskToCtld(crane::grpc::TaskToCtld const& val) {
     task_to_ctld = val;
 
@@ -341,6 +414,7 @@ struct TaskInCtld {
 
     uid = val.uid();
     name = val.name();
+    qos = val.qos();
     cmd_line = val.cmd_line();
     env = val.env();
     cwd = val.cwd();
@@ -375,21 +449,26 @@ struct Qos {
   std::string name;
   std::string description;
   uint32_t priority;
-  uint32_t max_jobs_per_user;
+
+  // The limits below are unlimited if 0.
+  // The number of pending and running jobs of a user under this qos.
+  uint32_t max_jobs_per_user{0};
+  uint32_t max_running_jobs_per_user{0};
+  uint32_t max_cpus_per_user{0};
 };
 
 struct Account {
   bool deleted = false;
   std::string name;
   std::string description;
-  std::list<std::string> users;
-  std::list<std::string> child_accounts;
+  absl::flat_hash_set<std::string> users;
+  absl::flat_hash_set<std::string> child_accounts;
   std::string parent_account;
-  std::list<std::string> allowed_partition;
+  absl::flat_hash_set<std::string> allowed_partition;
   //  std::unordered_map<std::string, bool> allowed_partition;  /*partition
   //  name, enable*/
   std::string default_qos;
-  std::list<std::string> allowed_qos_list;
+  absl::flat_hash_set<std::string> allowed_qos_list;
 };
 
 struct User {
@@ -406,4 +485,17 @@ struct User {
   AdminLevel admin_level;
 };
 
+/**
+ * The CPU-seconds consumed by a user or an account, decayed to
+ * checkpoint_time.
+ */
+struct UsageRecord {
+  enum class EntityType { USER, ACCOUNT };
+
+  EntityType type;
+  std::string name;
+  double usage;
+  absl::Time checkpoint_time;
+};
+
 }  // namespace Ctld
@@ -422,6 +422,101 @@ bool MongodbClient::CommitTransaction(
   return true;
 }
 
+void MongodbClient::BulkUpsertAccounts(
+    const std::vector<const Ctld::Account*>& created,
+    const std::vector<const Ctld::Account*>& updated) {
+  std::vector<document> documents;
+  documents.reserve(created.size() + updated.size());
+
+  int64_t now = ToUnixSeconds(absl::Now());
+  for (const Ctld::Account* account : created) {
+    documents.emplace_back(AccountToDocument_(*account));
+    documents.back().append(kvp("creation_time", now), kvp("mod_time", now));
+  }
+  for (const Ctld::Account* account : updated) {
+    documents.emplace_back(AccountToDocument_(*account));
+    documents.back().append(kvp("mod_time", now));
+  }
+
+  BulkUpsertByName_(m_account_collection_name_, documents);
+}
+
+void MongodbClient::BulkUpsertUsers(
+    const std::vector<const Ctld::User*>& created,
+    const std::vector<const Ctld::User*>& updated) {
+  std::vector<document> documents;
+  documents.reserve(created.size() + updated.size());
+
+  int64_t now = ToUnixSeconds(absl::Now());
+  for (const Ctld::User* user : created) {
+    documents.emplace_back(UserToDocument_(*user));
+    documents.back().append(kvp("creation_time", now), kvp("mod_time", now));
+  }
+  for (const Ctld::User* user : updated) {
+    documents.emplace_back(UserToDocument_(*user));
+    documents.back().append(kvp("mod_time", now));
+  }
+
+  BulkUpsertByName_(m_user_collection_name_, documents);
+}
+
+bool MongodbClient::UpsertUsageRecords(
+    const std::vector<Ctld::UsageRecord>& records) {
+  if (records.empty()) return true;
+
+  mongocxx::options::bulk_write opts;
+  opts.ordered(false);
+  mongocxx::bulk_write bulk =
+      (*GetClient_())[m_db_name_][m_usage_collection_name_].create_bulk_write(
+          opts);
+
+  for (const auto& record : records) {
+    document filter, set_document, update;
+    std::string type =
+        record.type == Ctld::UsageRecord::EntityType::USER ? "user" : "account";
+    filter.append(kvp("type", type), kvp("name", record.name));
+    set_document.append(
+        kvp("usage", record.usage),
+        kvp("checkpoint_time", ToUnixSeconds(record.checkpoint_time)));
+    update.append(kvp("$set", set_document));
+
+    mongocxx::model::update_one upsert_op{filter.view(), update.view()};
+    upsert_op.upsert(true);
+    bulk.append(upsert_op);
+  }
+
+  try {
+    bsoncxx::stdx::optional<mongocxx::result::bulk_write> result =
+        bulk.execute();
+    if (!result) return false;
+  } catch (const mongocxx::exception& e) {
+    PrintError_(e.what());
+    return false;
+  }
+  return true;
+}
+
+void MongodbClient::SelectAllUsageRecords(
+    std::vector<Ctld::UsageRecord>* records) {
+  mongocxx::cursor cursor =
+      (*GetClient_())[m_db_name_][m_usage_collection_name_].find({});
+  for (auto view : cursor) {
+    try {
+      Ctld::UsageRecord record;
+      record.type = view["type"].get_string().value == "user"
+                        ? Ctld::UsageRecord::EntityType::USER
+                        : Ctld::UsageRecord::EntityType::ACCOUNT;
+      record.name = view["name"].get_string().value;
+      record.usage = view["usage"].get_double().value;
+      record.checkpoint_time =
+          absl::FromUnixSeconds(view["checkpoint_time"].get_int64().value);
+      records->emplace_back(std::move(record));
+    } catch (const bsoncxx::exception& e) {
+      PrintError_(e.what());
+    }
+  }
+}
+
 template <typename V>
 void MongodbClient::DocumentAppendItem_(document* doc, const std::string& key,
                                         const V& value) {
@@ -439,6 +534,17 @@ void MongodbClient::DocumentAppendItem_<std::list<std::string>>(
   }));
 }
 
+template <>
+void MongodbClient::DocumentAppendItem_<absl::flat_hash_set<std::string>>(
+    document* doc, const std::string& key,
+    const absl::flat_hash_set<std::string>& value) {
+  doc->append(kvp(key, [&value](sub_array array) {
+    for (const auto& v : value) {
+      array.append(v);
+    }
+  }));
+}
+
 template <>
 void MongodbClient::DocumentAppendItem_<MongodbClient::PartitionQosMap>(
     document* doc, const std::string& key,
@@ -488,6 +594,26 @@ mongocxx::client* MongodbClient::GetClient_() {
   return nullptr;
 }
 
+void MongodbClient::BulkUpsertByName_(const std::string& coll_name,
+                                      const std::vector<document>& documents) {
+  if (documents.empty()) return;
+
+  mongocxx::bulk_write bulk =
+      (*GetClient_())[m_db_name_][coll_name].create_bulk_write(*GetSession_());
+  for (const auto& doc : documents) {
+    document filter, update;
+    filter.append(kvp("name", doc.view()["name"].get_string().value));
+    update.append(kvp("$set", doc.view()));
+
+    mongocxx::model::update_one upsert_op{filter.view(), update.view()};
+    upsert_op.upsert(true);
+    bulk.append(upsert_op);
+  }
+
+  // Not caught here so that the enclosing transaction is aborted.
+  bulk.execute();
+}
+
 mongocxx::client_session* MongodbClient::GetSession_() {
   if (m_connect_pool_) {
     thread_local mongocxx::client_session session =
@@ -544,20 +670,20 @@ void MongodbClient::ViewToAccount_(const bsoncxx::document::view& account_view,
     account->name = account_view["name"].get_string().value;
     account->description = account_view["description"].get_string().value;
     for (auto&& user : account_view["users"].get_array().value) {
-      account->users.emplace_back(user.get_string().value);
+      account->users.emplace(user.get_string().value);
     }
     for (auto&& acct : account_view["child_accounts"].get_array().value) {
-      account->child_accounts.emplace_back(acct.get_string().value);
+      account->child_accounts.emplace(acct.get_string().value);
     }
     for (auto&& partition :
          account_view["allowed_partition"].get_array().value) {
-      account->allowed_partition.emplace_back(partition.get_string().value);
+      account->allowed_partition.emplace(partition.get_string().value);
     }
     account->parent_account = account_view["parent_account"].get_string().value;
     account->default_qos = account_view["default_qos"].get_string().value;
     for (auto& allowed_qos :
          account_view["allowed_qos_list"].get_array().value) {
-      account->allowed_qos_list.emplace_back(allowed_qos.get_string());
+      account->allowed_qos_list.emplace(allowed_qos.get_string().value);
     }
   } catch (const bsoncxx::exception& e) {
     PrintError_(e.what());
@@ -570,9 +696,11 @@ bsoncxx::builder::basic::document MongodbClient::AccountToDocument_(
       "deleted",         "name",           "description",       "users",
       "child_accounts",  "parent_account", "allowed_partition", "default_qos",
       "allowed_qos_list"};
-  std::tuple<bool, std::string, std::string, std::list<std::string>,
-             std::list<std::string>, std::string, std::list<std::string>,
-             std::string, std::list<std::string>>
+  std::tuple<bool, std::string, std::string,
+             absl::flat_hash_set<std::string>,
+             absl::flat_hash_set<std::string>, std::string,
+             absl::flat_hash_set<std::string>, std::string,
+             absl::flat_hash_set<std::string>>
       values{false,
              account.name,
              account.description,
@@ -594,6 +722,13 @@ void MongodbClient::ViewToQos_(const bsoncxx::document::view& qos_view,
     qos->description = qos_view["description"].get_string().value;
     qos->priority = qos_view["priority"].get_int32().value;
     qos->max_jobs_per_user = qos_view["max_jobs_per_user"].get_int32().value;
+
+    // Absent in the qos created by older versions.
+    if (qos_view.find("max_running_jobs_per_user") != qos_view.end())
+      qos->max_running_jobs_per_user =
+          qos_view["max_running_jobs_per_user"].get_int32().value;
+    if (qos_view.find("max_cpus_per_user") != qos_view.end())
+      qos->max_cpus_per_user = qos_view["max_cpus_per_user"].get_int32().value;
   } catch (const bsoncxx::exception& e) {
     PrintError_(e.what());
   }
@@ -601,10 +736,19 @@ void MongodbClient::ViewToQos_(const bsoncxx::document::view& qos_view,
 
 bsoncxx::builder::basic::document MongodbClient::QosToDocument_(
     const Ctld::Qos& qos) {
-  std::array<std::string, 5> fields{"deleted", "name", "description",
-                                    "priority", "max_jobs_per_user"};
-  std::tuple<bool, std::string, std::string, int, int> values{
-      false, qos.name, qos.description, qos.priority, qos.max_jobs_per_user};
+  std::array<std::string, 7> fields{
+      "deleted",           "name",
+      "description",       "priority",
+      "max_jobs_per_user", "max_running_jobs_per_user",
+      "max_cpus_per_user"};
+  std::tuple<bool, std::string, std::string, int, int, int, int> values{
+      false,
+      qos.name,
+      qos.description,
+      qos.priority,
+      qos.max_jobs_per_user,
+      qos.max_running_jobs_per_user,
+      qos.max_cpus_per_user};
 
   return DocumentConstructor_(fields, values);
 }
@@ -613,15 +757,16 @@ MongodbClient::document MongodbClient::TaskInEmbeddedDbToDocument_(
     const crane::grpc::TaskInEmbeddedDb& task) {
   auto const& task_to_ctld = task.task_to_ctld();
   auto const& persisted_part = task.persisted_part();
+  auto const& usage = persisted_part.resource_usage();
 
   // 0  task_id       task_id        mod_time       deleted       account
   // 5  cpus_req      mem_req        task_name      env           id_user
   // 10 id_group      nodelist       nodes_alloc   node_inx    partition_name
   // 15 priority      time_eligible  time_start    time_end    time_suspended
   // 20 script        state          timelimit     time_submit work_dir
-  // 25 submit_line
+  // 25 submit_line   cpu_time_ns    max_mem_bytes io_read_bytes io_write_bytes
 
-  std::array<std::string, 26> fields{
+  std::array<std::string, 30> fields{
       "task_id",        "task_db_id",    "mod_time",    "deleted",
       "account",  // 0 - 4
       "cpus_req",       "mem_req",       "task_name",   "env",
@@ -632,7 +777,8 @@ MongodbClient::document MongodbClient::TaskInEmbeddedDbToDocument_(
       "time_suspended",  // 15 - 19
       "script",         "state",         "timelimit",   "time_submit",
       "work_dir",     // 20 - 24
-      "submit_line",  // 25
+      "submit_line",    "cpu_time_ns",   "max_mem_bytes", "io_read_bytes",
+      "io_write_bytes",  // 25 - 29
   };
 
   std::tuple<int32_t, task_db_id_t, int64_t, bool, std::string,   /*0-4*/
@@ -640,7 +786,7 @@ MongodbClient::document MongodbClient::TaskInEmbeddedDbToDocument_(
              int32_t, std::string, int32_t, int32_t, std::string, /*10-14*/
              int64_t, int64_t, int64_t, int64_t, int64_t,         /*15-19*/
              std::string, int32_t, int64_t, int64_t, std::string, /*20-24*/
-             std::string>
+             std::string, int64_t, int64_t, int64_t, int64_t>    /*25-29*/
       values{// 0-4
              static_cast<int32_t>(persisted_part.task_id()),
              persisted_part.task_db_id(), absl::ToUnixSeconds(absl::Now()),
@@ -660,8 +806,12 @@ MongodbClient::document MongodbClient::TaskInEmbeddedDbToDocument_(
              // 20-24
              task_to_ctld.batch_meta().sh_script(), persisted_part.status(),
              task_to_ctld.time_limit().seconds(), 0, task_to_ctld.cwd(),
-             // 25
-             task_to_ctld.cmd_line()};
+             // 25-29
+             task_to_ctld.cmd_line(),
+             static_cast<int64_t>(usage.cpu_time_ns()),
+             static_cast<int64_t>(usage.max_memory_bytes()),
+             static_cast<int64_t>(usage.blkio_read_bytes()),
+             static_cast<int64_t>(usage.blkio_write_bytes())};
 
   return DocumentConstructor_(fields, values);
 }
@@ -672,9 +822,9 @@ MongodbClient::document MongodbClient::TaskInCtldToDocument_(TaskInCtld* task) {
   // 10 id_group      nodelist       nodes_alloc   node_inx    partition_name
   // 15 priority      time_eligible  time_start    time_end    time_suspended
   // 20 script        state          timelimit     time_submit work_dir
-  // 25 submit_line
+  // 25 submit_line   cpu_time_ns    max_mem_bytes io_read_bytes io_write_bytes
 
-  std::array<std::string, 26> fields{
+  std::array<std::string, 30> fields{
       "task_id",        "task_db_id",    "mod_time",    "deleted",
       "account",  // 0 - 4
       "cpus_req",       "mem_req",       "task_name",   "env",
@@ -685,7 +835,8 @@ MongodbClient::document MongodbClient::TaskInCtldToDocument_(TaskInCtld* task) {
       "time_suspended",  // 15 - 19
       "script",         "state",         "timelimit",   "time_submit",
       "work_dir",     // 20 - 24
-      "submit_line",  // 25
+      "submit_line",    "cpu_time_ns",   "max_mem_bytes", "io_read_bytes",
+      "io_write_bytes",  // 25 - 29
   };
 
   std::tuple<int32_t, task_db_id_t, int64_t, bool, std::string,   /*0-4*/
@@ -693,7 +844,7 @@ MongodbClient::document MongodbClient::TaskInCtldToDocument_(TaskInCtld* task) {
              int32_t, std::string, int32_t, int32_t, std::string, /*10-14*/
              int64_t, int64_t, int64_t, int64_t, int64_t,         /*15-19*/
              std::string, int32_t, int64_t, int64_t, std::string, /*20-24*/
-             std::string>
+             std::string, int64_t, int64_t, int64_t, int64_t>    /*25-29*/
       values{// 0-4
              static_cast<int32_t>(task->TaskId()), task->TaskDbId(),
              absl::ToUnixSeconds(absl::Now()), false, task->Account(),
@@ -711,8 +862,12 @@ MongodbClient::document MongodbClient::TaskInCtldToDocument_(TaskInCtld* task) {
              // 20-24
              std::get<BatchMetaInTask>(task->meta).sh_script, task->Status(),
              absl::ToInt64Seconds(task->time_limit), 0, task->cwd,
-             // 25
-             task->cmd_line};
+             // 25-29
+             task->cmd_line,
+             static_cast<int64_t>(task->ResourceUsage().cpu_time_ns()),
+             static_cast<int64_t>(task->ResourceUsage().max_memory_bytes()),
+             static_cast<int64_t>(task->ResourceUsage().blkio_read_bytes()),
+             static_cast<int64_t>(task->ResourceUsage().blkio_write_bytes())};
 
   return DocumentConstructor_(fields, values);
 }
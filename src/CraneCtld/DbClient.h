@@ -13,6 +13,7 @@
 #include <mongocxx/pool.hpp>
 #include <source_location>
 #include <string>
+#include <vector>
 
 #include "CtldPublicDefs.h"
 #include "crane/PublicHeader.h"
@@ -127,6 +128,21 @@ class MongodbClient {
   bool CommitTransaction(
       const mongocxx::client_session::with_transaction_cb& callback);
 
+  /**
+   * Write the whole documents of accounts or users with one bulk write.
+   * Documents of created entities are inserted or overwrite the deleted
+   * entities of the same names. Only called in the callback of
+   * CommitTransaction(). A failure throws to abort the transaction.
+   */
+  void BulkUpsertAccounts(const std::vector<const Account*>& created,
+                          const std::vector<const Account*>& updated);
+  void BulkUpsertUsers(const std::vector<const User*>& created,
+                       const std::vector<const User*>& updated);
+
+  /* ----- Method of operating the usage table ----------- */
+  bool UpsertUsageRecords(const std::vector<UsageRecord>& records);
+  void SelectAllUsageRecords(std::vector<UsageRecord>* records);
+
  private:
   using array = bsoncxx::builder::basic::array;
   using document = bsoncxx::builder::basic::document;
@@ -156,6 +172,9 @@ class MongodbClient {
   mongocxx::client* GetClient_();
   mongocxx::client_session* GetSession_();
 
+  void BulkUpsertByName_(const std::string& coll_name,
+                         const std::vector<document>& documents);
+
   void ViewToUser_(const bsoncxx::document::view& user_view, User* user);
 
   document UserToDocument_(const User& user);
@@ -178,6 +197,7 @@ class MongodbClient {
   const std::string m_account_collection_name_{"acct_table"};
   const std::string m_user_collection_name_{"user_table"};
   const std::string m_qos_collection_name_{"qos_table"};
+  const std::string m_usage_collection_name_{"usage_table"};
 
   std::unique_ptr<mongocxx::instance> m_instance_;
   std::unique_ptr<mongocxx::pool> m_connect_pool_;
@@ -191,6 +211,11 @@ template <>
 void MongodbClient::DocumentAppendItem_<std::list<std::string>>(
     document* doc, const std::string& key, const std::list<std::string>& value);
 
+template <>
+void MongodbClient::DocumentAppendItem_<absl::flat_hash_set<std::string>>(
+    document* doc, const std::string& key,
+    const absl::flat_hash_set<std::string>& value);
+
 template <>
 void MongodbClient::DocumentAppendItem_<MongodbClient::PartitionQosMap>(
     document* doc, const std::string& key,
@@ -0,0 +1,139 @@
+#include "FairShareManager.h"
+
+#include <cmath>
+
+namespace Ctld {
+
+FairShareManager::FairShareManager(absl::Duration half_life, absl::Time now)
+    : m_half_life_(half_life), m_base_time_(now) {}
+
+FairShareManager::~FairShareManager() {
+  m_thread_stop_.Notify();
+  if (m_checkpoint_thread_.joinable()) m_checkpoint_thread_.join();
+}
+
+void FairShareManager::Load(const std::vector<UsageRecord>& records) {
+  util::lock_guard guard(m_mtx_);
+
+  for (const auto& record : records) {
+    double scaled_usage =
+        record.usage * std::exp2(ScaleExponentNoLock_(record.checkpoint_time));
+    if (record.type == UsageRecord::EntityType::USER)
+      AddScaledUsageNoLock_(&m_user_usages_, record.name, scaled_usage);
+    else
+      AddScaledUsageNoLock_(&m_account_usages_, record.name, scaled_usage);
+  }
+}
+
+void FairShareManager::StartCheckpointThread(absl::Duration interval,
+                                             CheckpointCb cb) {
+  m_checkpoint_cb_ = std::move(cb);
+  m_checkpoint_thread_ =
+      std::thread([this, interval] { CheckpointThread_(interval); });
+}
+
+void FairShareManager::CheckpointThread_(absl::Duration interval) {
+  while (!m_thread_stop_.WaitForNotificationWithTimeout(interval)) {
+    m_checkpoint_cb_(Dump());
+  }
+
+  // Save the usage accumulated since the last checkpoint before exiting.
+  m_checkpoint_cb_(Dump());
+}
+
+void FairShareManager::AddUsage(const std::string& user,
+                                const std::string& account,
+                                double cpu_seconds, absl::Time at) {
+  util::lock_guard guard(m_mtx_);
+
+  if (ScaleExponentNoLock_(at) > kMaxScaleExponent) RebaseNoLock_(at);
+
+  double scaled_usage = cpu_seconds * std::exp2(ScaleExponentNoLock_(at));
+  AddScaledUsageNoLock_(&m_user_usages_, user, scaled_usage);
+  if (!account.empty())
+    AddScaledUsageNoLock_(&m_account_usages_, account, scaled_usage);
+}
+
+double FairShareManager::UserUsage(const std::string& user, absl::Time now) {
+  util::lock_guard guard(m_mtx_);
+  return UsageNoLock_(m_user_usages_, user, now);
+}
+
+double FairShareManager::AccountUsage(const std::string& account,
+                                      absl::Time now) {
+  util::lock_guard guard(m_mtx_);
+  return UsageNoLock_(m_account_usages_, account, now);
+}
+
+double FairShareManager::UserFairShareFactor(const std::string& user) {
+  util::lock_guard guard(m_mtx_);
+  return FairShareFactor_(m_user_usages_, user);
+}
+
+double FairShareManager::AccountFairShareFactor(const std::string& account) {
+  util::lock_guard guard(m_mtx_);
+  return FairShareFactor_(m_account_usages_, account);
+}
+
+std::vector<UsageRecord> FairShareManager::Dump(absl::Time now) {
+  util::lock_guard guard(m_mtx_);
+
+  std::vector<UsageRecord> records;
+  records.reserve(m_user_usages_.scaled_usages.size() +
+                  m_account_usages_.scaled_usages.size());
+
+  double decay = std::exp2(-ScaleExponentNoLock_(now));
+  for (const auto& [name, scaled_usage] : m_user_usages_.scaled_usages)
+    records.emplace_back(UsageRecord{UsageRecord::EntityType::USER, name,
+                                     scaled_usage * decay, now});
+  for (const auto& [name, scaled_usage] : m_account_usages_.scaled_usages)
+    records.emplace_back(UsageRecord{UsageRecord::EntityType::ACCOUNT, name,
+                                     scaled_usage * decay, now});
+
+  return records;
+}
+
+double FairShareManager::ScaleExponentNoLock_(absl::Time t) {
+  return absl::FDivDuration(t - m_base_time_, m_half_life_);
+}
+
+void FairShareManager::AddScaledUsageNoLock_(UsageTable* table,
+                                             const std::string& name,
+                                             double scaled_usage) {
+  table->scaled_usages[name] += scaled_usage;
+  table->scaled_total += scaled_usage;
+}
+
+double FairShareManager::UsageNoLock_(const UsageTable& table,
+                                      const std::string& name,
+                                      absl::Time now) {
+  auto iter = table.scaled_usages.find(name);
+  if (iter == table.scaled_usages.end()) return 0;
+
+  return iter->second * std::exp2(-ScaleExponentNoLock_(now));
+}
+
+double FairShareManager::FairShareFactor_(const UsageTable& table,
+                                          const std::string& name) {
+  auto iter = table.scaled_usages.find(name);
+  if (iter == table.scaled_usages.end() || table.scaled_total <= 0) return 1;
+
+  // The decay factor cancels out in the ratio of two scaled values.
+  double normalized_usage = iter->second / table.scaled_total;
+  double normalized_shares = 1.0 / table.scaled_usages.size();
+  return std::exp2(-normalized_usage / normalized_shares);
+}
+
+void FairShareManager::RebaseNoLock_(absl::Time t) {
+  double decay = std::exp2(-ScaleExponentNoLock_(t));
+
+  for (UsageTable* table : {&m_user_usages_, &m_account_usages_}) {
+    for (auto& [name, scaled_usage] : table->scaled_usages)
+      scaled_usage *= decay;
+    table->scaled_total *= decay;
+  }
+
+  m_base_time_ = t;
+}
+
+}  // namespace Ctld
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/synchronization/notification.h>
+
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CtldPublicDefs.h"
+#include "crane/Lock.h"
+
+namespace Ctld {
+
+/**
+ * Accumulates the CPU-seconds consumed by users and accounts from completed
+ * jobs. Usage decays exponentially with the configured half-life.
+ *
+ * Decay is applied lazily: usage is stored scaled by 2^((t - base)/half_life),
+ * where t is the time at which the usage is added. All stored values then
+ * decay by the same factor, so adding usage and computing fair-share factors
+ * are O(1) and no periodic sweep is needed. The base time is only moved
+ * forward when the scale is about to grow too large, which happens once every
+ * kMaxScaleExponent half-lives.
+ *
+ * All public methods in this class is thread-safe.
+ */
+class FairShareManager {
+ public:
+  using CheckpointCb = std::function<void(std::vector<UsageRecord>&&)>;
+
+  explicit FairShareManager(absl::Duration half_life,
+                            absl::Time now = absl::Now());
+
+  ~FairShareManager();
+
+  /**
+   * Restore the usage checkpointed by a previous run.
+   */
+  void Load(const std::vector<UsageRecord>& records) LOCKS_EXCLUDED(m_mtx_);
+
+  /**
+   * Call cb with a dump of all usage every interval and once more on
+   * destruction.
+   */
+  void StartCheckpointThread(absl::Duration interval, CheckpointCb cb);
+
+  void AddUsage(const std::string& user, const std::string& account,
+                double cpu_seconds, absl::Time at) LOCKS_EXCLUDED(m_mtx_);
+
+  /**
+   * @return The usage decayed to now.
+   */
+  double UserUsage(const std::string& user, absl::Time now = absl::Now())
+      LOCKS_EXCLUDED(m_mtx_);
+  double AccountUsage(const std::string& account,
+                      absl::Time now = absl::Now()) LOCKS_EXCLUDED(m_mtx_);
+
+  /**
+   * The fair-share factor is 2^(-U/S), where U is the share of the total
+   * usage consumed by the entity and S is its share of the cluster. All
+   * entities with usage have equal shares for now. The factor is 1 for an
+   * entity without usage, 0.5 for one which consumed exactly its share and
+   * approaches 0 as the usage grows.
+   */
+  double UserFairShareFactor(const std::string& user) LOCKS_EXCLUDED(m_mtx_);
+  double AccountFairShareFactor(const std::string& account)
+      LOCKS_EXCLUDED(m_mtx_);
+
+  std::vector<UsageRecord> Dump(absl::Time now = absl::Now())
+      LOCKS_EXCLUDED(m_mtx_);
+
+ private:
+  // 2^kMaxScaleExponent stays far away from the range limit of double.
+  static constexpr double kMaxScaleExponent = 64;
+
+  struct UsageTable {
+    absl::flat_hash_map<std::string, double> scaled_usages;
+    double scaled_total{0};
+  };
+
+  double ScaleExponentNoLock_(absl::Time t) EXCLUSIVE_LOCKS_REQUIRED(m_mtx_);
+
+  void AddScaledUsageNoLock_(UsageTable* table, const std::string& name,
+                             double scaled_usage)
+      EXCLUSIVE_LOCKS_REQUIRED(m_mtx_);
+
+  double UsageNoLock_(const UsageTable& table, const std::string& name,
+                      absl::Time now) EXCLUSIVE_LOCKS_REQUIRED(m_mtx_);
+
+  static double FairShareFactor_(const UsageTable& table,
+                                 const std::string& name);
+
+  /**
+   * Move the base time to t and rescale all stored usage accordingly.
+   */
+  void RebaseNoLock_(absl::Time t) EXCLUSIVE_LOCKS_REQUIRED(m_mtx_);
+
+  void CheckpointThread_(absl::Duration interval);
+
+  const absl::Duration m_half_life_;
+
+  util::mutex m_mtx_;
+  absl::Time m_base_time_ GUARDED_BY(m_mtx_);
+  UsageTable m_user_usages_ GUARDED_BY(m_mtx_);
+  UsageTable m_account_usages_ GUARDED_BY(m_mtx_);
+
+  CheckpointCb m_checkpoint_cb_;
+  std::thread m_checkpoint_thread_;
+  absl::Notification m_thread_stop_;
+};
+
+}  // namespace Ctld
+
+inline std::unique_ptr<Ctld::FairShareManager> g_fair_share_manager;
@@ -0,0 +1,136 @@
+#include "QosLimiter.h"
+
+#include <algorithm>
+
+namespace Ctld {
+
+void QosLimiter::SetQosLimits(const std::string& qos, const Limits& limits) {
+  util::lock_guard guard(m_mtx_);
+  m_qos_limits_[qos] = limits;
+}
+
+void QosLimiter::RemoveQos(const std::string& qos) {
+  util::lock_guard guard(m_mtx_);
+  m_qos_limits_.erase(qos);
+}
+
+bool QosLimiter::TryAddSubmittedJob(const TaskInCtld& task) {
+  util::lock_guard guard(m_mtx_);
+
+  // The counters are only created for an admitted job, so a user whose jobs
+  // are all rejected leaves nothing behind.
+  UserKey key{task.qos, task.uid};
+  auto counters_iter = m_user_counters_.find(key);
+  uint32_t submitted_jobs = counters_iter == m_user_counters_.end()
+                                ? 0
+                                : counters_iter->second.submitted_jobs;
+
+  auto iter = m_qos_limits_.find(task.qos);
+  if (iter != m_qos_limits_.end()) {
+    const Limits& limits = iter->second;
+    if (limits.max_jobs_per_user != 0 &&
+        submitted_jobs >= limits.max_jobs_per_user)
+      return false;
+  }
+
+  if (counters_iter == m_user_counters_.end())
+    counters_iter = m_user_counters_.emplace(std::move(key), UserCounters{})
+                        .first;
+  counters_iter->second.submitted_jobs++;
+  return true;
+}
+
+bool QosLimiter::CheckRunningLimits(const TaskInCtld& task) {
+  util::lock_guard guard(m_mtx_);
+
+  auto iter = m_user_counters_.find(UserKey{task.qos, task.uid});
+  if (iter == m_user_counters_.end())
+    return !RunningLimitsReachedNoLock_(task, UserCounters{});
+
+  return !RunningLimitsReachedNoLock_(task, iter->second);
+}
+
+bool QosLimiter::TryAddRunningJob(const TaskInCtld& task) {
+  util::lock_guard guard(m_mtx_);
+
+  UserKey key{task.qos, task.uid};
+  auto iter = m_user_counters_.find(key);
+  if (iter == m_user_counters_.end()) {
+    if (RunningLimitsReachedNoLock_(task, UserCounters{})) return false;
+    iter = m_user_counters_.emplace(std::move(key), UserCounters{}).first;
+  } else if (RunningLimitsReachedNoLock_(task, iter->second)) {
+    return false;
+  }
+
+  iter->second.running_jobs++;
+  iter->second.running_cpus += CpusOf_(task);
+  return true;
+}
+
+void QosLimiter::RemoveRunningJob(const TaskInCtld& task) {
+  util::lock_guard guard(m_mtx_);
+
+  auto iter = m_user_counters_.find(UserKey{task.qos, task.uid});
+  if (iter == m_user_counters_.end()) [[unlikely]] {
+    CRANE_ERROR("Task #{} is not counted in QosLimiter.", task.TaskId());
+    return;
+  }
+
+  // The job is still counted as submitted, so the counters are kept.
+  iter->second.running_jobs--;
+  iter->second.running_cpus -= CpusOf_(task);
+}
+
+void QosLimiter::AddRecoveredJob(const TaskInCtld& task, bool running) {
+  util::lock_guard guard(m_mtx_);
+
+  UserCounters& counters = m_user_counters_[UserKey{task.qos, task.uid}];
+  counters.submitted_jobs++;
+  if (running) {
+    counters.running_jobs++;
+    counters.running_cpus += CpusOf_(task);
+  }
+}
+
+void QosLimiter::RemoveJob(const TaskInCtld& task, bool was_running) {
+  util::lock_guard guard(m_mtx_);
+
+  auto iter = m_user_counters_.find(UserKey{task.qos, task.uid});
+  if (iter == m_user_counters_.end()) [[unlikely]] {
+    CRANE_ERROR("Task #{} is not counted in QosLimiter.", task.TaskId());
+    return;
+  }
+
+  UserCounters& counters = iter->second;
+  counters.submitted_jobs--;
+  if (was_running) {
+    counters.running_jobs--;
+    counters.running_cpus -= CpusOf_(task);
+  }
+
+  if (counters.submitted_jobs == 0 && counters.running_jobs == 0)
+    m_user_counters_.erase(iter);
+}
+
+double QosLimiter::CpusOf_(const TaskInCtld& task) {
+  return task.resources.allocatable_resource.cpu_count *
+         std::max(task.node_num, 1U);
+}
+
+bool QosLimiter::RunningLimitsReachedNoLock_(const TaskInCtld& task,
+                                             const UserCounters& counters) {
+  auto iter = m_qos_limits_.find(task.qos);
+  if (iter == m_qos_limits_.end()) return false;
+
+  const Limits& limits = iter->second;
+  if (limits.max_running_jobs_per_user != 0 &&
+      counters.running_jobs >= limits.max_running_jobs_per_user)
+    return true;
+  if (limits.max_cpus_per_user != 0 &&
+      counters.running_cpus + CpusOf_(task) > limits.max_cpus_per_user)
+    return true;
+
+  return false;
+}
+
+}  // namespace Ctld
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <string>
+#include <utility>
+
+#include "CtldPublicDefs.h"
+#include "crane/Lock.h"
+
+namespace Ctld {
+
+/**
+ * Enforces the per-user limits of QoS. The jobs and CPUs of each user under
+ * each qos are counted when a job is submitted, started and ended, so a check
+ * is a hash lookup instead of a scan over the task maps.
+ *
+ * A job is counted as submitted from SubmitTask until it ends, and as running
+ * from being selected to run until it ends.
+ *
+ * All public methods in this class is thread-safe.
+ */
+class QosLimiter {
+ public:
+  // 0 means unlimited.
+  struct Limits {
+    uint32_t max_jobs_per_user{0};
+    uint32_t max_running_jobs_per_user{0};
+    uint32_t max_cpus_per_user{0};
+  };
+
+  void SetQosLimits(const std::string& qos, const Limits& limits)
+      LOCKS_EXCLUDED(m_mtx_);
+
+  void RemoveQos(const std::string& qos) LOCKS_EXCLUDED(m_mtx_);
+
+  /**
+   * Count a job as submitted if the user is below max_jobs_per_user.
+   * @return false if the limit is reached.
+   */
+  bool TryAddSubmittedJob(const TaskInCtld& task) LOCKS_EXCLUDED(m_mtx_);
+
+  /**
+   * @return true if the job can be started without exceeding
+   * max_running_jobs_per_user and max_cpus_per_user.
+   */
+  bool CheckRunningLimits(const TaskInCtld& task) LOCKS_EXCLUDED(m_mtx_);
+
+  /**
+   * Count a job as running if CheckRunningLimits() passes.
+   * @return false if any limit would be exceeded.
+   */
+  bool TryAddRunningJob(const TaskInCtld& task) LOCKS_EXCLUDED(m_mtx_);
+
+  /**
+   * Undo TryAddRunningJob() for a job put back to the pending queue.
+   */
+  void RemoveRunningJob(const TaskInCtld& task) LOCKS_EXCLUDED(m_mtx_);
+
+  /**
+   * Count a job recovered from the embedded db regardless of the limits.
+   */
+  void AddRecoveredJob(const TaskInCtld& task, bool running)
+      LOCKS_EXCLUDED(m_mtx_);
+
+  /**
+   * Called when a job ends. `was_running` tells whether TryAddRunningJob()
+   * succeeded for it.
+   */
+  void RemoveJob(const TaskInCtld& task, bool was_running)
+      LOCKS_EXCLUDED(m_mtx_);
+
+ private:
+  using UserKey = std::pair<std::string /*qos*/, uid_t>;
+
+  struct UserCounters {
+    uint32_t submitted_jobs{0};
+    uint32_t running_jobs{0};
+    double running_cpus{0};
+  };
+
+  static double CpusOf_(const TaskInCtld& task);
+
+  bool RunningLimitsReachedNoLock_(const TaskInCtld& task,
+                                   const UserCounters& counters)
+      EXCLUSIVE_LOCKS_REQUIRED(m_mtx_);
+
+  util::mutex m_mtx_;
+  absl::flat_hash_map<std::string /*qos*/, Limits> m_qos_limits_
+      GUARDED_BY(m_mtx_);
+  absl::flat_hash_map<UserKey, UserCounters> m_user_counters_
+      GUARDED_BY(m_mtx_);
+};
+
+}  // namespace Ctld
+
+inline std::unique_ptr<Ctld::QosLimiter> g_qos_limiter;
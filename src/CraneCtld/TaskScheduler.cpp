@@ -1,5 +1,8 @@
 #include "TaskScheduler.h"
 
+#include <absl/strings/str_join.h>
+#include <pwd.h>
+
 #include <algorithm>
 #include <map>
 #include <range/v3/all.hpp>
@@ -7,6 +10,8 @@
 #include "CranedKeeper.h"
 #include "CtldGrpcServer.h"
 #include "EmbeddedDbClient.h"
+#include "FairShareManager.h"
+#include "QosLimiter.h"
 #include "crane/String.h"
 
 namespace Ctld {
@@ -261,6 +266,8 @@ CraneErr TaskScheduler::TryRequeueRecoveredTaskIntoPendingQueueLock_(
   err = CheckTaskValidityAndAcquireAttrs_(task.get());
   if (err != CraneErr::kOk) return err;
 
+  g_qos_limiter->AddRecoveredJob(*task, false);
+
   m_partition_to_tasks_map_[task->PartitionId()].emplace(task->TaskId());
   m_pending_task_map_.emplace(task->TaskId(), std::move(task));
 
@@ -280,6 +287,8 @@ void TaskScheduler::PutRecoveredTaskIntoRunningQueueLock_(
     m_node_to_tasks_map_[node_id].emplace(task->TaskId());
   }
 
+  g_qos_limiter->AddRecoveredJob(*task, true);
+
   m_partition_to_tasks_map_[task->PartitionId()].emplace(task->TaskId());
   m_running_task_map_.emplace(task->TaskId(), std::move(task));
 }
@@ -291,21 +300,62 @@ void TaskScheduler::ScheduleThread_() {
     // m_pending_task_map_mtx_ needs to be acquired. Deadlock may happen under
     // such a situation.
     m_pending_task_map_mtx_.Lock();
-    if (!m_pending_task_map_.empty()) {  // all_part_metas is locked here.
+    if (!m_pending_task_map_.empty()) {
       // Running map must be locked before g_meta_container's lock.
       // Otherwise, DEADLOCK may happen because TaskStatusChange() locks running
       // map first and then locks g_meta_container.
       m_running_task_map_mtx_.Lock();
 
-      auto all_part_metas = g_meta_container->GetAllPartitionsMetaMapPtr();
       std::list<INodeSelectionAlgo::NodeSelectionResult> selection_result_list;
-
-      m_node_selection_algo_->NodeSelect(*all_part_metas, m_running_task_map_,
-                                         &m_pending_task_map_,
-                                         &selection_result_list);
+      {  // all_part_metas is locked in this scope.
+        auto all_part_metas = g_meta_container->GetAllPartitionsMetaMapPtr();
+        m_node_selection_algo_->NodeSelect(*all_part_metas,
+                                           m_running_task_map_,
+                                           &m_pending_task_map_,
+                                           &selection_result_list);
+      }
       m_running_task_map_mtx_.Unlock();
       m_pending_task_map_mtx_.Unlock();
 
+      // The locks of the partitions are released after NodeSelect(), so a
+      // selected node may have gone down or been changed since then. The
+      // resources are malloced with a re-check under the lock of the
+      // partition, and a task failing it is put back to the pending queue.
+      for (auto it = selection_result_list.begin();
+           it != selection_result_list.end();) {
+        auto& task = it->first;
+        std::vector<CranedId> malloced_node_ids;
+        for (uint32_t node_index : it->second) {
+          CranedId node_id{task->PartitionId(), node_index};
+          if (!g_meta_container->TryMallocResourceFromNode(
+                  node_id, task->TaskId(), task->resources))
+            break;
+          malloced_node_ids.emplace_back(node_id);
+        }
+
+        if (malloced_node_ids.size() == it->second.size()) {
+          ++it;
+          continue;
+        }
+
+        CRANE_DEBUG("Selected nodes of task #{} changed. Requeue it.",
+                    task->TaskId());
+        for (const CranedId& node_id : malloced_node_ids)
+          g_meta_container->FreeResourceFromNode(node_id, task->TaskId());
+        g_qos_limiter->RemoveRunningJob(*task);
+
+        m_pending_task_map_mtx_.Lock();
+        m_pending_task_map_.emplace(task->TaskId(), std::move(task));
+        m_pending_task_map_mtx_.Unlock();
+        it = selection_result_list.erase(it);
+      }
+
+      // The cgroups of all the tasks started on a node in this round are
+      // created by one RPC to that node.
+      HashMap<CranedId, std::vector<std::pair<task_id_t, uid_t>>,
+              CranedId::Hash>
+          node_cgroups_to_create;
+
       for (auto& it : selection_result_list) {
         auto& task = it.first;
         uint32_t partition_id = task->PartitionId();
@@ -315,20 +365,21 @@ void TaskScheduler::ScheduleThread_() {
         task->nodes_alloc = task->NodeIndexes().size();
 
         for (uint32_t node_index : task->NodeIndexes()) {
-          CranedMeta node_meta =
-              all_part_metas->at(partition_id).craned_meta_map.at(node_index);
-
           CranedId node_id{partition_id, node_index};
-          g_meta_container->MallocResourceFromNode(node_id, task->TaskId(),
-                                                   task->resources);
 
-          task->NodesAdd(node_meta.static_meta.hostname);
+          CranedStaticMeta static_meta;
+          {
+            auto craned_meta = g_meta_container->GetNodeMetaPtr(node_id);
+            static_meta = craned_meta->static_meta;
+          }
+
+          task->NodesAdd(static_meta.hostname);
 
           if (task->type == crane::grpc::Interactive) {
             InteractiveTaskAllocationDetail detail{
                 .craned_index = node_index,
-                .ipv4_addr = node_meta.static_meta.hostname,
-                .port = node_meta.static_meta.port,
+                .ipv4_addr = static_meta.hostname,
+                .port = static_meta.port,
                 .resource_uuid = m_uuid_gen_(),
             };
 
@@ -351,13 +402,25 @@ void TaskScheduler::ScheduleThread_() {
         CranedId first_node_id{partition_id, task->NodeIndexes().front()};
         task->executing_node_id = first_node_id;
 
-        for (auto iter : task->NodeIndexes()) {
-          CranedId node_id{partition_id, iter};
-          CranedStub* stub = g_craned_keeper->GetCranedStub(node_id);
-          CRANE_TRACE("Send CreateCgroupForTask to {}: ", node_id);
-          stub->CreateCgroupForTask(task->TaskId(), task->uid);
-        }
+        for (auto iter : task->NodeIndexes())
+          node_cgroups_to_create[CranedId{partition_id, iter}].emplace_back(
+              task->TaskId(), task->uid);
+      }
+
+      for (auto& [node_id, task_uid_pairs] : node_cgroups_to_create) {
+        CranedStub* stub = g_craned_keeper->GetCranedStub(node_id);
+        CRANE_TRACE("Send CreateCgroupForTasks of {} tasks to {}",
+                    task_uid_pairs.size(), node_id);
+        std::vector<task_id_t> failed_task_ids;
+        if (stub->CreateCgroupForTasks(task_uid_pairs, &failed_task_ids) ==
+            CraneErr::kGenericFailure)
+          CRANE_ERROR("Failed to create cgroups for tasks {} on Node {}",
+                      absl::StrJoin(failed_task_ids, ","), node_id);
+      }
 
+      for (auto& it : selection_result_list) {
+        auto& task = it.first;
+        CranedId first_node_id = task->executing_node_id;
         auto* task_ptr = task.get();
 
         // IMPORTANT: task must be put into running_task_map before any
@@ -383,7 +446,6 @@ void TaskScheduler::ScheduleThread_() {
               task_ptr->TaskDbId());
         }
       }
-      // all_part_metas is unlocked here.
     } else {
       m_pending_task_map_mtx_.Unlock();
     }
@@ -406,6 +468,12 @@ CraneErr TaskScheduler::SubmitTask(std::unique_ptr<TaskInCtld> task,
   err = CheckTaskValidityAndAcquireAttrs_(task.get());
   if (err != CraneErr::kOk) return err;
 
+  if (!g_qos_limiter->TryAddSubmittedJob(*task)) {
+    CRANE_TRACE("User {} reached max_jobs_per_user of qos {}. Reject it.",
+                task->uid, task->qos);
+    return CraneErr::kExceedQosLimit;
+  }
+
   // Add the task to the pending task queue.
   task->SetStatus(crane::grpc::Pending);
 
@@ -413,6 +481,7 @@ CraneErr TaskScheduler::SubmitTask(std::unique_ptr<TaskInCtld> task,
   ok = g_embedded_db_client->AppendTaskToPendingAndAdvanceTaskIds(task.get());
   if (!ok) {
     CRANE_ERROR("Failed to append the task to embedded db queue.");
+    g_qos_limiter->RemoveJob(*task, false);
     return CraneErr::kSystemErr;
   }
 
@@ -431,7 +500,8 @@ CraneErr TaskScheduler::SubmitTask(std::unique_ptr<TaskInCtld> task,
 
 void TaskScheduler::TaskStatusChangeNoLock_(
     uint32_t task_id, uint32_t craned_index,
-    crane::grpc::TaskStatus new_status) {
+    crane::grpc::TaskStatus new_status,
+    crane::grpc::TaskResourceUsage const& usage) {
   auto iter = m_running_task_map_.find(task_id);
   if (iter == m_running_task_map_.end()) {
     CRANE_WARN("Ignoring unknown task id {} in TaskStatusChange.", task_id);
@@ -456,10 +526,14 @@ void TaskScheduler::TaskStatusChangeNoLock_(
   }
 
   task->SetEndTime(absl::Now());
+  task->SetResourceUsage(usage);
 
   g_embedded_db_client->UpdatePersistedPartOfTask(task->TaskDbId(),
                                                   task->PersistedPart());
 
+  ChargeUsageOfTask_(task.get());
+  g_qos_limiter->RemoveJob(*task, true);
+
   for (auto&& task_node_index : task->NodeIndexes()) {
     CranedId task_node_id{task->PartitionId(), task_node_index};
     g_meta_container->FreeResourceFromNode(task_node_id, task_id);
@@ -535,6 +609,8 @@ CraneErr TaskScheduler::CancelPendingOrRunningTask(uint32_t operator_uid,
     g_embedded_db_client->UpdatePersistedPartOfTask(task->TaskDbId(),
                                                     task->PersistedPart());
 
+    g_qos_limiter->RemoveJob(*task, false);
+
     TransferTaskToMongodb_(task.get());
 
     return CraneErr::kOk;
@@ -553,6 +629,7 @@ CraneErr TaskScheduler::CancelPendingOrRunningTask(uint32_t operator_uid,
 
 void TaskScheduler::QueryTasksInPartition(
     std::optional<std::string> const& partition_opt,
+    google::protobuf::FieldMask const* task_meta_mask,
     crane::grpc::QueryJobsInPartitionReply* response) {
   auto* task_list = response->mutable_task_metas();
   auto* state_list = response->mutable_task_status();
@@ -567,7 +644,7 @@ void TaskScheduler::QueryTasksInPartition(
     std::unique_ptr<TaskInCtld>& task = it.second;
 
     auto* task_it = task_list->Add();
-    task_it->CopyFrom(task->TaskToCtld());
+    task->CopyTaskToCtldTo(task_meta_mask, task_it);
 
     auto* state_it = state_list->Add();
     *state_it = task->Status();
@@ -604,7 +681,9 @@ void MinLoadFirst::CalculateNodeSelectionInfo_(
   NodeSelectionInfo& node_selection_info_ref = *node_selection_info;
 
   node_selection_info_ref.task_num_node_id_map.emplace(
-      node_meta.running_task_resource_map.size(), node_id);
+      NodeSelectionInfo::LoadKey{node_meta.running_task_resource_map.size(),
+                                 node_meta.load.load_average},
+      node_id);
 
   // Sort all running task in this node by ending time.
   std::vector<std::pair<absl::Time, uint32_t>> end_time_task_id_vec;
@@ -963,6 +1042,13 @@ void MinLoadFirst::NodeSelect(
     uint32_t part_id = pending_task_it->second->PartitionId();
     auto& task = pending_task_it->second;
 
+    // Skip the tasks whose users have reached the running limits of their
+    // qos. No resource is reserved for them.
+    if (!g_qos_limiter->CheckRunningLimits(*task)) {
+      ++pending_task_it;
+      continue;
+    }
+
     NodeSelectionInfo& node_info = part_id_node_info_map[part_id];
     auto& part_meta = all_partitions_meta_map.at(part_id);
 
@@ -984,9 +1070,11 @@ void MinLoadFirst::NodeSelect(
       for (auto it = node_info.task_num_node_id_map.begin();
            it != node_info.task_num_node_id_map.end(); ++it) {
         if (it->second == node_id) {
-          uint32_t num_task = it->first + 1;
+          NodeSelectionInfo::LoadKey key{it->first.first + 1,
+                                         it->first.second};
           node_info.task_num_node_id_map.erase(it);
-          node_info.task_num_node_id_map.emplace(num_task, node_id);
+          node_info.task_num_node_id_map.emplace(key, node_id);
+          break;
         }
       }
 
@@ -1141,7 +1229,9 @@ void MinLoadFirst::NodeSelect(
       // #endif
     }
 
-    if (expected_start_time == now) {
+    // Only the scheduling thread adds running jobs, so TryAddRunningJob()
+    // always succeeds after CheckRunningLimits() above.
+    if (expected_start_time == now && g_qos_limiter->TryAddRunningJob(*task)) {
       // The task can be started now.
       task->SetStartTime(expected_start_time);
 
@@ -1165,6 +1255,21 @@ void MinLoadFirst::NodeSelect(
   }
 }
 
+void TaskScheduler::ChargeUsageOfTask_(TaskInCtld* task) {
+  absl::Duration elapsed = task->EndTime() - task->StartTime();
+  if (!g_fair_share_manager || elapsed <= absl::ZeroDuration()) return;
+
+  double cpu_seconds = task->resources.allocatable_resource.cpu_count *
+                       task->NodeIndexes().size() *
+                       absl::ToDoubleSeconds(elapsed);
+
+  passwd* pwd = getpwuid(task->uid);
+  std::string user = pwd ? pwd->pw_name : std::to_string(task->uid);
+
+  g_fair_share_manager->AddUsage(user, task->Account(), cpu_seconds,
+                                 task->EndTime());
+}
+
 void TaskScheduler::TransferTaskToMongodb_(TaskInCtld* task) {
   bool ok;
   ok = g_embedded_db_client->MovePendingOrRunningTaskToEnded(task->TaskDbId());
@@ -81,8 +81,11 @@ class MinLoadFirst : public INodeSelectionAlgo {
   using ValidTimeSegmentsVec = std::vector<TimeSegment>;
 
   struct NodeSelectionInfo {
-    std::multimap<uint32_t /* # of running tasks */, uint32_t /* node index */>
-        task_num_node_id_map;
+    // Nodes with the same number of running tasks are ordered by the load
+    // reported by their heartbeats.
+    using LoadKey =
+        std::pair<uint32_t /* # of running tasks */, double /* load average */>;
+    std::multimap<LoadKey, uint32_t /* node index */> task_num_node_id_map;
     std::unordered_map<uint32_t /* Node Index*/, TimeAvailResMap>
         node_time_avail_res_map;
   };
@@ -141,17 +144,21 @@ class TaskScheduler {
 
   void TaskStatusChange(uint32_t task_id, uint32_t craned_index,
                         crane::grpc::TaskStatus new_status,
-                        std::optional<std::string> reason) {
+                        std::optional<std::string> reason,
+                        crane::grpc::TaskResourceUsage const& usage = {}) {
     // The order of LockGuards matters.
     LockGuard running_guard(&m_running_task_map_mtx_);
     LockGuard indexes_guard(&m_task_indexes_mtx_);
-    TaskStatusChangeNoLock_(task_id, craned_index, new_status);
+    TaskStatusChangeNoLock_(task_id, craned_index, new_status, usage);
   }
 
   void TerminateTasksOnCraned(CranedId craned_id);
 
   // Temporary inconsistency may happen. If 'false' is returned, just ignore it.
+  // If task_meta_mask is not nullptr, only the selected fields of TaskToCtld
+  // are copied into the reply.
   void QueryTasksInPartition(std::optional<std::string> const& partition_opt,
+                             google::protobuf::FieldMask const* task_meta_mask,
                              crane::grpc::QueryJobsInPartitionReply* response);
 
   bool QueryCranedIdOfRunningTask(uint32_t task_id, CranedId* craned_id) {
@@ -169,8 +176,16 @@ class TaskScheduler {
  private:
   void ScheduleThread_();
 
-  void TaskStatusChangeNoLock_(uint32_t task_id, uint32_t craned_index,
-                               crane::grpc::TaskStatus new_status);
+  void TaskStatusChangeNoLock_(
+      uint32_t task_id, uint32_t craned_index,
+      crane::grpc::TaskStatus new_status,
+      crane::grpc::TaskResourceUsage const& usage = {});
+
+  /**
+   * Add the CPU-seconds consumed by an ended task to the usage of its user
+   * and account.
+   */
+  static void ChargeUsageOfTask_(TaskInCtld* task);
 
   CraneErr TryRequeueRecoveredTaskIntoPendingQueueLock_(
       std::unique_ptr<TaskInCtld> task);
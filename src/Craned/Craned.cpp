@@ -13,6 +13,7 @@
 #include "CranedPublicDefs.h"
 #include "CranedServer.h"
 #include "CtldClient.h"
+#include "ProcessSpawner.h"
 #include "crane/FdFunctions.h"
 #include "crane/Network.h"
 #include "crane/PublicHeader.h"
@@ -107,6 +108,66 @@ void ParseConfig(int argc, char** argv) {
       else
         g_config.CraneCtldListenPort = kCtldDefaultPort;
 
+      if (config["CranedHeartbeatIntervalSec"]) {
+        uint32_t heartbeat_interval_sec =
+            config["CranedHeartbeatIntervalSec"].as<uint32_t>();
+        if (heartbeat_interval_sec == 0) {
+          CRANE_ERROR("CranedHeartbeatIntervalSec must be positive.");
+          std::exit(1);
+        }
+        g_config.CranedHeartbeatInterval =
+            absl::Seconds(heartbeat_interval_sec);
+      } else
+        g_config.CranedHeartbeatInterval = absl::Seconds(10);
+
+      if (config["CranedCgroupSampleIntervalSec"])
+        g_config.CgroupSampleInterval = absl::Seconds(
+            config["CranedCgroupSampleIntervalSec"].as<uint32_t>());
+      else
+        g_config.CgroupSampleInterval = absl::Seconds(30);
+
+      if (config["CranedCgroupPoolSize"])
+        g_config.CgroupPoolSize = config["CranedCgroupPoolSize"].as<uint32_t>();
+      else
+        g_config.CgroupPoolSize = 16;
+
+      if (config["CranedOutputCapture"])
+        g_config.Output.Capture = config["CranedOutputCapture"].as<bool>();
+
+      if (config["CranedOutputBufferKB"])
+        g_config.Output.BufferBytes =
+            config["CranedOutputBufferKB"].as<size_t>() * 1024;
+      else
+        g_config.Output.BufferBytes = 1024 * 1024;
+
+      if (config["CranedOutputFlushIntervalSec"])
+        g_config.Output.FlushInterval = absl::Seconds(
+            config["CranedOutputFlushIntervalSec"].as<uint32_t>());
+      else
+        g_config.Output.FlushInterval = absl::Seconds(5);
+
+      if (config["CranedOutputRateLimitKBps"])
+        g_config.Output.RateLimitBytesPerSec =
+            config["CranedOutputRateLimitKBps"].as<size_t>() * 1024;
+      else
+        g_config.Output.RateLimitBytesPerSec = 0;
+
+      if (config["CranedOutputStagingDir"])
+        g_config.Output.StagingDir =
+            config["CranedOutputStagingDir"].as<std::string>();
+
+      if (config["CranedOutputStagingFlushMB"])
+        g_config.Output.StagingFlushBytes =
+            config["CranedOutputStagingFlushMB"].as<uint64_t>() * 1024 * 1024;
+      else
+        g_config.Output.StagingFlushBytes = 64 * 1024 * 1024;
+
+      if (config["CranedOutputTailBufferKB"])
+        g_config.Output.TailBufferBytes =
+            config["CranedOutputTailBufferKB"].as<size_t>() * 1024;
+      else
+        g_config.Output.TailBufferBytes = 64 * 1024;
+
       if (config["CranedDebugLevel"])
         g_config.CranedDebugLevel =
             config["CranedDebugLevel"].as<std::string>();
@@ -395,10 +456,25 @@ void CreateRequiredDirectories() {
     CRANE_ERROR("Invalid CranedLogFile path {}: {}", g_config.CranedLogFile,
                 e.what());
   }
+
+  if (!g_config.Output.StagingDir.empty()) {
+    try {
+      std::filesystem::create_directories(g_config.Output.StagingDir);
+    } catch (const std::exception& e) {
+      CRANE_ERROR("Invalid CranedOutputStagingDir {}: {}",
+                  g_config.Output.StagingDir, e.what());
+    }
+  }
 }
 
 void GlobalVariableInit() {
   CreateRequiredDirectories();
+
+  // The spawner must be forked while Craned is still single-threaded, i.e.,
+  // before spdlog starts its threads.
+  g_process_spawner = Craned::ProcessSpawner::Create();
+  if (!g_process_spawner) std::exit(1);
+
   InitSpdlog();
 
   // Enable inter-thread custom event notification.
@@ -407,6 +483,9 @@ void GlobalVariableInit() {
   Craned::g_thread_pool = std::make_unique<BS::thread_pool>(
       std::thread::hardware_concurrency() / 2);
 
+  util::CgroupManager::Instance().InitCgroupPool("Crane_Pool_",
+                                                 g_config.CgroupPoolSize);
+
   g_task_mgr = std::make_unique<Craned::TaskManager>();
 
   g_ctld_client = std::make_unique<Craned::CtldClient>();
@@ -415,6 +494,7 @@ void GlobalVariableInit() {
   std::string ctld_address = fmt::format("{}:{}", g_config.ControlMachine,
                                          g_config.CraneCtldListenPort);
   g_ctld_client->InitChannelAndStub(ctld_address);
+  g_ctld_client->StartHeartbeat(g_config.CranedHeartbeatInterval);
 }
 
 void StartServer() {
@@ -428,9 +508,12 @@ void StartServer() {
   g_server->Wait();
 
   // Free global variables
+  g_ctld_client->StopHeartbeat();
   g_task_mgr.reset();
+  util::CgroupManager::Instance().DestroyCgroupPool();
   g_server.reset();
   g_ctld_client.reset();
+  g_process_spawner.reset();
 
   std::exit(0);
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <absl/time/time.h>
 #include <pwd.h>
 
 #include <BS_thread_pool.hpp>
@@ -15,6 +16,7 @@ struct TaskStatusChange {
   task_id_t task_id{};
   crane::grpc::TaskStatus new_status{};
   std::optional<std::string> reason;
+  util::CgroupUsage usage;
 };
 
 class PasswordEntry {
@@ -68,6 +70,12 @@ struct TaskInfoOfUid {
   std::string cgroup_path;
 };
 
+struct TaskOutputInfo {
+  std::string path;
+  uid_t uid;
+  gid_t gid;
+};
+
 struct Node {
   uint32_t cpu;
   uint64_t memory_bytes;
@@ -103,6 +111,33 @@ struct Config {
 
   bool CranedForeground{};
 
+  absl::Duration CranedHeartbeatInterval;
+
+  // Zero disables the periodic sampling. The usage of a task is still read
+  // once when it ends.
+  absl::Duration CgroupSampleInterval;
+
+  // The number of cgroups created ahead of time and handed out to new tasks.
+  // Zero disables the pool.
+  uint32_t CgroupPoolSize;
+
+  // The output of batch tasks is collected by Craned and written to the
+  // output files in large chunks. See OutputManager.
+  struct OutputConf {
+    bool Capture{false};
+    size_t BufferBytes;
+    absl::Duration FlushInterval;
+    // 0 means unlimited.
+    size_t RateLimitBytesPerSec;
+    // Empty disables staging on the local disk.
+    std::string StagingDir;
+    uint64_t StagingFlushBytes;
+    // The latest output kept in memory for TailTaskOutput.
+    size_t TailBufferBytes;
+  };
+
+  OutputConf Output;
+
   std::string Hostname;
   CranedId NodeId;
 
@@ -1,7 +1,13 @@
 #include "CranedServer.h"
 
+#include <absl/strings/numbers.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <grpcpp/server_posix.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include <yaml-cpp/yaml.h>
 
 #include <boost/algorithm/string/join.hpp>
@@ -15,299 +21,369 @@ namespace Craned {
 
 using boost::uuids::uuid;
 
-Status CranedServiceImpl::SrunXStream(
-    ServerContext *context,
-    ServerReaderWriter<SrunXStreamReply, SrunXStreamRequest> *stream) {
+SrunXStreamReactor *SrunXStreamReactor::Create(
+    grpc::CallbackServerContext *context) {
+  std::shared_ptr<SrunXStreamReactor> reactor(new SrunXStreamReactor(context));
+
+  util::lock_guard guard(reactor->m_mtx_);
+  reactor->m_self_ = reactor;
+  return reactor.get();
+}
+
+SrunXStreamReactor::SrunXStreamReactor(grpc::CallbackServerContext *context)
+    : m_context_(context), m_output_(evbuffer_new()) {
   CRANE_DEBUG("SrunX connects from {}", context->peer());
+  StartRead(&m_request_);
+}
 
-  enum class StreamState {
-    kNegotiation = 0,
-    kCheckResource,
-    kExecutiveInfo,
-    kWaitForEofOrSigOrTaskEnd,
-    kFinish,
-    kAbort
-  };
+SrunXStreamReactor::~SrunXStreamReactor() { evbuffer_free(m_output_); }
 
-  CraneErr err;
-  bool ok;
-  SrunXStreamRequest request;
-  SrunXStreamReply reply;
+void SrunXStreamReactor::OnReadDone(bool ok) {
+  StreamState state;
+  if (ok) {
+    state = HandleRequest_(m_state_);
+  } else if (m_state_ == StreamState::kWaitForEofOrSigOrTaskEnd) {
+    // If the task ends, the callback which handles the end of a task in
+    // TaskManager will send the task end message to client. The client
+    // will call stream->WritesDone() to end the stream. Then the read fails.
+    state = StreamState::kFinish;
 
-  // gRPC doesn't support parallel Write() on the same stream.
-  // Use mutex to guarantee serial Write() in SrunXStream.
-  std::mutex stream_w_mtx;
+    util::lock_guard guard(m_mtx_);
+    DiscardOutputNoLock_();
+  } else {
+    CRANE_DEBUG("Connection error when trying reading request from peer {}",
+                m_context_->peer());
+    state = StreamState::kAbort;
+  }
 
-  // A task id is bound to one connection.
-  uint32_t task_id;
-  // A resource uuid is bound to one task.
-  uuid resource_uuid;
+  Transit_(state);
+}
 
-  StreamState state = StreamState::kNegotiation;
-  while (true) {
-    switch (state) {
-      case StreamState::kNegotiation:
-        ok = stream->Read(&request);
-        if (ok) {
-          if (request.type() != SrunXStreamRequest::NegotiationType) {
-            CRANE_DEBUG("Expect negotiation from peer {}, but none.",
-                        context->peer());
-            state = StreamState::kAbort;
-          } else {
-            CRANE_DEBUG("Negotiation from peer: {}", context->peer());
-            reply.Clear();
-            reply.set_type(SrunXStreamReply::ResultType);
-            reply.mutable_result()->set_ok(true);
+void SrunXStreamReactor::Transit_(StreamState state) {
+  m_state_ = state;
 
-            stream_w_mtx.lock();
-            stream->Write(reply);
-            stream_w_mtx.unlock();
+  switch (state) {
+    case StreamState::kFinish:
+      CRANE_TRACE("Connection from peer {} finished normally",
+                  m_context_->peer());
 
-            state = StreamState::kCheckResource;
-          }
-        } else {
-          CRANE_DEBUG(
-              "Connection error when trying reading negotiation from peer {}",
-              context->peer());
-          state = StreamState::kAbort;
-        }
-        break;
+      // Invalidate resource uuid and free the resource in use.
+      g_server->RevokeResourceToken(m_resource_uuid_);
+      Finish_(Status::OK);
+      break;
 
-      case StreamState::kCheckResource:
-        ok = stream->Read(&request);
-        if (ok) {
-          if (request.type() != SrunXStreamRequest::CheckResourceType) {
-            CRANE_DEBUG("Expect CheckResource from peer {}, but got {}.",
-                        context->peer(), request.GetTypeName());
-            state = StreamState::kAbort;
-          } else {
-            std::copy(request.check_resource().resource_uuid().begin(),
-                      request.check_resource().resource_uuid().end(),
-                      resource_uuid.data);
-
-            task_id = request.check_resource().task_id();
-            // Check the validity of resource uuid provided by client.
-            err = g_server->CheckValidityOfResourceUuid(resource_uuid, task_id);
-            if (err != CraneErr::kOk) {
-              // The resource uuid provided by Client is invalid. Reject.
-              reply.Clear();
-              reply.set_type(SrunXStreamReply::ResultType);
-
-              auto *result = reply.mutable_result();
-              result->set_ok(false);
-              result->set_reason(
-                  fmt::format("Resource uuid invalid: {}",
-                              (err == CraneErr::kNonExistent
-                                   ? "Not Existent"
-                                   : "It doesn't match with task_id")));
-
-              stream_w_mtx.lock();
-              stream->Write(reply, grpc::WriteOptions());
-              stream_w_mtx.unlock();
-
-              state = StreamState::kFinish;
-            } else {
-              reply.Clear();
-              reply.set_type(SrunXStreamReply::ResultType);
-              reply.mutable_result()->set_ok(true);
-
-              stream_w_mtx.lock();
-              stream->Write(reply);
-              stream_w_mtx.unlock();
-
-              state = StreamState::kExecutiveInfo;
-            }
-          }
-        } else {
-          CRANE_DEBUG(
-              "Connection error when trying reading negotiation from peer {}",
-              context->peer());
-          state = StreamState::kAbort;
-        }
+    case StreamState::kAbort: {
+      CRANE_DEBUG("Connection from peer {} aborted.", m_context_->peer());
 
-        break;
-      case StreamState::kExecutiveInfo:
-        ok = stream->Read(&request);
-        if (ok) {
-          if (request.type() != SrunXStreamRequest::ExecutiveInfoType) {
-            CRANE_DEBUG("Expect CheckResource from peer {}, but got {}.",
-                        context->peer(), request.GetTypeName());
-            state = StreamState::kAbort;
-          } else {
-            std::forward_list<std::string> arguments;
-            auto iter = arguments.before_begin();
-            for (const auto &arg : request.exec_info().arguments()) {
-              iter = arguments.emplace_after(iter, arg);
-            }
-
-            // We have checked the validity of resource uuid. Now execute it.
-
-            // It's safe to call stream->Write() on a closed stream.
-            // (stream->Write() just return false rather than throwing an
-            // exception).
-            auto output_callback = [stream, &write_mtx = stream_w_mtx](
-                                       std::string &&buf, void *user_data) {
-              CRANE_TRACE("Output Callback called. buf: {}", buf);
-              crane::grpc::SrunXStreamReply reply;
-              reply.set_type(SrunXStreamReply::IoRedirectionType);
-
-              std::string *reply_buf = reply.mutable_io()->mutable_buf();
-              *reply_buf = std::move(buf);
-
-              write_mtx.lock();
-              stream->Write(reply);
-              write_mtx.unlock();
-
-              CRANE_TRACE("stream->Write() done.");
-            };
-
-            // Call stream->Write() and cause the grpc thread
-            // that owns 'stream' to stop the connection handling and quit.
-            auto finish_callback =
-                [stream, &write_mtx = stream_w_mtx /*, context*/](
-                    bool is_terminated_by_signal, int value, void *user_data) {
-                  CRANE_TRACE("Finish Callback called. signaled: {}, value: {}",
-                              is_terminated_by_signal, value);
-                  crane::grpc::SrunXStreamReply reply;
-                  reply.set_type(SrunXStreamReply::ExitStatusType);
-
-                  crane::grpc::StreamReplyExitStatus *stat =
-                      reply.mutable_exit_status();
-                  stat->set_reason(
-                      is_terminated_by_signal
-                          ? crane::grpc::StreamReplyExitStatus::Signal
-                          : crane::grpc::StreamReplyExitStatus::Normal);
-                  stat->set_value(value);
-
-                  // stream->WriteLast() shall not be used here.
-                  // On the server side, WriteLast cause all the Write() to be
-                  // blocked until the service handler returned.
-                  // WriteLast() should actually be called on the client side.
-                  write_mtx.lock();
-                  stream->Write(reply, grpc::WriteOptions());
-                  write_mtx.unlock();
-
-                  // If this line is appended, when SrunX has no response to
-                  // WriteLast, the connection can stop anyway. Otherwise, the
-                  // connection will stop (i.e. stream->Read() returns false)
-                  // only if 1. SrunX calls stream->WriteLast() or 2. the
-                  // underlying channel is broken. However, the 2 situations
-                  // cover all situations that we can meet, so the following
-                  // line should not be added except when debugging.
-                  //
-                  // context->TryCancel();
-                };
-
-            std::list<std::string> args;
-            for (auto &&arg : request.exec_info().arguments())
-              args.push_back(arg);
-
-            err = g_task_mgr->SpawnInteractiveTaskAsync(
-                task_id, request.exec_info().executive_path(), std::move(args),
-                std::move(output_callback), std::move(finish_callback));
-            if (err == CraneErr::kOk) {
-              reply.Clear();
-              reply.set_type(SrunXStreamReply::ResultType);
-
-              auto *result = reply.mutable_result();
-              result->set_ok(true);
-
-              stream_w_mtx.lock();
-              stream->Write(reply);
-              stream_w_mtx.unlock();
-
-              state = StreamState::kWaitForEofOrSigOrTaskEnd;
-            } else {
-              reply.Clear();
-              reply.set_type(SrunXStreamReply::ResultType);
-
-              auto *result = reply.mutable_result();
-              result->set_ok(false);
-
-              if (err == CraneErr::kSystemErr)
-                result->set_reason(
-                    fmt::format("System error: {}", strerror(errno)));
-              else if (err == CraneErr::kStop)
-                result->set_reason("Server is stopping");
-              else
-                result->set_reason(fmt::format("Unknown failure. Code: . ",
-                                               uint16_t(err),
-                                               CraneErrStr(err)));
-
-              stream_w_mtx.lock();
-              stream->Write(reply);
-              stream_w_mtx.unlock();
-
-              state = StreamState::kFinish;
-            }
-          }
-        } else {
-          CRANE_DEBUG(
-              "Connection error when trying reading negotiation from peer {}",
-              context->peer());
-          state = StreamState::kAbort;
-        }
-        break;
+      // Invalidate resource uuid and free the resource in use.
+      g_server->RevokeResourceToken(m_resource_uuid_);
+      {
+        util::lock_guard guard(m_mtx_);
+        DiscardOutputNoLock_();
+      }
+      Finish_(Status::CANCELLED);
+      break;
+    }
 
-      case StreamState::kWaitForEofOrSigOrTaskEnd: {
-        ok = stream->Read(&request);
-        if (ok) {
-          if (request.type() != SrunXStreamRequest::SignalType) {
-            CRANE_DEBUG("Expect signal from peer {}, but none.",
-                        context->peer());
-            state = StreamState::kAbort;
-          } else {
-            // If ctrl+C is pressed before the task ends, inform TaskManager
-            // of the interrupt and wait for TaskManager to stop the Task.
+    case StreamState::kSpawning:
+      break;
 
-            CRANE_TRACE("Receive signum {} from client. Killing task {}",
-                        request.signum(), task_id);
+    default:
+      StartRead(&m_request_);
+  }
+}
 
-            // Todo: Sometimes, TaskManager can't kill a task, there're some
-            //  problems here.
+void SrunXStreamReactor::OnWriteDone(bool ok) {
+  {
+    util::lock_guard guard(m_mtx_);
+    m_writing_ = false;
+
+    // Nothing can be sent on a broken stream. The read fails then as well.
+    if (!ok) {
+      CRANE_DEBUG("Failed to write to peer {}. Dropping the output.",
+                  m_context_->peer());
+      DiscardOutputNoLock_();
+    }
+  }
 
-            g_task_mgr->TerminateTaskAsync(task_id);
+  WriteNext_();
+}
 
-            // The state machine does not switch the state here.
-            // We just use stream->Read() to wait for the task to end.
-            // When the task ends, the finish_callback will shut down the
-            // stream and cause stream->Read() to return with false.
-          }
-        } else {
-          // If the task ends, the callback which handles the end of a task in
-          // TaskManager will send the task end message to client. The client
-          // will call stream->Write() to end the stream. Then the
-          // stream->Read() returns with ok = false.
+void SrunXStreamReactor::OnDone() {
+  // The callbacks in TaskManager may keep the reactor alive until the process
+  // exits. They drop the output from then on.
+  std::shared_ptr<SrunXStreamReactor> self;
+  {
+    util::lock_guard guard(m_mtx_);
+    DiscardOutputNoLock_();
+    self = std::move(m_self_);
+  }
+}
 
-          state = StreamState::kFinish;
-        }
-        break;
+SrunXStreamReactor::StreamState SrunXStreamReactor::HandleRequest_(
+    StreamState state) {
+  switch (state) {
+    case StreamState::kNegotiation:
+      if (m_request_.type() != SrunXStreamRequest::NegotiationType) {
+        CRANE_DEBUG("Expect negotiation from peer {}, but none.",
+                    m_context_->peer());
+        return StreamState::kAbort;
       }
 
-      case StreamState::kAbort: {
-        CRANE_DEBUG("Connection from peer {} aborted.", context->peer());
+      CRANE_DEBUG("Negotiation from peer: {}", m_context_->peer());
+      WriteReply_(ResultReply_(true));
+      return StreamState::kCheckResource;
 
-        // Invalidate resource uuid and free the resource in use.
-        g_server->RevokeResourceToken(resource_uuid);
+    case StreamState::kCheckResource: {
+      if (m_request_.type() != SrunXStreamRequest::CheckResourceType) {
+        CRANE_DEBUG("Expect CheckResource from peer {}, but got {}.",
+                    m_context_->peer(), m_request_.GetTypeName());
+        return StreamState::kAbort;
+      }
 
-        return Status::CANCELLED;
+      std::copy(m_request_.check_resource().resource_uuid().begin(),
+                m_request_.check_resource().resource_uuid().end(),
+                m_resource_uuid_.data);
+
+      m_task_id_ = m_request_.check_resource().task_id();
+      // Check the validity of resource uuid provided by client.
+      CraneErr err =
+          g_server->CheckValidityOfResourceUuid(m_resource_uuid_, m_task_id_);
+      if (err != CraneErr::kOk) {
+        // The resource uuid provided by Client is invalid. Reject.
+        WriteReply_(ResultReply_(
+            false, fmt::format("Resource uuid invalid: {}",
+                               (err == CraneErr::kNonExistent
+                                    ? "Not Existent"
+                                    : "It doesn't match with task_id"))));
+        return StreamState::kFinish;
       }
 
-      case StreamState::kFinish: {
-        CRANE_TRACE("Connection from peer {} finished normally",
-                    context->peer());
+      WriteReply_(ResultReply_(true));
+      return StreamState::kExecutiveInfo;
+    }
+
+    case StreamState::kExecutiveInfo:
+      if (m_request_.type() != SrunXStreamRequest::ExecutiveInfoType) {
+        CRANE_DEBUG("Expect ExecutiveInfo from peer {}, but got {}.",
+                    m_context_->peer(), m_request_.GetTypeName());
+        return StreamState::kAbort;
+      }
 
-        // Invalidate resource uuid and free the resource in use.
-        g_server->RevokeResourceToken(resource_uuid);
+      // We have checked the validity of resource uuid. Now execute it.
+      SpawnTask_();
+      return StreamState::kSpawning;
 
-        return Status::OK;
+    case StreamState::kWaitForEofOrSigOrTaskEnd:
+      if (m_request_.type() != SrunXStreamRequest::SignalType) {
+        CRANE_DEBUG("Expect signal from peer {}, but none.",
+                    m_context_->peer());
+        return StreamState::kAbort;
       }
 
-      default:
-        CRANE_ERROR("Unexpected CranedServer State: {}", uint(state));
-        return Status::CANCELLED;
+      // If ctrl+C is pressed before the task ends, inform TaskManager
+      // of the interrupt and wait for TaskManager to stop the Task.
+      CRANE_TRACE("Receive signum {} from client. Killing task {}",
+                  m_request_.signum(), m_task_id_);
+
+      // Todo: Sometimes, TaskManager can't kill a task, there're some
+      //  problems here.
+      g_task_mgr->TerminateTaskAsync(m_task_id_);
+
+      // The state machine does not switch the state here. When the task
+      // ends, the exit status is sent and the client closes the stream.
+      return StreamState::kWaitForEofOrSigOrTaskEnd;
+
+    default:
+      CRANE_ERROR("Unexpected CranedServer State: {}", uint(state));
+      return StreamState::kAbort;
+  }
+}
+
+void SrunXStreamReactor::SpawnTask_() {
+  std::shared_ptr<SrunXStreamReactor> self = shared_from_this();
+  auto output_callback = [self](struct evbuffer *buf, pid_t pid) {
+    return self->OnOutput_(buf, pid);
+  };
+  auto finish_callback = [self](bool is_terminated_by_signal, int value,
+                                void *user_data) {
+    self->OnTaskFinish_(is_terminated_by_signal, value);
+  };
+
+  std::list<std::string> args;
+  for (auto &&arg : m_request_.exec_info().arguments()) args.push_back(arg);
+
+  g_task_mgr->SpawnInteractiveTaskAsync(
+      m_task_id_, m_request_.exec_info().executive_path(), std::move(args),
+      std::move(output_callback), std::move(finish_callback),
+      [self](CraneErr err) { self->OnSpawned_(err); });
+}
+
+void SrunXStreamReactor::OnSpawned_(CraneErr err) {
+  if (err == CraneErr::kOk) {
+    {
+      util::lock_guard guard(m_mtx_);
+      m_replies_.emplace_back(ResultReply_(true));
+      m_output_allowed_ = true;
+    }
+    WriteNext_();
+    Transit_(StreamState::kWaitForEofOrSigOrTaskEnd);
+    return;
+  }
+
+  std::string reason;
+  if (err == CraneErr::kSystemErr)
+    reason = fmt::format("System error: {}", strerror(errno));
+  else if (err == CraneErr::kStop)
+    reason = "Server is stopping";
+  else
+    reason = fmt::format("Unknown failure. Code: {}. {}", uint16_t(err),
+                         CraneErrStr(err));
+
+  WriteReply_(ResultReply_(false, std::move(reason)));
+  Transit_(StreamState::kFinish);
+}
+
+bool SrunXStreamReactor::OnOutput_(struct evbuffer *buf, pid_t pid) {
+  bool keep_reading;
+  {
+    util::lock_guard guard(m_mtx_);
+    if (m_broken_) {
+      evbuffer_drain(buf, evbuffer_get_length(buf));
+      return true;
     }
+
+    m_pid_ = pid;
+    evbuffer_add_buffer(m_output_, buf);
+
+    keep_reading = evbuffer_get_length(m_output_) < kOutputHighWatermark;
+    if (!keep_reading) m_output_paused_ = true;
   }
+
+  WriteNext_();
+  return keep_reading;
+}
+
+void SrunXStreamReactor::OnTaskFinish_(bool is_terminated_by_signal,
+                                       int value) {
+  CRANE_TRACE("Finish Callback called. signaled: {}, value: {}",
+              is_terminated_by_signal, value);
+
+  SrunXStreamReply reply;
+  reply.set_type(SrunXStreamReply::ExitStatusType);
+
+  crane::grpc::StreamReplyExitStatus *stat = reply.mutable_exit_status();
+  stat->set_reason(is_terminated_by_signal
+                       ? crane::grpc::StreamReplyExitStatus::Signal
+                       : crane::grpc::StreamReplyExitStatus::Normal);
+  stat->set_value(value);
+
+  {
+    util::lock_guard guard(m_mtx_);
+    if (m_broken_) return;
+    m_exit_status_ = std::move(reply);
+  }
+
+  // The stream is not finished here. The client closes the stream after
+  // receiving the exit status, and then the read fails.
+  WriteNext_();
+}
+
+SrunXStreamReply SrunXStreamReactor::ResultReply_(bool ok,
+                                                  std::string reason) {
+  SrunXStreamReply reply;
+  reply.set_type(SrunXStreamReply::ResultType);
+
+  auto *result = reply.mutable_result();
+  result->set_ok(ok);
+  if (!reason.empty()) result->set_reason(std::move(reason));
+
+  return reply;
+}
+
+void SrunXStreamReactor::WriteReply_(SrunXStreamReply &&reply) {
+  {
+    util::lock_guard guard(m_mtx_);
+    if (m_broken_) return;
+    m_replies_.emplace_back(std::move(reply));
+  }
+
+  WriteNext_();
+}
+
+void SrunXStreamReactor::Finish_(Status status) {
+  {
+    util::lock_guard guard(m_mtx_);
+    m_finish_status_ = std::move(status);
+  }
+
+  WriteNext_();
+}
+
+void SrunXStreamReactor::WriteNext_() {
+  bool finish = false;
+  Status finish_status;
+  {
+    util::lock_guard guard(m_mtx_);
+    if (m_writing_ || m_finished_) return;
+
+    if (m_broken_) {
+      // Only waiting for the finish.
+    } else if (!m_replies_.empty()) {
+      m_write_reply_ = std::move(m_replies_.front());
+      m_replies_.pop_front();
+      m_writing_ = true;
+    } else if (m_output_allowed_ && evbuffer_get_length(m_output_) > 0) {
+      // All the output arrived since the last write goes in one frame.
+      size_t len = std::min(evbuffer_get_length(m_output_), kMaxFrameBytes);
+
+      m_write_reply_.Clear();
+      m_write_reply_.set_type(SrunXStreamReply::IoRedirectionType);
+      std::string *frame = m_write_reply_.mutable_io()->mutable_buf();
+      frame->resize(len);
+      evbuffer_remove(m_output_, frame->data(), len);
+      m_writing_ = true;
+
+      if (m_output_paused_ &&
+          evbuffer_get_length(m_output_) <= kOutputLowWatermark) {
+        m_output_paused_ = false;
+        g_task_mgr->ResumeProcessOutputAsync(m_pid_);
+      }
+    } else if (m_exit_status_.has_value()) {
+      m_write_reply_ = std::move(m_exit_status_.value());
+      m_exit_status_.reset();
+      m_writing_ = true;
+    }
+
+    if (!m_writing_) {
+      if (!m_finish_status_.has_value()) return;
+      finish_status = std::move(m_finish_status_.value());
+      m_finished_ = true;
+      finish = true;
+    }
+  }
+
+  if (finish)
+    Finish(std::move(finish_status));
+  else
+    StartWrite(&m_write_reply_);
+}
+
+void SrunXStreamReactor::DiscardOutputNoLock_() {
+  m_broken_ = true;
+  m_replies_.clear();
+  m_exit_status_.reset();
+  evbuffer_drain(m_output_, evbuffer_get_length(m_output_));
+
+  if (m_output_paused_) {
+    m_output_paused_ = false;
+    g_task_mgr->ResumeProcessOutputAsync(m_pid_);
+  }
+}
+
+grpc::ServerBidiReactor<SrunXStreamRequest, SrunXStreamReply> *
+CranedServiceImpl::SrunXStream(grpc::CallbackServerContext *context) {
+  return SrunXStreamReactor::Create(context);
 }
 
 void CranedServer::GrantResourceToken(const uuid &resource_uuid,
@@ -329,8 +405,8 @@ CraneErr CranedServer::RevokeResourceToken(const uuid &resource_uuid) {
   return CraneErr::kOk;
 }
 
-grpc::Status CranedServiceImpl::ExecuteTask(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CranedServiceImpl::ExecuteTask(
+    grpc::CallbackServerContext *context,
     const crane::grpc::ExecuteTaskRequest *request,
     crane::grpc::ExecuteTaskReply *response) {
   CRANE_TRACE("Received a task with id {}", request->task().task_id());
@@ -338,37 +414,38 @@ grpc::Status CranedServiceImpl::ExecuteTask(
   g_task_mgr->ExecuteTaskAsync(request->task());
 
   response->set_ok(true);
-  return Status::OK;
+
+  auto *reactor = context->DefaultReactor();
+  reactor->Finish(Status::OK);
+  return reactor;
 }
 
-grpc::Status CranedServiceImpl::TerminateTask(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CranedServiceImpl::TerminateTask(
+    grpc::CallbackServerContext *context,
     const crane::grpc::TerminateTaskRequest *request,
     crane::grpc::TerminateTaskReply *response) {
   g_task_mgr->TerminateTaskAsync(request->task_id());
   response->set_ok(true);
 
-  return Status::OK;
+  auto *reactor = context->DefaultReactor();
+  reactor->Finish(Status::OK);
+  return reactor;
 }
 
-grpc::Status CranedServiceImpl::TerminateOrphanedTask(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CranedServiceImpl::TerminateOrphanedTask(
+    grpc::CallbackServerContext *context,
     const crane::grpc::TerminateOrphanedTaskRequest *request,
     crane::grpc::TerminateOrphanedTaskReply *response) {
   g_task_mgr->MarkTaskAsOrphanedAndTerminateAsync(request->task_id());
   response->set_ok(true);
 
-  return Status::OK;
+  auto *reactor = context->DefaultReactor();
+  reactor->Finish(Status::OK);
+  return reactor;
 }
 
-grpc::Status CranedServiceImpl::QueryTaskIdFromPort(
-    grpc::ServerContext *context,
-    const crane::grpc::QueryTaskIdFromPortRequest *request,
-    crane::grpc::QueryTaskIdFromPortReply *response) {
-  CRANE_TRACE("Receive QueryTaskIdFromPort RPC from {}: port: {}",
-              context->peer(), request->port());
-
-  std::string port_hex = fmt::format("{:0>4X}", request->port());
+std::vector<pid_t> CranedServiceImpl::PidAndAncestorsOfPort_(uint32_t port) {
+  std::string port_hex = fmt::format("{:0>4X}", port);
 
   ino_t inode;
 
@@ -389,17 +466,17 @@ grpc::Status CranedServiceImpl::QueryTaskIdFromPort(
       if (port_hex == tcp_line_vec[2]) {
         inode_found = true;
         inode = std::stoul(tcp_line_vec[13]);
-        CRANE_TRACE("Inode num for port {} is {}", request->port(), inode);
+        CRANE_TRACE("Inode num for port {} is {}", port, inode);
         break;
       }
     }
     if (!inode_found) {
-      CRANE_TRACE("Inode num for port {} is not found.", request->port());
-      response->set_ok(false);
-      return Status::OK;
+      CRANE_TRACE("Inode num for port {} is not found.", port);
+      return {};
     }
   } else {  // can't find file
     CRANE_ERROR("Can't open file: {}", tcp_path);
+    return {};
   }
 
   // 2.find_pid_by_inode
@@ -424,8 +501,8 @@ grpc::Status CranedServiceImpl::QueryTaskIdFromPort(
         }
         if (statbuf.st_ino == inode) {
           pid_i = std::stoi(pid_s);
-          CRANE_TRACE("Pid for the process that owns port {} is {}",
-                      request->port(), pid_i);
+          CRANE_TRACE("Pid for the process that owns port {} is {}", port,
+                      pid_i);
           break;
         }
       }
@@ -435,67 +512,120 @@ grpc::Status CranedServiceImpl::QueryTaskIdFromPort(
     }
   }
   if (pid_i == -1) {
-    CRANE_TRACE("Pid for the process that owns port {} is not found.",
-                request->port());
-    response->set_ok(false);
-    return Status::OK;
+    CRANE_TRACE("Pid for the process that owns port {} is not found.", port);
+    return {};
   }
 
   // 3. pid2jobid
-  do {
-    std::optional<uint32_t> task_id_opt =
-        g_task_mgr->QueryTaskIdFromPidAsync(pid_i);
-    if (task_id_opt.has_value()) {
-      CRANE_TRACE("Task id for pid {} is #{}", pid_i, task_id_opt.value());
-      response->set_ok(true);
-      response->set_task_id(task_id_opt.value());
-      return Status::OK;
+  // The process and its ancestors are looked up in TaskManager at once.
+  // Task processes are descendants of Craned, so the walk stops at Craned
+  // and is capped at kMaxAncestorNum in case /proc changes under us.
+  constexpr size_t kMaxAncestorNum = 64;
+  const pid_t craned_pid = getpid();
+  std::vector<pid_t> pids;
+  while (pid_i > 1 && pid_i != craned_pid && pids.size() < kMaxAncestorNum) {
+    pids.emplace_back(pid_i);
+
+    std::string proc_dir = fmt::format("/proc/{}/status", pid_i);
+    YAML::Node proc_details = YAML::LoadFile(proc_dir);
+    if (proc_details["PPid"]) {
+      pid_i = std::stoi(proc_details["PPid"].as<std::string>());
     } else {
-      std::string proc_dir = fmt::format("/proc/{}/status", pid_i);
-      YAML::Node proc_details = YAML::LoadFile(proc_dir);
-      if (proc_details["PPid"]) {
-        pid_t ppid = std::stoi(proc_details["PPid"].as<std::string>());
-        CRANE_TRACE("Pid {} not found in TaskManager. Checking ppid {}", pid_i,
-                    ppid);
-        pid_i = ppid;
-      } else {
-        CRANE_TRACE(
-            "Pid {} not found in TaskManager. "
-            "However ppid is 1. Break the loop.",
-            pid_i);
-        pid_i = 1;
-      }
+      CRANE_TRACE("Pid {} has no ppid. Break the loop.", pid_i);
+      pid_i = 1;
     }
-  } while (pid_i > 1);
+  }
 
-  response->set_ok(false);
-  return Status::OK;
+  return pids;
 }
 
-grpc::Status CranedServiceImpl::CreateCgroupForTask(
-    grpc::ServerContext *context,
-    const crane::grpc::CreateCgroupForTaskRequest *request,
-    crane::grpc::CreateCgroupForTaskReply *response) {
-  CRANE_TRACE("Receive CreateCgroup for task #{}, uid {}", request->task_id(),
-              request->uid());
-  bool ok = g_task_mgr->CreateCgroupAsync(request->task_id(), request->uid());
-  response->set_ok(ok);
-  return Status::OK;
+grpc::ServerUnaryReactor *CranedServiceImpl::QueryTaskIdFromPort(
+    grpc::CallbackServerContext *context,
+    const crane::grpc::QueryTaskIdFromPortRequest *request,
+    crane::grpc::QueryTaskIdFromPortReply *response) {
+  CRANE_TRACE("Receive QueryTaskIdFromPort RPC from {}: port: {}",
+              context->peer(), request->port());
+
+  auto *reactor = context->DefaultReactor();
+
+  // Scanning /proc takes long, so it is done in the thread pool, which then
+  // asks TaskManager and finishes the RPC.
+  g_thread_pool->push_task([request, response, reactor] {
+    std::vector<pid_t> pids = PidAndAncestorsOfPort_(request->port());
+    if (pids.empty()) {
+      response->set_ok(false);
+      reactor->Finish(Status::OK);
+      return;
+    }
+
+    g_task_mgr->QueryTaskIdFromPidAsync(
+        std::move(pids),
+        [reactor, response](std::optional<uint32_t> task_id_opt) {
+          if (task_id_opt.has_value()) {
+            CRANE_TRACE("Task id for the port is #{}", task_id_opt.value());
+            response->set_ok(true);
+            response->set_task_id(task_id_opt.value());
+          } else {
+            response->set_ok(false);
+          }
+          reactor->Finish(Status::OK);
+        });
+  });
+
+  return reactor;
 }
 
-grpc::Status CranedServiceImpl::ReleaseCgroupForTask(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CranedServiceImpl::CreateCgroupForTasks(
+    grpc::CallbackServerContext *context,
+    const crane::grpc::CreateCgroupForTasksRequest *request,
+    crane::grpc::CreateCgroupForTasksReply *response) {
+  CRANE_TRACE("Receive CreateCgroupForTasks for {} tasks",
+              request->task_ids_size());
+
+  auto *reactor = context->DefaultReactor();
+  if (request->task_ids_size() != request->uids_size()) {
+    reactor->Finish({grpc::StatusCode::INVALID_ARGUMENT,
+                     "task_ids and uids have different lengths."});
+    return reactor;
+  }
+
+  std::vector<std::pair<task_id_t, uid_t>> task_uid_pairs;
+  task_uid_pairs.reserve(request->task_ids_size());
+  for (int i = 0; i < request->task_ids_size(); i++)
+    task_uid_pairs.emplace_back(request->task_ids(i), request->uids(i));
+
+  g_task_mgr->CreateCgroupsAsync(
+      std::move(task_uid_pairs),
+      [reactor, response](std::vector<task_id_t> failed_task_ids) {
+        response->mutable_failed_task_ids()->Assign(failed_task_ids.begin(),
+                                                    failed_task_ids.end());
+        reactor->Finish(Status::OK);
+      });
+
+  return reactor;
+}
+
+grpc::ServerUnaryReactor *CranedServiceImpl::ReleaseCgroupForTask(
+    grpc::CallbackServerContext *context,
     const crane::grpc::ReleaseCgroupForTaskRequest *request,
     crane::grpc::ReleaseCgroupForTaskReply *response) {
-  bool ok = g_task_mgr->ReleaseCgroupAsync(request->task_id(), request->uid());
-  response->set_ok(ok);
-  return Status::OK;
+  auto *reactor = context->DefaultReactor();
+
+  g_task_mgr->ReleaseCgroupAsync(request->task_id(), request->uid(),
+                                 [reactor, response](bool ok) {
+                                   response->set_ok(ok);
+                                   reactor->Finish(Status::OK);
+                                 });
+
+  return reactor;
 }
 
-grpc::Status CranedServiceImpl::QueryTaskIdFromPortForward(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CranedServiceImpl::QueryTaskIdFromPortForward(
+    grpc::CallbackServerContext *context,
     const crane::grpc::QueryTaskIdFromPortForwardRequest *request,
     crane::grpc::QueryTaskIdFromPortForwardReply *response) {
+  auto *reactor = context->DefaultReactor();
+
   // Check whether the remote address is in the addresses of CraneD nodes.
   auto ip_iter =
       g_config.Ipv4ToNodesHostname.find(request->target_craned_address());
@@ -511,27 +641,8 @@ grpc::Status CranedServiceImpl::QueryTaskIdFromPortForward(
         request->target_craned_port(), request->uid());
 
     response->set_from_user(true);
-
-    TaskInfoOfUid info{};
-    bool ok = g_task_mgr->QueryTaskInfoOfUidAsync(request->uid(), &info);
-    if (ok) {
-      CRANE_TRACE(
-          "Found a task #{} belonging to uid {}. "
-          "This ssh session process is going to be moved into the task's "
-          "cgroup {}.",
-          info.first_task_id, request->uid(), info.cgroup_path);
-      response->set_task_id(info.first_task_id);
-      response->set_cgroup_path(info.cgroup_path);
-      response->set_ok(true);
-    } else {
-      CRANE_TRACE(
-          "This ssh session can't be moved into uid {}'s tasks. "
-          "This uid has {} task(s) and cgroup found: {}. "
-          "Reject this ssh request.",
-          request->uid(), info.job_cnt, info.cgroup_exists);
-      response->set_ok(false);
-    }
-    return Status::OK;
+    ReplyWithTaskOfUid_(request->uid(), response, reactor);
+    return reactor;
   }
 
   CRANE_TRACE(
@@ -544,62 +655,79 @@ grpc::Status CranedServiceImpl::QueryTaskIdFromPortForward(
   // node. Check if the remote port belongs to a task. If so, move it in to the
   // cgroup of this task. If not so, check uid again or reject this ssh request.
 
+  // The remote CraneD is queried by the callback API of the stub, and the
+  // state of the call lives until its callback returns.
+  struct RemoteQuery {
+    std::unique_ptr<crane::grpc::Craned::Stub> stub;
+    ClientContext context;
+    crane::grpc::QueryTaskIdFromPortRequest request;
+    crane::grpc::QueryTaskIdFromPortReply reply;
+  };
+
   std::string target_craned = fmt::format(
       "{}:{}", request->target_craned_address(), request->target_craned_port());
   std::shared_ptr<Channel> channel_of_remote_craned =
       grpc::CreateChannel(target_craned, grpc::InsecureChannelCredentials());
 
-  std::unique_ptr<crane::grpc::Craned::Stub> stub_of_remote_craned =
-      crane::grpc::Craned::NewStub(channel_of_remote_craned);
-
-  crane::grpc::QueryTaskIdFromPortRequest request_to_remote_craned;
-  crane::grpc::QueryTaskIdFromPortReply reply_from_remote_craned;
-  ClientContext context_of_remote_craned;
-  Status status_remote_craned;
-
-  request_to_remote_craned.set_port(request->ssh_remote_port());
-
-  status_remote_craned = stub_of_remote_craned->QueryTaskIdFromPort(
-      &context_of_remote_craned, request_to_remote_craned,
-      &reply_from_remote_craned);
-  if (!status_remote_craned.ok()) {
-    CRANE_ERROR("QueryTaskIdFromPort gRPC call failed: {} | {}",
-                status_remote_craned.error_message(),
-                status_remote_craned.error_details());
-    response->set_ok(false);
-    return Status::OK;
-  }
+  auto query = std::make_shared<RemoteQuery>();
+  query->stub = crane::grpc::Craned::NewStub(channel_of_remote_craned);
+  query->request.set_port(request->ssh_remote_port());
+
+  query->stub->async()->QueryTaskIdFromPort(
+      &query->context, &query->request, &query->reply,
+      [query, request, response, reactor](Status status) {
+        if (!status.ok()) {
+          CRANE_ERROR("QueryTaskIdFromPort gRPC call failed: {} | {}",
+                      status.error_message(), status.error_details());
+          response->set_ok(false);
+          reactor->Finish(Status::OK);
+          return;
+        }
 
-  if (reply_from_remote_craned.ok()) {
-    util::Cgroup *cg;
-    if (g_task_mgr->QueryCgOfTaskIdAsync(reply_from_remote_craned.task_id(),
-                                         &cg)) {
-      CRANE_TRACE(
-          "ssh client with remote port {} belongs to task #{}. "
-          "Moving this ssh session process into the task's cgroup",
-          request->ssh_remote_port(), reply_from_remote_craned.task_id());
+        if (!query->reply.ok()) {
+          ReplyWithTaskOfUid_(request->uid(), response, reactor);
+          return;
+        }
 
-      response->set_ok(true);
-      response->set_task_id(reply_from_remote_craned.task_id());
-      response->set_cgroup_path(cg->GetCgroupString());
-    } else {
-      CRANE_TRACE(
-          "ssh client with remote port {} belongs to task #{}. "
-          "But the task's cgroup is not found. Reject this ssh request",
-          request->ssh_remote_port(), reply_from_remote_craned.task_id());
-      response->set_ok(false);
-    }
+        task_id_t task_id = query->reply.task_id();
+        g_task_mgr->QueryCgOfTaskIdAsync(
+            task_id, [request, response, reactor, task_id](util::Cgroup *cg) {
+              if (cg != nullptr) {
+                CRANE_TRACE(
+                    "ssh client with remote port {} belongs to task #{}. "
+                    "Moving this ssh session process into the task's cgroup",
+                    request->ssh_remote_port(), task_id);
+
+                response->set_ok(true);
+                response->set_task_id(task_id);
+                response->set_cgroup_path(cg->GetCgroupString());
+              } else {
+                CRANE_TRACE(
+                    "ssh client with remote port {} belongs to task #{}. "
+                    "But the task's cgroup is not found. Reject this ssh "
+                    "request",
+                    request->ssh_remote_port(), task_id);
+                response->set_ok(false);
+              }
+              reactor->Finish(Status::OK);
+            });
+      });
+
+  return reactor;
+}
 
-    return Status::OK;
-  } else {
-    TaskInfoOfUid info{};
-    bool ok = g_task_mgr->QueryTaskInfoOfUidAsync(request->uid(), &info);
+void CranedServiceImpl::ReplyWithTaskOfUid_(
+    uid_t uid, crane::grpc::QueryTaskIdFromPortForwardReply *response,
+    grpc::ServerUnaryReactor *reactor) {
+  g_task_mgr->QueryTaskInfoOfUidAsync(uid, [uid, response, reactor](
+                                               bool ok,
+                                               const TaskInfoOfUid &info) {
     if (ok) {
       CRANE_TRACE(
           "Found a task #{} belonging to uid {}. "
           "This ssh session process is going to be moved into the task's "
           "cgroup {}.",
-          info.first_task_id, request->uid(), info.cgroup_path);
+          info.first_task_id, uid, info.cgroup_path);
       response->set_task_id(info.first_task_id);
       response->set_cgroup_path(info.cgroup_path);
       response->set_ok(true);
@@ -608,52 +736,255 @@ grpc::Status CranedServiceImpl::QueryTaskIdFromPortForward(
           "This ssh session can't be moved into uid {}'s tasks. "
           "This uid has {} task(s) and cgroup found: {}. "
           "Reject this ssh request.",
-          request->uid(), info.job_cnt, info.cgroup_exists);
+          uid, info.job_cnt, info.cgroup_exists);
       response->set_ok(false);
     }
-    return Status::OK;
-  }
+    reactor->Finish(Status::OK);
+  });
 }
 
-grpc::Status CranedServiceImpl::MigrateSshProcToCgroup(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CranedServiceImpl::MigrateSshProcToCgroup(
+    grpc::CallbackServerContext *context,
     const crane::grpc::MigrateSshProcToCgroupRequest *request,
     crane::grpc::MigrateSshProcToCgroupReply *response) {
   CRANE_TRACE("Moving pid {} to cgroup {}", request->pid(),
               request->cgroup_path());
-  bool ok = util::CgroupManager::Instance().MigrateProcTo(
-      request->pid(), request->cgroup_path());
 
-  if (!ok) {
-    CRANE_ERROR("GrpcMigrateSshProcToCgroup failed on pid: {}, cgroup: {}",
-                request->pid(), request->cgroup_path());
-    response->set_ok(false);
-  } else {
-    response->set_ok(true);
-  }
+  auto *reactor = context->DefaultReactor();
+
+  // Writing the cgroup files may block, so it is done in the thread pool.
+  g_thread_pool->push_task([request, response, reactor] {
+    bool ok = util::CgroupManager::Instance().MigrateProcTo(
+        request->pid(), request->cgroup_path());
 
-  return Status::OK;
+    if (!ok) {
+      CRANE_ERROR("GrpcMigrateSshProcToCgroup failed on pid: {}, cgroup: {}",
+                  request->pid(), request->cgroup_path());
+      response->set_ok(false);
+    } else {
+      response->set_ok(true);
+    }
+
+    reactor->Finish(Status::OK);
+  });
+
+  return reactor;
 }
 
-grpc::Status CranedServiceImpl::CheckTaskStatus(
-    grpc::ServerContext *context,
+grpc::ServerUnaryReactor *CranedServiceImpl::CheckTaskStatus(
+    grpc::CallbackServerContext *context,
     const crane::grpc::CheckTaskStatusRequest *request,
     crane::grpc::CheckTaskStatusReply *response) {
-  crane::grpc::TaskStatus status{};
+  auto *reactor = context->DefaultReactor();
+
+  g_task_mgr->CheckTaskStatusAsync(
+      request->task_id(),
+      [reactor, response](bool exist, crane::grpc::TaskStatus status) {
+        response->set_ok(exist);
+        response->set_status(status);
+        reactor->Finish(Status::OK);
+      });
+
+  return reactor;
+}
+
+grpc::ServerWriteReactor<crane::grpc::TailTaskOutputReply> *
+CranedServiceImpl::TailTaskOutput(
+    grpc::CallbackServerContext *context,
+    const crane::grpc::TailTaskOutputRequest *request) {
+  return new TailTaskOutputReactor(context, request,
+                                   CranedServer::PeerUidOf(context));
+}
+
+TailTaskOutputReactor::TailTaskOutputReactor(
+    grpc::CallbackServerContext *context,
+    const crane::grpc::TailTaskOutputRequest *request,
+    std::optional<uid_t> peer_uid)
+    : m_context_(context), m_request_(request) {
+  if (!peer_uid.has_value()) {
+    FinishWithError_("TailTaskOutput is only served on the unix socket.");
+    return;
+  }
+  m_peer_uid_ = peer_uid.value();
+
+  g_task_mgr->QueryTaskOutputInfoAsync(
+      request->task_id(), [this](std::optional<TaskOutputInfo> info) {
+        OnOutputInfo_(std::move(info));
+      });
+}
+
+void TailTaskOutputReactor::OnOutputInfo_(std::optional<TaskOutputInfo> info) {
+  if (!info.has_value()) {
+    FinishWithError_(
+        fmt::format("Task #{} is not a running batch task on this node.",
+                    m_request_->task_id()));
+    return;
+  }
+
+  if (m_peer_uid_ != 0 && m_peer_uid_ != info->uid) {
+    FinishWithError_("Permission denied.");
+    return;
+  }
+
+  m_info_ = std::move(info.value());
+  PollAfter_(absl::ZeroDuration());
+}
+
+bool TailTaskOutputReactor::Open_() {
+  m_opened_ = true;
+
+  m_output_mgr_ = g_task_mgr->GetOutputManager();
+  if (m_output_mgr_ != nullptr &&
+      m_output_mgr_->OpenTail(m_request_->task_id(), m_request_->offset(),
+                              &m_cursor_))
+    return true;
+
+  // Tail the output file of a task whose output is not captured by Craned.
+  m_output_mgr_ = nullptr;
+  m_fd_ = OutputManager::OpenAsUser(m_info_.path, O_RDONLY | O_CLOEXEC,
+                                    m_info_.uid, m_info_.gid);
+  if (m_fd_ < 0) {
+    FinishWithError_(fmt::format("Failed to open output file {}: {}",
+                                 m_info_.path, strerror(errno)));
+    return false;
+  }
+
+  m_offset_ = m_request_->offset();
+  if (m_request_->offset() < 0) {
+    struct stat st {};
+    if (fstat(m_fd_, &st) != 0) {
+      FinishWithError_(fmt::format("Failed to stat output file {}: {}",
+                                   m_info_.path, strerror(errno)));
+      return false;
+    }
+    uint64_t size = st.st_size;
+    m_offset_ = size - std::min<uint64_t>(-m_request_->offset(), size);
+  }
+
+  return true;
+}
+
+void TailTaskOutputReactor::OnWriteDone(bool ok) {
+  if (!ok) {
+    Finish(Status::OK);
+    return;
+  }
+
+  Poll_();
+}
+
+void TailTaskOutputReactor::Poll_() {
+  if (m_context_->IsCancelled() || g_server->m_is_shutting_down_.load()) {
+    Finish(Status::OK);
+    return;
+  }
+
+  // The output file may be on a slow shared filesystem, so it is opened and
+  // read in the thread pool instead of the gRPC threads. The output behind
+  // the ring buffer is read from the file as well.
+  g_thread_pool->push_task([this] {
+    if (!m_opened_ && !Open_()) return;
+
+    if (m_output_mgr_ != nullptr)
+      PollTail_();
+    else
+      PollFile_();
+  });
+}
+
+void TailTaskOutputReactor::PollTail_() {
+  m_reply_.Clear();
+
+  uint64_t offset;
+  OutputManager::TailStatus status =
+      m_output_mgr_->ReadTail(&m_cursor_, kTailMaxReplyBytes,
+                              absl::ZeroDuration(), m_reply_.mutable_data(),
+                              &offset);
+  if (status == OutputManager::TailStatus::kTimeout) {
+    PollAfter_(kTailPollInterval);
+    return;
+  }
+
+  m_reply_.set_ok(true);
+  if (status == OutputManager::TailStatus::kEnd) {
+    m_reply_.set_offset(m_cursor_.offset);
+    m_reply_.set_eof(true);
+    StartWriteAndFinish(&m_reply_, grpc::WriteOptions(), Status::OK);
+    return;
+  }
+
+  m_reply_.set_offset(offset);
+  StartWrite(&m_reply_);
+}
+
+void TailTaskOutputReactor::PollFile_() {
+  m_reply_.Clear();
 
-  bool exist = g_task_mgr->CheckTaskStatusAsync(request->task_id(), &status);
-  response->set_ok(exist);
-  response->set_status(status);
+  std::string *data = m_reply_.mutable_data();
+  data->resize(kTailMaxReplyBytes);
+  ssize_t n;
+  do {
+    n = pread(m_fd_, data->data(), kTailMaxReplyBytes, m_offset_);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0) {
+    FinishWithError_(fmt::format("Failed to read output file {}: {}",
+                                 m_info_.path, strerror(errno)));
+    return;
+  }
+
+  if (n > 0) {
+    data->resize(n);
+    m_reply_.set_ok(true);
+    m_reply_.set_offset(m_offset_);
+    m_offset_ += n;
+    StartWrite(&m_reply_);
+    return;
+  }
+
+  // The end of the file has been read after the task ended.
+  if (!m_task_running_) {
+    m_reply_.Clear();
+    m_reply_.set_ok(true);
+    m_reply_.set_offset(m_offset_);
+    m_reply_.set_eof(true);
+    StartWriteAndFinish(&m_reply_, grpc::WriteOptions(), Status::OK);
+    return;
+  }
 
-  return Status::OK;
+  // Read the file once more after the task ends to get its last output.
+  g_task_mgr->QueryTaskOutputInfoAsync(
+      m_request_->task_id(), [this](std::optional<TaskOutputInfo> info) {
+        m_task_running_ = info.has_value();
+        PollAfter_(kTailWaitInterval);
+      });
+}
+
+void TailTaskOutputReactor::PollAfter_(absl::Duration delay) {
+  m_alarm_ = std::make_unique<grpc::Alarm>();
+  m_alarm_->Set(absl::ToChronoTime(absl::Now() + delay),
+                [this](bool) { Poll_(); });
+}
+
+void TailTaskOutputReactor::FinishWithError_(std::string reason) {
+  m_reply_.Clear();
+  m_reply_.set_ok(false);
+  m_reply_.set_reason(std::move(reason));
+  StartWriteAndFinish(&m_reply_, grpc::WriteOptions(), Status::OK);
 }
 
 CranedServer::CranedServer(const Config::CranedListenConf &listen_conf) {
   m_service_impl_ = std::make_unique<CranedServiceImpl>();
 
   grpc::ServerBuilder builder;
-  builder.AddListeningPort(listen_conf.UnixSocketListenAddr,
-                           grpc::InsecureServerCredentials());
+
+  // Accept the keepalive pings which cranectld sends on idle channels.
+  // Otherwise gRPC answers them with GOAWAY and the channel reconnects.
+  builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS,
+                             1 /*true*/);
+  builder.AddChannelArgument(
+      GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS,
+      kCranedMinPingIntervalSec * 1000);
 
   std::string listen_addr_port = fmt::format(
       "{}:{}", listen_conf.CranedListenAddr, listen_conf.CranedListenPort);
@@ -679,15 +1010,116 @@ CranedServer::CranedServer(const Config::CranedListenConf &listen_conf) {
   builder.RegisterService(m_service_impl_.get());
 
   m_server_ = builder.BuildAndStart();
+  if (!ListenOnUnixSocket_(listen_conf.UnixSocketListenAddr)) std::exit(1);
   CRANE_INFO("Craned is listening on [{}, {}]",
              listen_conf.UnixSocketListenAddr, listen_addr_port);
 
-  g_task_mgr->SetSigintCallback([p_server = m_server_.get()] {
-    p_server->Shutdown();
-    CRANE_TRACE("Grpc Server Shutdown() was called.");
+  g_task_mgr->SetSigintCallback([this] {
+    m_is_shutting_down_ = true;
+    m_shutdown_thread_ = std::thread([this] {
+      StopUnixSocketListener_();
+      m_server_->Shutdown();
+      CRANE_TRACE("Grpc Server Shutdown() was called.");
+    });
   });
 }
 
+void CranedServer::Wait() {
+  m_server_->Wait();
+  if (m_shutdown_thread_.joinable()) m_shutdown_thread_.join();
+
+  if (m_unix_accept_thread_.joinable()) m_unix_accept_thread_.join();
+  if (m_unix_listen_fd_ >= 0) {
+    close(m_unix_listen_fd_);
+    unlink(m_unix_socket_path_.c_str());
+  }
+}
+
+std::optional<uid_t> CranedServer::PeerUidOf(
+    const grpc::CallbackServerContext *context) {
+  // gRPC names the connections added by AddInsecureChannelFromFd() as
+  // "fd:<fd>". The fd stays open while a call on it is active.
+  constexpr std::string_view kFdPrefix = "fd:";
+  std::string peer = context->peer();
+  int fd;
+  if (!peer.starts_with(kFdPrefix) ||
+      !absl::SimpleAtoi(peer.substr(kFdPrefix.size()), &fd))
+    return std::nullopt;
+
+  struct ucred cred {};
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+    CRANE_ERROR("Failed to get the credential of {}: {}", context->peer(),
+                strerror(errno));
+    return std::nullopt;
+  }
+
+  return cred.uid;
+}
+
+bool CranedServer::ListenOnUnixSocket_(const std::string &listen_addr) {
+  constexpr std::string_view kUnixPrefix = "unix://";
+  m_unix_socket_path_ = listen_addr.starts_with(kUnixPrefix)
+                            ? listen_addr.substr(kUnixPrefix.size())
+                            : listen_addr;
+
+  struct sockaddr_un addr {};
+  if (m_unix_socket_path_.size() >= sizeof(addr.sun_path)) {
+    CRANE_ERROR("Unix socket path {} is too long.", m_unix_socket_path_);
+    return false;
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, m_unix_socket_path_.c_str(),
+          sizeof(addr.sun_path) - 1);
+
+  m_unix_listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (m_unix_listen_fd_ < 0) {
+    CRANE_ERROR("Failed to create the unix socket: {}", strerror(errno));
+    return false;
+  }
+
+  unlink(m_unix_socket_path_.c_str());
+  if (bind(m_unix_listen_fd_, reinterpret_cast<struct sockaddr *>(&addr),
+           sizeof(addr)) != 0 ||
+      listen(m_unix_listen_fd_, SOMAXCONN) != 0) {
+    CRANE_ERROR("Failed to listen on {}: {}", m_unix_socket_path_,
+                strerror(errno));
+    return false;
+  }
+
+  m_unix_accept_thread_ =
+      std::thread([this] { AcceptUnixSocketConnections_(); });
+  return true;
+}
+
+void CranedServer::AcceptUnixSocketConnections_() {
+  while (true) {
+    int fd = accept4(m_unix_listen_fd_, nullptr, nullptr,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (m_is_shutting_down_) break;
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+
+      CRANE_ERROR("Failed to accept on {}: {}", m_unix_socket_path_,
+                  strerror(errno));
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+          errno == ENOMEM) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        continue;
+      }
+      break;
+    }
+
+    // gRPC takes the ownership of fd.
+    grpc::AddInsecureChannelFromFd(m_server_.get(), fd);
+  }
+}
+
+void CranedServer::StopUnixSocketListener_() {
+  // Wakes up the accept4() in m_unix_accept_thread_.
+  if (m_unix_listen_fd_ >= 0) shutdown(m_unix_listen_fd_, SHUT_RDWR);
+}
+
 CraneErr CranedServer::CheckValidityOfResourceUuid(const uuid &resource_uuid,
                                                    uint32_t task_id) {
   LockGuard guard(m_mtx_);
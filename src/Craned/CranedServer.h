@@ -1,7 +1,9 @@
 #pragma once
 
+#include <event2/buffer.h>
 #include <google/protobuf/util/time_util.h>
 #include <grpc++/grpc++.h>
+#include <grpcpp/alarm.h>
 
 #include <atomic>
 #include <boost/uuid/uuid.hpp>
@@ -38,66 +40,289 @@ using crane::grpc::Craned;
 using crane::grpc::SrunXStreamReply;
 using crane::grpc::SrunXStreamRequest;
 
-class CranedServiceImpl : public Craned::Service {
+/**
+ * Runs an interactive process for SrunX and forwards its output.
+ *
+ * The stream is driven by the callbacks of gRPC and of TaskManager, so no
+ * thread is blocked while the process is spawned or runs. The output is moved
+ * from the socket of the process into m_output_ in the event loop of
+ * TaskManager without copying, and is sent in frames of at most
+ * kMaxFrameBytes, one at a time. The bytes arriving while a frame is being
+ * sent are coalesced into the next one.
+ *
+ * When m_output_ exceeds kOutputHighWatermark, TaskManager stops reading the
+ * output, so the process of a slow client blocks in write(). The reading
+ * resumes when the sent frames bring m_output_ down to kOutputLowWatermark.
+ *
+ * The reactor is owned by itself until OnDone() and by the callbacks passed
+ * to TaskManager until the process exits.
+ */
+class SrunXStreamReactor
+    : public grpc::ServerBidiReactor<SrunXStreamRequest, SrunXStreamReply>,
+      public std::enable_shared_from_this<SrunXStreamReactor> {
+ public:
+  static SrunXStreamReactor *Create(grpc::CallbackServerContext *context);
+
+  ~SrunXStreamReactor() override;
+
+  void OnReadDone(bool ok) override LOCKS_EXCLUDED(m_mtx_);
+
+  void OnWriteDone(bool ok) override LOCKS_EXCLUDED(m_mtx_);
+
+  void OnDone() override LOCKS_EXCLUDED(m_mtx_);
+
+ private:
+  enum class StreamState {
+    kNegotiation = 0,
+    kCheckResource,
+    kExecutiveInfo,
+    // Waiting for TaskManager to spawn the process. No read is started.
+    kSpawning,
+    kWaitForEofOrSigOrTaskEnd,
+    kFinish,
+    kAbort
+  };
+
+  static constexpr size_t kMaxFrameBytes = 256 * 1024;
+  static constexpr size_t kOutputHighWatermark = 1024 * 1024;
+  static constexpr size_t kOutputLowWatermark = 256 * 1024;
+
+  explicit SrunXStreamReactor(grpc::CallbackServerContext *context);
+
+  // Returns the next state.
+  StreamState HandleRequest_(StreamState state) LOCKS_EXCLUDED(m_mtx_);
+
+  // Read the next request, or finish the RPC in kFinish and kAbort.
+  void Transit_(StreamState state) LOCKS_EXCLUDED(m_mtx_);
+
+  void SpawnTask_() LOCKS_EXCLUDED(m_mtx_);
+
+  // Called in the event loop of TaskManager.
+  void OnSpawned_(CraneErr err) LOCKS_EXCLUDED(m_mtx_);
+
+  // Called in the event loop of TaskManager.
+  bool OnOutput_(struct evbuffer *buf, pid_t pid) LOCKS_EXCLUDED(m_mtx_);
+
+  // Called in the event loop of TaskManager.
+  void OnTaskFinish_(bool is_terminated_by_signal, int value)
+      LOCKS_EXCLUDED(m_mtx_);
+
+  static SrunXStreamReply ResultReply_(bool ok, std::string reason = {});
+
+  void WriteReply_(SrunXStreamReply &&reply) LOCKS_EXCLUDED(m_mtx_);
+
+  // Finish the RPC once the reply being written is done.
+  void Finish_(Status status) LOCKS_EXCLUDED(m_mtx_);
+
+  // Start writing the next reply unless one is being written, or finish the
+  // RPC if nothing is left. The replies come first, then the output and at
+  // last the exit status. StartWrite() and Finish() are called without m_mtx_
+  // held, since their reactions may run in the calling thread.
+  void WriteNext_() LOCKS_EXCLUDED(m_mtx_);
+
+  // Drop the output which can no longer be sent and resume the reading.
+  void DiscardOutputNoLock_() EXCLUSIVE_LOCKS_REQUIRED(m_mtx_);
+
+  grpc::CallbackServerContext *m_context_;
+
+  // Only touched by the reactions of reading and OnSpawned_, which never run
+  // concurrently.
+  StreamState m_state_{StreamState::kNegotiation};
+  SrunXStreamRequest m_request_;
+  // A task id is bound to one connection.
+  uint32_t m_task_id_{0};
+  // A resource uuid is bound to one task.
+  uuid m_resource_uuid_{};
+
+  util::mutex m_mtx_;
+
+  std::shared_ptr<SrunXStreamReactor> m_self_ GUARDED_BY(m_mtx_);
+
+  // The reply passed to StartWrite(), which must be kept until OnWriteDone.
+  // Only touched by the thread which sets m_writing_.
+  SrunXStreamReply m_write_reply_;
+  bool m_writing_ GUARDED_BY(m_mtx_) = false;
+
+  std::list<SrunXStreamReply> m_replies_ GUARDED_BY(m_mtx_);
+  struct evbuffer *m_output_ GUARDED_BY(m_mtx_);
+  std::optional<SrunXStreamReply> m_exit_status_ GUARDED_BY(m_mtx_);
+
+  // The output is held until the result of spawning is sent.
+  bool m_output_allowed_ GUARDED_BY(m_mtx_) = false;
+  bool m_output_paused_ GUARDED_BY(m_mtx_) = false;
+  pid_t m_pid_ GUARDED_BY(m_mtx_) = 0;
+
+  std::optional<Status> m_finish_status_ GUARDED_BY(m_mtx_);
+  bool m_finished_ GUARDED_BY(m_mtx_) = false;
+  // Set when a write fails or the RPC is done. The output is dropped then.
+  bool m_broken_ GUARDED_BY(m_mtx_) = false;
+};
+
+/**
+ * Streams the output of a batch task for TailTaskOutput.
+ *
+ * Each step runs in a reaction of gRPC, a callback of TaskManager or a
+ * grpc::Alarm, and starts the next one when it is done, so no thread waits
+ * for the output. A reader which has caught up polls again after
+ * kTailPollInterval, or after kTailWaitInterval for an output file which is
+ * not captured by Craned.
+ */
+class TailTaskOutputReactor
+    : public grpc::ServerWriteReactor<crane::grpc::TailTaskOutputReply> {
+ public:
+  /**
+   * @param peer_uid The uid of the client read from the unix socket, or
+   *  nullopt if the client is not connected by the unix socket, in which
+   *  case the RPC is rejected.
+   */
+  TailTaskOutputReactor(grpc::CallbackServerContext *context,
+                        const crane::grpc::TailTaskOutputRequest *request,
+                        std::optional<uid_t> peer_uid);
+
+  ~TailTaskOutputReactor() override {
+    if (m_fd_ >= 0) close(m_fd_);
+  }
+
+  void OnWriteDone(bool ok) override;
+
+  void OnDone() override { delete this; }
+
+ private:
+  static constexpr absl::Duration kTailPollInterval = absl::Milliseconds(200);
+  static constexpr absl::Duration kTailWaitInterval = absl::Seconds(1);
+
+  // Each write waits until the reader has room for the reply, so a slow
+  // reader only holds back itself.
+  static constexpr size_t kTailMaxReplyBytes = 64 * 1024;
+
+  // Called in the event loop of TaskManager.
+  void OnOutputInfo_(std::optional<TaskOutputInfo> info);
+
+  // Open the ring buffer or the output file. Called in the thread pool,
+  // since the file may be on a slow shared filesystem.
+  bool Open_();
+
+  // Send the next piece of the output or poll again later.
+  void Poll_();
+
+  // Called in the thread pool.
+  void PollTail_();
+
+  void PollFile_();
+
+  void PollAfter_(absl::Duration delay);
+
+  void FinishWithError_(std::string reason);
+
+  grpc::CallbackServerContext *m_context_;
+  const crane::grpc::TailTaskOutputRequest *m_request_;
+  uid_t m_peer_uid_{0};
+
+  TaskOutputInfo m_info_;
+  bool m_opened_{false};
+
+  // Set if the output is captured by OutputManager.
+  OutputManager *m_output_mgr_{nullptr};
+  OutputManager::TailCursor m_cursor_;
+
+  // Used if the output is written to the file by the task itself.
+  int m_fd_{-1};
+  uint64_t m_offset_{0};
+  bool m_task_running_{true};
+
+  crane::grpc::TailTaskOutputReply m_reply_;
+
+  // A new alarm is created for each wait, since the callback of an alarm
+  // must not be replaced while it runs. An alarm is kept alive by gRPC until
+  // its callback returns.
+  std::unique_ptr<grpc::Alarm> m_alarm_;
+};
+
+class CranedServiceImpl : public Craned::CallbackService {
  public:
   CranedServiceImpl() = default;
 
-  Status SrunXStream(ServerContext *context,
-                     ServerReaderWriter<SrunXStreamReply, SrunXStreamRequest>
-                         *stream) override;
+  grpc::ServerBidiReactor<SrunXStreamRequest, SrunXStreamReply> *SrunXStream(
+      grpc::CallbackServerContext *context) override;
 
-  grpc::Status ExecuteTask(grpc::ServerContext *context,
-                           const crane::grpc::ExecuteTaskRequest *request,
-                           crane::grpc::ExecuteTaskReply *response) override;
+  grpc::ServerUnaryReactor *ExecuteTask(
+      grpc::CallbackServerContext *context,
+      const crane::grpc::ExecuteTaskRequest *request,
+      crane::grpc::ExecuteTaskReply *response) override;
 
-  grpc::Status TerminateTask(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *TerminateTask(
+      grpc::CallbackServerContext *context,
       const crane::grpc::TerminateTaskRequest *request,
       crane::grpc::TerminateTaskReply *response) override;
 
-  grpc::Status TerminateOrphanedTask(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *TerminateOrphanedTask(
+      grpc::CallbackServerContext *context,
       const crane::grpc::TerminateOrphanedTaskRequest *request,
       crane::grpc::TerminateOrphanedTaskReply *response) override;
 
-  grpc::Status CheckTaskStatus(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *CheckTaskStatus(
+      grpc::CallbackServerContext *context,
       const crane::grpc::CheckTaskStatusRequest *request,
       crane::grpc::CheckTaskStatusReply *response) override;
 
-  grpc::Status QueryTaskIdFromPort(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *QueryTaskIdFromPort(
+      grpc::CallbackServerContext *context,
       const crane::grpc::QueryTaskIdFromPortRequest *request,
       crane::grpc::QueryTaskIdFromPortReply *response) override;
 
-  grpc::Status QueryTaskIdFromPortForward(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *QueryTaskIdFromPortForward(
+      grpc::CallbackServerContext *context,
       const crane::grpc::QueryTaskIdFromPortForwardRequest *request,
       crane::grpc::QueryTaskIdFromPortForwardReply *response) override;
 
-  grpc::Status MigrateSshProcToCgroup(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *MigrateSshProcToCgroup(
+      grpc::CallbackServerContext *context,
       const crane::grpc::MigrateSshProcToCgroupRequest *request,
       crane::grpc::MigrateSshProcToCgroupReply *response) override;
 
-  grpc::Status CreateCgroupForTask(
-      grpc::ServerContext *context,
-      const crane::grpc::CreateCgroupForTaskRequest *request,
-      crane::grpc::CreateCgroupForTaskReply *response) override;
+  grpc::ServerUnaryReactor *CreateCgroupForTasks(
+      grpc::CallbackServerContext *context,
+      const crane::grpc::CreateCgroupForTasksRequest *request,
+      crane::grpc::CreateCgroupForTasksReply *response) override;
 
-  grpc::Status ReleaseCgroupForTask(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor *ReleaseCgroupForTask(
+      grpc::CallbackServerContext *context,
       const crane::grpc::ReleaseCgroupForTaskRequest *request,
       crane::grpc::ReleaseCgroupForTaskReply *response) override;
+
+  grpc::ServerWriteReactor<crane::grpc::TailTaskOutputReply> *TailTaskOutput(
+      grpc::CallbackServerContext *context,
+      const crane::grpc::TailTaskOutputRequest *request) override;
+
+ private:
+  // The process listening on the local port and its ancestors up to Craned,
+  // read from /proc. Empty if no process is found.
+  static std::vector<pid_t> PidAndAncestorsOfPort_(uint32_t port);
+
+  // Let the ssh session join the first task of the uid, if any.
+  static void ReplyWithTaskOfUid_(
+      uid_t uid, crane::grpc::QueryTaskIdFromPortForwardReply *response,
+      grpc::ServerUnaryReactor *reactor);
 };
 
 class CranedServer {
  public:
   explicit CranedServer(const Config::CranedListenConf &listen_conf);
 
-  inline void Shutdown() { m_server_->Shutdown(); }
+  inline void Shutdown() {
+    m_is_shutting_down_ = true;
+    StopUnixSocketListener_();
+    m_server_->Shutdown();
+  }
 
-  inline void Wait() { m_server_->Wait(); }
+  void Wait();
+
+  /**
+   * @return the uid of the client read by SO_PEERCRED, or nullopt if the
+   *  client is not connected by the unix socket of Craned.
+   */
+  static std::optional<uid_t> PeerUidOf(
+      const grpc::CallbackServerContext *context);
 
   void GrantResourceToken(const uuid &resource_uuid, uint32_t task_id)
       LOCKS_EXCLUDED(m_mtx_);
@@ -112,6 +337,15 @@ class CranedServer {
   using Mutex = util::mutex;
   using LockGuard = util::AbslMutexLockGuard;
 
+  // The connections to the unix socket are accepted here instead of by
+  // gRPC and then handed to m_server_, so that PeerUidOf() can find the
+  // socket of a call.
+  bool ListenOnUnixSocket_(const std::string &listen_addr);
+
+  void AcceptUnixSocketConnections_();
+
+  void StopUnixSocketListener_();
+
   // Craned no longer takes the responsibility for resource management.
   // Resource management is handled in CraneCtld. Craned only records
   // who have the permission to execute interactive tasks in Craned.
@@ -122,10 +356,21 @@ class CranedServer {
 
   Mutex m_mtx_;
 
+  // Long-running streams end when this is set, so that Shutdown() returns.
+  std::atomic_bool m_is_shutting_down_{false};
+
   std::unique_ptr<CranedServiceImpl> m_service_impl_;
   std::unique_ptr<Server> m_server_;
 
-  friend class CranedServiceImpl;
+  // Calls Shutdown() on SIGINT. The RPCs waiting for the event loop of
+  // TaskManager are answered meanwhile, so it can't be called from there.
+  std::thread m_shutdown_thread_;
+
+  std::string m_unix_socket_path_;
+  int m_unix_listen_fd_{-1};
+  std::thread m_unix_accept_thread_;
+
+  friend class TailTaskOutputReactor;
 };
 }  // namespace Craned
 
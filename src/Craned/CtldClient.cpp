@@ -1,11 +1,17 @@
 #include "CtldClient.h"
 
+#include <sys/sysinfo.h>
+
 #include <boost/uuid/uuid_io.hpp>
+#include <cstdlib>
+
+#include "TaskManager.h"
 
 namespace Craned {
 
 CtldClient::~CtldClient() {
   m_thread_stop_ = true;
+  StopHeartbeat();
 
   CRANE_TRACE("CtldClient is ending. Waiting for the thread to finish.");
   m_async_send_thread_.join();
@@ -21,6 +27,18 @@ void CtldClient::InitChannelAndStub(const std::string& server_address) {
   m_async_send_thread_ = std::thread([this] { AsyncSendThread_(); });
 }
 
+void CtldClient::StartHeartbeat(absl::Duration interval) {
+  m_heartbeat_thread_ =
+      std::thread([this, interval] { HeartbeatThread_(interval); });
+}
+
+void CtldClient::StopHeartbeat() {
+  if (!m_heartbeat_thread_.joinable()) return;
+
+  m_heartbeat_stop_.Notify();
+  m_heartbeat_thread_.join();
+}
+
 void CtldClient::TaskStatusChangeAsync(TaskStatusChange&& task_status_change) {
   absl::MutexLock lock(&m_task_status_change_mtx_);
   m_task_status_change_list_.emplace_back(std::move(task_status_change));
@@ -91,6 +109,12 @@ void CtldClient::AsyncSendThread_() {
         if (status_change.reason.has_value())
           request.set_reason(status_change.reason.value());
 
+        auto* usage = request.mutable_resource_usage();
+        usage->set_cpu_time_ns(status_change.usage.cpu_time_ns);
+        usage->set_max_memory_bytes(status_change.usage.max_memory_bytes);
+        usage->set_blkio_read_bytes(status_change.usage.blkio_read_bytes);
+        usage->set_blkio_write_bytes(status_change.usage.blkio_write_bytes);
+
         status = m_stub_->TaskStatusChange(&context, request, &reply);
         if (!status.ok()) {
           CRANE_ERROR(
@@ -129,4 +153,33 @@ void CtldClient::AsyncSendThread_() {
   }
 }
 
+void CtldClient::HeartbeatThread_(absl::Duration interval) {
+  do {
+    grpc::ClientContext context;
+    crane::grpc::CranedHeartbeatRequest request;
+    crane::grpc::CranedHeartbeatReply reply;
+
+    // A heartbeat that cannot be delivered within one interval is useless.
+    context.set_deadline(absl::ToChronoTime(absl::Now() + interval));
+
+    request.set_partition_id(m_craned_id_.partition_id);
+    request.set_craned_index(m_craned_id_.craned_index);
+
+    double load_avg[1];
+    if (getloadavg(load_avg, 1) == 1) request.set_load_average(load_avg[0]);
+
+    struct sysinfo info {};
+    if (sysinfo(&info) == 0)
+      request.set_free_memory_bytes(
+          (uint64_t{info.freeram} + info.bufferram) * info.mem_unit);
+
+    if (g_task_mgr) request.set_running_task_num(g_task_mgr->RunningTaskNum());
+
+    grpc::Status status = m_stub_->CranedHeartbeat(&context, request, &reply);
+    if (!status.ok())
+      CRANE_TRACE("Failed to send heartbeat to CraneCtld: {}",
+                  status.error_message());
+  } while (!m_heartbeat_stop_.WaitForNotificationWithTimeout(interval));
+}
+
 }  // namespace Craned
@@ -2,6 +2,7 @@
 
 #include <absl/base/thread_annotations.h>
 #include <absl/synchronization/mutex.h>
+#include <absl/synchronization/notification.h>
 #include <grpc++/grpc++.h>
 
 #include <atomic>
@@ -43,6 +44,20 @@ class CtldClient {
    */
   void InitChannelAndStub(const std::string& server_address);
 
+  /**
+   * Start a thread sending the load of this node to CraneCtld every interval.
+   * CraneCtld considers the node down if several heartbeats in a row are
+   * missed, even if the grpc channel to it is still connected.
+   * Must be called after InitChannelAndStub().
+   */
+  void StartHeartbeat(absl::Duration interval);
+
+  /**
+   * Stop and join the heartbeat thread. Must be called before g_task_mgr is
+   * destroyed since the heartbeat reads it.
+   */
+  void StopHeartbeat();
+
   void TaskStatusChangeAsync(TaskStatusChange&& task_status_change);
 
   bool CancelTaskStatusChangeByTaskId(task_id_t task_id,
@@ -53,6 +68,8 @@ class CtldClient {
  private:
   void AsyncSendThread_();
 
+  void HeartbeatThread_(absl::Duration interval);
+
   absl::Mutex m_task_status_change_mtx_;
 
   std::list<TaskStatusChange> m_task_status_change_list_
@@ -61,6 +78,9 @@ class CtldClient {
   std::thread m_async_send_thread_;
   std::atomic_bool m_thread_stop_{false};
 
+  std::thread m_heartbeat_thread_;
+  absl::Notification m_heartbeat_stop_;
+
   std::shared_ptr<Channel> m_ctld_channel_;
 
   std::unique_ptr<CraneCtld::Stub> m_stub_;
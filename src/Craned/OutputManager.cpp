@@ -0,0 +1,554 @@
+#include "OutputManager.h"
+
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace Craned {
+
+OutputManager::OutputManager(struct event_base* base, Options options)
+    : m_options_(std::move(options)), m_ev_base_(base) {
+  m_ev_resume_ = event_new(m_ev_base_, -1, EV_READ | EV_PERSIST,
+                           EvResumeCb_, this);
+  if (!m_ev_resume_) {
+    CRANE_ERROR("Failed to create the output resume event!");
+    std::terminate();
+  }
+  if (event_add(m_ev_resume_, nullptr) < 0) {
+    CRANE_ERROR("Could not add the output resume event to base!");
+    std::terminate();
+  }
+
+  if (m_options_.rate_limit_bytes_per_sec > 0) {
+    size_t rate = m_options_.rate_limit_bytes_per_sec;
+    m_rate_limit_cfg_ = ev_token_bucket_cfg_new(
+        rate, rate, EV_RATE_LIMIT_MAX, EV_RATE_LIMIT_MAX, nullptr);
+    if (!m_rate_limit_cfg_)
+      CRANE_ERROR("Failed to create the token bucket. Output is unlimited.");
+  }
+
+  m_writer_thread_ = std::thread([this] { WriterThread_(); });
+}
+
+OutputManager::~OutputManager() {
+  {
+    util::lock_guard guard(m_mtx_);
+
+    // The pipes of the tasks which are still running are read no more.
+    for (auto& output : m_outputs_) {
+      if (output->bev) {
+        AppendTailNoLock_(output.get(), bufferevent_get_input(output->bev));
+        evbuffer_add_buffer(output->pending,
+                            bufferevent_get_input(output->bev));
+        bufferevent_free(output->bev);
+        output->bev = nullptr;
+      }
+      output->eof = true;
+    }
+    m_stop_ = true;
+  }
+  m_cv_.Signal();
+  m_tail_cv_.SignalAll();
+
+  if (m_writer_thread_.joinable()) m_writer_thread_.join();
+
+  if (m_ev_resume_) event_free(m_ev_resume_);
+  if (m_rate_limit_cfg_) ev_token_bucket_cfg_free(m_rate_limit_cfg_);
+}
+
+bool OutputManager::AddOutput(task_id_t task_id, int read_fd,
+                              std::string path, uid_t uid, gid_t gid) {
+  auto output = std::make_shared<TaskOutput>();
+  output->mgr = this;
+  output->task_id = task_id;
+  output->path = std::move(path);
+  output->uid = uid;
+  output->gid = gid;
+
+  output->bev =
+      bufferevent_socket_new(m_ev_base_, read_fd, BEV_OPT_CLOSE_ON_FREE);
+  if (!output->bev) {
+    CRANE_ERROR("Failed to create bufferevent for the output of task #{}",
+                task_id);
+    close(read_fd);
+    return false;
+  }
+
+  output->pending = evbuffer_new();
+  evbuffer_enable_locking(output->pending, nullptr);
+  output->tail.resize(m_options_.tail_buffer_bytes);
+
+  if (m_rate_limit_cfg_)
+    bufferevent_set_rate_limit(output->bev, m_rate_limit_cfg_);
+
+  bufferevent_setcb(output->bev, EvReadCb_, nullptr, EvEventCb_,
+                    output.get());
+  bufferevent_enable(output->bev, EV_READ);
+  bufferevent_disable(output->bev, EV_WRITE);
+
+  util::lock_guard guard(m_mtx_);
+  m_outputs_.emplace_back(std::move(output));
+  return true;
+}
+
+bool OutputManager::OpenTail(task_id_t task_id, int64_t offset,
+                             TailCursor* cursor) {
+  util::lock_guard guard(m_mtx_);
+
+  auto iter = std::find_if(
+      m_outputs_.begin(), m_outputs_.end(),
+      [task_id](const auto& output) { return output->task_id == task_id; });
+  if (iter == m_outputs_.end() || (*iter)->tail.empty()) return false;
+
+  cursor->output = *iter;
+
+  uint64_t total = cursor->output->total_bytes;
+  if (offset >= 0)
+    cursor->offset = offset;
+  else
+    cursor->offset = total - std::min<uint64_t>(-offset, total);
+  return true;
+}
+
+OutputManager::TailStatus OutputManager::ReadTail(TailCursor* cursor,
+                                                  size_t max_bytes,
+                                                  absl::Duration timeout,
+                                                  std::string* data,
+                                                  uint64_t* data_offset) {
+  TaskOutput* output = cursor->output.get();
+  absl::Time deadline = absl::Now() + timeout;
+
+  uint64_t file_offset;
+  size_t file_len;
+
+  {
+    util::lock_guard guard(m_mtx_);
+    while (cursor->offset >= output->total_bytes && !output->eof && !m_stop_)
+      if (m_tail_cv_.WaitWithDeadline(&m_mtx_, deadline)) break;
+
+    if (cursor->offset >= output->total_bytes)
+      return output->eof ? TailStatus::kEnd : TailStatus::kTimeout;
+
+    if (cursor->offset >= TailStartNoLock_(output) ||
+        !output->dest_base.has_value() ||
+        cursor->offset >= output->dest_bytes) {
+      CopyTailNoLock_(output, cursor, max_bytes, data, data_offset);
+      return TailStatus::kOk;
+    }
+
+    file_offset = output->dest_base.value() + cursor->offset;
+    file_len = std::min<uint64_t>({max_bytes,
+                                   TailStartNoLock_(output) - cursor->offset,
+                                   output->dest_bytes - cursor->offset});
+  }
+
+  // The bytes behind the ring buffer are read from the output file.
+  int fd = OpenAsUser(output->path, O_RDONLY | O_CLOEXEC, output->uid,
+                      output->gid);
+  ssize_t n = -1;
+  if (fd >= 0) {
+    data->resize(file_len);
+    n = pread(fd, data->data(), file_len, file_offset);
+    close(fd);
+  }
+
+  if (n > 0) {
+    data->resize(n);
+    *data_offset = cursor->offset;
+    cursor->offset += n;
+    return TailStatus::kOk;
+  }
+
+  CRANE_DEBUG("Failed to read the output of task #{} from {}: {}",
+              output->task_id, output->path,
+              n == 0 ? "unexpected end of file" : strerror(errno));
+
+  util::lock_guard guard(m_mtx_);
+  CopyTailNoLock_(output, cursor, max_bytes, data, data_offset);
+  return TailStatus::kOk;
+}
+
+uint64_t OutputManager::TailStartNoLock_(const TaskOutput* output) {
+  return output->total_bytes -
+         std::min<uint64_t>(output->tail.size(), output->total_bytes);
+}
+
+void OutputManager::CopyTailNoLock_(const TaskOutput* output,
+                                    TailCursor* cursor, size_t max_bytes,
+                                    std::string* data,
+                                    uint64_t* data_offset) {
+  // The bytes which have left the ring buffer are skipped.
+  cursor->offset = std::max(cursor->offset, TailStartNoLock_(output));
+
+  size_t capacity = output->tail.size();
+  size_t len =
+      std::min<uint64_t>(max_bytes, output->total_bytes - cursor->offset);
+  size_t pos = cursor->offset % capacity;
+  size_t first = std::min(len, capacity - pos);
+
+  data->resize(len);
+  memcpy(data->data(), output->tail.data() + pos, first);
+  memcpy(data->data() + first, output->tail.data(), len - first);
+
+  *data_offset = cursor->offset;
+  cursor->offset += len;
+}
+
+void OutputManager::AppendTailNoLock_(TaskOutput* output,
+                                      struct evbuffer* buf) {
+  if (output->tail.empty()) return;
+
+  size_t capacity = output->tail.size();
+  size_t len = evbuffer_get_length(buf);
+
+  // Only the last `capacity` bytes survive.
+  size_t skip = len > capacity ? len - capacity : 0;
+  output->total_bytes += skip;
+
+  evbuffer_ptr ptr;
+  evbuffer_ptr_set(buf, &ptr, skip, EVBUFFER_PTR_SET);
+
+  int n_vec = evbuffer_peek(buf, -1, &ptr, nullptr, 0);
+  std::vector<evbuffer_iovec> vecs(n_vec);
+  evbuffer_peek(buf, -1, &ptr, vecs.data(), n_vec);
+
+  for (const auto& vec : vecs) {
+    const char* src = static_cast<const char*>(vec.iov_base);
+    size_t remaining = vec.iov_len;
+    while (remaining > 0) {
+      size_t pos = output->total_bytes % capacity;
+      size_t count = std::min(remaining, capacity - pos);
+      memcpy(output->tail.data() + pos, src, count);
+      src += count;
+      remaining -= count;
+      output->total_bytes += count;
+    }
+  }
+}
+
+void OutputManager::EvReadCb_(struct bufferevent* bev, void* output) {
+  auto* out = reinterpret_cast<TaskOutput*>(output);
+  OutputManager* this_ = out->mgr;
+  struct evbuffer* input = bufferevent_get_input(bev);
+
+  if (!out->tail.empty()) {
+    {
+      util::lock_guard guard(this_->m_mtx_);
+      AppendTailNoLock_(out, input);
+    }
+    this_->m_tail_cv_.SignalAll();
+  }
+
+  // Only the chains of the evbuffer are moved.
+  evbuffer_remove_buffer(input, out->pending, evbuffer_get_length(input));
+
+  if (evbuffer_get_length(out->pending) < this_->m_options_.buffer_bytes)
+    return;
+
+  // The task blocks in write() once the pipe is full.
+  bufferevent_disable(bev, EV_READ);
+  {
+    util::lock_guard guard(this_->m_mtx_);
+    out->paused = true;
+    this_->m_flush_requested_ = true;
+  }
+  this_->m_cv_.Signal();
+}
+
+void OutputManager::EvEventCb_(struct bufferevent* bev, short events,
+                               void* output) {
+  auto* out = reinterpret_cast<TaskOutput*>(output);
+  OutputManager* this_ = out->mgr;
+
+  if (!(events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))) return;
+
+  if (events & BEV_EVENT_ERROR)
+    CRANE_ERROR("Failed to read the output of task #{}: {}", out->task_id,
+                strerror(errno));
+
+  {
+    util::lock_guard guard(this_->m_mtx_);
+    AppendTailNoLock_(out, bufferevent_get_input(bev));
+    out->eof = true;
+    this_->m_flush_requested_ = true;
+  }
+  this_->m_cv_.Signal();
+  this_->m_tail_cv_.SignalAll();
+
+  evbuffer_add_buffer(out->pending, bufferevent_get_input(bev));
+  bufferevent_free(bev);
+  out->bev = nullptr;
+}
+
+void OutputManager::EvResumeCb_(int, short events, void* user_data) {
+  auto* this_ = reinterpret_cast<OutputManager*>(user_data);
+
+  std::vector<struct bufferevent*> bevs;
+  {
+    util::lock_guard guard(this_->m_mtx_);
+    for (auto& output : this_->m_outputs_) {
+      if (output->paused && evbuffer_get_length(output->pending) <
+                                this_->m_options_.buffer_bytes) {
+        output->paused = false;
+        bevs.emplace_back(output->bev);
+      }
+    }
+  }
+
+  // A paused pipe is not read, so its bufferevent is not freed by EOF.
+  for (struct bufferevent* bev : bevs) bufferevent_enable(bev, EV_READ);
+}
+
+void OutputManager::WriterThread_() {
+  absl::Time last_flush_time = absl::Now();
+
+  while (true) {
+    std::vector<std::pair<TaskOutput*, bool /*eof*/>> outputs;
+    bool stop;
+    bool timed_flush;
+
+    m_mtx_.Lock();
+    if (!m_stop_ && !m_flush_requested_)
+      m_cv_.WaitWithTimeout(&m_mtx_, m_options_.flush_interval);
+
+    stop = m_stop_;
+    m_flush_requested_ = false;
+    for (auto& output : m_outputs_)
+      outputs.emplace_back(output.get(), output->eof);
+    m_mtx_.Unlock();
+
+    // Outputs are only removed by this thread, so the pointers stay valid.
+    absl::Time now = absl::Now();
+    timed_flush = now - last_flush_time >= m_options_.flush_interval;
+    if (timed_flush) last_flush_time = now;
+
+    bool drained = false;
+    for (auto [output, eof] : outputs) {
+      if (eof || timed_flush ||
+          evbuffer_get_length(output->pending) >= m_options_.buffer_bytes) {
+        FlushOutput_(output, eof);
+        drained = true;
+      }
+    }
+
+    {
+      util::lock_guard guard(m_mtx_);
+      m_outputs_.remove_if(
+          [](const auto& output) { return output->finished; });
+    }
+
+    if (stop) break;
+
+    if (drained) event_active(m_ev_resume_, 0, 0);
+  }
+}
+
+void OutputManager::FlushOutput_(TaskOutput* output, bool final) {
+  struct evbuffer* buf = output->pending;
+
+  if (output->failed) {
+    evbuffer_drain(buf, evbuffer_get_length(buf));
+  } else if (m_options_.staging_dir.empty()) {
+    size_t len = evbuffer_get_length(buf);
+    if ((len > 0 || final) && OpenDestFile_(output) &&
+        WriteBuffer_(output, buf, output->dest_fd, output->path))
+      AddDestBytes_(output, len);
+  } else {
+    // Staging is tried once for each output.
+    if (output->staging_path.empty() && evbuffer_get_length(buf) > 0) {
+      output->staging_path =
+          fmt::format("{}/{}.{}.out", m_options_.staging_dir,
+                      output->task_id, m_next_staging_id_++);
+      output->staging_fd =
+          open(output->staging_path.c_str(),
+               O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+      if (output->staging_fd < 0)
+        CRANE_WARN("Failed to create staging file {}: {}. Writing the output "
+                   "of task #{} to {} directly.",
+                   output->staging_path, strerror(errno), output->task_id,
+                   output->path);
+    }
+
+    if (output->staging_fd < 0) {
+      size_t len = evbuffer_get_length(buf);
+      if ((len > 0 || final) && OpenDestFile_(output) &&
+          WriteBuffer_(output, buf, output->dest_fd, output->path))
+        AddDestBytes_(output, len);
+    } else {
+      size_t len = evbuffer_get_length(buf);
+      if (WriteBuffer_(output, buf, output->staging_fd,
+                       output->staging_path))
+        output->staged_bytes += len;
+
+      if (output->staged_bytes >= m_options_.staging_flush_bytes || final)
+        CopyStagedOutput_(output);
+    }
+
+    // The output file is created even if the task prints nothing.
+    if (final && output->dest_fd < 0 && !output->failed) OpenDestFile_(output);
+  }
+
+  if (final) {
+    if (output->dest_fd >= 0) close(output->dest_fd);
+    if (output->staging_fd >= 0) {
+      close(output->staging_fd);
+      unlink(output->staging_path.c_str());
+    }
+    output->finished = true;
+  }
+}
+
+void OutputManager::CopyStagedOutput_(TaskOutput* output) {
+  if (output->staged_bytes == 0) return;
+
+  // sendfile() and copy_file_range() refuse a file opened with O_APPEND,
+  // which is kept so that several jobs can share an output file.
+  if (!output->failed && OpenDestFile_(output)) {
+    m_copy_buf_.resize(kCopyChunkBytes);
+
+    uint64_t offset = 0;
+    while (offset < output->staged_bytes) {
+      size_t count =
+          std::min<uint64_t>(kCopyChunkBytes, output->staged_bytes - offset);
+      ssize_t n = pread(output->staging_fd, m_copy_buf_.data(), count, offset);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0 || !WriteAll_(output->dest_fd, m_copy_buf_.data(), n)) {
+        CRANE_ERROR("Failed to copy the output of task #{} to {}: {}",
+                    output->task_id, output->path,
+                    n == 0 ? "unexpected end of file" : strerror(errno));
+        output->failed = true;
+        break;
+      }
+      offset += n;
+    }
+    AddDestBytes_(output, offset);
+  }
+
+  // The staging file is opened with O_APPEND, so later writes start from 0.
+  if (ftruncate(output->staging_fd, 0) != 0)
+    CRANE_ERROR("Failed to truncate staging file {}: {}",
+                output->staging_path, strerror(errno));
+  output->staged_bytes = 0;
+}
+
+bool OutputManager::OpenDestFile_(TaskOutput* output) {
+  if (output->dest_fd >= 0) return true;
+  if (output->failed) return false;
+
+  output->dest_fd =
+      OpenAsUser(output->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                 output->uid, output->gid);
+  if (output->dest_fd < 0) {
+    CRANE_ERROR("Failed to open output file {} of task #{}: {}",
+                output->path, output->task_id, strerror(errno));
+    output->failed = true;
+    return false;
+  }
+
+  // Other writers of the file are not taken into account.
+  off_t base = lseek(output->dest_fd, 0, SEEK_END);
+  if (base >= 0) {
+    util::lock_guard guard(m_mtx_);
+    output->dest_base = base;
+  }
+  return true;
+}
+
+void OutputManager::AddDestBytes_(TaskOutput* output, uint64_t n) {
+  util::lock_guard guard(m_mtx_);
+  output->dest_bytes += n;
+}
+
+bool OutputManager::WriteAll_(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool OutputManager::WriteBuffer_(TaskOutput* output, struct evbuffer* buf,
+                                 int fd, const std::string& path) {
+  // evbuffer_write() hands the chains of the evbuffer to writev().
+  while (evbuffer_get_length(buf) > 0) {
+    int n = evbuffer_write(buf, fd);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      CRANE_ERROR("Failed to write the output of task #{} to {}: {}",
+                  output->task_id, path, strerror(errno));
+      output->failed = true;
+      evbuffer_drain(buf, evbuffer_get_length(buf));
+      return false;
+    }
+  }
+  return true;
+}
+
+int OutputManager::OpenAsUser(const std::string& path, int flags, uid_t uid,
+                              gid_t gid) {
+  uid_t craned_uid = geteuid();
+  gid_t craned_gid = getegid();
+
+  // Only root can switch the credentials.
+  bool switch_cred = craned_uid == 0;
+
+  std::vector<gid_t> craned_groups;
+  if (switch_cred) {
+    int group_num = getgroups(0, nullptr);
+    if (group_num > 0) {
+      craned_groups.resize(group_num);
+      getgroups(group_num, craned_groups.data());
+    }
+
+    std::vector<gid_t> user_groups = GroupsOfUser_(uid, gid);
+    syscall(SYS_setgroups, user_groups.size(), user_groups.data());
+    setfsgid(gid);
+    setfsuid(uid);
+  }
+
+  int fd = open(path.c_str(), flags, 0644);
+  int saved_errno = errno;
+
+  if (switch_cred) {
+    setfsuid(craned_uid);
+    setfsgid(craned_gid);
+    syscall(SYS_setgroups, craned_groups.size(), craned_groups.data());
+  }
+
+  errno = saved_errno;
+  return fd;
+}
+
+std::vector<gid_t> OutputManager::GroupsOfUser_(uid_t uid, gid_t gid) {
+  // getpwuid() is not thread-safe.
+  long buf_size = sysconf(_SC_GETPW_R_SIZE_MAX);
+  std::vector<char> buf(buf_size > 0 ? buf_size : 16384);
+  passwd pwd{};
+  passwd* result = nullptr;
+  if (getpwuid_r(uid, &pwd, buf.data(), buf.size(), &result) != 0 ||
+      result == nullptr)
+    return {gid};
+
+  // The first call only gets the number of the groups.
+  int group_num = 0;
+  getgrouplist(pwd.pw_name, gid, nullptr, &group_num);
+
+  std::vector<gid_t> groups(group_num);
+  if (getgrouplist(pwd.pw_name, gid, groups.data(), &group_num) < 0)
+    return {gid};
+  groups.resize(group_num);
+
+  return groups;
+}
+
+}  // namespace Craned
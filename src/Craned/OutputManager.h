@@ -0,0 +1,236 @@
+#pragma once
+
+#include <absl/synchronization/mutex.h>
+#include <absl/time/time.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <sys/types.h>
+
+#include <list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CranedPublicDefs.h"
+#include "crane/Lock.h"
+#include "crane/PublicHeader.h"
+
+namespace Craned {
+
+/**
+ * Collects the stdout/stderr of batch tasks from pipes in the event loop of
+ * TaskManager and writes them to the output files in a writer thread.
+ *
+ * A task writing its output directly issues one tiny append to the shared
+ * filesystem per write(). Here the bytes read from the pipe of a task are
+ * moved into a bounded per-task evbuffer without copying
+ * (evbuffer_remove_buffer) and are written by writev() when the buffer is
+ * full, when the flush interval elapses or when the pipe is closed.
+ *
+ * When the buffer of a task is full, its pipe is not read until the writer
+ * drains the buffer, so a task producing output faster than it can be written
+ * blocks in write() instead of growing the memory of Craned. The read rate of
+ * each pipe can also be limited by a token bucket.
+ *
+ * With a staging directory, the flushed output is appended to a file on the
+ * local disk and copied to the output file in chunks of staging_flush_bytes
+ * and when the pipe is closed.
+ *
+ * The output files are opened with the fsuid and fsgid of the user of the
+ * task, so that the permission is checked as if the task opened them itself.
+ *
+ * The pipe is read independently of the SIGCHLD of the task, so the tail of
+ * the output may reach the output file shortly after the task is finished.
+ *
+ * The latest tail_buffer_bytes of each output are also kept in a ring buffer
+ * for TailTaskOutput. A reader behind the ring buffer reads the bytes already
+ * written to the output file from there and skips the ones still on the way.
+ */
+class OutputManager {
+ private:
+  struct TaskOutput;
+
+ public:
+  enum class TailStatus : uint8_t {
+    kOk,
+    kTimeout,
+    // The pipe is closed and all the output has been read.
+    kEnd,
+  };
+
+  // The position of a reader in an output. The output is kept alive by the
+  // cursor after the task ends.
+  struct TailCursor {
+    std::shared_ptr<TaskOutput> output;
+    uint64_t offset{0};
+  };
+
+  struct Options {
+    size_t buffer_bytes;
+    absl::Duration flush_interval;
+    // 0 means unlimited.
+    size_t rate_limit_bytes_per_sec;
+    // Empty disables staging.
+    std::string staging_dir;
+    uint64_t staging_flush_bytes;
+    // 0 disables the ring buffer and TailTaskOutput falls back to the file.
+    size_t tail_buffer_bytes;
+  };
+
+  OutputManager(struct event_base* base, Options options);
+
+  /**
+   * Writes out all the output collected so far. Must be called after the
+   * event loop exits.
+   */
+  ~OutputManager();
+
+  /**
+   * Start collecting the output from a pipe. Must be called in the thread of
+   * the event loop.
+   * @param read_fd The read end of the pipe, owned by OutputManager after this
+   *  call.
+   * @param path The output file, created if it does not exist.
+   * @return false if the pipe cannot be watched. read_fd is closed then.
+   */
+  bool AddOutput(task_id_t task_id, int read_fd, std::string path, uid_t uid,
+                 gid_t gid) LOCKS_EXCLUDED(m_mtx_);
+
+  /**
+   * @param offset The offset to start from. A negative value counts back
+   *  from the current end of the output.
+   * @return false if the output of the task is not captured or the ring
+   *  buffer is disabled.
+   */
+  bool OpenTail(task_id_t task_id, int64_t offset, TailCursor* cursor)
+      LOCKS_EXCLUDED(m_mtx_);
+
+  /**
+   * Wait for the output after the cursor and read at most max_bytes of it.
+   * @param[out] data_offset The offset of data, which may be ahead of the
+   *  cursor if the bytes in between are not available.
+   */
+  TailStatus ReadTail(TailCursor* cursor, size_t max_bytes,
+                      absl::Duration timeout, std::string* data,
+                      uint64_t* data_offset) LOCKS_EXCLUDED(m_mtx_);
+
+  /**
+   * open() with the fsuid, fsgid and supplementary groups of the user. The
+   * credentials are switched by raw syscalls which, unlike the glibc wrappers
+   * of setgroups() and the setuid() family, only affect the calling thread.
+   */
+  static int OpenAsUser(const std::string& path, int flags, uid_t uid,
+                        gid_t gid);
+
+ private:
+  // The size of each write from the staging file to the output file.
+  static constexpr size_t kCopyChunkBytes = 8 * 1024 * 1024;
+
+  struct TaskOutput {
+    ~TaskOutput() {
+      if (pending) evbuffer_free(pending);
+    }
+
+    OutputManager* mgr;
+
+    task_id_t task_id;
+    std::string path;
+    uid_t uid;
+    gid_t gid;
+
+    // Only touched in the thread of the event loop.
+    struct bufferevent* bev{nullptr};
+
+    // The bytes waiting for the writer. The locking of the evbuffer is
+    // enabled since it is filled and drained in different threads.
+    struct evbuffer* pending{nullptr};
+
+    // eof and paused are guarded by m_mtx_ of OutputManager.
+    // Set when the pipe is closed. No more bytes are added to pending then.
+    bool eof{false};
+    // Set when the pipe is not read because pending is full.
+    bool paused{false};
+
+    // The fields of the ring buffer are also guarded by m_mtx_.
+    std::vector<char> tail;
+    // The number of bytes read from the pipe so far.
+    uint64_t total_bytes{0};
+    // The offset of the output in the output file, known once it is opened,
+    // and the number of bytes written there.
+    std::optional<uint64_t> dest_base;
+    uint64_t dest_bytes{0};
+
+    /* ---------------- Only touched by the writer thread ------------------ */
+    int dest_fd{-1};
+    int staging_fd{-1};
+    std::string staging_path;
+    uint64_t staged_bytes{0};
+    // An error is logged once and the following output is discarded.
+    bool failed{false};
+    // Set after the final flush. The TaskOutput is removed then.
+    bool finished{false};
+  };
+
+  // Copy the bytes in buf to the ring buffer.
+  static void AppendTailNoLock_(TaskOutput* output, struct evbuffer* buf);
+
+  // The offset of the oldest byte in the ring buffer.
+  static uint64_t TailStartNoLock_(const TaskOutput* output);
+
+  static void CopyTailNoLock_(const TaskOutput* output, TailCursor* cursor,
+                              size_t max_bytes, std::string* data,
+                              uint64_t* data_offset);
+
+  static void EvReadCb_(struct bufferevent* bev, void* output);
+
+  static void EvEventCb_(struct bufferevent* bev, short events, void* output);
+
+  // Resumes reading the paused pipes whose buffers have been drained.
+  static void EvResumeCb_(int, short events, void* user_data);
+
+  void WriterThread_();
+
+  // @param final Write out everything and close the files.
+  void FlushOutput_(TaskOutput* output, bool final);
+
+  void CopyStagedOutput_(TaskOutput* output);
+
+  bool OpenDestFile_(TaskOutput* output) LOCKS_EXCLUDED(m_mtx_);
+
+  void AddDestBytes_(TaskOutput* output, uint64_t n) LOCKS_EXCLUDED(m_mtx_);
+
+  static bool WriteAll_(int fd, const char* data, size_t len);
+
+  // gid and the supplementary groups of the user, or only gid if the user is
+  // not found.
+  static std::vector<gid_t> GroupsOfUser_(uid_t uid, gid_t gid);
+
+  // Returns false and logs the error once if the write fails.
+  static bool WriteBuffer_(TaskOutput* output, struct evbuffer* buf, int fd,
+                           const std::string& path);
+
+  const Options m_options_;
+
+  struct event_base* m_ev_base_;
+  struct event* m_ev_resume_{nullptr};
+  struct ev_token_bucket_cfg* m_rate_limit_cfg_{nullptr};
+
+  /* ---------------- Only touched by the writer thread ------------------ */
+  uint64_t m_next_staging_id_{0};
+  std::vector<char> m_copy_buf_;
+
+  util::mutex m_mtx_;
+  absl::CondVar m_cv_;
+  // Signaled when any ring buffer grows or any pipe is closed.
+  absl::CondVar m_tail_cv_;
+  std::list<std::shared_ptr<TaskOutput>> m_outputs_ GUARDED_BY(m_mtx_);
+  bool m_flush_requested_ GUARDED_BY(m_mtx_) = false;
+  bool m_stop_ GUARDED_BY(m_mtx_) = false;
+
+  std::thread m_writer_thread_;
+};
+
+}  // namespace Craned
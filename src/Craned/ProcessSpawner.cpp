@@ -0,0 +1,382 @@
+#include "ProcessSpawner.h"
+
+#include <fcntl.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/util/delimited_message_util.h>
+#include <grp.h>
+#include <linux/sched.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <cstring>
+#include <vector>
+
+#include "crane/FdFunctions.h"
+
+namespace Craned {
+
+using google::protobuf::io::FileInputStream;
+using google::protobuf::io::FileOutputStream;
+using google::protobuf::util::ParseDelimitedFromZeroCopyStream;
+using google::protobuf::util::SerializeDelimitedToZeroCopyStream;
+
+using crane::grpc::subprocess::SpawnReply;
+using crane::grpc::subprocess::SpawnRequest;
+
+std::unique_ptr<ProcessSpawner> ProcessSpawner::Create() {
+  int socket_pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socket_pair) != 0) {
+    CRANE_ERROR("Failed to create socket pair for the spawner: {}",
+                strerror(errno));
+    return nullptr;
+  }
+
+  // Task processes are re-parented to the nearest subreaper when the
+  // intermediate process forked by the spawner exits.
+  if (prctl(PR_SET_CHILD_SUBREAPER, 1) != 0) {
+    CRANE_ERROR("Failed to make Craned a child subreaper: {}",
+                strerror(errno));
+    close(socket_pair[0]);
+    close(socket_pair[1]);
+    return nullptr;
+  }
+
+  pid_t craned_pid = getpid();
+  pid_t pid = fork();
+  if (pid < 0) {
+    CRANE_ERROR("Failed to fork the spawner: {}", strerror(errno));
+    close(socket_pair[0]);
+    close(socket_pair[1]);
+    return nullptr;
+  }
+
+  if (pid == 0) {  // Spawner proc
+    close(socket_pair[0]);
+
+    prctl(PR_SET_NAME, "craned-spawner");
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != craned_pid) _exit(0);
+
+    // SIGINT sent to the foreground process group is handled by Craned.
+    signal(SIGINT, SIG_IGN);
+
+    ServeLoop_(socket_pair[1]);
+  }
+
+  close(socket_pair[1]);
+  CRANE_DEBUG("Spawner process started. pid: {}", pid);
+
+  return std::unique_ptr<ProcessSpawner>(
+      new ProcessSpawner(pid, socket_pair[0]));
+}
+
+ProcessSpawner::~ProcessSpawner() {
+  // The spawner exits when it reads EOF.
+  close(m_fd_);
+}
+
+CraneErr ProcessSpawner::Spawn(const SpawnRequest& request, int child_fd,
+                               int output_fd, int cgroup_fd, pid_t* pid,
+                               bool* in_cgroup) {
+  util::lock_guard guard(m_mtx_);
+
+  int fds[kMaxFdNum] = {child_fd};
+  size_t fd_num = 1;
+  if (request.capture_output()) fds[fd_num++] = output_fd;
+  if (cgroup_fd >= 0) fds[fd_num++] = cgroup_fd;
+  if (!SendFds_(m_fd_, fds, fd_num)) {
+    CRANE_ERROR("Failed to pass fd to the spawner: {}", strerror(errno));
+    return CraneErr::kSystemErr;
+  }
+
+  FileOutputStream ostream(m_fd_);
+  bool ok = SerializeDelimitedToZeroCopyStream(request, &ostream);
+  ok &= ostream.Flush();
+  if (!ok) {
+    CRANE_ERROR("Failed to send spawn request to the spawner.");
+    return CraneErr::kProtobufError;
+  }
+
+  FileInputStream istream(m_fd_);
+  SpawnReply reply;
+  if (!ParseDelimitedFromZeroCopyStream(&reply, &istream, nullptr)) {
+    CRANE_ERROR("Failed to read spawn reply from the spawner.");
+    return CraneErr::kProtobufError;
+  }
+
+  if (!reply.ok()) {
+    CRANE_ERROR("The spawner failed to fork: {}", reply.reason());
+    return CraneErr::kSystemErr;
+  }
+
+  *pid = reply.pid();
+  *in_cgroup = reply.in_cgroup();
+  return CraneErr::kOk;
+}
+
+bool ProcessSpawner::SendFds_(int sock, const int* fds, size_t n) {
+  char byte = 0;
+  iovec iov{.iov_base = &byte, .iov_len = 1};
+
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxFdNum)]{};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+
+  ssize_t ret;
+  do {
+    ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (ret < 0 && errno == EINTR);
+
+  return ret == 1;
+}
+
+size_t ProcessSpawner::RecvFds_(int sock, int* fds) {
+  char byte;
+  iovec iov{.iov_base = &byte, .iov_len = 1};
+
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxFdNum)]{};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t ret;
+  do {
+    ret = recvmsg(sock, &msg, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret != 1) return 0;
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS) return 0;
+
+  size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+  return n;
+}
+
+void ProcessSpawner::ServeLoop_(int sock) {
+  while (true) {
+    int fds[kMaxFdNum];
+    size_t fd_num = RecvFds_(sock, fds);
+    if (fd_num == 0) _exit(0);
+
+    SpawnRequest request;
+    FileInputStream istream(sock);
+    if (!ParseDelimitedFromZeroCopyStream(&request, &istream, nullptr))
+      _exit(1);
+
+    size_t fd_idx = 0;
+    int child_fd = fds[fd_idx++];
+    int output_fd = -1;
+    if (request.capture_output() && fd_idx < fd_num)
+      output_fd = fds[fd_idx++];
+    int cgroup_fd = fd_idx < fd_num ? fds[fd_idx] : -1;
+
+    SpawnReply reply =
+        ForkTask_(sock, request, child_fd, output_fd, cgroup_fd);
+    for (size_t i = 0; i < fd_num; i++) close(fds[i]);
+
+    FileOutputStream ostream(sock);
+    bool ok = SerializeDelimitedToZeroCopyStream(reply, &ostream);
+    ok &= ostream.Flush();
+    if (!ok) _exit(1);
+  }
+}
+
+SpawnReply ProcessSpawner::ForkTask_(int sock, const SpawnRequest& request,
+                                     int child_fd, int output_fd,
+                                     int cgroup_fd) {
+  // Passed from the intermediate process to the spawner.
+  struct ForkResult {
+    pid_t pid;
+    bool in_cgroup;
+  };
+
+  SpawnReply reply;
+
+  int pid_pipe[2];
+  if (pipe2(pid_pipe, O_CLOEXEC) != 0) {
+    reply.set_ok(false);
+    reply.set_reason(fmt::format("pipe2: {}", strerror(errno)));
+    return reply;
+  }
+
+  pid_t mid_pid = fork();
+  if (mid_pid == 0) {  // Intermediate proc
+    close(sock);
+    close(pid_pipe[0]);
+
+    ForkResult result{-1, false};
+    if (cgroup_fd >= 0) {
+      result.pid = CloneIntoCgroup_(cgroup_fd);
+      result.in_cgroup = result.pid >= 0;
+    }
+    if (!result.in_cgroup) result.pid = fork();
+
+    if (result.pid == 0) {  // Task proc
+      close(pid_pipe[1]);
+      ExecTask_(request, child_fd, output_fd, !result.in_cgroup);
+    }
+
+    if (result.pid < 0) result.pid = -errno;
+    // The spawner reads a short write as a failure, so the task process
+    // which it doesn't know about is killed.
+    if (write(pid_pipe[1], &result, sizeof(result)) != sizeof(result)) {
+      if (result.pid > 0) kill(result.pid, SIGKILL);
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  close(pid_pipe[1]);
+  if (mid_pid < 0) {
+    close(pid_pipe[0]);
+    reply.set_ok(false);
+    reply.set_reason(fmt::format("fork: {}", strerror(errno)));
+    return reply;
+  }
+
+  ForkResult result{-EPIPE, false};
+  if (read(pid_pipe[0], &result, sizeof(result)) != sizeof(result))
+    result.pid = -EPIPE;
+  close(pid_pipe[0]);
+
+  // The task process has been re-parented to Craned once this returns.
+  waitpid(mid_pid, nullptr, 0);
+
+  if (result.pid <= 0) {
+    reply.set_ok(false);
+    reply.set_reason(fmt::format("fork: {}", strerror(-result.pid)));
+    return reply;
+  }
+
+  reply.set_ok(true);
+  reply.set_pid(result.pid);
+  reply.set_in_cgroup(result.in_cgroup);
+  return reply;
+}
+
+pid_t ProcessSpawner::CloneIntoCgroup_(int cgroup_fd) {
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+  clone_args args{};
+  args.flags = CLONE_INTO_CGROUP;
+  args.exit_signal = SIGCHLD;
+  args.cgroup = cgroup_fd;
+
+  // glibc provides no wrapper of clone3(). This is safe here since the
+  // intermediate process is single-threaded.
+  return static_cast<pid_t>(syscall(SYS_clone3, &args, sizeof(args)));
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+void ProcessSpawner::ExecTask_(const SpawnRequest& request, int child_fd,
+                               int output_fd, bool handshake) {
+  using crane::grpc::subprocess::CanStartMessage;
+  using crane::grpc::subprocess::ChildProcessReady;
+
+  // Set pgid to the pid of task root process.
+  setpgid(0, 0);
+
+  // The signal disposition set by the spawner survives execv().
+  signal(SIGINT, SIG_DFL);
+
+  // The task keeps the supplementary groups of the user as a login does.
+  gid_t gid = request.gid();
+  PasswordEntry pwd_entry(request.uid());
+  int groups_ret = pwd_entry.Valid()
+                       ? initgroups(pwd_entry.Username().c_str(), gid)
+                       : setgroups(1, &gid);
+  bool ok = groups_ret == 0 && setregid(gid, gid) == 0 &&
+            setreuid(request.uid(), request.uid()) == 0 &&
+            chdir(request.cwd().c_str()) == 0;
+
+  if (handshake) {
+    FileInputStream istream(child_fd);
+    CanStartMessage msg;
+    ParseDelimitedFromZeroCopyStream(&msg, &istream, nullptr);
+    if (!msg.ok()) std::abort();
+  }
+
+  int out_fd = -1;
+  if (ok) {
+    out_fd = open(request.output_file().c_str(), O_RDWR | O_CREAT | O_APPEND,
+                  0644);
+    ok = out_fd != -1;
+  }
+
+  if (handshake) {
+    FileOutputStream ostream(child_fd);
+    ChildProcessReady child_process_ready;
+    child_process_ready.set_ok(ok);
+    bool sent =
+        SerializeDelimitedToZeroCopyStream(child_process_ready, &ostream);
+    sent &= ostream.Flush();
+    if (!sent) std::abort();
+  }
+
+  // Without the handshake, the failure is only seen by the abnormal exit.
+  if (!ok) std::abort();
+
+  close(child_fd);
+
+  // The output file is written by Craned from the other end of the pipe.
+  if (output_fd >= 0) {
+    close(out_fd);
+    out_fd = output_fd;
+  }
+
+  dup2(out_fd, 1);  // stdout -> output file or pipe
+  dup2(out_fd, 2);  // stderr -> output file or pipe
+  close(out_fd);
+
+  // If these file descriptors are not closed, a program like mpirun may
+  // keep waiting for the input from stdin or other fds and will never end.
+  close(0);  // close stdin
+  util::CloseFdFrom(3);
+
+  for (const auto& str : request.env()) {
+    auto pos = str.find_first_of('=');
+    if (std::string::npos != pos) {
+      std::string name = str.substr(0, pos);
+      std::string value = str.substr(pos + 1);
+      setenv(name.c_str(), value.c_str(), 1);
+    }
+  }
+
+  // Prepare the command line arguments.
+  std::vector<const char*> argv;
+  argv.push_back(request.exec_path().c_str());
+  for (auto&& arg : request.args()) {
+    argv.push_back(arg.c_str());
+  }
+  argv.push_back(nullptr);
+
+  execv(request.exec_path().c_str(), const_cast<char* const*>(argv.data()));
+
+  // Error occurred since execv returned. At this point, errno is set.
+  // Ctld use SIGABRT to inform the client of this failure.
+  fmt::print(stderr, "[Craned Subprocess Error] Failed to execv. Error: {}\n",
+             strerror(errno));
+  // Todo: See https://tldp.org/LDP/abs/html/exitcodes.html, return standard
+  //  exit codes
+  abort();
+}
+
+}  // namespace Craned
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <memory>
+
+#include "CranedPublicDefs.h"
+#include "crane/Lock.h"
+#include "crane/PublicHeader.h"
+#include "protos/CraneSubprocess.pb.h"
+
+namespace Craned {
+
+/**
+ * A small single-threaded process forked at the start of Craned which forks
+ * the task processes on behalf of Craned. Forking the multi-threaded Craned
+ * itself costs time proportional to its memory footprint and requires
+ * switching the privilege of the whole daemon.
+ *
+ * The spawner forks an intermediate process which forks the task process and
+ * exits at once. Craned is a child subreaper, so the task process is
+ * re-parented to Craned, which reaps it when it exits.
+ *
+ * The task process drops its privilege to the user of the task, and then
+ * goes through the same CanStartMessage/ChildProcessReady handshake with
+ * Craned on the socket passed in the request before calling execv().
+ * stdout and stderr of the task go to the output file, or to the output pipe
+ * passed in the request when Craned captures the output.
+ *
+ * If the fd of a cgroup v2 directory is given, the task process is created
+ * directly inside that cgroup by clone3(CLONE_INTO_CGROUP). Craned then has
+ * nothing to do before execv(), so the handshake is skipped and a failure
+ * before execv() is reported by the exit status of the process. The spawner
+ * falls back to fork() and the handshake if clone3() is not supported.
+ */
+class ProcessSpawner {
+ public:
+  /**
+   * Fork the spawner process. Must be called before Craned creates any
+   * thread.
+   * @return nullptr if the spawner cannot be started.
+   */
+  static std::unique_ptr<ProcessSpawner> Create();
+
+  ~ProcessSpawner();
+
+  /**
+   * Ask the spawner to fork a task process.
+   * @param child_fd The end of the handshake socket pair for the task
+   *  process. It is duplicated into the spawner and can be closed after this
+   *  call.
+   * @param output_fd The write end of the output pipe if
+   *  request.capture_output() is set, or -1.
+   * @param cgroup_fd The fd of the cgroup v2 directory to create the process
+   *  in, or -1. Like child_fd, these fds can be closed after this call.
+   * @param[out] in_cgroup Set to true if the process is created inside the
+   *  cgroup and skips the handshake.
+   * @return kOk with *pid set on success. kSystemErr if the spawner is not
+   *  reachable or fails to fork. kProtobufError if the request or the reply
+   *  cannot be transferred.
+   */
+  CraneErr Spawn(const crane::grpc::subprocess::SpawnRequest& request,
+                 int child_fd, int output_fd, int cgroup_fd, pid_t* pid,
+                 bool* in_cgroup)
+      LOCKS_EXCLUDED(m_mtx_);
+
+ private:
+  ProcessSpawner(pid_t spawner_pid, int fd)
+      : m_spawner_pid_(spawner_pid), m_fd_(fd) {}
+
+  static constexpr size_t kMaxFdNum = 3;
+
+  static bool SendFds_(int sock, const int* fds, size_t n);
+
+  // Returns the number of fds received, 0 if the peer is closed or no fd is
+  // received.
+  static size_t RecvFds_(int sock, int* fds);
+
+  [[noreturn]] static void ServeLoop_(int sock);
+
+  static crane::grpc::subprocess::SpawnReply ForkTask_(
+      int sock, const crane::grpc::subprocess::SpawnRequest& request,
+      int child_fd, int output_fd, int cgroup_fd);
+
+  // Returns the pid like fork(). Sets errno to ENOSYS if clone3() or
+  // CLONE_INTO_CGROUP is not available.
+  static pid_t CloneIntoCgroup_(int cgroup_fd);
+
+  [[noreturn]] static void ExecTask_(
+      const crane::grpc::subprocess::SpawnRequest& request, int child_fd,
+      int output_fd, bool handshake);
+
+  pid_t m_spawner_pid_;
+
+  util::mutex m_mtx_;
+  int m_fd_ GUARDED_BY(m_mtx_);
+};
+
+}  // namespace Craned
+
+inline std::unique_ptr<Craned::ProcessSpawner> g_process_spawner;
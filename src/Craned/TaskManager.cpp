@@ -3,12 +3,18 @@
 #include <absl/strings/str_join.h>
 #include <absl/strings/str_split.h>
 #include <fcntl.h>
+#include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/util/delimited_message_util.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
+#include <algorithm>
 #include <utility>
 
+#include "ProcessSpawner.h"
 #include "ResourceAllocators.h"
 #include "crane/FdFunctions.h"
 #include "protos/CraneSubprocess.pb.h"
@@ -34,6 +40,19 @@ TaskManager::TaskManager()
     CRANE_ERROR("Could not initialize libevent!");
     std::terminate();
   }
+  m_timer_wheel_ =
+      std::make_unique<crane::EvTimerWheel>(m_ev_base_, kTimerWheelTick);
+  if (g_config.Output.Capture) {
+    m_output_mgr_ = std::make_unique<OutputManager>(
+        m_ev_base_,
+        OutputManager::Options{
+            .buffer_bytes = g_config.Output.BufferBytes,
+            .flush_interval = g_config.Output.FlushInterval,
+            .rate_limit_bytes_per_sec = g_config.Output.RateLimitBytesPerSec,
+            .staging_dir = g_config.Output.StagingDir,
+            .staging_flush_bytes = g_config.Output.StagingFlushBytes,
+            .tail_buffer_bytes = g_config.Output.TailBufferBytes});
+  }
   {  // SIGCHLD
     m_ev_sigchld_ = evsignal_new(m_ev_base_, SIGCHLD, EvSigchldCb_, this);
     if (!m_ev_sigchld_) {
@@ -46,6 +65,29 @@ TaskManager::TaskManager()
       std::terminate();
     }
   }
+  // Without cgroup.kill, processes forked while the others are being killed
+  // one by one may escape, so such cgroups are killed repeatedly by
+  // KillAndReleaseCgroups_ instead of being watched.
+  if (m_cg_mgr_.CgroupKillAvailable()) {
+    // cgroup.events of the cgroups being emptied
+    m_cg_inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_cg_inotify_fd_ < 0) {
+      CRANE_WARN("Failed to create the inotify instance: {}", strerror(errno));
+    } else {
+      m_ev_cg_events_ =
+          event_new(m_ev_base_, m_cg_inotify_fd_, EV_READ | EV_PERSIST,
+                    EvCgroupEventsCb_, this);
+      if (!m_ev_cg_events_) {
+        CRANE_ERROR("Failed to create the cgroup events event!");
+        std::terminate();
+      }
+
+      if (event_add(m_ev_cg_events_, nullptr) < 0) {
+        CRANE_ERROR("Could not add the cgroup events event to base!");
+        std::terminate();
+      }
+    }
+  }
   {  // SIGINT
     m_ev_sigint_ = evsignal_new(m_ev_base_, SIGINT, EvSigintCb_, this);
     if (!m_ev_sigint_) {
@@ -200,6 +242,46 @@ TaskManager::TaskManager()
       std::terminate();
     }
   }
+  {
+    m_ev_query_task_output_info_ =
+        event_new(m_ev_base_, -1, EV_READ | EV_PERSIST,
+                  EvQueryTaskOutputInfoCb_, this);
+    if (!m_ev_query_task_output_info_) {
+      CRANE_ERROR("Failed to create the query_task_output_info event!");
+      std::terminate();
+    }
+    if (event_add(m_ev_query_task_output_info_, nullptr) < 0) {
+      CRANE_ERROR("Could not add the m_ev_query_task_output_info_ to base!");
+      std::terminate();
+    }
+  }
+  {
+    m_ev_resume_process_output_ =
+        event_new(m_ev_base_, -1, EV_READ | EV_PERSIST,
+                  EvResumeProcessOutputCb_, this);
+    if (!m_ev_resume_process_output_) {
+      CRANE_ERROR("Failed to create the resume_process_output event!");
+      std::terminate();
+    }
+    if (event_add(m_ev_resume_process_output_, nullptr) < 0) {
+      CRANE_ERROR("Could not add the m_ev_resume_process_output_ to base!");
+      std::terminate();
+    }
+  }
+
+  if (g_config.CgroupSampleInterval > absl::ZeroDuration()) {
+    m_ev_sample_cg_usage_ =
+        event_new(m_ev_base_, -1, EV_PERSIST, EvSampleCgroupUsageCb_, this);
+    if (!m_ev_sample_cg_usage_) {
+      CRANE_ERROR("Failed to create the sample_cg_usage event!");
+      std::terminate();
+    }
+    timeval tv = absl::ToTimeval(g_config.CgroupSampleInterval);
+    if (evtimer_add(m_ev_sample_cg_usage_, &tv) < 0) {
+      CRANE_ERROR("Could not add the m_ev_sample_cg_usage_ to base!");
+      std::terminate();
+    }
+  }
 
   m_ev_loop_thread_ =
       std::thread([this]() { event_base_dispatch(m_ev_base_); });
@@ -210,6 +292,8 @@ TaskManager::~TaskManager() {
 
   if (m_ev_sigchld_) event_free(m_ev_sigchld_);
   if (m_ev_sigint_) event_free(m_ev_sigint_);
+  if (m_ev_cg_events_) event_free(m_ev_cg_events_);
+  if (m_cg_inotify_fd_ >= 0) close(m_cg_inotify_fd_);
 
   if (m_ev_grpc_interactive_task_) event_free(m_ev_grpc_interactive_task_);
   if (m_ev_query_task_info_of_uid_) event_free(m_ev_query_task_info_of_uid_);
@@ -220,9 +304,16 @@ TaskManager::~TaskManager() {
   if (m_ev_grpc_execute_task_) event_free(m_ev_grpc_execute_task_);
   if (m_ev_task_status_change_) event_free(m_ev_task_status_change_);
   if (m_ev_check_task_status_) event_free(m_ev_check_task_status_);
+  if (m_ev_query_task_output_info_) event_free(m_ev_query_task_output_info_);
+  if (m_ev_resume_process_output_) event_free(m_ev_resume_process_output_);
+  if (m_ev_sample_cg_usage_) event_free(m_ev_sample_cg_usage_);
 
   if (m_ev_exit_event_) event_free(m_ev_exit_event_);
 
+  // Its bufferevents and timer belong to m_ev_base_.
+  m_output_mgr_.reset();
+  m_timer_wheel_.reset();
+
   if (m_ev_base_) event_base_free(m_ev_base_);
 }
 
@@ -236,13 +327,27 @@ std::string TaskManager::CgroupStrByTaskId_(uint32_t task_id) {
   return fmt::format("Crane_Task_{}", task_id);
 }
 
+TaskManager::ProcessExitInfo TaskManager::ProcessExitInfoOf_(pid_t pid,
+                                                            int status) {
+  // Todo(More status tracing): WIFSTOPPED(status) and WIFCONTINUED(status)
+  if (WIFSIGNALED(status)) {
+    // Killed by signal WTERMSIG(status)
+    CRANE_TRACE("Reaped pid {}. Signaled: true, Signal: {}", pid,
+                WTERMSIG(status));
+    return {pid, true, WTERMSIG(status)};
+  }
+
+  // Exited with status WEXITSTATUS(status)
+  CRANE_TRACE("Reaped pid {}. Signaled: false, Status: {}", pid,
+              WEXITSTATUS(status));
+  return {pid, false, WEXITSTATUS(status)};
+}
+
 void TaskManager::EvSigchldCb_(evutil_socket_t sig, short events,
                                void* user_data) {
   assert(m_instance_ptr_->m_instance_ptr_ != nullptr);
   auto* this_ = reinterpret_cast<TaskManager*>(user_data);
 
-  SigchldInfo sigchld_info{};
-
   int status;
   pid_t pid;
   while (true) {
@@ -250,86 +355,7 @@ void TaskManager::EvSigchldCb_(evutil_socket_t sig, short events,
                   /* TODO(More status tracing): | WUNTRACED | WCONTINUED */);
 
     if (pid > 0) {
-      if (WIFEXITED(status)) {
-        // Exited with status WEXITSTATUS(status)
-        sigchld_info = {pid, false, WEXITSTATUS(status)};
-        CRANE_TRACE("Receiving SIGCHLD for pid {}. Signaled: false, Status: {}",
-                    pid, WEXITSTATUS(status));
-      } else if (WIFSIGNALED(status)) {
-        // Killed by signal WTERMSIG(status)
-        sigchld_info = {pid, true, WTERMSIG(status)};
-        CRANE_TRACE("Receiving SIGCHLD for pid {}. Signaled: true, Signal: {}",
-                    pid, WTERMSIG(status));
-      }
-      /* Todo(More status tracing):
-       else if (WIFSTOPPED(status)) {
-        printf("stopped by signal %d\n", WSTOPSIG(status));
-      } else if (WIFCONTINUED(status)) {
-        printf("continued\n");
-      } */
-
-      uint32_t task_id;
-      TaskInstance* instance;
-      ProcessInstance* proc;
-
-      auto task_iter = this_->m_pid_task_map_.find(pid);
-      auto proc_iter = this_->m_pid_proc_map_.find(pid);
-      if (task_iter == this_->m_pid_task_map_.end() ||
-          proc_iter == this_->m_pid_proc_map_.end())
-        CRANE_ERROR("Failed to find task id for pid {}.", pid);
-      else {
-        instance = task_iter->second;
-        proc = proc_iter->second;
-        task_id = instance->task.task_id();
-
-        proc->Finish(sigchld_info.is_terminated_by_signal, sigchld_info.value);
-
-        // Free the ProcessInstance. ITask struct is not freed here because
-        // the ITask for an Interactive task can have no ProcessInstance.
-        auto pr_it = instance->processes.find(pid);
-        if (pr_it == instance->processes.end()) {
-          CRANE_ERROR("Failed to find pid {} in task #{}'s ProcessInstances",
-                      task_id, pid);
-        } else {
-          instance->processes.erase(pr_it);
-
-          // Remove indexes from pid to ProcessInstance*
-          this_->m_pid_proc_map_.erase(proc_iter);
-
-          if (!instance->processes.empty()) {
-            if (sigchld_info.is_terminated_by_signal &&
-                !instance->already_failed) {
-              // If a task is terminated by a signal and there are other
-              //  running processes belonging to this task, kill them.
-              instance->already_failed = true;
-              this_->TerminateTaskAsync(task_id);
-            }
-          } else if (!instance->orphaned) {
-            // If the ProcessInstance has no process left and the task was not
-            // marked as an orphaned task, send TaskStatusChange for this task.
-            // See the comment of EvActivateTaskStatusChange_.
-            if (instance->task.type() == crane::grpc::Batch) {
-              // For a Batch task, the end of the process means it is done.
-              if (sigchld_info.is_terminated_by_signal) {
-                if (instance->cancelled_by_user)
-                  this_->EvActivateTaskStatusChange_(
-                      task_id, crane::grpc::TaskStatus::Cancelled,
-                      std::nullopt);
-                else
-                  this_->EvActivateTaskStatusChange_(
-                      task_id, crane::grpc::TaskStatus::Failed, std::nullopt);
-              } else
-                this_->EvActivateTaskStatusChange_(
-                    task_id, crane::grpc::TaskStatus::Finished, std::nullopt);
-            } else {
-              // For a COMPLETING Interactive task with a process running, the
-              // end of this process means that this task is done.
-              this_->EvActivateTaskStatusChange_(
-                  task_id, crane::grpc::TaskStatus::Finished, std::nullopt);
-            }
-          }
-        }
-      }
+      this_->EvOnProcessExit_(ProcessExitInfoOf_(pid, status));
     } else if (pid == 0) {
       // There's no child that needs reaping.
       // If Craned is exiting, check if there's any task remaining.
@@ -348,19 +374,252 @@ void TaskManager::EvSigchldCb_(evutil_socket_t sig, short events,
   }
 }
 
+void TaskManager::EvProcessExitCb_(int pidfd, short events, void* process) {
+  auto* this_ = m_instance_ptr_;
+  auto* proc = reinterpret_cast<ProcessInstance*>(process);
+
+  // The pid of a zombie is not reused until it is reaped, so the process is
+  // reaped by its pid.
+  int status;
+  pid_t pid = waitpid(proc->GetPid(), &status, WNOHANG);
+  if (pid <= 0) {
+    // The event is not added again, and EvSigchldCb_ reaps the process.
+    CRANE_DEBUG("Failed to reap subprocess {} on its pidfd: {}",
+                proc->GetPid(), pid == 0 ? "not exited" : strerror(errno));
+    return;
+  }
+
+  this_->EvOnProcessExit_(ProcessExitInfoOf_(pid, status));
+}
+
+void TaskManager::EvOnProcessExit_(const ProcessExitInfo& info) {
+  uint32_t task_id;
+  TaskInstance* instance;
+  ProcessInstance* proc;
+
+  auto task_iter = m_pid_task_map_.find(info.pid);
+  auto proc_iter = m_pid_proc_map_.find(info.pid);
+  if (task_iter == m_pid_task_map_.end() ||
+      proc_iter == m_pid_proc_map_.end()) {
+    // E.g. a daemon started by a task, which is re-parented to Craned when
+    // its parent exits.
+    CRANE_TRACE("Reaped pid {} which is not a process of any task.",
+                info.pid);
+    return;
+  }
+
+  instance = task_iter->second;
+  proc = proc_iter->second;
+  task_id = instance->task.task_id();
+
+  DrainProcessOutput_(proc);
+  proc->Finish(info.is_terminated_by_signal, info.value);
+
+  // Free the ProcessInstance. ITask struct is not freed here because
+  // the ITask for an Interactive task can have no ProcessInstance.
+  auto pr_it = instance->processes.find(info.pid);
+  if (pr_it == instance->processes.end()) {
+    CRANE_ERROR("Failed to find pid {} in task #{}'s ProcessInstances",
+                info.pid, task_id);
+    return;
+  }
+
+  // The pidfd event of the process is freed with it.
+  instance->processes.erase(pr_it);
+
+  // Remove indexes from pid to ProcessInstance*
+  m_pid_proc_map_.erase(proc_iter);
+  m_pid_task_map_.erase(task_iter);
+
+  if (!instance->processes.empty()) {
+    if (info.is_terminated_by_signal && !instance->already_failed) {
+      // If a task is terminated by a signal and there are other
+      //  running processes belonging to this task, kill them.
+      instance->already_failed = true;
+      TerminateTaskAsync(task_id);
+    }
+  } else if (!instance->orphaned) {
+    // If the ProcessInstance has no process left and the task was not
+    // marked as an orphaned task, send TaskStatusChange for this task.
+    // See the comment of EvActivateTaskStatusChange_.
+    if (instance->task.type() == crane::grpc::Batch) {
+      // For a Batch task, the end of the process means it is done.
+      if (info.is_terminated_by_signal) {
+        if (instance->cancelled_by_user)
+          EvFinishBatchTask_(task_id, crane::grpc::TaskStatus::Cancelled);
+        else
+          EvFinishBatchTask_(task_id, crane::grpc::TaskStatus::Failed);
+      } else
+        EvFinishBatchTask_(task_id, crane::grpc::TaskStatus::Finished);
+    } else {
+      // For a COMPLETING Interactive task with a process running, the
+      // end of this process means that this task is done.
+      EvActivateTaskStatusChange_(task_id, crane::grpc::TaskStatus::Finished,
+                                  std::nullopt);
+    }
+  }
+}
+
+void TaskManager::EvFinishBatchTask_(task_id_t task_id,
+                                     crane::grpc::TaskStatus status) {
+  auto cg_iter = m_task_id_to_cg_map_.find(task_id);
+  if (m_cg_inotify_fd_ >= 0 && cg_iter != m_task_id_to_cg_map_.end() &&
+      !cg_iter->second->Empty()) {
+    CRANE_TRACE("Killing the processes left by task #{}.", task_id);
+    cg_iter->second->KillAllProcesses();
+
+    bool watched =
+        EvWatchCgroupEmpty_(cg_iter->second, [this, task_id, status](bool) {
+          auto iter = m_task_map_.find(task_id);
+          if (iter == m_task_map_.end() || iter->second->orphaned) return;
+
+          // The task may have been cancelled during the wait.
+          EvActivateTaskStatusChange_(task_id,
+                                      iter->second->cancelled_by_user
+                                          ? crane::grpc::TaskStatus::Cancelled
+                                          : status,
+                                      std::nullopt);
+        });
+    if (watched) return;
+  }
+
+  EvActivateTaskStatusChange_(task_id, status, std::nullopt);
+}
+
+bool TaskManager::EvWatchCgroupEmpty_(util::Cgroup* cg,
+                                      std::function<void(bool)> done) {
+  if (m_cg_inotify_fd_ < 0) return false;
+
+  std::string path = cg->EventsFilePath();
+  int wd = inotify_add_watch(m_cg_inotify_fd_, path.c_str(), IN_MODIFY);
+  if (wd < 0) {
+    CRANE_ERROR("Failed to watch {}: {}", path, strerror(errno));
+    return false;
+  }
+
+  auto [iter, inserted] = m_cg_empty_waiters_.try_emplace(wd);
+  iter->second.callbacks.emplace_back(std::move(done));
+  if (inserted) {
+    iter->second.cg = cg;
+    iter->second.timeout_timer = m_timer_wheel_->AddTimer(
+        kCgroupEmptyTimeout, [this, wd] { EvFinishCgroupWatch_(wd, false); });
+  }
+
+  // The cgroup may have become empty before the watch was added.
+  if (cg->Empty()) EvFinishCgroupWatch_(wd, true);
+  return true;
+}
+
+void TaskManager::EvFinishCgroupWatch_(int wd, bool empty) {
+  auto iter = m_cg_empty_waiters_.find(wd);
+  if (iter == m_cg_empty_waiters_.end()) return;
+
+  CgroupEmptyWaiter waiter = std::move(iter->second);
+  m_cg_empty_waiters_.erase(iter);
+
+  m_timer_wheel_->CancelTimer(waiter.timeout_timer);
+  // Fails harmlessly if the cgroup has been removed.
+  inotify_rm_watch(m_cg_inotify_fd_, wd);
+
+  if (!empty)
+    CRANE_ERROR("Processes are still left in cgroup {} after {}s.",
+                waiter.cg->GetCgroupString(), kCgroupEmptyTimeout.count());
+
+  for (auto& cb : waiter.callbacks) cb(empty);
+}
+
+void TaskManager::EvCgroupEventsCb_(int fd, short events, void* user_data) {
+  auto* this_ = reinterpret_cast<TaskManager*>(user_data);
+
+  alignas(struct inotify_event) char buf[4096];
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    for (char* p = buf; p < buf + len;) {
+      auto* event = reinterpret_cast<struct inotify_event*>(p);
+      p += sizeof(struct inotify_event) + event->len;
+
+      auto iter = this_->m_cg_empty_waiters_.find(event->wd);
+      if (iter == this_->m_cg_empty_waiters_.end()) continue;
+
+      // cgroup.events is also modified when its "frozen" key changes.
+      // IN_IGNORED means that the cgroup has been removed.
+      if ((event->mask & IN_IGNORED) || iter->second.cg->Empty())
+        this_->EvFinishCgroupWatch_(event->wd, true);
+    }
+  }
+}
+
 void TaskManager::EvSubprocessReadCb_(struct bufferevent* bev, void* process) {
   auto* proc = reinterpret_cast<ProcessInstance*>(process);
+  evbuffer* input = bufferevent_get_input(bev);
+
+  if (proc->AwaitingReady()) {
+    // ChildProcessReady is prefixed by its length in varint.
+    size_t len = evbuffer_get_length(input);
+    const auto* data = evbuffer_pullup(input, -1);
+
+    google::protobuf::io::CodedInputStream coded(data, len);
+    uint32_t msg_len;
+    if (!coded.ReadVarint32(&msg_len) ||
+        coded.CurrentPosition() + msg_len > len)
+      return;  // Wait for more bytes.
+
+    crane::grpc::subprocess::ChildProcessReady child_process_ready;
+    bool ok = child_process_ready.ParseFromArray(
+        data + coded.CurrentPosition(), static_cast<int>(msg_len));
+    evbuffer_drain(input, coded.CurrentPosition() + msg_len);
+
+    proc->SetAwaitingReady(false);
+    bufferevent_set_timeouts(bev, nullptr, nullptr);
+
+    // The subprocess aborts by itself after replying false, and
+    // EvOnProcessExit_ handles the rest.
+    if (!ok || !child_process_ready.ok())
+      CRANE_ERROR(
+          "Subprocess {} failed to switch to the user, enter the working "
+          "directory or open the output file.",
+          proc->GetPid());
+    else
+      CRANE_TRACE("Subprocess {} is ready and calls execv.", proc->GetPid());
 
-  size_t buf_len = evbuffer_get_length(bev->input);
+    if (evbuffer_get_length(input) == 0) return;
+  }
 
-  std::string str;
-  str.resize(buf_len);
-  int n_copy = evbuffer_remove(bev->input, str.data(), buf_len);
+  size_t buf_len = evbuffer_get_length(input);
+  CRANE_TRACE("Read {:>4} bytes from subprocess (pid: {})", buf_len,
+              proc->GetPid());
 
-  CRANE_TRACE("Read {:>4} bytes from subprocess (pid: {}): {}", n_copy,
-              proc->GetPid(), str);
+  // Nobody consumes the bytes, so they are dropped without being copied.
+  if (!proc->HasOutputCb()) {
+    evbuffer_drain(input, buf_len);
+    return;
+  }
 
-  proc->Output(std::move(str));
+  // The consumer, e.g. a slow SrunX client, stops the reading so that the
+  // process blocks in write() instead of growing the memory of Craned.
+  if (!proc->Output(input)) {
+    CRANE_TRACE("Pause reading the output of subprocess {}", proc->GetPid());
+    proc->PauseOutput();
+  }
+}
+
+void TaskManager::EvSubprocessEventCb_(struct bufferevent* bev, short events,
+                                       void* process) {
+  auto* proc = reinterpret_cast<ProcessInstance*>(process);
+
+  if ((events & BEV_EVENT_TIMEOUT) && proc->AwaitingReady()) {
+    // The process has not called execv() and is alone in its process group.
+    CRANE_ERROR("Subprocess {} did not get ready in {}. Killing it.",
+                proc->GetPid(),
+                absl::FormatDuration(kChildProcessReadyTimeout));
+    proc->SetAwaitingReady(false);
+    kill(proc->GetPid(), SIGKILL);
+  }
+
+  // On EOF or error, the end of the subprocess is handled by
+  // EvOnProcessExit_.
+  if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT))
+    bufferevent_disable(bev, EV_READ);
 }
 
 void TaskManager::EvSigintCb_(int sig, short events, void* user_data) {
@@ -399,9 +658,19 @@ void TaskManager::EvSigintCb_(int sig, short events, void* user_data) {
       this_->ShutdownAsync();
     } else {
       CRANE_INFO(
-          "SIGINT has been triggered already. Sending SIGKILL to all process "
-          "groups instead.");
+          "SIGINT has been triggered already. Sending SIGKILL to all tasks "
+          "instead.");
       for (auto&& [task_id, task_instance] : this_->m_task_map_) {
+        // The cgroup also holds the processes which have left the process
+        // groups, and is killed at once.
+        auto cg_iter = this_->m_task_id_to_cg_map_.find(task_id);
+        if (cg_iter != this_->m_task_id_to_cg_map_.end() &&
+            cg_iter->second->KillAllProcesses()) {
+          CRANE_INFO("Killed the processes in the cgroup of task #{}",
+                     task_id);
+          continue;
+        }
+
         for (auto&& [pid, pr_instance] : task_instance->processes) {
           CRANE_INFO(
               "Sending SIGINT to the process group of task #{} with root "
@@ -458,13 +727,11 @@ void TaskManager::SetSigintCallback(std::function<void()> cb) {
 
 CraneErr TaskManager::SpawnProcessInInstance_(
     TaskInstance* instance, std::unique_ptr<ProcessInstance> process) {
-  using google::protobuf::io::FileInputStream;
   using google::protobuf::io::FileOutputStream;
-  using google::protobuf::util::ParseDelimitedFromZeroCopyStream;
   using google::protobuf::util::SerializeDelimitedToZeroCopyStream;
 
   using crane::grpc::subprocess::CanStartMessage;
-  using crane::grpc::subprocess::ChildProcessReady;
+  using crane::grpc::subprocess::SpawnRequest;
 
   int socket_pair[2];
 
@@ -473,206 +740,181 @@ CraneErr TaskManager::SpawnProcessInInstance_(
     return CraneErr::kSystemErr;
   }
 
-  // save the current uid/gid
-  savedPrivilege saved_priv;
-  saved_priv.uid = getuid();
-  saved_priv.gid = getgid();
-  saved_priv.cwd = get_current_dir_name();
-
-  int rc = setegid(instance->pwd_entry.Gid());
-  if (rc == -1) {
-    CRANE_ERROR("error: setegid. {}", strerror(errno));
-    return CraneErr::kSystemErr;
-  }
-  __gid_t gid_a[1] = {instance->pwd_entry.Gid()};
-  setgroups(1, gid_a);
-  rc = seteuid(instance->pwd_entry.Uid());
-  if (rc == -1) {
-    CRANE_ERROR("error: seteuid. {}", strerror(errno));
-    return CraneErr::kSystemErr;
-  }
-  const std::string& cwd = instance->task.cwd();
-  rc = chdir(cwd.c_str());
-  if (rc == -1) {
-    CRANE_ERROR("error: chdir to {}. {}", cwd.c_str(), strerror(errno));
-    return CraneErr::kSystemErr;
+  SpawnRequest request;
+  request.set_uid(instance->pwd_entry.Uid());
+  request.set_gid(instance->pwd_entry.Gid());
+  request.set_cwd(instance->task.cwd());
+  request.set_exec_path(process->GetExecPath());
+  for (auto&& arg : process->GetArgList()) request.add_args(arg);
+  request.set_output_file(process->batch_meta.parsed_output_file_pattern);
+
+  std::vector<std::string> env_vec =
+      absl::StrSplit(instance->task.env(), "||");
+  for (auto&& env : env_vec) request.add_env(std::move(env));
+
+  std::string nodelist = absl::StrJoin(instance->task.allocated_nodes(), ";");
+  request.add_env(fmt::format("CRANE_JOB_NODELIST={}", nodelist));
+
+  // The output of a batch task goes through a pipe to OutputManager, which
+  // writes the output file in large chunks.
+  int output_pipe[2] = {-1, -1};
+  if (m_output_mgr_ && instance->task.type() == crane::grpc::Batch) {
+    if (pipe2(output_pipe, O_CLOEXEC) != 0) {
+      CRANE_ERROR("Failed to create output pipe for task #{}: {}",
+                  instance->task.task_id(), strerror(errno));
+      close(socket_pair[0]);
+      close(socket_pair[1]);
+      return CraneErr::kSystemErr;
+    }
+    request.set_capture_output(true);
   }
 
-  pid_t child_pid = fork();
-  if (child_pid > 0) {  // Parent proc
-    close(socket_pair[1]);
-    int fd = socket_pair[0];
-    bool ok;
-    CraneErr err;
-
-    setegid(saved_priv.gid);
-    seteuid(saved_priv.uid);
-    setgroups(0, nullptr);
-    chdir(saved_priv.cwd.c_str());
-
-    FileInputStream istream(fd);
-    FileOutputStream ostream(fd);
-    CanStartMessage msg;
-    ChildProcessReady child_process_ready;
-
-    CRANE_DEBUG("Subprocess was created for task #{} pid: {}",
-                instance->task.task_id(), child_pid);
+  // The task process is forked by the spawner instead of Craned itself.
+  // With cgroup v2, it is created inside the cgroup of the task, and the
+  // migration and the handshake below are skipped.
+  int cgroup_fd = m_cg_mgr_.OpenCgroupFd(instance->cg_path);
+  pid_t child_pid;
+  bool in_cgroup = false;
+  CraneErr err =
+      g_process_spawner->Spawn(request, socket_pair[1], output_pipe[1],
+                               cgroup_fd, &child_pid, &in_cgroup);
+  close(socket_pair[1]);
+  if (output_pipe[1] >= 0) close(output_pipe[1]);
+  if (cgroup_fd >= 0) close(cgroup_fd);
+  if (err != CraneErr::kOk) {
+    close(socket_pair[0]);
+    if (output_pipe[0] >= 0) close(output_pipe[0]);
+    return err;
+  }
 
-    process->SetPid(child_pid);
+  int fd = socket_pair[0];
+  bool ok;
 
-    // Add event for stdout/stderr of the new subprocess
-    struct bufferevent* ev_buf_event;
-    ev_buf_event =
-        bufferevent_socket_new(m_ev_base_, fd, BEV_OPT_CLOSE_ON_FREE);
-    if (!ev_buf_event) {
-      CRANE_ERROR(
-          "Error constructing bufferevent for the subprocess of task #!",
-          instance->task.task_id());
-      err = CraneErr::kLibEventError;
-      goto AskChildToSuicide;
-    }
-    bufferevent_setcb(ev_buf_event, EvSubprocessReadCb_, nullptr, nullptr,
-                      (void*)process.get());
-    bufferevent_enable(ev_buf_event, EV_READ);
-    bufferevent_disable(ev_buf_event, EV_WRITE);
+  FileOutputStream ostream(fd);
+  CanStartMessage msg;
 
-    process->SetEvBufEvent(ev_buf_event);
+  CRANE_DEBUG("Subprocess was created for task #{} pid: {}",
+              instance->task.task_id(), child_pid);
 
-    // Migrate the new subprocess to newly created cgroup
-    if (!m_cg_mgr_.MigrateProcTo(process->GetPid(), instance->cg_path)) {
-      CRANE_ERROR(
-          "Terminate the subprocess of task #{} due to failure of cgroup "
-          "migration.",
-          instance->task.task_id());
+  process->SetPid(child_pid);
 
-      m_cg_mgr_.Release(instance->cg_path);
-      err = CraneErr::kCgroupError;
-      goto AskChildToSuicide;
-    }
-
-    CRANE_TRACE("New task #{} is ready. Asking subprocess to execv...",
+  // Add event for stdout/stderr of the new subprocess
+  struct bufferevent* ev_buf_event;
+  ev_buf_event = bufferevent_socket_new(m_ev_base_, fd, BEV_OPT_CLOSE_ON_FREE);
+  if (!ev_buf_event) {
+    CRANE_ERROR("Error constructing bufferevent for the subprocess of task #{}",
                 instance->task.task_id());
-
-    // Tell subprocess that the parent process is ready. Then the
-    // subprocess should continue to exec().
-    msg.set_ok(true);
-    ok = SerializeDelimitedToZeroCopyStream(msg, &ostream);
-    ok &= ostream.Flush();
-    if (!ok) {
-      CRANE_ERROR("Failed to ask subprocess {} to suicide for task #{}",
-                  child_pid, instance->task.task_id());
-      return CraneErr::kProtobufError;
-    }
-
-    ParseDelimitedFromZeroCopyStream(&child_process_ready, &istream, nullptr);
-    if (!msg.ok()) {
-      CRANE_ERROR("Failed to read protobuf from subprocess {} of task #{}",
-                  child_pid, instance->task.task_id());
-      return CraneErr::kProtobufError;
+    if (output_pipe[0] >= 0) close(output_pipe[0]);
+
+    if (in_cgroup) {
+      // The subprocess doesn't wait for CanStartMessage and may have already
+      // called execv(), so it is killed instead.
+      kill(child_pid, SIGKILL);
+      close(fd);
+      return CraneErr::kLibEventError;
     }
 
-    // Add indexes from pid to TaskInstance*, ProcessInstance*
-    m_pid_task_map_.emplace(child_pid, instance);
-    m_pid_proc_map_.emplace(child_pid, process.get());
-
-    // Move the ownership of ProcessInstance into the TaskInstance.
-    instance->processes.emplace(child_pid, std::move(process));
-
-    return CraneErr::kOk;
-
-  AskChildToSuicide:
-    msg.set_ok(false);
-
-    ok = SerializeDelimitedToZeroCopyStream(msg, &ostream);
-    if (!ok) {
-      CRANE_ERROR("Failed to ask subprocess {} to suicide for task #{}",
-                  child_pid, instance->task.task_id());
-      return CraneErr::kProtobufError;
-    }
-    return err;
-  } else {  // Child proc
-    // CRANE_TRACE("Set reuid to {}, regid to {}", instance->pwd_entry.Uid(),
-    //              instance->pwd_entry.Gid());
-    setreuid(instance->pwd_entry.Uid(), instance->pwd_entry.Uid());
-    setregid(instance->pwd_entry.Gid(), instance->pwd_entry.Gid());
-
-    // Set pgid to the pid of task root process.
-    setpgid(0, 0);
-
-    close(socket_pair[0]);
-    int fd = socket_pair[1];
+    err = CraneErr::kLibEventError;
+    goto AskChildToSuicide;
+  }
+  bufferevent_setcb(ev_buf_event, EvSubprocessReadCb_, nullptr,
+                    EvSubprocessEventCb_, (void*)process.get());
+  bufferevent_enable(ev_buf_event, EV_READ);
+  bufferevent_disable(ev_buf_event, EV_WRITE);
+
+  process->SetEvBufEvent(ev_buf_event);
+
+  // The pipe is drained until every process holding its write end exits,
+  // including the case that the task process is asked to suicide below.
+  if (output_pipe[0] >= 0)
+    m_output_mgr_->AddOutput(instance->task.task_id(), output_pipe[0],
+                             process->batch_meta.parsed_output_file_pattern,
+                             instance->pwd_entry.Uid(),
+                             instance->pwd_entry.Gid());
+
+  // A failure of the subprocess before execv() is reported by its exit.
+  if (in_cgroup) goto RegisterProcess;
+
+  // Migrate the new subprocess to newly created cgroup
+  if (!m_cg_mgr_.MigrateProcTo(process->GetPid(), instance->cg_path)) {
+    CRANE_ERROR(
+        "Terminate the subprocess of task #{} due to failure of cgroup "
+        "migration.",
+        instance->task.task_id());
 
-    FileInputStream istream(fd);
-    FileOutputStream ostream(fd);
-    CanStartMessage msg;
-    ChildProcessReady child_process_ready;
-    bool ok;
+    g_thread_pool->push_task([cg_mgr = &m_cg_mgr_, path = instance->cg_path] {
+      cg_mgr->Release(path);
+    });
+    err = CraneErr::kCgroupError;
+    goto AskChildToSuicide;
+  }
 
-    ParseDelimitedFromZeroCopyStream(&msg, &istream, nullptr);
-    if (!msg.ok()) std::abort();
+  CRANE_TRACE("New task #{} is ready. Asking subprocess to execv...",
+              instance->task.task_id());
+
+  // Tell subprocess that the parent process is ready. Then the
+  // subprocess should continue to exec().
+  msg.set_ok(true);
+  ok = SerializeDelimitedToZeroCopyStream(msg, &ostream);
+  ok &= ostream.Flush();
+  if (!ok) {
+    CRANE_ERROR("Failed to ask subprocess {} to suicide for task #{}",
+                child_pid, instance->task.task_id());
+    return CraneErr::kProtobufError;
+  }
 
-    int out_fd = open(process->batch_meta.parsed_output_file_pattern.c_str(),
-                      O_RDWR | O_CREAT | O_APPEND, 0644);
-    if (out_fd == -1) {
-      std::abort();
-    }
+  {
+    // ChildProcessReady is read by EvSubprocessReadCb_ so that a slow
+    // subprocess does not block the event loop.
+    timeval tv = absl::ToTimeval(kChildProcessReadyTimeout);
+    bufferevent_set_timeouts(ev_buf_event, &tv, nullptr);
+    process->SetAwaitingReady(true);
+  }
 
-    child_process_ready.set_ok(true);
-    ok = SerializeDelimitedToZeroCopyStream(child_process_ready, &ostream);
-    ok &= ostream.Flush();
-    if (!ok) {
-      std::abort();
+RegisterProcess:
+  {
+    // The exit of the process is noticed on its pidfd. SIGCHLD is only
+    // relied on if pidfd_open(), added in Linux 5.3, is not available.
+    int pidfd = -1;
+#ifdef SYS_pidfd_open
+    pidfd = static_cast<int>(syscall(SYS_pidfd_open, child_pid, 0));
+#endif
+    if (pidfd < 0) {
+      CRANE_TRACE("pidfd_open() failed for subprocess {}: {}", child_pid,
+                  strerror(errno));
+    } else {
+      struct event* ev_exit = event_new(m_ev_base_, pidfd, EV_READ,
+                                        EvProcessExitCb_, process.get());
+      if (ev_exit != nullptr && event_add(ev_exit, nullptr) == 0) {
+        process->SetExitEvent(ev_exit);
+      } else {
+        CRANE_ERROR("Failed to add the exit event of subprocess {}.",
+                    child_pid);
+        if (ev_exit != nullptr) event_free(ev_exit);
+        close(pidfd);
+      }
     }
+  }
 
-    close(fd);
-
-    dup2(out_fd, 1);  // stdout -> output file
-    dup2(out_fd, 2);  // stderr -> output file
-    close(out_fd);
-
-    // If these file descriptors are not closed, a program like mpirun may
-    // keep waiting for the input from stdin or other fds and will never end.
-    close(0);  // close stdin
-    util::CloseFdFrom(3);
-
-    std::vector<std::string> env_vec =
-        absl::StrSplit(instance->task.env(), "||");
+  // Add indexes from pid to TaskInstance*, ProcessInstance*
+  m_pid_task_map_.emplace(child_pid, instance);
+  m_pid_proc_map_.emplace(child_pid, process.get());
 
-    std::string nodelist = absl::StrJoin(instance->task.allocated_nodes(), ";");
-    std::string nodelist_env = fmt::format("CRANE_JOB_NODELIST={}", nodelist);
+  // Move the ownership of ProcessInstance into the TaskInstance.
+  instance->processes.emplace(child_pid, std::move(process));
 
-    env_vec.emplace_back(nodelist_env);
+  return CraneErr::kOk;
 
-    for (const auto& str : env_vec) {
-      auto pos = str.find_first_of('=');
-      if (std::string::npos != pos) {
-        std::string name = str.substr(0, pos);
-        std::string value = str.substr(pos + 1);
-        if (setenv(name.c_str(), value.c_str(), 1)) {
-          // fmt::print("set environ failed!\n");
-        }
-      }
-    }
+AskChildToSuicide:
+  msg.set_ok(false);
 
-    // Prepare the command line arguments.
-    std::vector<const char*> argv;
-    argv.push_back(process->GetExecPath().c_str());
-    for (auto&& arg : process->GetArgList()) {
-      argv.push_back(arg.c_str());
-    }
-    argv.push_back(nullptr);
-
-    execv(process->GetExecPath().c_str(),
-          const_cast<char* const*>(argv.data()));
-
-    // Error occurred since execv returned. At this point, errno is set.
-    // Ctld use SIGABRT to inform the client of this failure.
-    fmt::print(stderr, "[Craned Subprocess Error] Failed to execv. Error: {}\n",
-               strerror(errno));
-    // Todo: See https://tldp.org/LDP/abs/html/exitcodes.html, return standard
-    //  exit codes
-    abort();
+  ok = SerializeDelimitedToZeroCopyStream(msg, &ostream);
+  if (!ok) {
+    CRANE_ERROR("Failed to ask subprocess {} to suicide for task #{}",
+                child_pid, instance->task.task_id());
+    return CraneErr::kProtobufError;
   }
+  return err;
 }
 
 CraneErr TaskManager::ExecuteTaskAsync(crane::grpc::TaskToD task) {
@@ -700,6 +942,8 @@ void TaskManager::EvGrpcExecuteTaskCb_(int, short events, void* user_data) {
         popped_instance->task.task_id(), std::move(popped_instance));
 
     TaskInstance* instance = iter->second.get();
+    this_->m_running_task_num_.store(this_->m_task_map_.size(),
+                                     std::memory_order_relaxed);
 
     // Add task id to the running task set of the UID.
     // Pam module need it.
@@ -804,12 +1048,6 @@ void TaskManager::EvGrpcExecuteTaskCb_(int, short events, void* user_data) {
         process->batch_meta.parsed_output_file_pattern += ".out";
       }
 
-      auto output_cb = [](std::string&& buf, void* data) {
-        CRANE_TRACE("Read output from subprocess: {}", buf);
-      };
-
-      process->SetOutputCb(std::move(output_cb));
-
       err = this_->SpawnProcessInInstance_(instance, std::move(process));
 
       if (err != CraneErr::kOk) {
@@ -822,8 +1060,8 @@ void TaskManager::EvGrpcExecuteTaskCb_(int, short events, void* user_data) {
     }
 
     // Add a timer to limit the execution time of a task.
-    this_->EvAddTerminationTimer_(instance,
-                                  instance->task.time_limit().seconds());
+    this_->EvAddTerminationTimer_(
+        instance, std::chrono::seconds(instance->task.time_limit().seconds()));
   }
 }
 
@@ -852,13 +1090,19 @@ void TaskManager::EvTaskStatusChangeCb_(int efd, short events,
     TaskInstance* task_instance = iter->second.get();
     uid_t uid = task_instance->task.uid();
 
-    if (task_instance->termination_timer) {
-      event_del(task_instance->termination_timer);
-      event_free(task_instance->termination_timer);
-    }
+    this_->m_timer_wheel_->CancelTimer(task_instance->termination_timer);
+
+    // The cgroup is kept until CraneCtld releases it, so the final counters
+    // can still be read here.
+    auto cg_iter = this_->m_task_id_to_cg_map_.find(status_change.task_id);
+    if (cg_iter != this_->m_task_id_to_cg_map_.end())
+      cg_iter->second->SampleUsage(&task_instance->cg_usage);
+    status_change.usage = task_instance->cg_usage;
 
     // Free the TaskInstance structure
     this_->m_task_map_.erase(status_change.task_id);
+    this_->m_running_task_num_.store(this_->m_task_map_.size(),
+                                     std::memory_order_relaxed);
 
     CRANE_TRACE("Put TaskStatusChange for task #{} into queue.",
                 status_change.task_id);
@@ -885,34 +1129,32 @@ void TaskManager::EvActivateTaskStatusChange_(
   event_active(m_ev_task_status_change_, 0, 0);
 }
 
-CraneErr TaskManager::SpawnInteractiveTaskAsync(
+void TaskManager::SpawnInteractiveTaskAsync(
     uint32_t task_id, std::string executive_path,
     std::list<std::string> arguments,
-    std::function<void(std::string&&, void*)> output_cb,
-    std::function<void(bool, int, void*)> finish_cb) {
+    std::function<bool(struct evbuffer*, pid_t)> output_cb,
+    std::function<void(bool, int, void*)> finish_cb,
+    std::function<void(CraneErr)> done) {
   EvQueueGrpcInteractiveTask elem{
+      .done = std::move(done),
       .task_id = task_id,
       .executive_path = std::move(executive_path),
       .arguments = std::move(arguments),
       .output_cb = std::move(output_cb),
       .finish_cb = std::move(finish_cb),
   };
-  std::future<CraneErr> err_future = elem.err_promise.get_future();
 
   m_grpc_interactive_task_queue_.enqueue(std::move(elem));
   event_active(m_ev_grpc_interactive_task_, 0, 0);
-
-  return err_future.get();
 }
 
-std::optional<uint32_t> TaskManager::QueryTaskIdFromPidAsync(pid_t pid) {
-  EvQueueQueryTaskIdFromPid elem{.pid = pid};
-  std::future<std::optional<uint32_t>> task_id_opt_future =
-      elem.task_id_prom.get_future();
+void TaskManager::QueryTaskIdFromPidAsync(
+    std::vector<pid_t> pids,
+    std::function<void(std::optional<uint32_t>)> done) {
+  EvQueueQueryTaskIdFromPid elem{.done = std::move(done),
+                                 .pids = std::move(pids)};
   m_query_task_id_from_pid_queue_.enqueue(std::move(elem));
   event_active(m_ev_query_task_id_from_pid_, 0, 0);
-
-  return task_id_opt_future.get();
 }
 
 void TaskManager::EvGrpcSpawnInteractiveTaskCb_(int efd, short events,
@@ -927,15 +1169,15 @@ void TaskManager::EvGrpcSpawnInteractiveTaskCb_(int efd, short events,
     auto task_iter = this_->m_task_map_.find(elem.task_id);
     if (task_iter == this_->m_task_map_.end()) {
       CRANE_ERROR("Cannot find task #{}", elem.task_id);
-      elem.err_promise.set_value(CraneErr::kNonExistent);
-      return;
+      elem.done(CraneErr::kNonExistent);
+      continue;
     }
 
     if (task_iter->second->task.type() != crane::grpc::Interactive) {
       CRANE_ERROR("Try spawning a new process in non-interactive task #{}!",
                   elem.task_id);
-      elem.err_promise.set_value(CraneErr::kInvalidParam);
-      return;
+      elem.done(CraneErr::kInvalidParam);
+      continue;
     }
 
     auto process = std::make_unique<ProcessInstance>(
@@ -947,7 +1189,7 @@ void TaskManager::EvGrpcSpawnInteractiveTaskCb_(int efd, short events,
     CraneErr err;
     err = this_->SpawnProcessInInstance_(task_iter->second.get(),
                                          std::move(process));
-    elem.err_promise.set_value(err);
+    elem.done(err);
 
     if (err != CraneErr::kOk)
       this_->EvActivateTaskStatusChange_(elem.task_id, crane::grpc::Failed,
@@ -961,31 +1203,40 @@ void TaskManager::EvGrpcQueryTaskIdFromPidCb_(int efd, short events,
 
   EvQueueQueryTaskIdFromPid elem;
   while (this_->m_query_task_id_from_pid_queue_.try_dequeue(elem)) {
-    auto task_iter = this_->m_pid_task_map_.find(elem.pid);
-    if (task_iter == this_->m_pid_task_map_.end())
-      elem.task_id_prom.set_value(std::nullopt);
-    else {
-      TaskInstance* instance = task_iter->second;
-      uint32_t task_id = instance->task.task_id();
-      elem.task_id_prom.set_value(task_id);
+    std::optional<uint32_t> task_id;
+    for (pid_t pid : elem.pids) {
+      auto task_iter = this_->m_pid_task_map_.find(pid);
+      if (task_iter != this_->m_pid_task_map_.end()) {
+        task_id = task_iter->second->task.task_id();
+        break;
+      }
     }
+
+    elem.done(task_id);
   }
 }
 
-void TaskManager::EvOnTimerCb_(int, short, void* arg_) {
-  auto* arg = reinterpret_cast<EvTimerCbArg*>(arg_);
-  TaskManager* this_ = arg->task_manager;
+void TaskManager::EvSampleCgroupUsageCb_(int, short, void* user_data) {
+  auto* this_ = reinterpret_cast<TaskManager*>(user_data);
+
+  for (auto& [task_id, instance] : this_->m_task_map_) {
+    auto cg_iter = this_->m_task_id_to_cg_map_.find(task_id);
+    if (cg_iter == this_->m_task_id_to_cg_map_.end()) continue;
+
+    cg_iter->second->SampleUsage(&instance->cg_usage);
+  }
+}
 
-  CRANE_TRACE("Task #{} exceeded its time limit. Terminating it...",
-              arg->task_instance->task.task_id());
+void TaskManager::EvOnTerminationTimer_(task_id_t task_id) {
+  auto iter = m_task_map_.find(task_id);
+  if (iter == m_task_map_.end()) return;
+  iter->second->termination_timer = crane::TimerWheel::kInvalidTimerId;
 
-  EvQueueTaskTerminate ev_task_terminate{arg->task_instance->task.task_id()};
-  this_->m_task_terminate_queue_.enqueue(ev_task_terminate);
-  event_active(this_->m_ev_task_terminate_, 0, 0);
+  CRANE_TRACE("Task #{} exceeded its time limit. Terminating it...", task_id);
 
-  event_del(arg->timer_ev);
-  event_free(arg->timer_ev);
-  arg->task_instance->termination_timer = nullptr;
+  EvQueueTaskTerminate ev_task_terminate{task_id};
+  m_task_terminate_queue_.enqueue(ev_task_terminate);
+  event_active(m_ev_task_terminate_, 0, 0);
 }
 
 void TaskManager::EvTerminateTaskCb_(int efd, short events, void* user_data) {
@@ -1037,45 +1288,55 @@ void TaskManager::MarkTaskAsOrphanedAndTerminateAsync(task_id_t task_id) {
   event_active(m_ev_task_terminate_, 0, 0);
 }
 
-bool TaskManager::CreateCgroupAsync(uint32_t task_id, uid_t uid) {
-  EvQueueCreateCg elem{.task_id = task_id, .uid = uid};
+void TaskManager::CreateCgroupsAsync(
+    std::vector<std::pair<task_id_t, uid_t>>&& task_uid_pairs,
+    std::function<void(std::vector<task_id_t>)> done) {
+  EvQueueCreateCg elem{.task_uid_pairs = std::move(task_uid_pairs),
+                       .done = std::move(done)};
 
-  std::future<bool> ok_fut = elem.ok_prom.get_future();
   m_grpc_create_cg_queue_.enqueue(std::move(elem));
   event_active(m_ev_grpc_create_cg_, 0, 0);
-  return ok_fut.get();
 }
 
-bool TaskManager::ReleaseCgroupAsync(uint32_t task_id, uid_t uid) {
-  EvQueueReleaseCg elem{.task_id = task_id, .uid = uid};
+void TaskManager::ReleaseCgroupAsync(uint32_t task_id, uid_t uid,
+                                     std::function<void(bool)> done) {
+  EvQueueReleaseCg elem{
+      .task_id = task_id, .uid = uid, .done = std::move(done)};
 
-  std::future<bool> ok_fut = elem.ok_prom.get_future();
   m_grpc_release_cg_queue_.enqueue(std::move(elem));
   event_active(m_ev_grpc_release_cg_, 0, 0);
-  return ok_fut.get();
 }
 
 void TaskManager::EvGrpcCreateCgroupCb_(int efd, short events,
                                         void* user_data) {
   auto* this_ = reinterpret_cast<TaskManager*>(user_data);
 
+  // Drain all the requests queued since the last wakeup so that concurrent
+  // callers are served in the same round.
+  std::vector<EvQueueCreateCg> batch;
   EvQueueCreateCg create_cg;
-  while (this_->m_grpc_create_cg_queue_.try_dequeue(create_cg)) {
-    CRANE_DEBUG("Creating Cgroup for task #{}", create_cg.task_id);
-
-    std::string cg_path = CgroupStrByTaskId_(create_cg.task_id);
-    util::Cgroup* cgroup;
-    cgroup = this_->m_cg_mgr_.CreateOrOpen(cg_path, util::ALL_CONTROLLER_FLAG,
-                                           util::NO_CONTROLLER_FLAG, false);
-    // Create cgroup for the new subprocess
-    if (!cgroup) {
-      CRANE_ERROR("Failed to create cgroup for task #{}", create_cg.task_id);
-      create_cg.ok_prom.set_value(false);
-    } else {
-      create_cg.ok_prom.set_value(true);
-      this_->m_task_id_to_cg_map_.emplace(create_cg.task_id, cgroup);
-      this_->m_uid_to_task_ids_map_[create_cg.uid].emplace(create_cg.task_id);
+  while (this_->m_grpc_create_cg_queue_.try_dequeue(create_cg))
+    batch.emplace_back(std::move(create_cg));
+
+  for (auto& elem : batch) {
+    std::vector<task_id_t> failed_task_ids;
+
+    for (auto const& [task_id, uid] : elem.task_uid_pairs) {
+      CRANE_DEBUG("Creating Cgroup for task #{}", task_id);
+
+      std::string cg_path = CgroupStrByTaskId_(task_id);
+      util::Cgroup* cgroup = this_->m_cg_mgr_.AcquireFromPool(cg_path);
+      // Create cgroup for the new subprocess
+      if (!cgroup) {
+        CRANE_ERROR("Failed to create cgroup for task #{}", task_id);
+        failed_task_ids.emplace_back(task_id);
+      } else {
+        this_->m_task_id_to_cg_map_.emplace(task_id, cgroup);
+        this_->m_uid_to_task_ids_map_[uid].emplace(task_id);
+      }
     }
+
+    elem.done(std::move(failed_task_ids));
   }
 }
 
@@ -1083,6 +1344,8 @@ void TaskManager::EvGrpcReleaseCgroupCb_(int efd, short events,
                                          void* user_data) {
   auto* this_ = reinterpret_cast<TaskManager*>(user_data);
 
+  std::vector<std::pair<task_id_t, util::Cgroup*>> cgs_to_release;
+
   EvQueueReleaseCg release_cg;
   while (this_->m_grpc_release_cg_queue_.try_dequeue(release_cg)) {
     CRANE_DEBUG("Destroying Cgroup for task #{}", release_cg.task_id);
@@ -1098,63 +1361,90 @@ void TaskManager::EvGrpcReleaseCgroupCb_(int efd, short events,
           "Trying to release a non-existent cgroup for task #{}. "
           "Ignoring it...",
           release_cg.task_id);
-      release_cg.ok_prom.set_value(false);
-      return;
-    } else {
-      // The termination of all processes in a cgroup is a time-consuming work.
-      // Therefore, once we are sure that the cgroup for this task exists, we
-      // let gRPC call return and put the termination work into the thread pool
-      // to avoid blocking the event loop of TaskManager.
-      // Kind of async behavior.
-      release_cg.ok_prom.set_value(true);
-
-      util::Cgroup* cg = iter->second;
-      this_->m_task_id_to_cg_map_.erase(iter);
-
-      g_thread_pool->push_task(
-          [cg, cg_mgr = &this_->m_cg_mgr_, task_id = release_cg.task_id] {
-            bool rc;
-            int cnt = 0;
-
-            while (true) {
-              if (cg->Empty()) {
-                CRANE_TRACE("Cgroup {} now has no process inside.",
-                            cg->GetCgroupString());
-                break;
-              }
-
-              if (cnt >= 5) {
-                CRANE_ERROR(
-                    "Couldn't kill the processes in cgroup {} after {} times. "
-                    "Skipping it.",
-                    cg->GetCgroupString(), cnt);
-                break;
-              }
-
-              cg->KillAllProcesses();
-              ++cnt;
-              std::this_thread::sleep_for(std::chrono::milliseconds(200));
-            }
-
-            rc = cg_mgr->Release(cg->GetCgroupString());
-            // Release cgroup for the new subprocess
-            if (!rc) {
-              CRANE_ERROR("Failed to Release cgroup for task #{}", task_id);
-            }
+      release_cg.done(false);
+      continue;
+    }
+
+    // The termination of all processes in a cgroup is a time-consuming work.
+    // Therefore, once we are sure that the cgroup for this task exists, we
+    // let gRPC call return and wait for the termination asynchronously.
+    release_cg.done(true);
+
+    task_id_t task_id = release_cg.task_id;
+    util::Cgroup* cg = iter->second;
+    this_->m_task_id_to_cg_map_.erase(iter);
+
+    // With cgroup.kill, the whole process tree is killed by one write and
+    // the cgroup is removed once it is reported empty. Otherwise, the
+    // cgroup is killed and polled repeatedly in the thread pool.
+    if (this_->m_cg_inotify_fd_ >= 0) {
+      cg->KillAllProcesses();
+      bool watched = this_->EvWatchCgroupEmpty_(
+          cg, [cg_mgr = &this_->m_cg_mgr_, task_id, cg](bool) {
+            // Releasing may recycle the cgroup into the pool, so it is done
+            // in the thread pool. A cgroup still having processes after the
+            // timeout is killed a few more times there before it is
+            // released.
+            g_thread_pool->push_task([cg_mgr, task_id, cg] {
+              KillAndReleaseCgroups_({{task_id, cg}}, cg_mgr);
+            });
           });
+      if (watched) continue;
     }
+
+    cgs_to_release.emplace_back(task_id, cg);
   }
+
+  if (cgs_to_release.empty()) return;
+
+  g_thread_pool->push_task(
+      [cgs = std::move(cgs_to_release), cg_mgr = &this_->m_cg_mgr_]() mutable {
+        KillAndReleaseCgroups_(std::move(cgs), cg_mgr);
+      });
 }
 
-bool TaskManager::QueryTaskInfoOfUidAsync(uid_t uid, TaskInfoOfUid* info) {
-  EvQueueQueryTaskInfoOfUid elem{.uid = uid};
+void TaskManager::KillAndReleaseCgroups_(
+    std::vector<std::pair<task_id_t, util::Cgroup*>> cgs,
+    util::CgroupManager* cg_mgr) {
+  // All the cgroups in a batch are killed and then polled together, so the
+  // batch waits for one retry interval per round instead of one per cgroup.
+  for (int cnt = 0; !cgs.empty(); ++cnt) {
+    auto non_empty_begin =
+        std::partition(cgs.begin(), cgs.end(),
+                       [](auto const& p) { return p.second->Empty(); });
+
+    for (auto it = cgs.begin(); it != non_empty_begin; ++it)
+      CRANE_TRACE("Cgroup {} now has no process inside.",
+                  it->second->GetCgroupString());
+
+    if (cnt >= 5) {
+      for (auto it = non_empty_begin; it != cgs.end(); ++it)
+        CRANE_ERROR(
+            "Couldn't kill the processes in cgroup {} after {} times. "
+            "Skipping it.",
+            it->second->GetCgroupString(), cnt);
+      non_empty_begin = cgs.end();
+    }
+
+    for (auto it = cgs.begin(); it != non_empty_begin; ++it) {
+      // Release cgroup for the new subprocess
+      if (!cg_mgr->Release(it->second->GetCgroupString()))
+        CRANE_ERROR("Failed to Release cgroup for task #{}", it->first);
+    }
+    cgs.erase(cgs.begin(), non_empty_begin);
+    if (cgs.empty()) break;
+
+    for (auto& [task_id, cg] : cgs) cg->KillAllProcesses();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  }
+}
+
+void TaskManager::QueryTaskInfoOfUidAsync(
+    uid_t uid, std::function<void(bool, const TaskInfoOfUid&)> done) {
+  EvQueueQueryTaskInfoOfUid elem{.uid = uid, .done = std::move(done)};
 
-  std::future<TaskInfoOfUid> info_fut = elem.info_prom.get_future();
   m_query_task_info_of_uid_queue_.enqueue(std::move(elem));
   event_active(m_ev_query_task_info_of_uid_, 0, 0);
-
-  *info = info_fut.get();
-  return info->job_cnt > 0 && info->cgroup_exists;
 }
 
 void TaskManager::EvGrpcQueryTaskInfoOfUidCb_(int efd, short events,
@@ -1182,19 +1472,16 @@ void TaskManager::EvGrpcQueryTaskInfoOfUidCb_(int efd, short events,
       }
     }
 
-    query.info_prom.set_value(info);
+    query.done(info.job_cnt > 0 && info.cgroup_exists, info);
   }
 }
 
-bool TaskManager::QueryCgOfTaskIdAsync(uint32_t task_id, util::Cgroup** cg) {
-  EvQueueQueryCgOfTaskId elem{.task_id = task_id};
+void TaskManager::QueryCgOfTaskIdAsync(
+    uint32_t task_id, std::function<void(util::Cgroup*)> done) {
+  EvQueueQueryCgOfTaskId elem{.task_id = task_id, .done = std::move(done)};
 
-  std::future<util::Cgroup*> cg_fut = elem.cg_prom.get_future();
   m_query_cg_of_task_id_queue_.enqueue(std::move(elem));
   event_active(m_ev_query_cg_of_task_id_, 0, 0);
-
-  *cg = cg_fut.get();
-  return *cg != nullptr;
 }
 
 void TaskManager::EvGrpcQueryCgOfTaskIdCb_(int efd, short events,
@@ -1207,28 +1494,20 @@ void TaskManager::EvGrpcQueryCgOfTaskIdCb_(int efd, short events,
 
     auto iter = this_->m_task_id_to_cg_map_.find(query.task_id);
     if (iter != this_->m_task_id_to_cg_map_.end()) {
-      query.cg_prom.set_value(iter->second);
+      query.done(iter->second);
     } else {
-      query.cg_prom.set_value(nullptr);
+      query.done(nullptr);
     }
   }
 }
 
-bool TaskManager::CheckTaskStatusAsync(task_id_t task_id,
-                                       crane::grpc::TaskStatus* status) {
-  EvQueueCheckTaskStatus elem{.task_id = task_id};
-
-  std::future<std::pair<bool, crane::grpc::TaskStatus>> res{
-      elem.status_prom.get_future()};
+void TaskManager::CheckTaskStatusAsync(
+    task_id_t task_id,
+    std::function<void(bool, crane::grpc::TaskStatus)> done) {
+  EvQueueCheckTaskStatus elem{.task_id = task_id, .done = std::move(done)};
 
   m_check_task_status_queue_.enqueue(std::move(elem));
   event_active(m_ev_check_task_status_, 0, 0);
-
-  auto [ok, task_status] = res.get();
-  if (!ok) return false;
-
-  *status = task_status;
-  return true;
 }
 
 void TaskManager::EvCheckTaskStatusCb_(int, short events, void* user_data) {
@@ -1240,7 +1519,7 @@ void TaskManager::EvCheckTaskStatusCb_(int, short events, void* user_data) {
     auto it = this_->m_task_map_.find(task_id);
     if (it != this_->m_task_map_.end()) {
       // Found in task map. The task must be running.
-      elem.status_prom.set_value({true, crane::grpc::TaskStatus::Running});
+      elem.done(true, crane::grpc::TaskStatus::Running);
       continue;
     }
 
@@ -1251,13 +1530,85 @@ void TaskManager::EvCheckTaskStatusCb_(int, short events, void* user_data) {
     bool exist =
         g_ctld_client->CancelTaskStatusChangeByTaskId(task_id, &status);
     if (exist) {
-      elem.status_prom.set_value({true, status});
+      elem.done(true, status);
       continue;
     }
 
-    elem.status_prom.set_value(
-        {false, /* Invalid Value*/ crane::grpc::Pending});
+    elem.done(false, /* Invalid Value*/ crane::grpc::Pending);
   }
 }
 
+void TaskManager::QueryTaskOutputInfoAsync(
+    task_id_t task_id,
+    std::function<void(std::optional<TaskOutputInfo>)> done) {
+  EvQueueQueryTaskOutputInfo elem{.task_id = task_id, .done = std::move(done)};
+
+  m_query_task_output_info_queue_.enqueue(std::move(elem));
+  event_active(m_ev_query_task_output_info_, 0, 0);
+}
+
+void TaskManager::EvQueryTaskOutputInfoCb_(int, short events,
+                                           void* user_data) {
+  auto* this_ = reinterpret_cast<TaskManager*>(user_data);
+
+  EvQueueQueryTaskOutputInfo elem;
+  while (this_->m_query_task_output_info_queue_.try_dequeue(elem)) {
+    auto iter = this_->m_task_map_.find(elem.task_id);
+    if (iter == this_->m_task_map_.end() ||
+        iter->second->task.type() != crane::grpc::Batch ||
+        iter->second->processes.empty()) {
+      elem.done(std::nullopt);
+      continue;
+    }
+
+    const TaskInstance* instance = iter->second.get();
+    const ProcessInstance* process = instance->processes.begin()->second.get();
+    elem.done(
+        TaskOutputInfo{.path = process->batch_meta.parsed_output_file_pattern,
+                       .uid = instance->pwd_entry.Uid(),
+                       .gid = instance->pwd_entry.Gid()});
+  }
+}
+
+void TaskManager::ResumeProcessOutputAsync(pid_t pid) {
+  m_resume_process_output_queue_.enqueue(pid);
+  event_active(m_ev_resume_process_output_, 0, 0);
+}
+
+void TaskManager::EvResumeProcessOutputCb_(int, short events,
+                                           void* user_data) {
+  auto* this_ = reinterpret_cast<TaskManager*>(user_data);
+
+  pid_t pid;
+  while (this_->m_resume_process_output_queue_.try_dequeue(pid)) {
+    auto iter = this_->m_pid_proc_map_.find(pid);
+    if (iter == this_->m_pid_proc_map_.end()) continue;
+
+    CRANE_TRACE("Resume reading the output of subprocess {}", pid);
+    iter->second->ResumeOutput();
+  }
+}
+
+void TaskManager::DrainProcessOutput_(ProcessInstance* proc) {
+  if (!proc->HasOutputCb() || proc->AwaitingReady()) return;
+
+  // The socket is blocking, and its write end may still be held by the
+  // descendants of the process, so only the bytes available now are read.
+  evbuffer* input = proc->OutputBuffer();
+  int fd = proc->OutputFd();
+  char buf[16 * 1024];
+  while (evbuffer_get_length(input) < kMaxDrainedOutputBytes) {
+    ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n > 0) {
+      evbuffer_add(input, buf, n);
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else {
+      break;
+    }
+  }
+
+  if (evbuffer_get_length(input) > 0) proc->Output(input);
+}
+
 }  // namespace Craned
@@ -11,6 +11,7 @@
 #include <grpc++/grpc++.h>
 #include <sys/eventfd.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
 #include <any>
 #include <atomic>
@@ -18,7 +19,6 @@
 #include <csignal>
 #include <forward_list>
 #include <functional>
-#include <future>
 #include <optional>
 #include <string>
 #include <thread>
@@ -26,7 +26,9 @@
 
 #include "CranedPublicDefs.h"
 #include "CtldClient.h"
+#include "OutputManager.h"
 #include "crane/PublicHeader.h"
+#include "crane/TimerWheel.h"
 #include "protos/Crane.grpc.pb.h"
 #include "protos/Crane.pb.h"
 
@@ -43,6 +45,7 @@ class ProcessInstance {
         m_arguments_(std::move(arg_list)),
         m_pid_(0),
         m_ev_buf_event_(nullptr),
+        m_ev_exit_(nullptr),
         m_user_data_(nullptr) {}
 
   ~ProcessInstance() {
@@ -56,6 +59,11 @@ class ProcessInstance {
     }
 
     if (m_ev_buf_event_) bufferevent_free(m_ev_buf_event_);
+    if (m_ev_exit_) {
+      int pidfd = event_get_fd(m_ev_exit_);
+      event_free(m_ev_exit_);
+      close(pidfd);
+    }
   }
 
   [[nodiscard]] const std::string& GetExecPath() const {
@@ -72,16 +80,37 @@ class ProcessInstance {
     m_ev_buf_event_ = ev_buf_event;
   }
 
-  void SetOutputCb(std::function<void(std::string&&, void*)> cb) {
+  // The event owns its pidfd, which is closed with it.
+  void SetExitEvent(struct event* ev_exit) { m_ev_exit_ = ev_exit; }
+
+  void SetAwaitingReady(bool awaiting) { m_awaiting_ready_ = awaiting; }
+  [[nodiscard]] bool AwaitingReady() const { return m_awaiting_ready_; }
+
+  void SetOutputCb(std::function<bool(struct evbuffer*, pid_t)> cb) {
     m_output_cb_ = std::move(cb);
   }
 
+  [[nodiscard]] bool HasOutputCb() const { return bool(m_output_cb_); }
+
   void SetFinishCb(std::function<void(bool, int, void*)> cb) {
     m_finish_cb_ = std::move(cb);
   }
 
-  void Output(std::string&& buf) {
-    if (m_output_cb_) m_output_cb_(std::move(buf), m_user_data_);
+  // Returns false if the reading of the output should be paused.
+  bool Output(struct evbuffer* buf) {
+    return !m_output_cb_ || m_output_cb_(buf, m_pid_);
+  }
+
+  void PauseOutput() { bufferevent_disable(m_ev_buf_event_, EV_READ); }
+
+  void ResumeOutput() { bufferevent_enable(m_ev_buf_event_, EV_READ); }
+
+  [[nodiscard]] int OutputFd() const {
+    return bufferevent_getfd(m_ev_buf_event_);
+  }
+
+  [[nodiscard]] struct evbuffer* OutputBuffer() const {
+    return bufferevent_get_input(m_ev_buf_event_);
   }
 
   void Finish(bool is_killed, int val) {
@@ -102,15 +131,27 @@ class ProcessInstance {
   // The underlying event that handles the output of the task.
   struct bufferevent* m_ev_buf_event_;
 
+  // The event on the pidfd of the process, which becomes readable when the
+  // process exits. nullptr if pidfd_open() is not supported.
+  struct event* m_ev_exit_;
+
+  // Whether ChildProcessReady has not been received from the subprocess.
+  bool m_awaiting_ready_{false};
+
   /* ------- Fields set by the caller of SpawnProcessInInstance_  -------- */
   std::string m_executive_path_;
   std::list<std::string> m_arguments_;
 
   /***
-   * The callback function called when a task writes to stdout or stderr.
-   * @param[in] buf a slice of output buffer.
+   * The callback function called in the event loop when a task writes to
+   * stdout or stderr.
+   * @param[in] buf the output read so far. The callback moves the bytes out
+   * of it, e.g. by evbuffer_add_buffer(), instead of copying them.
+   * @param[in] pid the pid of the process, used to resume the reading.
+   * @return false to stop reading the output until
+   * TaskManager::ResumeProcessOutputAsync(pid) is called.
    */
-  std::function<void(std::string&& buf, void*)> m_output_cb_;
+  std::function<bool(struct evbuffer* buf, pid_t pid)> m_output_cb_;
 
   /***
    * The callback function called when a task is finished.
@@ -146,7 +187,10 @@ struct TaskInstance {
 
   // The cgroup name that restrains the TaskInstance.
   std::string cg_path;
-  struct event* termination_timer{nullptr};
+  // The latest resource usage sampled from the cgroup of this task.
+  util::CgroupUsage cg_usage;
+  crane::TimerWheel::TimerId termination_timer{
+      crane::TimerWheel::kInvalidTimerId};
 
   std::unordered_map<pid_t, std::unique_ptr<ProcessInstance>> processes;
 };
@@ -165,27 +209,78 @@ class TaskManager {
 
   CraneErr ExecuteTaskAsync(crane::grpc::TaskToD task);
 
-  CraneErr SpawnInteractiveTaskAsync(
+  /*
+   * The methods below taking a done callback return at once. The callback is
+   * called in the thread of the event loop with the result, so that a gRPC
+   * reactor can finish the RPC from there without a thread waiting for it.
+   * It must not block.
+   */
+
+  void SpawnInteractiveTaskAsync(
       uint32_t task_id, std::string executive_path,
       std::list<std::string> arguments,
-      std::function<void(std::string&&, void*)> output_cb,
-      std::function<void(bool, int, void*)> finish_cb);
+      std::function<bool(struct evbuffer*, pid_t)> output_cb,
+      std::function<void(bool, int, void*)> finish_cb,
+      std::function<void(CraneErr)> done);
 
-  std::optional<uint32_t> QueryTaskIdFromPidAsync(pid_t pid);
+  /**
+   * Resume reading the output of an interactive process whose output
+   * callback returned false. Does nothing if the process has exited.
+   */
+  void ResumeProcessOutputAsync(pid_t pid);
+
+  /**
+   * Find the task of the first pid in pids that belongs to one, e.g. a pid
+   * followed by its ancestors.
+   */
+  void QueryTaskIdFromPidAsync(
+      std::vector<pid_t> pids,
+      std::function<void(std::optional<uint32_t>)> done);
 
-  bool QueryCgOfTaskIdAsync(uint32_t task_id, util::Cgroup** cg);
+  // The cgroup is nullptr if not found.
+  void QueryCgOfTaskIdAsync(uint32_t task_id,
+                            std::function<void(util::Cgroup*)> done);
 
-  bool QueryTaskInfoOfUidAsync(uid_t uid, TaskInfoOfUid* info);
+  // The bool is true if the uid has a task with a cgroup.
+  void QueryTaskInfoOfUidAsync(
+      uid_t uid, std::function<void(bool, const TaskInfoOfUid&)> done);
 
-  bool CreateCgroupAsync(uint32_t task_id, uid_t uid);
+  /**
+   * Create the cgroups of several tasks in one round of the event loop.
+   * done is called with the ids of the tasks whose cgroups cannot be created.
+   */
+  void CreateCgroupsAsync(
+      std::vector<std::pair<task_id_t, uid_t>>&& task_uid_pairs,
+      std::function<void(std::vector<task_id_t>)> done);
 
-  bool ReleaseCgroupAsync(uint32_t task_id, uid_t uid);
+  void ReleaseCgroupAsync(uint32_t task_id, uid_t uid,
+                          std::function<void(bool)> done);
 
   void TerminateTaskAsync(uint32_t task_id);
 
   void MarkTaskAsOrphanedAndTerminateAsync(task_id_t task_id);
 
-  bool CheckTaskStatusAsync(task_id_t task_id, crane::grpc::TaskStatus* status);
+  // The bool is false if the task is unknown to this node.
+  void CheckTaskStatusAsync(
+      task_id_t task_id,
+      std::function<void(bool, crane::grpc::TaskStatus)> done);
+
+  /**
+   * Look up the output file of a running batch task. done is called with
+   * std::nullopt if the task is not a running batch task on this node.
+   */
+  void QueryTaskOutputInfoAsync(
+      task_id_t task_id,
+      std::function<void(std::optional<TaskOutputInfo>)> done);
+
+  // nullptr if CranedOutputCapture is not set. Only the thread-safe methods
+  // of OutputManager can be called on it.
+  OutputManager* GetOutputManager() { return m_output_mgr_.get(); }
+
+  // Number of tasks in m_task_map_. Safe to call from any thread.
+  uint32_t RunningTaskNum() const {
+    return m_running_task_num_.load(std::memory_order_relaxed);
+  }
 
   // Wait internal libevent base loop to exit...
   void Wait();
@@ -204,42 +299,54 @@ class TaskManager {
   template <class T>
   using ConcurrentQueue = moodycamel::ConcurrentQueue<T>;
 
-  struct SigchldInfo {
+  // A subprocess which does not send ChildProcessReady in time, e.g. one
+  // blocked on opening its output file on a hung NFS mount, is killed.
+  static constexpr absl::Duration kChildProcessReadyTimeout =
+      absl::Seconds(30);
+
+  // The output read from an exited process whose descendants keep writing.
+  static constexpr size_t kMaxDrainedOutputBytes = 4 * 1024 * 1024;
+
+  // Processes left in the cgroup of a task are given this long to exit after
+  // being killed.
+  static constexpr std::chrono::seconds kCgroupEmptyTimeout{10};
+
+  struct ProcessExitInfo {
     pid_t pid;
     bool is_terminated_by_signal;
     int value;
   };
 
-  struct savedPrivilege {
-    uid_t uid;
-    gid_t gid;
-    std::string cwd;
+  struct CgroupEmptyWaiter {
+    util::Cgroup* cg;
+    // Called with false if the cgroup is still populated at the timeout.
+    std::vector<std::function<void(bool /*empty*/)>> callbacks;
+    crane::TimerWheel::TimerId timeout_timer;
   };
 
   struct EvQueueGrpcInteractiveTask {
-    std::promise<CraneErr> err_promise;
+    std::function<void(CraneErr)> done;
     uint32_t task_id;
     std::string executive_path;
     std::list<std::string> arguments;
-    std::function<void(std::string&&, void*)> output_cb;
+    std::function<bool(struct evbuffer*, pid_t)> output_cb;
     std::function<void(bool, int, void*)> finish_cb;
   };
 
   struct EvQueueQueryTaskIdFromPid {
-    std::promise<std::optional<uint32_t> /*task_id*/> task_id_prom;
-    pid_t pid;
+    std::function<void(std::optional<uint32_t> /*task_id*/)> done;
+    std::vector<pid_t> pids;
   };
 
   struct EvQueueCreateCg {
-    uint32_t task_id;
-    uid_t uid;
-    std::promise<bool> ok_prom;
+    std::vector<std::pair<task_id_t, uid_t>> task_uid_pairs;
+    std::function<void(std::vector<task_id_t>)> done;
   };
 
   struct EvQueueReleaseCg {
     uint32_t task_id;
     uid_t uid;
-    std::promise<bool> ok_prom;
+    std::function<void(bool)> done;
   };
 
   struct EvQueueTaskTerminate {
@@ -251,24 +358,22 @@ class TaskManager {
 
   struct EvQueueQueryTaskInfoOfUid {
     uid_t uid;
-    pid_t pid;
-    std::promise<TaskInfoOfUid> info_prom;
+    std::function<void(bool, const TaskInfoOfUid&)> done;
   };
 
   struct EvQueueQueryCgOfTaskId {
     uint32_t task_id;
-    std::promise<util::Cgroup*> cg_prom;
+    std::function<void(util::Cgroup*)> done;
   };
 
   struct EvQueueCheckTaskStatus {
     task_id_t task_id;
-    std::promise<std::pair<bool, crane::grpc::TaskStatus>> status_prom;
+    std::function<void(bool, crane::grpc::TaskStatus)> done;
   };
 
-  struct EvTimerCbArg {
-    TaskManager* task_manager;
-    TaskInstance* task_instance;
-    struct event* timer_ev;
+  struct EvQueueQueryTaskOutputInfo {
+    task_id_t task_id;
+    std::function<void(std::optional<TaskOutputInfo>)> done;
   };
 
   static std::string CgroupStrByTaskId_(uint32_t task_id);
@@ -277,12 +382,17 @@ class TaskManager {
    * EvActivateTaskStatusChange_ must NOT be called in this method and should be
    *  called in the caller method after checking the return value of this
    *  method.
+   * The process is forked by g_process_spawner and switches to the user of
+   *  the task by itself, so the privilege of Craned is never changed.
    * @return kSystemErr if the socket pair between the parent process and child
    *  process cannot be created, and the caller should call strerror() to check
-   *  the unix error code. kLibEventError if bufferevent_socket_new() fails.
+   *  the unix error code. kSystemErr is also returned if the spawner fails.
+   *  kLibEventError if bufferevent_socket_new() fails.
    *  kCgroupError if CgroupManager cannot move the process to the cgroup bound
-   *  to the TaskInstance. kProtobufError if the communication between the
-   *  parent and the child process fails.
+   *  to the TaskInstance. kProtobufError if CanStartMessage cannot be sent.
+   * ChildProcessReady is not waited for here. It is handled by
+   *  EvSubprocessReadCb_, and a subprocess that fails or times out before
+   *  execv() ends up in EvOnProcessExit_ like any other failed process.
    */
   CraneErr SpawnProcessInInstance_(TaskInstance* instance,
                                    std::unique_ptr<ProcessInstance> process);
@@ -293,9 +403,9 @@ class TaskManager {
    * Inform CraneCtld of the status change of a task.
    * This method is called when the status of a task is changed:
    * 1. A task is finished successfully. It means that this task returns
-   *  normally with 0 or a non-zero code. (EvSigchldCb_)
+   *  normally with 0 or a non-zero code. (EvOnProcessExit_)
    * 2. A task is killed by a signal. In this case, the task is considered
-   *  failed. (EvSigchldCb_)
+   *  failed. (EvOnProcessExit_)
    * 3. A task cannot be created because of various reasons.
    *  (EvGrpcSpawnInteractiveTaskCb_ and EvGrpcExecuteTaskCb_)
    * @param release_resource If set to true, CraneCtld will release the
@@ -307,39 +417,10 @@ class TaskManager {
 
   template <typename Duration>
   void EvAddTerminationTimer_(TaskInstance* instance, Duration duration) {
-    std::chrono::seconds const sec =
-        std::chrono::duration_cast<std::chrono::seconds>(duration);
-
-    auto* arg = new EvTimerCbArg;
-    arg->task_manager = this;
-    arg->task_instance = instance;
-
-    timeval tv{
-        sec.count(),
-        std::chrono::duration_cast<std::chrono::microseconds>(duration - sec)
-            .count()};
-
-    struct event* ev = event_new(m_ev_base_, -1, 0, EvOnTimerCb_, arg);
-    CRANE_ASSERT_MSG(ev != nullptr, "Failed to create new timer.");
-    evtimer_add(ev, &tv);
-
-    arg->timer_ev = ev;
-    arg->task_instance->termination_timer = ev;
-  }
-
-  void EvAddTerminationTimer_(TaskInstance* instance, int64_t secs) {
-    auto* arg = new EvTimerCbArg;
-    arg->task_manager = this;
-    arg->task_instance = instance;
-
-    timeval tv{static_cast<__time_t>(secs), 0};
-
-    struct event* ev = event_new(m_ev_base_, -1, 0, EvOnTimerCb_, arg);
-    CRANE_ASSERT_MSG(ev != nullptr, "Failed to create new timer.");
-    evtimer_add(ev, &tv);
-
-    arg->timer_ev = ev;
-    arg->task_instance->termination_timer = ev;
+    task_id_t task_id = instance->task.task_id();
+    instance->termination_timer = m_timer_wheel_->AddTimer(
+        std::chrono::ceil<crane::EvTimerWheel::Clock::duration>(duration),
+        [this, task_id] { EvOnTerminationTimer_(task_id); });
   }
 
   /**
@@ -376,8 +457,44 @@ class TaskManager {
 
   util::CgroupManager& m_cg_mgr_;
 
+  static ProcessExitInfo ProcessExitInfoOf_(pid_t pid, int status);
+
+  /**
+   * Handle the exit of a process reaped by EvProcessExitCb_ or EvSigchldCb_,
+   * whichever comes first.
+   */
+  void EvOnProcessExit_(const ProcessExitInfo& info);
+
+  /**
+   * Report the end of a batch task. The processes it left behind, e.g.
+   * daemons, are killed at once and the task is reported after they have
+   * exited, so that their usage is accounted to the task.
+   */
+  void EvFinishBatchTask_(task_id_t task_id, crane::grpc::TaskStatus status);
+
+  /**
+   * Call done once the cgroup has no process left, which is notified by the
+   * "populated" key of its cgroup.events, or with false after
+   * kCgroupEmptyTimeout. done is called before this returns if the cgroup is
+   * already empty. A cgroup watched twice shares the timeout of the first
+   * watch.
+   * @return false if the cgroup cannot be watched, e.g. without cgroup.kill,
+   *  and done is not called.
+   */
+  bool EvWatchCgroupEmpty_(util::Cgroup* cg, std::function<void(bool)> done);
+
+  void EvFinishCgroupWatch_(int wd, bool empty);
+
+  // Reaps the processes without a pidfd and the descendants of the tasks
+  // which are re-parented to Craned, a child subreaper.
   static void EvSigchldCb_(evutil_socket_t sig, short events, void* user_data);
 
+  static void EvProcessExitCb_(evutil_socket_t pidfd, short events,
+                               void* process);
+
+  static void EvCgroupEventsCb_(evutil_socket_t fd, short events,
+                                void* user_data);
+
   // Callback function to handle SIGINT sent by Ctrl+C
   static void EvSigintCb_(evutil_socket_t sig, short events, void* user_data);
 
@@ -390,6 +507,16 @@ class TaskManager {
   static void EvGrpcReleaseCgroupCb_(evutil_socket_t efd, short events,
                                      void* user_data);
 
+  /**
+   * Kill the processes in the cgroups and release them. Runs in the thread
+   * pool since killing may take several retries. Used when the cgroups
+   * cannot be watched by EvWatchCgroupEmpty_, e.g. without cgroup.kill, or
+   * are still not empty when the watch times out.
+   */
+  static void KillAndReleaseCgroups_(
+      std::vector<std::pair<task_id_t, util::Cgroup*>> cgs,
+      util::CgroupManager* cg_mgr);
+
   static void EvGrpcQueryTaskInfoOfUidCb_(evutil_socket_t efd, short events,
                                           void* user_data);
 
@@ -404,6 +531,9 @@ class TaskManager {
 
   static void EvSubprocessReadCb_(struct bufferevent* bev, void* process);
 
+  static void EvSubprocessEventCb_(struct bufferevent* bev, short events,
+                                   void* process);
+
   static void EvTaskStatusChangeCb_(evutil_socket_t efd, short events,
                                     void* user_data);
 
@@ -413,13 +543,40 @@ class TaskManager {
   static void EvCheckTaskStatusCb_(evutil_socket_t, short events,
                                    void* user_data);
 
+  static void EvQueryTaskOutputInfoCb_(evutil_socket_t, short events,
+                                       void* user_data);
+
+  static void EvResumeProcessOutputCb_(evutil_socket_t, short events,
+                                       void* user_data);
+
+  // Hand the output left in the socket of an exited process to its output
+  // callback, which is not called again since the process is freed next.
+  static void DrainProcessOutput_(ProcessInstance* proc);
+
   static void EvExitEventCb_(evutil_socket_t, short events, void* user_data);
 
-  static void EvOnTimerCb_(evutil_socket_t, short, void* arg);
+  void EvOnTerminationTimer_(task_id_t task_id);
+
+  static void EvSampleCgroupUsageCb_(evutil_socket_t, short, void* user_data);
 
   struct event_base* m_ev_base_;
+
+  // Holds the time limits of all the tasks with one libevent timer.
+  static constexpr crane::EvTimerWheel::Clock::duration kTimerWheelTick =
+      std::chrono::milliseconds(100);
+  std::unique_ptr<crane::EvTimerWheel> m_timer_wheel_;
+
+  // Writes the output of batch tasks if CranedOutputCapture is set.
+  std::unique_ptr<OutputManager> m_output_mgr_;
+
   struct event* m_ev_sigchld_;
 
+  // An inotify instance watching the cgroup.events of the cgroups being
+  // emptied. -1 without cgroup.kill.
+  int m_cg_inotify_fd_{-1};
+  struct event* m_ev_cg_events_{nullptr};
+  absl::flat_hash_map<int /*wd*/, CgroupEmptyWaiter> m_cg_empty_waiters_;
+
   // When this event is triggered, the TaskManager will not accept
   // any more new tasks and quit as soon as all existing task end.
   struct event* m_ev_sigint_;
@@ -432,6 +589,9 @@ class TaskManager {
   // ev_sigchld_cb_ will stop the event loop when there is no task running.
   std::atomic_bool m_is_ending_now_;
 
+  // Mirrors m_task_map_.size() for readers outside the event loop.
+  std::atomic_uint32_t m_running_task_num_{0};
+
   // When a new task grpc message arrives, the grpc function (which
   //  runs in parallel) uses m_grpc_event_fd_ to inform the event
   //  loop thread and the event loop thread retrieves the message
@@ -470,6 +630,16 @@ class TaskManager {
   struct event* m_ev_check_task_status_;
   ConcurrentQueue<EvQueueCheckTaskStatus> m_check_task_status_queue_;
 
+  struct event* m_ev_query_task_output_info_{nullptr};
+  ConcurrentQueue<EvQueueQueryTaskOutputInfo>
+      m_query_task_output_info_queue_;
+
+  struct event* m_ev_resume_process_output_{nullptr};
+  ConcurrentQueue<pid_t> m_resume_process_output_queue_;
+
+  // A persistent timer sampling the cgroups of all running tasks.
+  struct event* m_ev_sample_cg_usage_{nullptr};
+
   std::thread m_ev_loop_thread_;
 
   static inline TaskManager* m_instance_ptr_;
@@ -27,6 +27,7 @@ enum class CraneErr : uint16_t {
   kCgroupError,
   kProtobufError,
   kLibEventError,
+  kExceedQosLimit,
 
   __ERR_SIZE  // NOLINT(bugprone-reserved-identifier)
 };
@@ -49,6 +50,10 @@ inline const char* kDefaultCranedMutexFile =
 
 #undef DEFAULT_CRANE_TEMP_DIR
 
+// Craned accepts keepalive pings from cranectld at this interval at most.
+// CranedChannelKeepaliveTimeSec of cranectld must not be smaller.
+inline constexpr uint32_t kCranedMinPingIntervalSec = 10;
+
 namespace Internal {
 
 constexpr std::array<std::string_view, uint16_t(CraneErr::__ERR_SIZE)>
@@ -75,6 +80,7 @@ constexpr std::array<std::string_view, uint16_t(CraneErr::__ERR_SIZE)>
         "Error when manipulating cgroup",
         "Error when using protobuf",
         "Error when using LibEvent",
+        "Exceeding the limit of the QoS",
 };
 
 }
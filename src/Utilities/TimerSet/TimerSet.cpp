@@ -21,6 +21,9 @@ TimerSet::TimerSet() {
                    "Failed to create new timer event!");
   event_add(m_event_stop_, nullptr);
 
+  m_timer_wheel_ =
+      std::make_unique<EvTimerWheel>(m_timer_events_base_, kTimerTick);
+
   m_timer_thread_ =
       std::thread([this]() { event_base_dispatch(m_timer_events_base_); });
 }
@@ -28,6 +31,7 @@ TimerSet::TimerSet() {
 TimerSet::~TimerSet() {
   m_timer_thread_.join();
 
+  m_timer_wheel_.reset();
   if (m_event_stop_) event_free(m_event_stop_);
   if (m_event_new_timer_) event_free(m_event_new_timer_);
   if (m_timer_events_base_) event_base_free(m_timer_events_base_);
@@ -35,27 +39,15 @@ TimerSet::~TimerSet() {
 
 void TimerSet::OnNewTimer_(int, short, void* arg) {
   auto* this_ = reinterpret_cast<TimerSet*>(arg);
-  TimerMeta* meta;
+  NewTimer timer;
 
   // User-define events acts in an edge-triggered way. A while loop is needed.
-  while (this_->m_new_timer_queue_.try_dequeue(meta)) {
-    struct event* ev =
-        event_new(this_->m_timer_events_base_, -1, 0, Ontimer_, meta);
-    CRANE_ASSERT_MSG(ev != nullptr, "Failed to create new timer.");
-
-    evtimer_add(ev, &meta->tv);
-    meta->ev = ev;
+  while (this_->m_new_timer_queue_.try_dequeue(timer)) {
+    this_->m_timer_wheel_->AddTimer(
+        timer.deadline - TimerWheel::Clock::now(), std::move(timer.cb));
   }
 }
 
-void TimerSet::Ontimer_(int, short, void* arg) {
-  auto* meta = reinterpret_cast<TimerMeta*>(arg);
-  meta->cb();
-
-  event_free(meta->ev);
-  delete meta;
-}
-
 void TimerSet::Stop() { event_active(m_event_stop_, 0, 0); }
 
 void TimerSet::OnStop_(int, short, void* arg) {
@@ -0,0 +1,257 @@
+#include "crane/TimerWheel.h"
+
+#include <algorithm>
+#include <bit>
+
+#include "crane/Logger.h"
+
+namespace crane {
+
+TimerWheel::TimerWheel(Clock::duration tick, Clock::time_point now)
+    : m_tick_(tick), m_epoch_(now) {
+  m_heads_.fill(kNil);
+}
+
+TimerWheel::TimerId TimerWheel::AddTimer(Clock::time_point deadline,
+                                         std::function<void()> cb) {
+  uint32_t index = AllocNode_();
+  Node& node = m_nodes_[index];
+  node.expire = std::max(TickOf_(deadline, true), m_now_ + 1);
+  node.cb = std::move(cb);
+
+  Schedule_(index);
+  m_size_++;
+
+  return (uint64_t{node.generation} << 32) | index;
+}
+
+bool TimerWheel::CancelTimer(TimerId id) {
+  auto index = static_cast<uint32_t>(id);
+  auto generation = static_cast<uint32_t>(id >> 32);
+  if (index >= m_nodes_.size()) return false;
+
+  Node& node = m_nodes_[index];
+  if (node.generation != generation || node.slot == kFreeSlot) return false;
+
+  UnlinkNode_(index);
+  FreeNode_(index);
+  m_size_--;
+  return true;
+}
+
+size_t TimerWheel::Advance(Clock::time_point now) {
+  CRANE_ASSERT_MSG(!m_advancing_, "Advance() is called by a timer callback.");
+  m_advancing_ = true;
+
+  uint64_t target = TickOf_(now, false);
+  size_t expired = 0;
+
+  std::optional<uint64_t> tick;
+  while ((tick = NextTick_()) && *tick <= target) {
+    m_now_ = *tick;
+
+    // The lower levels are cascaded first. The timers moved down from a
+    // higher level never land in the slots reached at this tick except the
+    // one of level 0, which is expired right after.
+    for (uint32_t level = 1; level < kLevels; level++) {
+      if ((m_now_ & ((uint64_t{1} << (kSlotBits * level)) - 1)) != 0) break;
+      Cascade_(level);
+    }
+
+    expired += ExpireSlot_(m_now_ & (kSlots - 1));
+  }
+
+  m_now_ = std::max(m_now_, target);
+  m_advancing_ = false;
+
+  return expired;
+}
+
+std::optional<TimerWheel::Clock::time_point> TimerWheel::NextWakeup() const {
+  std::optional<uint64_t> tick = NextTick_();
+  if (!tick) return std::nullopt;
+
+  return m_epoch_ + m_tick_ * static_cast<int64_t>(*tick);
+}
+
+uint64_t TimerWheel::TickOf_(Clock::time_point time, bool round_up) const {
+  if (time <= m_epoch_) return 0;
+
+  Clock::duration elapsed = time - m_epoch_;
+  auto ticks = static_cast<uint64_t>(elapsed / m_tick_);
+  if (round_up && elapsed % m_tick_ != Clock::duration::zero()) ticks++;
+  return ticks;
+}
+
+uint32_t TimerWheel::AllocNode_() {
+  if (m_free_head_ == kNil) {
+    m_nodes_.emplace_back().generation = 1;
+    return m_nodes_.size() - 1;
+  }
+
+  uint32_t index = m_free_head_;
+  m_free_head_ = m_nodes_[index].next;
+  return index;
+}
+
+void TimerWheel::FreeNode_(uint32_t index) {
+  Node& node = m_nodes_[index];
+  node.cb = nullptr;
+  node.slot = kFreeSlot;
+  // 0 is skipped so that no id equals kInvalidTimerId.
+  if (++node.generation == 0) node.generation = 1;
+
+  node.next = m_free_head_;
+  m_free_head_ = index;
+}
+
+void TimerWheel::Schedule_(uint32_t index) {
+  uint64_t expire = m_nodes_[index].expire;
+  uint64_t distance = expire - m_now_;
+  if (distance > kMaxDistance) {
+    distance = kMaxDistance;
+    expire = m_now_ + kMaxDistance;
+  }
+
+  uint32_t level =
+      distance == 0 ? 0 : (std::bit_width(distance) - 1) / kSlotBits;
+  uint32_t slot = (expire >> (kSlotBits * level)) & (kSlots - 1);
+  LinkNode_(index, level * kSlots + slot);
+}
+
+void TimerWheel::LinkNode_(uint32_t index, uint32_t slot) {
+  Node& node = m_nodes_[index];
+  node.slot = slot;
+  node.prev = kNil;
+  node.next = m_heads_[slot];
+  if (node.next != kNil) m_nodes_[node.next].prev = index;
+  m_heads_[slot] = index;
+
+  if (slot < kExpiringSlot)
+    m_occupied_[slot / kSlots] |= uint64_t{1} << (slot % kSlots);
+}
+
+void TimerWheel::UnlinkNode_(uint32_t index) {
+  Node& node = m_nodes_[index];
+  if (node.prev != kNil)
+    m_nodes_[node.prev].next = node.next;
+  else
+    m_heads_[node.slot] = node.next;
+  if (node.next != kNil) m_nodes_[node.next].prev = node.prev;
+
+  if (node.slot < kExpiringSlot && m_heads_[node.slot] == kNil)
+    m_occupied_[node.slot / kSlots] &= ~(uint64_t{1} << (node.slot % kSlots));
+}
+
+void TimerWheel::Cascade_(uint32_t level) {
+  uint32_t slot = (m_now_ >> (kSlotBits * level)) & (kSlots - 1);
+  uint32_t index = m_heads_[level * kSlots + slot];
+  if (index == kNil) return;
+
+  m_heads_[level * kSlots + slot] = kNil;
+  m_occupied_[level] &= ~(uint64_t{1} << slot);
+
+  while (index != kNil) {
+    uint32_t next = m_nodes_[index].next;
+    Schedule_(index);
+    index = next;
+  }
+}
+
+size_t TimerWheel::ExpireSlot_(uint32_t slot) {
+  uint32_t head = m_heads_[slot];
+  if (head == kNil) return 0;
+
+  m_heads_[slot] = kNil;
+  m_occupied_[0] &= ~(uint64_t{1} << slot);
+
+  // The expiring timers are moved to a list of their own, so that the
+  // callbacks can still cancel the ones after them.
+  m_heads_[kExpiringSlot] = head;
+  for (uint32_t i = head; i != kNil; i = m_nodes_[i].next)
+    m_nodes_[i].slot = kExpiringSlot;
+
+  size_t expired = 0;
+  uint32_t index;
+  while ((index = m_heads_[kExpiringSlot]) != kNil) {
+    UnlinkNode_(index);
+    // The node is freed before the callback runs, since the callback may add
+    // timers and reallocate m_nodes_.
+    std::function<void()> cb = std::move(m_nodes_[index].cb);
+    FreeNode_(index);
+    m_size_--;
+
+    cb();
+    expired++;
+  }
+
+  return expired;
+}
+
+std::optional<uint64_t> TimerWheel::NextTick_() const {
+  std::optional<uint64_t> next;
+  for (uint32_t level = 0; level < kLevels; level++) {
+    uint64_t occupied = m_occupied_[level];
+    if (occupied == 0) continue;
+
+    // Find the first non-empty slot after the current one, which comes last.
+    uint64_t cur = m_now_ >> (kSlotBits * level);
+    uint32_t k =
+        std::countr_zero(std::rotr(occupied, (cur + 1) & (kSlots - 1))) + 1;
+    uint64_t tick = (cur + k) << (kSlotBits * level);
+
+    if (!next || tick < *next) next = tick;
+  }
+
+  return next;
+}
+
+EvTimerWheel::EvTimerWheel(struct event_base* base, Clock::duration tick)
+    : m_wheel_(tick, Clock::now()) {
+  m_ev_timer_ = evtimer_new(base, EvOnTimerCb_, this);
+  CRANE_ASSERT_MSG(m_ev_timer_ != nullptr, "Failed to create timer event.");
+}
+
+EvTimerWheel::~EvTimerWheel() { event_free(m_ev_timer_); }
+
+EvTimerWheel::TimerId EvTimerWheel::AddTimer(Clock::duration delay,
+                                             std::function<void()> cb) {
+  TimerId id = m_wheel_.AddTimer(Clock::now() + delay, std::move(cb));
+  Rearm_();
+  return id;
+}
+
+bool EvTimerWheel::CancelTimer(TimerId id) {
+  if (!m_wheel_.CancelTimer(id)) return false;
+
+  if (m_wheel_.Size() == 0 && m_armed_at_) {
+    evtimer_del(m_ev_timer_);
+    m_armed_at_.reset();
+  }
+  return true;
+}
+
+void EvTimerWheel::EvOnTimerCb_(evutil_socket_t, short, void* arg) {
+  auto* this_ = reinterpret_cast<EvTimerWheel*>(arg);
+
+  // libevent may fire a little early with a coarse clock. Nothing expires
+  // then and the event is armed again for the rest.
+  this_->m_armed_at_.reset();
+  this_->m_wheel_.Advance(Clock::now());
+  this_->Rearm_();
+}
+
+void EvTimerWheel::Rearm_() {
+  std::optional<Clock::time_point> wakeup = m_wheel_.NextWakeup();
+  if (!wakeup) return;
+  if (m_armed_at_ && *m_armed_at_ <= *wakeup) return;
+
+  auto delay = std::chrono::ceil<std::chrono::microseconds>(
+      std::max(*wakeup - Clock::now(), Clock::duration::zero()));
+  timeval tv{static_cast<time_t>(delay.count() / 1000000),
+             static_cast<suseconds_t>(delay.count() % 1000000)};
+  evtimer_add(m_ev_timer_, &tv);
+  m_armed_at_ = wakeup;
+}
+
+}  // namespace crane
@@ -4,9 +4,11 @@
 #include <event2/event.h>
 
 #include <functional>
+#include <memory>
 #include <thread>
 
 #include "crane/PublicHeader.h"
+#include "crane/TimerWheel.h"
 
 namespace crane {
 
@@ -17,18 +19,10 @@ class TimerSet {
 
   template <typename Duration>
   void AddTimer(Duration duration, std::function<void()> cb) {
-    auto* meta = new TimerMeta;
-    meta->cb = std::move(cb);
-
-    std::chrono::seconds const sec =
-        std::chrono::duration_cast<std::chrono::seconds>(duration);
-
-    meta->tv.tv_sec = sec.count();
-    meta->tv.tv_usec =
-        std::chrono::duration_cast<std::chrono::microseconds>(duration - sec)
-            .count();
-
-    m_new_timer_queue_.enqueue(meta);
+    m_new_timer_queue_.enqueue(NewTimer{
+        .deadline = TimerWheel::Clock::now() +
+                    std::chrono::ceil<TimerWheel::Clock::duration>(duration),
+        .cb = std::move(cb)});
     event_active(m_event_new_timer_, 0, 0);
   }
 
@@ -39,7 +33,13 @@ class TimerSet {
 
   static void OnNewTimer_(int, short, void* arg);
 
-  static void Ontimer_(int, short, void* arg);
+  static constexpr TimerWheel::Clock::duration kTimerTick =
+      std::chrono::milliseconds(1);
+
+  struct NewTimer {
+    TimerWheel::Clock::time_point deadline;
+    std::function<void()> cb;
+  };
 
   struct event_base* m_timer_events_base_;
   std::thread m_timer_thread_;
@@ -48,13 +48,10 @@ class TimerSet {
 
   struct event* m_event_stop_;
 
-  struct TimerMeta {
-    struct event* ev;
-    std::function<void()> cb;
-    timeval tv;
-  };
+  // All the timers share one libevent timer of the wheel.
+  std::unique_ptr<EvTimerWheel> m_timer_wheel_;
 
-  moodycamel::ConcurrentQueue<TimerMeta*> m_new_timer_queue_;
+  moodycamel::ConcurrentQueue<NewTimer> m_new_timer_queue_;
 };
 
 }  // namespace crane
\ No newline at end of file
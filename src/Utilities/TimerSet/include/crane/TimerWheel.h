@@ -0,0 +1,171 @@
+#pragma once
+
+#include <event2/event.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+namespace crane {
+
+/**
+ * A hierarchical timer wheel. It is not thread-safe and is driven by calling
+ * Advance() with the current time, e.g. from EvTimerWheel.
+ *
+ * Time is divided into ticks. Each of the kLevels levels has kSlots slots,
+ * and a slot at level l covers kSlots^l ticks. A timer is put in the level
+ * whose range covers its distance from the current tick. When the wheel
+ * reaches a slot of a higher level, the timers in the slot are moved to the
+ * lower levels, so each timer is moved at most kLevels - 1 times.
+ *
+ * The timers are kept in a pool of nodes linked by index, so adding and
+ * cancelling a timer is O(1) and no memory is allocated once the pool has
+ * grown to the maximum number of timers. A bitmap of non-empty slots is kept
+ * for each level, so the next tick with work is also found in O(1) and the
+ * ticks without timers are skipped. All the timers in a slot expire together
+ * in one Advance().
+ */
+class TimerWheel {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // Contains the index of the node and its generation, so that an id is not
+  // reused when the node is.
+  using TimerId = uint64_t;
+  static constexpr TimerId kInvalidTimerId = 0;
+
+  TimerWheel(Clock::duration tick, Clock::time_point now);
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  /**
+   * The deadline is rounded up to a tick. A timer whose deadline has passed
+   * expires in the next Advance().
+   */
+  TimerId AddTimer(Clock::time_point deadline, std::function<void()> cb);
+
+  /**
+   * @return false if the timer has expired or been cancelled.
+   */
+  bool CancelTimer(TimerId id);
+
+  /**
+   * Run the callbacks of the timers expiring at or before now. The callbacks
+   * may add and cancel timers.
+   * @return the number of expired timers.
+   */
+  size_t Advance(Clock::time_point now);
+
+  /**
+   * @return the time at which Advance() has work to do next, either expiring
+   *  timers or moving them to lower levels. nullopt if there are no timers.
+   */
+  std::optional<Clock::time_point> NextWakeup() const;
+
+  size_t Size() const { return m_size_; }
+
+ private:
+  static constexpr uint32_t kSlotBits = 6;
+  static constexpr uint32_t kSlots = 1 << kSlotBits;
+  static constexpr uint32_t kLevels = 6;
+  // Timers further than this are put in the last slots of the top level and
+  // moved down when they are reached.
+  static constexpr uint64_t kMaxDistance =
+      (uint64_t{1} << (kSlotBits * kLevels)) - 1;
+
+  static constexpr uint32_t kNil = UINT32_MAX;
+  // The slot of the nodes being expired by Advance().
+  static constexpr uint32_t kExpiringSlot = kLevels * kSlots;
+  // The slot of the nodes in the free list.
+  static constexpr uint32_t kFreeSlot = kExpiringSlot + 1;
+
+  struct Node {
+    uint64_t expire;
+    uint32_t generation{0};
+    uint32_t slot{kFreeSlot};
+    uint32_t prev{kNil};
+    uint32_t next{kNil};
+    std::function<void()> cb;
+  };
+
+  uint64_t TickOf_(Clock::time_point time, bool round_up) const;
+
+  uint32_t AllocNode_();
+
+  void FreeNode_(uint32_t index);
+
+  // Put the node in the slot for its expiration. The node may expire at the
+  // current tick when it is moved down from a higher level.
+  void Schedule_(uint32_t index);
+
+  void LinkNode_(uint32_t index, uint32_t slot);
+
+  void UnlinkNode_(uint32_t index);
+
+  // Move the timers in the slot of the level to the lower levels.
+  void Cascade_(uint32_t level);
+
+  size_t ExpireSlot_(uint32_t slot);
+
+  // The smallest tick after m_now_ at which a slot has work.
+  std::optional<uint64_t> NextTick_() const;
+
+  const Clock::duration m_tick_;
+  const Clock::time_point m_epoch_;
+
+  // The ticks up to m_now_ have been processed.
+  uint64_t m_now_{0};
+  size_t m_size_{0};
+  bool m_advancing_{false};
+
+  std::vector<Node> m_nodes_;
+  uint32_t m_free_head_{kNil};
+
+  // The heads of the lists of the slots, the expiring list included.
+  std::array<uint32_t, kLevels * kSlots + 1> m_heads_;
+  std::array<uint64_t, kLevels> m_occupied_{};
+};
+
+/**
+ * Drives a TimerWheel with one libevent timer armed for its next wakeup, so
+ * that any number of timers costs one event. All the methods must be called in
+ * the thread of the event loop.
+ */
+class EvTimerWheel {
+ public:
+  using Clock = TimerWheel::Clock;
+  using TimerId = TimerWheel::TimerId;
+
+  EvTimerWheel(struct event_base* base, Clock::duration tick);
+
+  ~EvTimerWheel();
+
+  EvTimerWheel(const EvTimerWheel&) = delete;
+  EvTimerWheel& operator=(const EvTimerWheel&) = delete;
+
+  TimerId AddTimer(Clock::duration delay, std::function<void()> cb);
+
+  // The event is disarmed when no timers are left, so that it doesn't keep
+  // the event loop from exiting.
+  bool CancelTimer(TimerId id);
+
+  size_t Size() const { return m_wheel_.Size(); }
+
+ private:
+  static void EvOnTimerCb_(evutil_socket_t, short, void* arg);
+
+  // Arm the event for the next wakeup of the wheel if it is earlier than the
+  // one the event is armed for.
+  void Rearm_();
+
+  TimerWheel m_wheel_;
+
+  struct event* m_ev_timer_;
+  std::optional<Clock::time_point> m_armed_at_;
+};
+
+}  // namespace crane
@@ -6,11 +6,41 @@
 
 #include "cgroup.linux.h"
 
+#include <absl/container/flat_hash_set.h>
+#include <fcntl.h>
+#include <linux/magic.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <csignal>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <sstream>
 
 namespace util {
 
+namespace {
+
+bool WriteCgroupFile(const std::string &path, std::string_view value) {
+  std::ofstream file(path);
+  file << value;
+  file.flush();
+  return file.good();
+}
+
+bool IsUnifiedHierarchy() {
+  struct statfs fs {};
+  if (statfs(CgroupConstant::kUnifiedHierarchyRoot.data(), &fs) != 0)
+    return false;
+  return fs.f_type == CGROUP2_SUPER_MAGIC;
+}
+
+}  // namespace
+
 /*
  * Create a CgroupManager.  Note this is private - users of the CgroupManager
  * may create an instance via CgroupManager::getInstance()
@@ -29,6 +59,13 @@ CgroupManager &CgroupManager::Instance() {
  * Returns 0 on success, -1 otherwise.
  */
 int CgroupManager::initialize() {
+  // In the hybrid mode, /sys/fs/cgroup is a tmpfs holding the v1 hierarchies
+  // and the controllers are still used through v1.
+  if (IsUnifiedHierarchy()) {
+    m_cg_version_ = CgroupConstant::CgroupVersion::V2;
+    return InitializeV2_();
+  }
+
   // Initialize library and data structures
   CRANE_DEBUG("Initializing cgroup library.");
   cgroup_init();
@@ -87,6 +124,18 @@ int CgroupManager::initialize() {
     cgroup_get_all_controller_end(&handle);
   }
 
+  for (size_t i = 0; i < m_mount_points_.size(); i++) {
+    auto controller = static_cast<Controller>(i);
+    if (!Mounted(controller)) continue;
+
+    char *mount_point = nullptr;
+    if (cgroup_get_subsys_mount_point(
+            GetControllerStringView(controller).data(), &mount_point) == 0) {
+      m_mount_points_[i] = mount_point;
+      free(mount_point);
+    }
+  }
+
   if (!Mounted(Controller::BLOCK_CONTROLLER)) {
     CRANE_WARN("Cgroup controller for I/O statistics is not available.\n");
   }
@@ -114,6 +163,71 @@ int CgroupManager::initialize() {
   return 0;
 }
 
+int CgroupManager::InitializeV2_() {
+  using CgroupConstant::Controller;
+  using CgroupConstant::kCranedSubtreeV2;
+
+  CRANE_DEBUG("Using the unified cgroup hierarchy.");
+
+  if (mkdir(kCranedSubtreeV2.data(), 0755) != 0 && errno != EEXIST) {
+    CRANE_WARN("Unable to create cgroup {}: {}\n", kCranedSubtreeV2,
+               strerror(errno));
+    return -1;
+  }
+
+  // cgroup.kill exists in every non-root cgroup if the kernel supports it.
+  m_cgroup_kill_available_ =
+      access(fmt::format("{}/cgroup.kill", kCranedSubtreeV2).c_str(), F_OK) ==
+      0;
+
+  // The controllers of kCranedSubtreeV2 are those enabled for the children of
+  // the root, which is left to the init system, e.g. systemd.
+  std::ifstream controllers_file(
+      fmt::format("{}/cgroup.controllers", kCranedSubtreeV2));
+  std::string name, subtree_control;
+  while (controllers_file >> name) {
+    if (name == "memory")
+      m_mounted_controllers_ |= ControllerFlags{Controller::MEMORY_CONTROLLER};
+    else if (name == "cpu")
+      // CPU accounting is provided by cpu.stat of the cpu controller.
+      m_mounted_controllers_ |=
+          Controller::CPU_CONTROLLER | Controller::CPUACCT_CONTROLLER;
+    else if (name == "io")
+      m_mounted_controllers_ |= ControllerFlags{Controller::BLOCK_CONTROLLER};
+    else
+      continue;
+
+    if (!subtree_control.empty()) subtree_control += ' ';
+    subtree_control += fmt::format("+{}", name);
+  }
+
+  if (!subtree_control.empty()) {
+    // cgroup.freeze is available in every non-root cgroup.
+    m_mounted_controllers_ |= ControllerFlags{Controller::FREEZE_CONTROLLER};
+
+    // A cgroup only gets the controllers enabled in the subtree_control of
+    // its parent.
+    if (!WriteCgroupFile(
+            fmt::format("{}/cgroup.subtree_control", kCranedSubtreeV2),
+            subtree_control))
+      CRANE_WARN("Unable to enable cgroup controllers \"{}\": {}\n",
+                 subtree_control, strerror(errno));
+  }
+
+  // The devices controller is replaced by eBPF programs in cgroup v2 and is
+  // not supported.
+  for (size_t i = 0; i < m_mount_points_.size(); i++) {
+    auto controller = static_cast<Controller>(i);
+    if (Mounted(controller))
+      m_mount_points_[i] = kCranedSubtreeV2;
+    else
+      CRANE_WARN("Cgroup controller {} is not available.\n",
+                 CgroupConstant::GetControllerStringView(controller));
+  }
+
+  return subtree_control.empty() ? -1 : 0;
+}
+
 /*
  * Initialize a controller for a given cgroup.
  *
@@ -182,6 +296,9 @@ Cgroup *CgroupManager::CreateOrOpen(const std::string &cgroup_string,
     return iter->second.first.get();
   }
 
+  if (m_cg_version_ == CgroupConstant::CgroupVersion::V2)
+    return CreateOrOpenV2_(cgroup_string, required_controllers);
+
   bool created_cgroup = false, changed_cgroup = false;
   struct cgroup *native_cgroup = cgroup_new_cgroup(cgroup_string.c_str());
   if (native_cgroup == NULL) {
@@ -290,52 +407,262 @@ Cgroup *CgroupManager::CreateOrOpen(const std::string &cgroup_string,
   return p;
 }
 
-bool CgroupManager::Release(const std::string &cgroup_path) {
-  LockGuard guard(m_mtx_);
+Cgroup *CgroupManager::CreateOrOpenV2_(const std::string &cgroup_string,
+                                       ControllerFlags required_controllers) {
+  // All the controllers enabled in kCranedSubtreeV2 apply to every cgroup, so
+  // only the required ones are checked.
+  if (required_controllers & ~m_mounted_controllers_) {
+    CRANE_WARN("Required cgroup controllers are not available for {}.\n",
+               cgroup_string);
+    return nullptr;
+  }
 
-  auto it = m_cgroup_ref_count_map_.find(cgroup_path);
-  if (it == m_cgroup_ref_count_map_.end()) {
-    CRANE_WARN("Destroying an unknown cgroup.");
-    return false;
+  std::string path =
+      fmt::format("{}/{}", CgroupConstant::kCranedSubtreeV2, cgroup_string);
+  if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+    CRANE_WARN("Unable to create cgroup {}: {}\n", path, strerror(errno));
+    return nullptr;
   }
 
-  size_t *ref_cnt = &it->second.second;
-  (*ref_cnt)--;
+  auto cgroup = std::make_unique<Cgroup>(cgroup_string, nullptr);
+  auto *p = cgroup.get();
 
-  // Only delete if this is the last ref and we originally created it.
-  if (*ref_cnt == 0) {
-    int err;
-    // Must re-initialize the cgroup structure before deletion.
-    struct cgroup *dcg = cgroup_new_cgroup(cgroup_path.c_str());
-    assert(dcg != nullptr);
-    if ((err = cgroup_get_cgroup(dcg))) {
-      CRANE_WARN("Unable to read cgroup {} for deletion: {} {}\n",
-                 cgroup_path.c_str(), err, cgroup_strerror(err));
-      cgroup_free(&dcg);
+  m_cgroup_ref_count_map_.emplace(cgroup_string,
+                                  std::make_pair(std::move(cgroup), 1));
+
+  return p;
+}
+
+bool CgroupManager::Release(const std::string &cgroup_path) {
+  std::unique_ptr<Cgroup> recycled;
+  std::string pool_path;
+
+  {
+    LockGuard guard(m_mtx_);
+
+    auto it = m_cgroup_ref_count_map_.find(cgroup_path);
+    if (it == m_cgroup_ref_count_map_.end()) {
+      CRANE_WARN("Destroying an unknown cgroup.");
       return false;
     }
 
-    // CGFLAG_DELETE_EMPTY_ONLY is set to avoid libgroup from finding parent
-    // cgroup, which is usually the mount point of root cgroup and will cause
-    // ENOENT error.
-    //
-    // Todo: Test this part when cgroup is not empty!
-    if ((err = cgroup_delete_cgroup_ext(
-             dcg, CGFLAG_DELETE_EMPTY_ONLY | CGFLAG_DELETE_IGNORE_MIGRATION))) {
-      CRANE_WARN("Unable to completely remove cgroup {}: {} {}\n",
-                 cgroup_path.c_str(), err, cgroup_strerror(err));
-    } else {
-      CRANE_TRACE("Deleted cgroup {}.", cgroup_path.c_str());
+    size_t *ref_cnt = &it->second.second;
+    (*ref_cnt)--;
+    if (*ref_cnt != 0) return true;
+
+    if (!it->second.first->m_poolable_ ||
+        m_cgroup_pool_.size() >= m_pool_capacity_) {
+      // Only delete if this is the last ref and we originally created it.
+      bool ok = DeleteCgroup_(cgroup_path);
+      if (!ok) return false;
+
+      // This call results in the destructor call of Cgroup, which frees the
+      // internal libcgroup struct.
+      m_cgroup_ref_count_map_.erase(it);
+      return true;
     }
 
-    // Notice the cgroup struct freed here is not the one held by Cgroup class.
+    recycled = std::move(it->second.first);
+    m_cgroup_ref_count_map_.erase(it);
+    pool_path = NextPoolPathNoLock_();
+  }
+
+  // Resetting and renaming touch several files, so they are done without
+  // holding the lock. A cgroup with processes left is never handed out to
+  // another task.
+  if (!recycled->Empty() || !recycled->ResetForReuse_() ||
+      !RenameCgroup_(recycled.get(), pool_path)) {
+    CRANE_WARN("Failed to recycle cgroup {}. Deleting it.", cgroup_path);
+    return DeleteCgroup_(recycled->GetCgroupString());
+  }
+
+  {
+    LockGuard guard(m_mtx_);
+    // The pool may have been destroyed meanwhile.
+    if (m_cgroup_pool_.size() < m_pool_capacity_) {
+      CRANE_TRACE("Recycled cgroup {} as {}.", cgroup_path, pool_path);
+      m_cgroup_pool_.emplace_back(std::move(recycled));
+      return true;
+    }
+  }
+
+  return DeleteCgroup_(recycled->GetCgroupString());
+}
+
+bool CgroupManager::DeleteCgroup_(const std::string &cgroup_path) const {
+  if (m_cg_version_ == CgroupConstant::CgroupVersion::V2) {
+    std::string path =
+        fmt::format("{}/{}", CgroupConstant::kCranedSubtreeV2, cgroup_path);
+    if (rmdir(path.c_str()) != 0 && errno != ENOENT)
+      CRANE_WARN("Unable to remove cgroup {}: {}\n", path, strerror(errno));
+    else
+      CRANE_TRACE("Deleted cgroup {}.", cgroup_path);
+    return true;
+  }
+
+  int err;
+  // Must re-initialize the cgroup structure before deletion.
+  struct cgroup *dcg = cgroup_new_cgroup(cgroup_path.c_str());
+  assert(dcg != nullptr);
+  if ((err = cgroup_get_cgroup(dcg))) {
+    CRANE_WARN("Unable to read cgroup {} for deletion: {} {}\n",
+               cgroup_path.c_str(), err, cgroup_strerror(err));
     cgroup_free(&dcg);
+    return false;
+  }
+
+  // CGFLAG_DELETE_EMPTY_ONLY is set to avoid libgroup from finding parent
+  // cgroup, which is usually the mount point of root cgroup and will cause
+  // ENOENT error.
+  //
+  // Todo: Test this part when cgroup is not empty!
+  if ((err = cgroup_delete_cgroup_ext(
+           dcg, CGFLAG_DELETE_EMPTY_ONLY | CGFLAG_DELETE_IGNORE_MIGRATION))) {
+    CRANE_WARN("Unable to completely remove cgroup {}: {} {}\n",
+               cgroup_path.c_str(), err, cgroup_strerror(err));
+  } else {
+    CRANE_TRACE("Deleted cgroup {}.", cgroup_path.c_str());
+  }
+
+  // Notice the cgroup struct freed here is not the one held by Cgroup class.
+  cgroup_free(&dcg);
+  return true;
+}
+
+void CgroupManager::InitCgroupPool(const std::string &prefix, size_t size) {
+  if (m_cg_version_ == CgroupConstant::CgroupVersion::V2) {
+    CRANE_DEBUG("The cgroup pool is not used with cgroup v2.");
+    return;
+  }
+
+  m_pool_prefix_ = prefix;
+  m_pool_capacity_ = size;
+
+  for (size_t i = 0; i < size; i++) {
+    std::string path;
+    {
+      LockGuard guard(m_mtx_);
+      path = NextPoolPathNoLock_();
+    }
+
+    if (CreateOrOpen(path, ALL_CONTROLLER_FLAG, NO_CONTROLLER_FLAG, false) ==
+        nullptr) {
+      CRANE_WARN("Failed to pre-create cgroup {}. The pool has {} cgroups.",
+                 path, i);
+      break;
+    }
+
+    LockGuard guard(m_mtx_);
+    auto it = m_cgroup_ref_count_map_.find(path);
+    it->second.first->m_poolable_ = true;
+    m_cgroup_pool_.emplace_back(std::move(it->second.first));
+    m_cgroup_ref_count_map_.erase(it);
+  }
+}
+
+Cgroup *CgroupManager::AcquireFromPool(const std::string &cgroup_string) {
+  std::unique_ptr<Cgroup> cg;
+  bool referenced;
+  {
+    LockGuard guard(m_mtx_);
+    referenced = m_cgroup_ref_count_map_.contains(cgroup_string);
+    if (!referenced && !m_cgroup_pool_.empty()) {
+      cg = std::move(m_cgroup_pool_.back());
+      m_cgroup_pool_.pop_back();
+    }
+  }
+
+  if (cg) {
+    if (RenameCgroup_(cg.get(), cgroup_string)) {
+      Cgroup *p = cg.get();
+      LockGuard guard(m_mtx_);
+      m_cgroup_ref_count_map_.emplace(cgroup_string,
+                                      std::make_pair(std::move(cg), 1));
+      return p;
+    }
+
+    CRANE_WARN("Failed to rename pooled cgroup {} to {}. Deleting it.",
+               cg->GetCgroupString(), cgroup_string);
+    DeleteCgroup_(cg->GetCgroupString());
+  }
+
+  Cgroup *created = CreateOrOpen(cgroup_string, ALL_CONTROLLER_FLAG,
+                                 NO_CONTROLLER_FLAG, false);
+  // A cgroup which is already referenced is only opened here. It is not
+  // pooled since its other users may have set limits on it.
+  if (created != nullptr && !referenced) {
+    LockGuard guard(m_mtx_);
+    created->m_poolable_ = true;
+  }
+  return created;
+}
+
+void CgroupManager::DestroyCgroupPool() {
+  std::vector<std::unique_ptr<Cgroup>> pool;
+  {
+    LockGuard guard(m_mtx_);
+    pool.swap(m_cgroup_pool_);
+    m_pool_capacity_ = 0;
+  }
+
+  for (const auto &cg : pool) DeleteCgroup_(cg->GetCgroupString());
+}
+
+std::string CgroupManager::NextPoolPathNoLock_() {
+  return fmt::format("{}{}", m_pool_prefix_, m_next_pool_id_++);
+}
+
+struct cgroup *CgroupManager::NewNativeHandle_(
+    const std::string &cgroup_path) const {
+  struct cgroup *handle = cgroup_new_cgroup(cgroup_path.c_str());
+  if (handle == nullptr) return nullptr;
+
+  for (size_t i = 0; i < m_mount_points_.size(); i++) {
+    auto controller = static_cast<CgroupConstant::Controller>(i);
+    if (!Mounted(controller)) continue;
+
+    if (cgroup_add_controller(
+            handle,
+            CgroupConstant::GetControllerStringView(controller).data()) ==
+        nullptr) {
+      cgroup_free(&handle);
+      return nullptr;
+    }
+  }
+
+  return handle;
+}
 
-    // This call results in the destructor call of Cgroup, which frees the
-    // internal libcgroup struct.
-    m_cgroup_ref_count_map_.erase(cgroup_path);
+bool CgroupManager::RenameCgroup_(Cgroup *cg,
+                                  const std::string &new_path) const {
+  struct cgroup *handle = NewNativeHandle_(new_path);
+  if (handle == nullptr) return false;
+
+  // Controllers mounted together, e.g. cpu and cpuacct, share a hierarchy and
+  // the directory is renamed only once.
+  absl::flat_hash_set<std::string> hierarchies;
+  for (const auto &mount_point : m_mount_points_)
+    if (!mount_point.empty()) hierarchies.emplace(mount_point);
+
+  std::vector<const std::string *> renamed;
+  for (const auto &mount_point : hierarchies) {
+    std::string from = fmt::format("{}/{}", mount_point, cg->m_cgroup_path_);
+    std::string to = fmt::format("{}/{}", mount_point, new_path);
+    if (rename(from.c_str(), to.c_str()) != 0) {
+      CRANE_WARN("Failed to rename {} to {}: {}", from, to, strerror(errno));
+
+      for (const std::string *done : renamed)
+        rename(fmt::format("{}/{}", *done, new_path).c_str(),
+               fmt::format("{}/{}", *done, cg->m_cgroup_path_).c_str());
+      cgroup_free(&handle);
+      return false;
+    }
+    renamed.emplace_back(&mount_point);
   }
 
+  cgroup_free(&cg->m_cgroup_);
+  cg->m_cgroup_ = handle;
+  cg->m_cgroup_path_ = new_path;
   return true;
 }
 
@@ -351,6 +678,17 @@ bool CgroupManager::MigrateProcTo(pid_t pid, const std::string &cgroup_path) {
     return false;
   }
 
+  if (m_cg_version_ == CgroupConstant::CgroupVersion::V2) {
+    // A single write moves the process into all controllers.
+    if (!WriteCgroupFile(iter->second.first->FilePathV2_("cgroup.procs"),
+                         std::to_string(pid))) {
+      CRANE_WARN("Cannot attach pid {} to cgroup {}: {}\n", pid, cgroup_path,
+                 strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
   using CgroupConstant::Controller;
   using CgroupConstant::GetControllerStringView;
 
@@ -530,6 +868,18 @@ end:
   return err == 0;
 }
 
+int CgroupManager::OpenCgroupFd(const std::string &cgroup_path) const {
+  if (m_cg_version_ != CgroupConstant::CgroupVersion::V2) return -1;
+
+  std::string path =
+      fmt::format("{}/{}", CgroupConstant::kCranedSubtreeV2, cgroup_path);
+  int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    CRANE_WARN("Unable to open cgroup {}: {}\n", path, strerror(errno));
+
+  return fd;
+}
+
 Cgroup *CgroupManager::Find(const std::string &cgroup_path) {
   auto iter = m_cgroup_ref_count_map_.find(cgroup_path);
   if (iter == m_cgroup_ref_count_map_.end()) return nullptr;
@@ -548,6 +898,12 @@ Cgroup::~Cgroup() {
   }
 }
 
+bool Cgroup::Valid() const {
+  return m_cgroup_ != nullptr ||
+         CgroupManager::Instance().Version() ==
+             CgroupConstant::CgroupVersion::V2;
+}
+
 bool Cgroup::SetMemorySoftLimitBytes(uint64_t memory_bytes) {
   return SetControllerValue(
       CgroupConstant::Controller::MEMORY_CONTROLLER,
@@ -574,6 +930,19 @@ bool Cgroup::SetCpuShares(uint64_t share) {
 bool Cgroup::SetCpuCoreLimit(double core_num) {
   constexpr uint32_t base = 1000'000;
 
+  if (CgroupManager::Instance().Version() ==
+      CgroupConstant::CgroupVersion::V2) {
+    // cpu.max holds both the quota and the period.
+    std::string cpu_max =
+        fmt::format("{} {}", uint64_t(base * core_num), base);
+    if (!WriteCgroupFile(FilePathV2_("cpu.max"), cpu_max)) {
+      CRANE_WARN("Unable to set cpu.max for cgroup {}: {}\n", m_cgroup_path_,
+                 strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
   bool ret;
   ret = SetControllerValue(CgroupConstant::Controller::CPU_CONTROLLER,
                            CgroupConstant::ControllerFile::CPU_CFS_QUOTA_US,
@@ -603,6 +972,9 @@ bool Cgroup::SetControllerValue(CgroupConstant::Controller controller,
     return false;
   }
 
+  if (cm.Version() == CgroupConstant::CgroupVersion::V2)
+    return SetControllerValueV2_(controller_file, value);
+
   int err;
 
   struct cgroup_controller *cg_controller;
@@ -649,6 +1021,21 @@ bool Cgroup::SetControllerStr(CgroupConstant::Controller controller,
     return false;
   }
 
+  if (cm.Version() == CgroupConstant::CgroupVersion::V2) {
+    std::string path = ControllerFilePath_(controller, controller_file);
+    if (path.empty()) {
+      CRANE_WARN("{} is not supported with cgroup v2.\n",
+                 CgroupConstant::GetControllerFileStringView(controller_file));
+      return false;
+    }
+    if (!WriteCgroupFile(path, str)) {
+      CRANE_WARN("Unable to write {} for cgroup {}: {}\n", path,
+                 m_cgroup_path_, strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
   int err;
 
   struct cgroup_controller *cg_controller;
@@ -683,9 +1070,268 @@ bool Cgroup::SetControllerStr(CgroupConstant::Controller controller,
   return true;
 }
 
+bool Cgroup::SetControllerValueV2_(
+    CgroupConstant::ControllerFile controller_file, uint64_t value) {
+  using CgroupConstant::ControllerFile;
+
+  std::string_view file_name =
+      CgroupConstant::GetControllerFileStringViewV2(controller_file);
+  if (file_name.empty()) {
+    CRANE_WARN("{} is not supported with cgroup v2.\n",
+               CgroupConstant::GetControllerFileStringView(controller_file));
+    return false;
+  }
+
+  // The conversions of values follow those of runc and systemd.
+  std::string content;
+  switch (controller_file) {
+    case ControllerFile::CPU_SHARES:
+      value = std::clamp<uint64_t>(value, 2, 262144);
+      content = std::to_string(1 + ((value - 2) * 9999) / 262142);
+      break;
+
+    case ControllerFile::CPU_CFS_PERIOD_US: {
+      // Keep the quota, which is the first field of cpu.max.
+      std::ifstream cpu_max(FilePathV2_(file_name));
+      std::string quota;
+      if (!(cpu_max >> quota)) quota = "max";
+      content = fmt::format("{} {}", quota, value);
+      break;
+    }
+
+    case ControllerFile::MEMORY_MEMSW_LIMIT_IN_BYTES: {
+      // memory.swap.max limits the swap only, while the v1 limit covers both
+      // the memory and the swap.
+      std::ifstream memory_max(FilePathV2_("memory.max"));
+      uint64_t memory_limit;
+      if (memory_max >> memory_limit)
+        value = value > memory_limit ? value - memory_limit : 0;
+      content = std::to_string(value);
+      break;
+    }
+
+    case ControllerFile::BLOCKIO_WEIGHT:
+      // Map blkio.weight in [10, 1000] onto io.weight in [1, 10000].
+      value = std::clamp<uint64_t>(value, 10, 1000);
+      content = fmt::format("default {}", 1 + (value - 10) * 9999 / 990);
+      break;
+
+    default:
+      content = std::to_string(value);
+  }
+
+  if (!WriteCgroupFile(FilePathV2_(file_name), content)) {
+    CRANE_WARN("Unable to write {} to {} for cgroup {}: {}\n", content,
+               file_name, m_cgroup_path_, strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+std::string Cgroup::FilePathV2_(std::string_view file) const {
+  return fmt::format("{}/{}/{}", CgroupConstant::kCranedSubtreeV2,
+                     m_cgroup_path_, file);
+}
+
+std::optional<uint64_t> Cgroup::GetKeyedValueV2_(std::string_view file,
+                                                 std::string_view key) const {
+  std::ifstream keyed_file(FilePathV2_(file));
+  std::string k;
+  uint64_t value;
+  while (keyed_file >> k >> value)
+    if (k == key) return value;
+
+  return std::nullopt;
+}
+
+std::string Cgroup::ControllerFilePath_(
+    CgroupConstant::Controller controller,
+    CgroupConstant::ControllerFile controller_file) const {
+  CgroupManager &cm = CgroupManager::Instance();
+  const std::string &mount_point = cm.MountPoint(controller);
+  if (mount_point.empty()) return {};
+
+  std::string_view file_name =
+      cm.Version() == CgroupConstant::CgroupVersion::V2
+          ? CgroupConstant::GetControllerFileStringViewV2(controller_file)
+          : CgroupConstant::GetControllerFileStringView(controller_file);
+  if (file_name.empty()) return {};
+
+  return fmt::format("{}/{}/{}", mount_point, m_cgroup_path_, file_name);
+}
+
+bool Cgroup::WriteControllerFile_(
+    CgroupConstant::Controller controller,
+    CgroupConstant::ControllerFile controller_file,
+    std::string_view value) const {
+  std::string path = ControllerFilePath_(controller, controller_file);
+  if (path.empty()) return false;
+
+  return WriteCgroupFile(path, value);
+}
+
+std::optional<uint64_t> Cgroup::GetControllerValue(
+    CgroupConstant::Controller controller,
+    CgroupConstant::ControllerFile controller_file) const {
+  using CgroupConstant::ControllerFile;
+
+  if (CgroupManager::Instance().Version() ==
+      CgroupConstant::CgroupVersion::V2) {
+    if (!CgroupManager::Instance().Mounted(controller)) return std::nullopt;
+
+    if (controller_file == ControllerFile::CPUACCT_USAGE) {
+      auto usage_usec = GetKeyedValueV2_("cpu.stat", "usage_usec");
+      if (!usage_usec.has_value()) return std::nullopt;
+      return usage_usec.value() * 1000;
+    }
+
+    // memory.peak is only available since Linux 5.19.
+    if (controller_file == ControllerFile::MEMORY_MAX_USAGE_IN_BYTES &&
+        access(FilePathV2_("memory.peak").c_str(), F_OK) != 0) {
+      std::ifstream file(FilePathV2_("memory.current"));
+      uint64_t value;
+      if (!(file >> value)) return std::nullopt;
+      return value;
+    }
+  }
+
+  std::string path = ControllerFilePath_(controller, controller_file);
+  if (path.empty()) return std::nullopt;
+
+  std::ifstream file(path);
+  uint64_t value;
+  if (!(file >> value)) return std::nullopt;
+  return value;
+}
+
+std::optional<uint64_t> Cgroup::GetCpuUsageNs() const {
+  return GetControllerValue(CgroupConstant::Controller::CPUACCT_CONTROLLER,
+                            CgroupConstant::ControllerFile::CPUACCT_USAGE);
+}
+
+std::optional<uint64_t> Cgroup::GetMemoryMaxUsageBytes() const {
+  return GetControllerValue(
+      CgroupConstant::Controller::MEMORY_CONTROLLER,
+      CgroupConstant::ControllerFile::MEMORY_MAX_USAGE_IN_BYTES);
+}
+
+bool Cgroup::GetBlockioServiceBytes(uint64_t *read_bytes,
+                                    uint64_t *write_bytes) const {
+  using CgroupConstant::Controller;
+  using CgroupConstant::ControllerFile;
+
+  std::string path =
+      ControllerFilePath_(Controller::BLOCK_CONTROLLER,
+                          ControllerFile::BLOCKIO_THROTTLE_IO_SERVICE_BYTES);
+  if (path.empty()) return false;
+
+  std::ifstream file(path);
+  if (!file) return false;
+
+  if (CgroupManager::Instance().Version() ==
+      CgroupConstant::CgroupVersion::V2) {
+    // Each line is "<major>:<minor> rbytes=<n> wbytes=<n> rios=<n> ...".
+    *read_bytes = *write_bytes = 0;
+    std::string line, field;
+    while (std::getline(file, line)) {
+      std::istringstream fields(line);
+      while (fields >> field) {
+        if (field.starts_with("rbytes="))
+          *read_bytes += std::strtoull(field.c_str() + 7, nullptr, 10);
+        else if (field.starts_with("wbytes="))
+          *write_bytes += std::strtoull(field.c_str() + 7, nullptr, 10);
+      }
+    }
+    return true;
+  }
+
+  // Each line is "<major>:<minor> <operation> <bytes>", followed by a line of
+  // "Total <bytes>" at the end.
+  *read_bytes = *write_bytes = 0;
+  std::string device, op;
+  uint64_t bytes;
+  while (file >> device >> op >> bytes) {
+    if (op == "Read")
+      *read_bytes += bytes;
+    else if (op == "Write")
+      *write_bytes += bytes;
+  }
+
+  return true;
+}
+
+void Cgroup::SampleUsage(CgroupUsage *usage) const {
+  if (auto cpu = GetCpuUsageNs(); cpu.has_value())
+    usage->cpu_time_ns = std::max(usage->cpu_time_ns, cpu.value());
+
+  if (auto mem = GetMemoryMaxUsageBytes(); mem.has_value())
+    usage->max_memory_bytes = std::max(usage->max_memory_bytes, mem.value());
+
+  uint64_t read_bytes, write_bytes;
+  if (GetBlockioServiceBytes(&read_bytes, &write_bytes)) {
+    usage->blkio_read_bytes = std::max(usage->blkio_read_bytes, read_bytes);
+    usage->blkio_write_bytes = std::max(usage->blkio_write_bytes, write_bytes);
+  }
+}
+
+bool Cgroup::ResetForReuse_() const {
+  using CgroupConstant::Controller;
+  using CgroupConstant::ControllerFile;
+  CgroupManager &cm = CgroupManager::Instance();
+
+  // The memsw limit must be raised before the memory limit since it cannot
+  // be lower than the latter. It is not enabled everywhere, so its result is
+  // ignored like in ResourceAllocators.
+  bool ok = true;
+  if (cm.Mounted(Controller::MEMORY_CONTROLLER)) {
+    // The page cache of the previous task stays charged to the cgroup until
+    // it is reclaimed, so it is dropped before the next task is limited.
+    ok &= WriteControllerFile_(Controller::MEMORY_CONTROLLER,
+                               ControllerFile::MEMORY_FORCE_EMPTY, "0");
+    WriteControllerFile_(Controller::MEMORY_CONTROLLER,
+                         ControllerFile::MEMORY_MEMSW_LIMIT_IN_BYTES, "-1");
+    ok &= WriteControllerFile_(Controller::MEMORY_CONTROLLER,
+                               ControllerFile::MEMORY_LIMIT_BYTES, "-1");
+    WriteControllerFile_(Controller::MEMORY_CONTROLLER,
+                         ControllerFile::MEMORY_SOFT_LIMIT_BYTES, "-1");
+    WriteControllerFile_(Controller::MEMORY_CONTROLLER,
+                         ControllerFile::MEMORY_MAX_USAGE_IN_BYTES, "0");
+  }
+  if (cm.Mounted(Controller::CPU_CONTROLLER))
+    ok &= WriteControllerFile_(Controller::CPU_CONTROLLER,
+                               ControllerFile::CPU_CFS_QUOTA_US, "-1");
+  if (cm.Mounted(Controller::CPUACCT_CONTROLLER))
+    WriteControllerFile_(Controller::CPUACCT_CONTROLLER,
+                         ControllerFile::CPUACCT_USAGE, "0");
+  if (cm.Mounted(Controller::BLOCK_CONTROLLER))
+    WriteControllerFile_(Controller::BLOCK_CONTROLLER,
+                         ControllerFile::BLOCKIO_RESET_STATS, "1");
+
+  return ok;
+}
+
 bool Cgroup::KillAllProcesses() {
   using namespace CgroupConstant::Internal;
 
+  if (CgroupManager::Instance().Version() ==
+      CgroupConstant::CgroupVersion::V2) {
+    // cgroup.kill, available since Linux 5.14, kills the whole subtree at
+    // once. Otherwise, the processes are killed one by one.
+    if (WriteCgroupFile(FilePathV2_("cgroup.kill"), "1")) return true;
+
+    std::ifstream procs(FilePathV2_("cgroup.procs"));
+    if (!procs) {
+      CRANE_ERROR("Unable to read cgroup.procs of cgroup \"{}\"",
+                  m_cgroup_path_);
+      return false;
+    }
+
+    pid_t pid;
+    while (procs >> pid) kill(pid, SIGKILL);
+    return true;
+  }
+
   const char *controller = CgroupConstant::GetControllerStringView(
                                CgroupConstant::Controller::CPU_CONTROLLER)
                                .data();
@@ -714,6 +1360,18 @@ bool Cgroup::KillAllProcesses() {
 bool Cgroup::Empty() {
   using namespace CgroupConstant::Internal;
 
+  if (CgroupManager::Instance().Version() ==
+      CgroupConstant::CgroupVersion::V2) {
+    // "populated" also covers the processes in descendant cgroups.
+    auto populated = GetKeyedValueV2_("cgroup.events", "populated");
+    if (!populated.has_value()) {
+      CRANE_ERROR("Unable to read cgroup.events of cgroup \"{}\"",
+                  m_cgroup_path_);
+      return false;
+    }
+    return populated.value() == 0;
+  }
+
   const char *controller = CgroupConstant::GetControllerStringView(
                                CgroupConstant::Controller::CPU_CONTROLLER)
                                .data();
@@ -735,4 +1393,11 @@ bool Cgroup::Empty() {
   }
 }
 
+std::string Cgroup::EventsFilePath() const {
+  if (CgroupManager::Instance().Version() == CgroupConstant::CgroupVersion::V1)
+    return {};
+
+  return FilePathV2_("cgroup.events");
+}
+
 }  // namespace util
\ No newline at end of file
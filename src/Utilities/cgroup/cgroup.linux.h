@@ -5,6 +5,11 @@
  * This is not meant to replace direct interaction with libcgroup, however
  * it provides some simple initialization and RAII wrappers.
  *
+ * On hosts with the unified hierarchy (cgroup v2), libcgroup is not used and
+ * the cgroup filesystem is accessed directly. The v1 controllers and files
+ * below are then mapped to their v2 counterparts, and all cgroups are created
+ * under kCranedSubtreeV2.
+ *
  */
 #pragma once
 
@@ -19,6 +24,7 @@
 #include <map>
 #include <optional>
 #include <string_view>
+#include <vector>
 
 #include "crane/Lock.h"
 #include "crane/Logger.h"
@@ -30,6 +36,18 @@ class CgroupManager;  // Forward Declaration
 
 namespace CgroupConstant {
 
+enum class CgroupVersion : uint8_t {
+  V1 = 0,
+  V2,
+};
+
+constexpr std::string_view kUnifiedHierarchyRoot = "/sys/fs/cgroup";
+
+// The subtree owned by Craned in the unified hierarchy. The controllers are
+// enabled in its cgroup.subtree_control only, never in the one of the root,
+// which belongs to the init system.
+constexpr std::string_view kCranedSubtreeV2 = "/sys/fs/cgroup/crane.slice";
+
 enum class Controller : uint64_t {
   MEMORY_CONTROLLER = 0,
   CPUACCT_CONTROLLER,
@@ -55,6 +73,12 @@ enum class ControllerFile : uint64_t {
   DEVICES_DENY,
   DEVICES_ALLOW,
 
+  CPUACCT_USAGE,
+  MEMORY_MAX_USAGE_IN_BYTES,
+  BLOCKIO_THROTTLE_IO_SERVICE_BYTES,
+  BLOCKIO_RESET_STATS,
+  MEMORY_FORCE_EMPTY,
+
   ControllerFileCount
 };
 
@@ -81,6 +105,37 @@ constexpr std::array<std::string_view,
 
         "devices.deny",
         "devices.allow",
+
+        "cpuacct.usage",
+        "memory.max_usage_in_bytes",
+        "blkio.throttle.io_service_bytes",
+        "blkio.reset_stats",
+        "memory.force_empty",
+    };
+
+// The files in the unified hierarchy holding the same setting or counter.
+// An empty string means there is no counterpart in cgroup v2.
+constexpr std::array<std::string_view,
+                     static_cast<size_t>(ControllerFile::ControllerFileCount)>
+    ControllerFileStringViewV2{
+        "cpu.weight",
+        "cpu.max",
+        "cpu.max",
+
+        "memory.max",
+        "memory.swap.max",
+        "memory.low",
+
+        "io.weight",
+
+        "",
+        "",
+
+        "cpu.stat",
+        "memory.peak",
+        "io.stat",
+        "",
+        "",
     };
 }  // namespace Internal
 
@@ -94,6 +149,12 @@ constexpr std::string_view GetControllerFileStringView(
       controller_file)];
 }
 
+constexpr std::string_view GetControllerFileStringViewV2(
+    ControllerFile controller_file) {
+  return Internal::ControllerFileStringViewV2[static_cast<uint64_t>(
+      controller_file)];
+}
+
 }  // namespace CgroupConstant
 
 class ControllerFlags {
@@ -186,18 +247,28 @@ const ControllerFlags NO_CONTROLLER_FLAG{};
 //  handles this for us and no additional care needs to be take.
 const ControllerFlags ALL_CONTROLLER_FLAG = (~NO_CONTROLLER_FLAG);
 
+// Resource usage counters of a cgroup. All counters are cumulative or peak
+// values, so a later sample is never smaller than an earlier one.
+struct CgroupUsage {
+  uint64_t cpu_time_ns{0};
+  uint64_t max_memory_bytes{0};
+  uint64_t blkio_read_bytes{0};
+  uint64_t blkio_write_bytes{0};
+};
+
 class Cgroup {
  public:
   Cgroup(const std::string &path, struct cgroup *handle)
       : m_cgroup_path_(path), m_cgroup_(handle) {}
   ~Cgroup();
 
+  // Always nullptr with cgroup v2.
   struct cgroup *NativeHandle() { return m_cgroup_; }
 
   const std::string &GetCgroupString() const { return m_cgroup_path_; };
 
   // Using the zombie object pattern as exceptions are not available.
-  bool Valid() const { return m_cgroup_ != nullptr; }
+  bool Valid() const;
 
   bool SetCpuCoreLimit(double core_num);
   bool SetCpuShares(uint64_t share);
@@ -212,14 +283,72 @@ class Cgroup {
                         CgroupConstant::ControllerFile controller_file,
                         const std::string &str);
 
+  /*
+   * The getters below read the controller files directly from the mounted
+   * cgroup filesystem instead of going through cgroup_get_cgroup(), which
+   * would read every file of every controller of this cgroup.
+   */
+  std::optional<uint64_t> GetControllerValue(
+      CgroupConstant::Controller controller,
+      CgroupConstant::ControllerFile controller_file) const;
+  std::optional<uint64_t> GetCpuUsageNs() const;
+  std::optional<uint64_t> GetMemoryMaxUsageBytes() const;
+  bool GetBlockioServiceBytes(uint64_t *read_bytes,
+                              uint64_t *write_bytes) const;
+
+  /*
+   * Update usage with the current counters of this cgroup. Counters that
+   * cannot be read, e.g. because the controller is not mounted, keep their
+   * previous values.
+   */
+  void SampleUsage(CgroupUsage *usage) const;
+
   bool KillAllProcesses();
 
   bool Empty();
 
+  /*
+   * Path of cgroup.events, which is modified when its "populated" key
+   * changes, so that Empty() can be waited for with inotify.
+   * Empty with cgroup v1.
+   */
+  std::string EventsFilePath() const;
+
  private:
+  // Empty if the controller is not mounted.
+  std::string ControllerFilePath_(
+      CgroupConstant::Controller controller,
+      CgroupConstant::ControllerFile controller_file) const;
+
+  bool WriteControllerFile_(CgroupConstant::Controller controller,
+                            CgroupConstant::ControllerFile controller_file,
+                            std::string_view value) const;
+
+  /*
+   * Remove the limits, the page cache charged and the counters left by the
+   * previous task so that this cgroup can be handed out again. The cgroup
+   * must be empty.
+   * Returns false if a limit or the charged memory cannot be removed.
+   */
+  bool ResetForReuse_() const;
+
+  bool SetControllerValueV2_(CgroupConstant::ControllerFile controller_file,
+                             uint64_t value);
+
+  // Read a "key value" line of a flat keyed file such as cpu.stat.
+  std::optional<uint64_t> GetKeyedValueV2_(std::string_view file,
+                                           std::string_view key) const;
+
+  // Path of an interface file, e.g. cgroup.procs, of this cgroup.
+  std::string FilePathV2_(std::string_view file) const;
+
   std::string m_cgroup_path_;
   mutable struct cgroup *m_cgroup_;
 
+  // Whether this cgroup can be put into the pool of CgroupManager when it is
+  // released.
+  bool m_poolable_{false};
+
   friend class CgroupManager;
 };
 
@@ -227,10 +356,26 @@ class CgroupManager {
  public:
   static CgroupManager &Instance();
 
+  CgroupConstant::CgroupVersion Version() const { return m_cg_version_; }
+
+  // Whether cgroup.kill, available since Linux 5.14, can kill all the
+  // processes of a cgroup at once. Always false with cgroup v1.
+  bool CgroupKillAvailable() const { return m_cgroup_kill_available_; }
+
   bool Mounted(CgroupConstant::Controller controller) const {
     return bool(m_mounted_controllers_ & ControllerFlags{controller});
   }
 
+  // Empty if the controller is not mounted. With cgroup v2, all available
+  // controllers share kCranedSubtreeV2.
+  const std::string &MountPoint(CgroupConstant::Controller controller) const {
+    return m_mount_points_[static_cast<uint64_t>(controller)];
+  }
+
+  /*
+   * With cgroup v2, `retrieve` is ignored and the cgroup is created by a
+   * single mkdir(2) if it does not exist.
+   */
   Cgroup *CreateOrOpen(const std::string &cgroup_string,
                        ControllerFlags preferred_controllers,
                        ControllerFlags required_controllers, bool retrieve)
@@ -238,7 +383,9 @@ class CgroupManager {
 
   /*
    * Decrease the cgroup reference count by 1.
-   * If the reference reaches 0, the cgroup will be removed in OS.
+   * If the reference reaches 0, the cgroup will be removed in OS, or reset
+   * and put back into the pool, which writes several files. Callers in an
+   * event loop should call it in another thread.
    * Returns true on success, false on failure;
    */
   bool Release(const std::string &cgroup_path) LOCKS_EXCLUDED(m_mtx_);
@@ -248,6 +395,40 @@ class CgroupManager {
   bool MigrateProcTo(pid_t pid, const std::string &cgroup_path)
       LOCKS_EXCLUDED(m_mtx_);
 
+  /*
+   * Open the directory of a cgroup for clone3(CLONE_INTO_CGROUP), which
+   * creates a process directly inside the cgroup.
+   * Returns -1 with cgroup v1 or on failure. The caller closes the fd.
+   */
+  int OpenCgroupFd(const std::string &cgroup_path) const;
+
+  /*
+   * Pre-create `size` cgroups with all the mounted controllers and no limit,
+   * named `<prefix><n>`. Cgroups obtained by AcquireFromPool() are put back
+   * into the pool by Release() until it holds `size` cgroups again. A cgroup
+   * which still has processes is deleted instead.
+   * Must be called before any other method.
+   *
+   * The pool is not used with cgroup v2, where creating a cgroup is a single
+   * mkdir(2) and the counters of a cgroup cannot be reset for reuse.
+   */
+  void InitCgroupPool(const std::string &prefix, size_t size)
+      LOCKS_EXCLUDED(m_mtx_);
+
+  /*
+   * Take a cgroup from the pool and rename it to cgroup_string, which only
+   * costs a rename(2) per hierarchy. Falls back to CreateOrOpen() if the
+   * pool is empty. The returned cgroup has no limit set.
+   */
+  Cgroup *AcquireFromPool(const std::string &cgroup_string)
+      LOCKS_EXCLUDED(m_mtx_);
+
+  /*
+   * Delete the cgroups in the pool. Called when Craned exits, after all the
+   * cgroups of tasks are released.
+   */
+  void DestroyCgroupPool() LOCKS_EXCLUDED(m_mtx_);
+
  private:
   using Mutex = absl::Mutex;
   using LockGuard = util::lock_guard;
@@ -258,16 +439,48 @@ class CgroupManager {
 
   int initialize();
 
+  // Returns -1 if kCranedSubtreeV2 cannot be created or no controller is
+  // available in it.
+  int InitializeV2_();
+
+  Cgroup *CreateOrOpenV2_(const std::string &cgroup_string,
+                          ControllerFlags required_controllers)
+      EXCLUSIVE_LOCKS_REQUIRED(m_mtx_);
+
   int initialize_controller(struct cgroup &cgroup,
                             CgroupConstant::Controller controller,
                             bool required, bool has_cgroup,
                             bool &changed_cgroup) const;
 
+  std::string NextPoolPathNoLock_() EXCLUSIVE_LOCKS_REQUIRED(m_mtx_);
+
+  // Build a libcgroup handle with all the mounted controllers. No syscall is
+  // made.
+  struct cgroup *NewNativeHandle_(const std::string &cgroup_path) const;
+
+  // Rename the directories of cg in all hierarchies and rebuild its handle.
+  bool RenameCgroup_(Cgroup *cg, const std::string &new_path) const;
+
+  bool DeleteCgroup_(const std::string &cgroup_path) const;
+
+  CgroupConstant::CgroupVersion m_cg_version_{
+      CgroupConstant::CgroupVersion::V1};
+  bool m_cgroup_kill_available_{false};
+
   ControllerFlags m_mounted_controllers_;
 
+  std::array<std::string,
+             static_cast<size_t>(CgroupConstant::Controller::ControllerCount)>
+      m_mount_points_;
+
   absl::flat_hash_map<std::string, std::pair<std::unique_ptr<Cgroup>, size_t>>
       m_cgroup_ref_count_map_ GUARDED_BY(m_mtx_);
 
+  std::string m_pool_prefix_;
+  size_t m_pool_capacity_{0};
+  uint64_t m_next_pool_id_ GUARDED_BY(m_mtx_){0};
+  std::vector<std::unique_ptr<Cgroup>> m_cgroup_pool_ GUARDED_BY(m_mtx_);
+
   Mutex m_mtx_;
 };
 
@@ -0,0 +1,248 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "CranedMetaContainer.h"
+
+using Ctld::CranedMetaContainerSimpleImpl;
+
+class CranedMetaContainerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    Ctld::Config config;
+
+    for (auto&& name : {"cn1", "cn2", "cn3"}) {
+      auto node = std::make_shared<Ctld::Config::Node>();
+      node->cpu = 4;
+      node->memory_bytes = 1024 * 1024 * 1024;
+      node->partition_name = "CPU";
+      config.Nodes.emplace(name, std::move(node));
+      config.Partitions["CPU"].nodes.emplace(name);
+    }
+    config.Partitions["CPU"].nodelist_str = "cn[1-3]";
+
+    container.InitFromConfig(config);
+    ASSERT_TRUE(container.GetCraneId("cn1", &cn1));
+    ASSERT_TRUE(container.GetCraneId("cn2", &cn2));
+  }
+
+  static const crane::grpc::PartitionCranedInfo::CranedListRegexOfState&
+  StateList(const crane::grpc::QueryClusterInfoReply& reply,
+            crane::grpc::CranedState state) {
+    return reply.partition_craned(0).common_craned_state_list(state);
+  }
+
+  CranedMetaContainerSimpleImpl container;
+  CranedId cn1, cn2;
+};
+
+TEST_F(CranedMetaContainerTest, InitialSummary) {
+  auto cluster = container.QueryClusterInfo();
+  ASSERT_EQ(cluster.partition_craned_size(), 1);
+  EXPECT_EQ(cluster.partition_craned(0).state(),
+            crane::grpc::PartitionState::PARTITION_DOWN);
+  EXPECT_EQ(StateList(cluster, crane::grpc::CRANE_DOWN).craned_num(), 3);
+  EXPECT_EQ(StateList(cluster, crane::grpc::CRANE_DOWN).craned_list_regex(),
+            "cn[1-3]");
+
+  auto part = container.QueryAllPartitionInfo();
+  ASSERT_EQ(part.partition_info_size(), 1);
+  EXPECT_EQ(part.partition_info(0).total_nodes(), 3);
+  EXPECT_EQ(part.partition_info(0).alive_nodes(), 0);
+
+  EXPECT_EQ(container.QueryAllCranedInfo().craned_info_list_size(), 3);
+}
+
+TEST_F(CranedMetaContainerTest, IncrementalUpdate) {
+  container.CranedUp(cn1);
+  container.CranedUp(cn2);
+
+  auto cluster = container.QueryClusterInfo();
+  EXPECT_EQ(cluster.partition_craned(0).state(),
+            crane::grpc::PartitionState::PARTITION_UP);
+  EXPECT_EQ(StateList(cluster, crane::grpc::CRANE_IDLE).craned_num(), 2);
+  EXPECT_EQ(StateList(cluster, crane::grpc::CRANE_DOWN).craned_num(), 1);
+
+  Resources half;
+  half.allocatable_resource.cpu_count = 2;
+  half.allocatable_resource.memory_bytes = 512 * 1024 * 1024;
+  half.allocatable_resource.memory_sw_bytes = 512 * 1024 * 1024;
+  container.MallocResourceFromNode(cn1, 1, half);
+
+  cluster = container.QueryClusterInfo();
+  EXPECT_EQ(StateList(cluster, crane::grpc::CRANE_MIX).craned_num(), 1);
+  EXPECT_EQ(StateList(cluster, crane::grpc::CRANE_MIX).craned_list_regex(),
+            "cn1");
+  EXPECT_EQ(StateList(cluster, crane::grpc::CRANE_IDLE).craned_list_regex(),
+            "cn2");
+
+  container.MallocResourceFromNode(cn1, 2, half);
+  cluster = container.QueryClusterInfo();
+  EXPECT_EQ(StateList(cluster, crane::grpc::CRANE_ALLOC).craned_num(), 1);
+  EXPECT_EQ(StateList(cluster, crane::grpc::CRANE_MIX).craned_num(), 0);
+
+  auto part = container.QueryAllPartitionInfo();
+  EXPECT_EQ(part.partition_info(0).alive_nodes(), 2);
+  EXPECT_DOUBLE_EQ(part.partition_info(0).alloc_cpus(), 4);
+
+  container.FreeResourceFromNode(cn1, 1);
+  container.FreeResourceFromNode(cn1, 2);
+  container.CranedDown(cn2);
+
+  cluster = container.QueryClusterInfo();
+  EXPECT_EQ(StateList(cluster, crane::grpc::CRANE_IDLE).craned_num(), 1);
+  EXPECT_EQ(StateList(cluster, crane::grpc::CRANE_DOWN).craned_list_regex(),
+            "cn[2-3]");
+
+  part = container.QueryAllPartitionInfo();
+  EXPECT_EQ(part.partition_info(0).alive_nodes(), 1);
+  EXPECT_DOUBLE_EQ(part.partition_info(0).alloc_cpus(), 0);
+
+  auto craned = container.QueryAllCranedInfo();
+  for (auto&& craned_info : craned.craned_info_list())
+    EXPECT_EQ(craned_info.running_task_num(), 0);
+}
+
+TEST_F(CranedMetaContainerTest, TryMallocChecksNode) {
+  Resources half;
+  half.allocatable_resource.cpu_count = 2;
+  half.allocatable_resource.memory_bytes = 512 * 1024 * 1024;
+  half.allocatable_resource.memory_sw_bytes = 512 * 1024 * 1024;
+
+  // cn1 is down.
+  EXPECT_FALSE(container.TryMallocResourceFromNode(cn1, 1, half));
+
+  container.CranedUp(cn1);
+  EXPECT_TRUE(container.TryMallocResourceFromNode(cn1, 1, half));
+  EXPECT_TRUE(container.TryMallocResourceFromNode(cn1, 2, half));
+  EXPECT_FALSE(container.TryMallocResourceFromNode(cn1, 3, half));
+
+  auto part = container.QueryAllPartitionInfo();
+  EXPECT_DOUBLE_EQ(part.partition_info(0).alloc_cpus(), 4);
+  EXPECT_DOUBLE_EQ(part.partition_info(0).avail_cpus(), 0);
+}
+
+TEST_F(CranedMetaContainerTest, WatchClusterState) {
+  crane::grpc::WatchClusterStateReply snapshot;
+  container.QueryClusterStateSince(0, &snapshot);
+  EXPECT_TRUE(snapshot.snapshot());
+  EXPECT_EQ(snapshot.craned_info_list_size(), 3);
+  EXPECT_EQ(snapshot.partition_info_list_size(), 1);
+
+  uint64_t version = snapshot.version();
+  EXPECT_EQ(container.ClusterStateVersion(), version);
+
+  container.CranedUp(cn1);
+  container.CranedUp(cn2);
+  container.CranedDown(cn1);
+  EXPECT_EQ(container.ClusterStateVersion(), version + 3);
+
+  crane::grpc::WatchClusterStateReply delta;
+  container.QueryClusterStateSince(version, &delta);
+  EXPECT_FALSE(delta.snapshot());
+  EXPECT_EQ(delta.version(), version + 3);
+  // cn1 changed twice but is sent once with its latest state.
+  ASSERT_EQ(delta.craned_info_list_size(), 2);
+  EXPECT_EQ(delta.craned_info_list(0).hostname(), "cn1");
+  EXPECT_EQ(delta.craned_info_list(0).state(), crane::grpc::CRANE_DOWN);
+  EXPECT_EQ(delta.craned_info_list(1).hostname(), "cn2");
+  ASSERT_EQ(delta.partition_info_list_size(), 1);
+  EXPECT_EQ(delta.partition_info_list(0).alive_nodes(), 1);
+
+  crane::grpc::WatchClusterStateReply empty;
+  container.QueryClusterStateSince(delta.version(), &empty);
+  EXPECT_FALSE(empty.snapshot());
+  EXPECT_EQ(empty.version(), delta.version());
+  EXPECT_EQ(empty.craned_info_list_size(), 0);
+
+  // A version unknown to this container, e.g. one from a future run, falls
+  // back to a snapshot.
+  crane::grpc::WatchClusterStateReply resumed;
+  container.QueryClusterStateSince(delta.version() + 1, &resumed);
+  EXPECT_TRUE(resumed.snapshot());
+  EXPECT_EQ(resumed.craned_info_list_size(), 3);
+}
+
+// Measures the throughput of concurrent malloc/free and summary queries.
+TEST(CranedMetaContainerBenchmark, Contention) {
+  constexpr uint32_t kPartitionNum = 4;
+  constexpr uint32_t kNodeNumPerPartition = 64;
+  constexpr uint32_t kWriterNum = 8;
+  constexpr uint32_t kReaderNum = 8;
+  constexpr uint32_t kRoundNum = 2000;
+  constexpr uint32_t kQueryNum = 2000;
+
+  Ctld::Config config;
+  for (uint32_t p = 0; p < kPartitionNum; p++) {
+    std::string part_name = fmt::format("part{}", p);
+    for (uint32_t n = 0; n < kNodeNumPerPartition; n++) {
+      std::string name = fmt::format("p{}cn{}", p, n);
+      auto node = std::make_shared<Ctld::Config::Node>();
+      node->cpu = 64;
+      node->memory_bytes = 64ull * 1024 * 1024 * 1024;
+      node->partition_name = part_name;
+      config.Nodes.emplace(name, std::move(node));
+      config.Partitions[part_name].nodes.emplace(name);
+    }
+  }
+
+  CranedMetaContainerSimpleImpl container;
+  container.InitFromConfig(config);
+  for (uint32_t p = 0; p < kPartitionNum; p++)
+    for (uint32_t n = 0; n < kNodeNumPerPartition; n++)
+      container.CranedUp({p, n});
+
+  Resources res;
+  res.allocatable_resource.cpu_count = 1;
+  res.allocatable_resource.memory_bytes = 1024 * 1024 * 1024;
+  res.allocatable_resource.memory_sw_bytes = 1024 * 1024 * 1024;
+
+  std::vector<std::thread> writers, readers;
+
+  auto begin = std::chrono::steady_clock::now();
+
+  for (uint32_t w = 0; w < kWriterNum; w++) {
+    writers.emplace_back([&, w] {
+      for (uint32_t i = 0; i < kRoundNum; i++) {
+        CranedId id{(w + i) % kPartitionNum, i % kNodeNumPerPartition};
+        uint32_t task_id = w * kRoundNum + i;
+        container.MallocResourceFromNode(id, task_id, res);
+        container.FreeResourceFromNode(id, task_id);
+      }
+    });
+  }
+  for (uint32_t r = 0; r < kReaderNum; r++) {
+    readers.emplace_back([&, r] {
+      for (uint32_t i = 0; i < kQueryNum; i++) {
+        switch ((r + i) % 3) {
+          case 0:
+            container.QueryClusterInfo();
+            break;
+          case 1:
+            container.QueryAllPartitionInfo();
+            break;
+          default:
+            container.QueryCranedInfo("p0cn0");
+        }
+      }
+    });
+  }
+
+  for (auto& t : writers) t.join();
+  for (auto& t : readers) t.join();
+  auto end = std::chrono::steady_clock::now();
+
+  double sec = std::chrono::duration<double>(end - begin).count();
+  uint32_t op_num = kWriterNum * kRoundNum * 2 + kReaderNum * kQueryNum;
+  fmt::print("{} malloc/free pairs and {} queries in {:.3f}s: {:.0f} op/s\n",
+             kWriterNum * kRoundNum, kReaderNum * kQueryNum, sec,
+             op_num / sec);
+
+  auto cluster = container.QueryClusterInfo();
+  for (auto&& part : cluster.partition_craned())
+    EXPECT_EQ(part.common_craned_state_list(crane::grpc::CRANE_IDLE)
+                  .craned_num(),
+              kNodeNumPerPartition);
+}
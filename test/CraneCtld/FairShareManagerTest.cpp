@@ -0,0 +1,78 @@
+#include "FairShareManager.h"
+
+#include <gtest/gtest.h>
+
+using Ctld::FairShareManager;
+using Ctld::UsageRecord;
+
+TEST(FairShareManager, Decay) {
+  absl::Time t0 = absl::FromUnixSeconds(1'000'000);
+  FairShareManager manager(absl::Hours(1), t0);
+
+  manager.AddUsage("alice", "lab", 100, t0);
+  EXPECT_DOUBLE_EQ(manager.UserUsage("alice", t0), 100);
+  EXPECT_DOUBLE_EQ(manager.UserUsage("alice", t0 + absl::Hours(1)), 50);
+  EXPECT_DOUBLE_EQ(manager.AccountUsage("lab", t0 + absl::Hours(2)), 25);
+
+  manager.AddUsage("alice", "lab", 50, t0 + absl::Hours(1));
+  EXPECT_DOUBLE_EQ(manager.UserUsage("alice", t0 + absl::Hours(1)), 100);
+  EXPECT_DOUBLE_EQ(manager.UserUsage("bob", t0), 0);
+}
+
+TEST(FairShareManager, Factor) {
+  absl::Time t0 = absl::FromUnixSeconds(1'000'000);
+  FairShareManager manager(absl::Hours(1), t0);
+
+  EXPECT_DOUBLE_EQ(manager.UserFairShareFactor("alice"), 1);
+
+  manager.AddUsage("alice", "lab", 100, t0);
+  manager.AddUsage("bob", "lab", 100, t0);
+  // Both consumed exactly their share.
+  EXPECT_DOUBLE_EQ(manager.UserFairShareFactor("alice"), 0.5);
+  EXPECT_DOUBLE_EQ(manager.UserFairShareFactor("carol"), 1);
+
+  // Usage added earlier has decayed more.
+  manager.AddUsage("bob", "lab", 100, t0 + absl::Hours(1));
+  EXPECT_LT(manager.UserFairShareFactor("bob"), 0.5);
+  EXPECT_GT(manager.UserFairShareFactor("alice"), 0.5);
+  EXPECT_DOUBLE_EQ(manager.UserFairShareFactor("alice"),
+                   std::exp2(-2 * 50.0 / 200.0));
+}
+
+TEST(FairShareManager, RebaseAndCheckpoint) {
+  absl::Time t0 = absl::FromUnixSeconds(1'000'000);
+  FairShareManager manager(absl::Hours(1), t0);
+
+  manager.AddUsage("alice", "lab", 100, t0);
+  // Far beyond the scale limit, which forces a rebase.
+  absl::Time t1 = t0 + absl::Hours(100);
+  manager.AddUsage("bob", "lab", 100, t1);
+  EXPECT_DOUBLE_EQ(manager.UserUsage("bob", t1), 100);
+  EXPECT_NEAR(manager.UserUsage("alice", t1), 100 * std::exp2(-100), 1e-30);
+
+  std::vector<UsageRecord> records = manager.Dump(t1 + absl::Hours(1));
+  EXPECT_EQ(records.size(), 3);
+
+  FairShareManager restored(absl::Hours(1), t1 + absl::Hours(5));
+  restored.Load(records);
+  EXPECT_DOUBLE_EQ(restored.UserUsage("bob", t1 + absl::Hours(2)), 25);
+  EXPECT_DOUBLE_EQ(restored.AccountUsage("lab", t1 + absl::Hours(1)),
+                   manager.AccountUsage("lab", t1 + absl::Hours(1)));
+}
+
+TEST(FairShareManager, CheckpointThread) {
+  std::vector<UsageRecord> checkpointed;
+  {
+    FairShareManager manager(absl::Hours(1));
+    manager.StartCheckpointThread(
+        absl::Hours(1), [&](std::vector<UsageRecord>&& records) {
+          checkpointed = std::move(records);
+        });
+    manager.AddUsage("alice", "", 100, absl::Now());
+  }
+
+  // The usage is checkpointed once more on destruction.
+  ASSERT_EQ(checkpointed.size(), 1);
+  EXPECT_EQ(checkpointed[0].name, "alice");
+  EXPECT_NEAR(checkpointed[0].usage, 100, 1e-3);
+}
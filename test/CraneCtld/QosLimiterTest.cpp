@@ -0,0 +1,83 @@
+#include "QosLimiter.h"
+
+#include <gtest/gtest.h>
+
+using Ctld::QosLimiter;
+using Ctld::TaskInCtld;
+
+namespace {
+
+TaskInCtld MakeTask(uid_t uid, const std::string& qos, double cpu) {
+  TaskInCtld task;
+  task.uid = uid;
+  task.qos = qos;
+  task.node_num = 1;
+  task.resources.allocatable_resource.cpu_count = cpu;
+  return task;
+}
+
+}  // namespace
+
+TEST(QosLimiter, SubmitLimit) {
+  QosLimiter limiter;
+  limiter.SetQosLimits("normal", {.max_jobs_per_user = 2});
+
+  TaskInCtld task = MakeTask(1000, "normal", 1);
+  EXPECT_TRUE(limiter.TryAddSubmittedJob(task));
+  EXPECT_TRUE(limiter.TryAddSubmittedJob(task));
+  EXPECT_FALSE(limiter.TryAddSubmittedJob(task));
+
+  // Other users and qos are counted separately.
+  EXPECT_TRUE(limiter.TryAddSubmittedJob(MakeTask(1001, "normal", 1)));
+  EXPECT_TRUE(limiter.TryAddSubmittedJob(MakeTask(1000, "other", 1)));
+
+  limiter.RemoveJob(task, false);
+  EXPECT_TRUE(limiter.TryAddSubmittedJob(task));
+}
+
+TEST(QosLimiter, RunningLimits) {
+  QosLimiter limiter;
+  limiter.SetQosLimits("normal", {.max_running_jobs_per_user = 2,
+                                  .max_cpus_per_user = 4});
+
+  TaskInCtld small = MakeTask(1000, "normal", 1);
+  TaskInCtld large = MakeTask(1000, "normal", 3);
+  TaskInCtld huge = MakeTask(1000, "normal", 5);
+  for (auto* task : {&small, &large, &huge})
+    ASSERT_TRUE(limiter.TryAddSubmittedJob(*task));
+
+  EXPECT_FALSE(limiter.CheckRunningLimits(huge));
+  EXPECT_TRUE(limiter.TryAddRunningJob(small));
+  EXPECT_TRUE(limiter.CheckRunningLimits(large));
+  EXPECT_TRUE(limiter.TryAddRunningJob(large));
+
+  // Both the job count and the cpu count are reached now.
+  EXPECT_FALSE(limiter.CheckRunningLimits(small));
+  EXPECT_FALSE(limiter.TryAddRunningJob(small));
+
+  limiter.RemoveJob(large, true);
+  EXPECT_TRUE(limiter.CheckRunningLimits(large));
+
+  limiter.RemoveQos("normal");
+  EXPECT_TRUE(limiter.CheckRunningLimits(huge));
+}
+
+TEST(QosLimiter, Recovery) {
+  QosLimiter limiter;
+  limiter.SetQosLimits("normal", {.max_jobs_per_user = 1,
+                                  .max_running_jobs_per_user = 1});
+
+  TaskInCtld task = MakeTask(1000, "normal", 1);
+  // Recovered jobs are counted even beyond the limits.
+  limiter.AddRecoveredJob(task, true);
+  limiter.AddRecoveredJob(task, false);
+
+  EXPECT_FALSE(limiter.TryAddSubmittedJob(task));
+  EXPECT_FALSE(limiter.CheckRunningLimits(task));
+
+  limiter.RemoveJob(task, true);
+  EXPECT_TRUE(limiter.CheckRunningLimits(task));
+  EXPECT_FALSE(limiter.TryAddSubmittedJob(task));
+  limiter.RemoveJob(task, false);
+  EXPECT_TRUE(limiter.TryAddSubmittedJob(task));
+}
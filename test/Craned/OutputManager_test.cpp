@@ -0,0 +1,245 @@
+#include "../../src/Craned/OutputManager.h"
+
+#include <event2/thread.h>
+#include <fcntl.h>
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+using namespace Craned;
+
+class OutputManagerTest : public testing::Test {
+ public:
+  void SetUp() override {
+    evthread_use_pthreads();
+    m_ev_base_ = event_base_new();
+
+    m_dir_ = std::filesystem::temp_directory_path() /
+             fmt::format("craned_output_test_{}", getpid());
+    std::filesystem::create_directories(m_dir_ / "staging");
+  }
+
+  void TearDown() override {
+    event_base_free(m_ev_base_);
+    std::filesystem::remove_all(m_dir_);
+  }
+
+  // Run the event loop until all pipes are closed.
+  void RunLoop(absl::Duration duration = absl::Milliseconds(500)) {
+    timeval tv = absl::ToTimeval(duration);
+    event_base_loopexit(m_ev_base_, &tv);
+    event_base_dispatch(m_ev_base_);
+  }
+
+  // Returns the write end of a new pipe collected by mgr.
+  int AddPipe(OutputManager* mgr, const std::string& path) {
+    int fds[2];
+    EXPECT_EQ(pipe2(fds, O_CLOEXEC), 0);
+    EXPECT_TRUE(mgr->AddOutput(1, fds[0], path, getuid(), getgid()));
+    return fds[1];
+  }
+
+  static std::string ReadFile(const std::string& path) {
+    std::ifstream ifs(path);
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    return ss.str();
+  }
+
+  static void WriteAll(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+      ssize_t n = write(fd, data.data() + written, data.size() - written);
+      ASSERT_GT(n, 0);
+      written += n;
+    }
+  }
+
+  OutputManager::Options DefaultOptions() {
+    return OutputManager::Options{.buffer_bytes = 4096,
+                                  .flush_interval = absl::Milliseconds(50),
+                                  .rate_limit_bytes_per_sec = 0,
+                                  .staging_dir = "",
+                                  .staging_flush_bytes = 0,
+                                  .tail_buffer_bytes = 1024};
+  }
+
+  struct event_base* m_ev_base_;
+  std::filesystem::path m_dir_;
+};
+
+TEST_F(OutputManagerTest, WriteDirectly) {
+  std::string path = m_dir_ / "out";
+  auto mgr = std::make_unique<OutputManager>(m_ev_base_, DefaultOptions());
+
+  int fd = AddPipe(mgr.get(), path);
+  WriteAll(fd, "hello\n");
+  WriteAll(fd, "world\n");
+  close(fd);
+
+  RunLoop();
+  mgr.reset();
+
+  EXPECT_EQ(ReadFile(path), "hello\nworld\n");
+}
+
+TEST_F(OutputManagerTest, EmptyOutputCreatesFile) {
+  std::string path = m_dir_ / "empty";
+  auto mgr = std::make_unique<OutputManager>(m_ev_base_, DefaultOptions());
+
+  close(AddPipe(mgr.get(), path));
+
+  RunLoop();
+  mgr.reset();
+
+  EXPECT_TRUE(std::filesystem::exists(path));
+  EXPECT_EQ(ReadFile(path), "");
+}
+
+TEST_F(OutputManagerTest, BackPressure) {
+  std::string path = m_dir_ / "large";
+  auto mgr = std::make_unique<OutputManager>(m_ev_base_, DefaultOptions());
+
+  // Far larger than the buffer and the capacity of the pipe.
+  std::string data;
+  for (int i = 0; data.size() < 4 * 1024 * 1024; i++)
+    data += fmt::format("line {}\n", i);
+
+  int fd = AddPipe(mgr.get(), path);
+  std::thread writer([&] {
+    WriteAll(fd, data);
+    close(fd);
+  });
+
+  RunLoop(absl::Seconds(3));
+  writer.join();
+  mgr.reset();
+
+  EXPECT_EQ(ReadFile(path), data);
+}
+
+TEST_F(OutputManagerTest, Staging) {
+  std::string path = m_dir_ / "staged";
+  auto options = DefaultOptions();
+  options.staging_dir = m_dir_ / "staging";
+  options.staging_flush_bytes = 16 * 1024;
+  auto mgr = std::make_unique<OutputManager>(m_ev_base_, options);
+
+  std::string data;
+  for (int i = 0; data.size() < 256 * 1024; i++)
+    data += fmt::format("line {}\n", i);
+
+  int fd = AddPipe(mgr.get(), path);
+  std::thread writer([&] {
+    WriteAll(fd, data);
+    close(fd);
+  });
+
+  RunLoop(absl::Seconds(1));
+  writer.join();
+  mgr.reset();
+
+  EXPECT_EQ(ReadFile(path), data);
+  EXPECT_TRUE(std::filesystem::is_empty(m_dir_ / "staging"));
+}
+
+TEST_F(OutputManagerTest, FlushOnDestruction) {
+  std::string path = m_dir_ / "running";
+  auto mgr = std::make_unique<OutputManager>(m_ev_base_, DefaultOptions());
+
+  // The pipe is still open when the manager is destroyed.
+  int fd = AddPipe(mgr.get(), path);
+  WriteAll(fd, "partial");
+
+  RunLoop(absl::Milliseconds(100));
+  mgr.reset();
+  close(fd);
+
+  EXPECT_EQ(ReadFile(path), "partial");
+}
+
+TEST_F(OutputManagerTest, RateLimit) {
+  std::string path = m_dir_ / "limited";
+  auto options = DefaultOptions();
+  options.rate_limit_bytes_per_sec = 8 * 1024;
+  auto mgr = std::make_unique<OutputManager>(m_ev_base_, options);
+
+  // Fits in the pipe, but takes several seconds to be read.
+  int fd = AddPipe(mgr.get(), path);
+  WriteAll(fd, std::string(48 * 1024, 'x'));
+
+  RunLoop(absl::Seconds(1));
+  mgr.reset();
+  close(fd);
+
+  size_t size = std::filesystem::file_size(path);
+  EXPECT_GT(size, 0);
+  EXPECT_LT(size, 48 * 1024);
+}
+
+TEST_F(OutputManagerTest, TailFromRingBuffer) {
+  std::string path = m_dir_ / "tail";
+  auto mgr = std::make_unique<OutputManager>(m_ev_base_, DefaultOptions());
+
+  int fd = AddPipe(mgr.get(), path);
+  WriteAll(fd, "abc");
+  RunLoop(absl::Milliseconds(100));
+
+  OutputManager::TailCursor cursor;
+  ASSERT_TRUE(mgr->OpenTail(1, -2, &cursor));
+
+  std::string data;
+  uint64_t offset;
+  ASSERT_EQ(mgr->ReadTail(&cursor, 1024, absl::Milliseconds(100), &data,
+                          &offset),
+            OutputManager::TailStatus::kOk);
+  EXPECT_EQ(data, "bc");
+  EXPECT_EQ(offset, 1);
+
+  EXPECT_EQ(mgr->ReadTail(&cursor, 1024, absl::Milliseconds(100), &data,
+                          &offset),
+            OutputManager::TailStatus::kTimeout);
+
+  close(fd);
+  RunLoop(absl::Milliseconds(100));
+  EXPECT_EQ(mgr->ReadTail(&cursor, 1024, absl::Milliseconds(100), &data,
+                          &offset),
+            OutputManager::TailStatus::kEnd);
+}
+
+TEST_F(OutputManagerTest, TailBehindRingBufferReadsFile) {
+  std::string path = m_dir_ / "tail_file";
+  auto mgr = std::make_unique<OutputManager>(m_ev_base_, DefaultOptions());
+
+  int fd = AddPipe(mgr.get(), path);
+  OutputManager::TailCursor cursor;
+  ASSERT_TRUE(mgr->OpenTail(1, 0, &cursor));
+
+  // Far larger than the ring buffer.
+  std::string expected;
+  for (int i = 0; expected.size() < 16 * 1024; i++)
+    expected += fmt::format("line {}\n", i);
+  WriteAll(fd, expected);
+  close(fd);
+  RunLoop();
+
+  std::string tailed;
+  while (true) {
+    std::string data;
+    uint64_t offset;
+    auto status = mgr->ReadTail(&cursor, 1000, absl::Milliseconds(100),
+                                &data, &offset);
+    if (status != OutputManager::TailStatus::kOk) {
+      EXPECT_EQ(status, OutputManager::TailStatus::kEnd);
+      break;
+    }
+    EXPECT_EQ(offset, tailed.size());
+    tailed += data;
+  }
+
+  EXPECT_EQ(tailed, expected);
+}
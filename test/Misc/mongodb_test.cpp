@@ -464,14 +464,14 @@ bool MongodbClient::GetAccountInfo(const std::string& name,
     account->name = account_view["name"].get_utf8().value;
     account->description = account_view["description"].get_utf8().value;
     for (auto&& user : account_view["users"].get_array().value) {
-      account->users.emplace_back(user.get_utf8().value);
+      account->users.emplace(user.get_utf8().value);
     }
     for (auto&& acct : account_view["child_account"].get_array().value) {
-      account->child_accounts.emplace_back(acct.get_utf8().value);
+      account->child_accounts.emplace(acct.get_utf8().value);
     }
     for (auto&& partition :
          account_view["allowed_partition"].get_array().value) {
-      account->allowed_partition.emplace_back(partition.get_utf8().value);
+      account->allowed_partition.emplace(partition.get_utf8().value);
     }
     account->parent_account = account_view["parent_account"].get_utf8().value;
     //    account->qos = account_view["qos"].get_utf8().value;
@@ -0,0 +1,215 @@
+#include "crane/TimerWheel.h"
+
+#include <event2/event.h>
+#include <gtest/gtest.h>
+#include <spdlog/fmt/fmt.h>
+
+#include <chrono>
+#include <ctime>
+#include <random>
+#include <vector>
+
+using crane::EvTimerWheel;
+using crane::TimerWheel;
+using namespace std::chrono_literals;
+
+namespace {
+
+TimerWheel::Clock::time_point Epoch() {
+  return TimerWheel::Clock::time_point{} + 1h;
+}
+
+}  // namespace
+
+TEST(TimerWheel, ExpireAtDeadline) {
+  // With 1us ticks, the wheel covers about 19 hours, so the timers up to two
+  // days away also exercise the ones beyond its range.
+  TimerWheel wheel(1us, Epoch());
+
+  std::mt19937_64 rng(42);
+  std::vector<TimerWheel::Clock::duration> delays;
+  for (int i = 0; i < 10000; i++) {
+    int64_t max_us;
+    switch (i % 4) {
+      case 0:
+        max_us = 100;
+        break;
+      case 1:
+        max_us = 1000 * 1000;
+        break;
+      case 2:
+        max_us = int64_t{3600} * 1000 * 1000;
+        break;
+      default:
+        max_us = int64_t{48} * 3600 * 1000 * 1000;
+    }
+    delays.emplace_back(std::chrono::microseconds(1 + rng() % max_us));
+  }
+
+  std::vector<TimerWheel::Clock::time_point> fired_at(delays.size());
+  TimerWheel::Clock::time_point now = Epoch();
+  for (size_t i = 0; i < delays.size(); i++)
+    wheel.AddTimer(Epoch() + delays[i], [&, i] { fired_at[i] = now; });
+  EXPECT_EQ(wheel.Size(), delays.size());
+
+  // Jump from one wakeup to the next, sometimes short of it.
+  size_t expired = 0;
+  while (auto wakeup = wheel.NextWakeup()) {
+    ASSERT_GT(*wakeup, now);
+    now = (rng() % 4 == 0) ? now + (*wakeup - now) / 2 : *wakeup;
+    expired += wheel.Advance(now);
+  }
+
+  EXPECT_EQ(expired, delays.size());
+  EXPECT_EQ(wheel.Size(), 0);
+  for (size_t i = 0; i < delays.size(); i++)
+    EXPECT_EQ(fired_at[i], Epoch() + delays[i]) << "Timer #" << i;
+}
+
+TEST(TimerWheel, Cancel) {
+  TimerWheel wheel(1ms, Epoch());
+
+  int fired = 0;
+  auto id1 = wheel.AddTimer(Epoch() + 10ms, [&] { fired++; });
+  auto id2 = wheel.AddTimer(Epoch() + 10ms, [&] { fired += 10; });
+  auto id3 = wheel.AddTimer(Epoch() + 10s, [&] { fired += 100; });
+
+  EXPECT_TRUE(wheel.CancelTimer(id2));
+  EXPECT_FALSE(wheel.CancelTimer(id2));
+  EXPECT_TRUE(wheel.CancelTimer(id3));
+  EXPECT_FALSE(wheel.CancelTimer(TimerWheel::kInvalidTimerId));
+  EXPECT_EQ(wheel.Size(), 1);
+
+  EXPECT_EQ(wheel.Advance(Epoch() + 9ms), 0);
+  EXPECT_EQ(wheel.Advance(Epoch() + 20s), 1);
+  EXPECT_EQ(fired, 1);
+  EXPECT_FALSE(wheel.CancelTimer(id1));
+  EXPECT_FALSE(wheel.NextWakeup().has_value());
+
+  // The nodes are reused, but the old ids stay invalid.
+  auto id4 = wheel.AddTimer(Epoch() + 30s, [] {});
+  EXPECT_NE(id4, id1);
+  EXPECT_NE(id4, id2);
+  EXPECT_FALSE(wheel.CancelTimer(id1));
+  EXPECT_TRUE(wheel.CancelTimer(id4));
+}
+
+TEST(TimerWheel, CallbackAddsAndCancels) {
+  TimerWheel wheel(1ms, Epoch());
+
+  std::vector<int> order;
+  TimerWheel::TimerId id2;
+  wheel.AddTimer(Epoch() + 5ms, [&] {
+    order.push_back(1);
+    EXPECT_TRUE(wheel.CancelTimer(id2));
+    // An expired deadline expires in the next Advance().
+    wheel.AddTimer(Epoch(), [&] { order.push_back(3); });
+  });
+  id2 = wheel.AddTimer(Epoch() + 6ms, [&] { order.push_back(2); });
+
+  EXPECT_EQ(wheel.Advance(Epoch() + 5ms), 1);
+  EXPECT_EQ(order, (std::vector<int>{1}));
+
+  EXPECT_EQ(wheel.Advance(Epoch() + 6ms), 1);
+  EXPECT_EQ(order, (std::vector<int>{1, 3}));
+  EXPECT_EQ(wheel.Size(), 0);
+}
+
+TEST(EvTimerWheel, Simple) {
+  struct event_base* base = event_base_new();
+  auto wheel = std::make_unique<EvTimerWheel>(base, 1ms);
+
+  auto begin = EvTimerWheel::Clock::now();
+  std::vector<int> fired;
+  wheel->AddTimer(50ms, [&] { fired.push_back(2); });
+  wheel->AddTimer(10ms, [&] { fired.push_back(1); });
+  auto id = wheel->AddTimer(30ms, [&] { fired.push_back(3); });
+  EXPECT_TRUE(wheel->CancelTimer(id));
+
+  event_base_dispatch(base);
+  auto elapsed = EvTimerWheel::Clock::now() - begin;
+
+  EXPECT_EQ(fired, (std::vector<int>{1, 2}));
+  EXPECT_GE(elapsed, 50ms);
+  EXPECT_EQ(wheel->Size(), 0);
+
+  wheel.reset();
+  event_base_free(base);
+}
+
+// Compares 10k task time limits held by one event each, as TaskManager used
+// to do, with the ones held by EvTimerWheel. It is timing-dependent and
+// prints its results, so it only runs with --gtest_also_run_disabled_tests.
+TEST(TimerWheelBenchmark, DISABLED_TenThousandTimers) {
+  constexpr int kTimerNum = 10000;
+  using Clock = std::chrono::steady_clock;
+
+  struct event_base* base = event_base_new();
+
+  // Most tasks end before their time limits, so the timers are cancelled.
+  auto begin = Clock::now();
+  std::vector<struct event*> events;
+  for (int i = 0; i < kTimerNum; i++) {
+    struct event* ev = event_new(
+        base, -1, 0, [](evutil_socket_t, short, void*) {}, nullptr);
+    timeval tv{3600 + i % 3600, 0};
+    evtimer_add(ev, &tv);
+    events.push_back(ev);
+  }
+  for (struct event* ev : events) {
+    event_del(ev);
+    event_free(ev);
+  }
+  double event_add_cancel_us =
+      std::chrono::duration<double, std::micro>(Clock::now() - begin).count();
+
+  auto wheel = std::make_unique<EvTimerWheel>(base, 100ms);
+  begin = Clock::now();
+  std::vector<EvTimerWheel::TimerId> ids;
+  for (int i = 0; i < kTimerNum; i++) {
+    auto delay = std::chrono::seconds(3600 + i % 3600);
+    ids.push_back(wheel->AddTimer(delay, [] {}));
+  }
+  for (auto id : ids) EXPECT_TRUE(wheel->CancelTimer(id));
+  double wheel_add_cancel_us =
+      std::chrono::duration<double, std::micro>(Clock::now() - begin).count();
+
+  // All the timers expire within 100ms. The CPU time is measured since the
+  // loop mostly waits.
+  int fired = 0;
+  auto cb = [](evutil_socket_t, short, void* arg) { (*(int*)arg)++; };
+  std::clock_t cpu_begin = std::clock();
+  events.clear();
+  for (int i = 0; i < kTimerNum; i++) {
+    struct event* ev = event_new(base, -1, 0, cb, &fired);
+    timeval tv{0, (i % 100) * 1000};
+    evtimer_add(ev, &tv);
+    events.push_back(ev);
+  }
+  event_base_dispatch(base);
+  for (struct event* ev : events) event_free(ev);
+  double event_expire_ms =
+      1000.0 * (std::clock() - cpu_begin) / CLOCKS_PER_SEC;
+  EXPECT_EQ(fired, kTimerNum);
+
+  fired = 0;
+  wheel = std::make_unique<EvTimerWheel>(base, 1ms);
+  cpu_begin = std::clock();
+  for (int i = 0; i < kTimerNum; i++)
+    wheel->AddTimer(std::chrono::milliseconds(i % 100), [&] { fired++; });
+  event_base_dispatch(base);
+  double wheel_expire_ms =
+      1000.0 * (std::clock() - cpu_begin) / CLOCKS_PER_SEC;
+  EXPECT_EQ(fired, kTimerNum);
+
+  fmt::print(
+      "{} timers added and cancelled: libevent {:.0f}us, wheel {:.0f}us\n",
+      kTimerNum, event_add_cancel_us, wheel_add_cancel_us);
+  fmt::print(
+      "{} timers expiring in 100ms, CPU time: libevent {:.1f}ms, wheel "
+      "{:.1f}ms\n",
+      kTimerNum, event_expire_ms, wheel_expire_ms);
+
+  wheel.reset();
+  event_base_free(base);
+}